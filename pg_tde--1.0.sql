@@ -235,6 +235,15 @@ LANGUAGE SQL;
 
 CREATE FUNCTION pg_tde_version() RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C;
 
+CREATE FUNCTION pg_tde_crypto_kernel() RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_tde_wal_key_fingerprint() RETURNS TEXT AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE FUNCTION pg_tde_keyring_broker_stats(OUT requests_served bigint, OUT cache_hits bigint, OUT timeouts bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
 -- Access method
 CREATE ACCESS METHOD tde_heap_basic TYPE TABLE HANDLER pg_tdeam_basic_handler;
 COMMENT ON ACCESS METHOD tde_heap_basic IS 'pg_tde table access method';
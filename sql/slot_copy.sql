@@ -0,0 +1,2 @@
+\set tde_am tde_heap
+\i sql/slot_copy.inc
\ No newline at end of file
@@ -0,0 +1,629 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_tde_keycache.c
+ *	  Cluster-wide cache of decrypted relation keys.
+ *
+ * Every backend keeps its own cache of relation keys (see pg_tde_tdemap.c),
+ * which is empty when the backend starts. Without a shared cache, every new
+ * backend has to read and decrypt the key of each relation it touches from
+ * the key files. This cache keeps the decrypted keys in the pg_tde DSA area,
+ * so a key is read from the files only once per cluster. Only the part of
+ * the area placed in the main shared memory is locked in memory, so the
+ * cache holds as many keys as fit there (REL_KEY_CACHE_AREA_SIZE).
+ *
+ * Entries are keyed by the RelFileLocator of the relation and are removed
+ * when the map entry of the relation is freed or rewritten, when the key
+ * files of a database are rewritten by a principal key rotation, and when
+ * the key files of a database are deleted.
+ *
+ * The keys of the global space are not kept here. They are loaded by every
+ * process at startup (see TDEInitGlobalKeys()), possibly by the postmaster
+ * before any backend exists.
+ *
+ * Optionally (pg_tde.prewarm_keys), a background worker loads the principal
+ * keys and all the relation keys of every database at server start.
+ *
+ * Most relations of a cluster are usually not encrypted, but the storage
+ * manager asks for the key of every relation on every read, write and
+ * extend, and finding out that a relation has no key means searching the map
+ * file. So this module also caches the absence of keys:
+ *
+ *	- a shared bloom filter holds every relation that has a key. The keys of a
+ *	  (database, tablespace) pair are added the first time one of its
+ *	  relations is looked up, and every key created afterwards is added when
+ *	  its map entry is written. Bits are never cleared, the keys of dropped
+ *	  relations just become false positives.
+ *	- the relations that pass the filter but have no key in the map file are
+ *	  remembered in a per-backend set, which is reset whenever a key is
+ *	  created anywhere in the cluster.
+ *
+ * IDENTIFICATION
+ *	  src/access/pg_tde_keycache.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/pg_tde_keycache.h"
+#include "access/pg_tde_tdemap.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/pg_database.h"
+#include "common/hashfn.h"
+#include "common/pg_tde_shmem.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+/* 256kB, about 0.25% false positives with 100000 keys */
+#define KEY_FILTER_BITS		(1 << 21)
+#define KEY_FILTER_WORDS	(KEY_FILTER_BITS / 32)
+#define KEY_FILTER_HASHES	3
+/* (database, tablespace) pairs whose keys are in the filter */
+#define KEY_FILTER_SPACES	1024
+
+/*
+ * Room reserved for the entries in the locked part of the DSA area, about
+ * 10000 keys. Keys that don't fit are not cached.
+ */
+#define REL_KEY_CACHE_AREA_SIZE	(1024 * 1024)
+
+typedef struct SharedRelKeyEntry
+{
+	RelFileLocator rlocator;	/* hash key, must be first */
+	uint8		key[INTERNAL_KEY_LEN];
+	uint32		page_cipher;
+} SharedRelKeyEntry;
+
+typedef struct SharedRelKeyCacheState
+{
+	int			hashTrancheId;
+	dshash_table_handle hashHandle;
+
+	/* Bumped every time a relation key is created or removed */
+	pg_atomic_uint64 keyGeneration;
+	/* (spcOid << 32 | dbOid) of the spaces loaded into the filter, 0 if free */
+	pg_atomic_uint64 filterSpaces[KEY_FILTER_SPACES];
+	pg_atomic_uint32 filter[KEY_FILTER_WORDS];
+} SharedRelKeyCacheState;
+
+typedef struct SharedRelKeyCacheLocalState
+{
+	SharedRelKeyCacheState *sharedState;
+	dshash_table *sharedHash;
+} SharedRelKeyCacheLocalState;
+
+/* parameter for the relation key shared hash */
+static dshash_parameters rel_key_dsh_params = {
+	sizeof(RelFileLocator),
+	sizeof(SharedRelKeyEntry),
+	dshash_memcmp,
+	dshash_memhash};
+
+typedef struct PrewarmDatabase
+{
+	Oid			dbOid;
+	Oid			spcOid;
+} PrewarmDatabase;
+
+bool		tde_prewarm_keys = false;
+
+static SharedRelKeyCacheLocalState relKeyCacheLocalState;
+
+/* Relations of this backend that passed the filter but have no key */
+static HTAB *noKeyRels = NULL;
+static uint64 noKeyRelsGeneration = 0;
+
+static Size rel_key_cache_shared_state_size(void);
+static Size initialize_shared_state(void *start_address);
+static void initialize_objects_in_dsa_area(dsa_area *dsa, void *raw_dsa_area);
+static void shared_memory_shutdown(int code, Datum arg);
+static dshash_table *get_rel_key_hash(void);
+static void register_key_prewarm_worker(void);
+
+static const TDEShmemSetupRoutine rel_key_cache_shmem_routine = {
+	.init_shared_state = initialize_shared_state,
+	.init_dsa_area_objects = initialize_objects_in_dsa_area,
+	.required_shared_mem_size = rel_key_cache_shared_state_size,
+	.shmem_kill = shared_memory_shutdown
+};
+
+void
+InitializeSharedRelKeyCache(void)
+{
+	DefineCustomBoolVariable("pg_tde.prewarm_keys",	/* name */
+							 "Load the principal and relation keys of all databases at server start.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &tde_prewarm_keys, /* value address */
+							 false,	/* boot value */
+							 PGC_POSTMASTER,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	RegisterShmemRequest(&rel_key_cache_shmem_routine);
+
+	if (tde_prewarm_keys && process_shared_preload_libraries_in_progress)
+		register_key_prewarm_worker();
+}
+
+/*
+ * The state struct, which includes the filter, plus room for the entries in
+ * the part of the DSA area placed in the main shared memory. Only that part
+ * is locked in memory, see pg_tde_shared_key_cache_put().
+ */
+static Size
+rel_key_cache_shared_state_size(void)
+{
+	return add_size(MAXALIGN(sizeof(SharedRelKeyCacheState)), REL_KEY_CACHE_AREA_SIZE);
+}
+
+static Size
+initialize_shared_state(void *start_address)
+{
+	SharedRelKeyCacheState *sharedState = (SharedRelKeyCacheState *) start_address;
+
+	relKeyCacheLocalState.sharedState = sharedState;
+	relKeyCacheLocalState.sharedHash = NULL;
+
+	pg_atomic_init_u64(&sharedState->keyGeneration, 0);
+	for (int i = 0; i < KEY_FILTER_SPACES; i++)
+		pg_atomic_init_u64(&sharedState->filterSpaces[i], 0);
+	for (int i = 0; i < KEY_FILTER_WORDS; i++)
+		pg_atomic_init_u32(&sharedState->filter[i], 0);
+
+	return sizeof(SharedRelKeyCacheState);
+}
+
+static void
+initialize_objects_in_dsa_area(dsa_area *dsa, void *raw_dsa_area)
+{
+	dshash_table *dsh;
+	SharedRelKeyCacheState *sharedState = relKeyCacheLocalState.sharedState;
+
+	Assert(sharedState != NULL);
+
+	sharedState->hashTrancheId = LWLockNewTrancheId();
+	rel_key_dsh_params.tranche_id = sharedState->hashTrancheId;
+#if PG_VERSION_NUM >= 170000
+	rel_key_dsh_params.copy_function = dshash_memcpy;
+#endif
+	dsh = dshash_create(dsa, &rel_key_dsh_params, 0);
+	sharedState->hashHandle = dshash_get_hash_table_handle(dsh);
+	dshash_detach(dsh);
+}
+
+static void
+shared_memory_shutdown(int code, Datum arg)
+{
+	relKeyCacheLocalState.sharedState = NULL;
+}
+
+/*
+ * Attaches the shared hash to the local backend on first use
+ */
+static dshash_table *
+get_rel_key_hash(void)
+{
+	MemoryContext oldcontext;
+
+	if (relKeyCacheLocalState.sharedHash)
+		return relKeyCacheLocalState.sharedHash;
+
+	Assert(relKeyCacheLocalState.sharedState != NULL);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	rel_key_dsh_params.tranche_id = relKeyCacheLocalState.sharedState->hashTrancheId;
+	relKeyCacheLocalState.sharedHash = dshash_attach(TdeGetDsaArea(), &rel_key_dsh_params,
+													 relKeyCacheLocalState.sharedState->hashHandle, 0);
+	MemoryContextSwitchTo(oldcontext);
+
+	return relKeyCacheLocalState.sharedHash;
+}
+
+/*
+ * Copies the cached key of the relation into *key. Returns false if the key
+ * is not in the cache.
+ */
+bool
+pg_tde_shared_key_cache_get(const RelFileLocator *rlocator, RelKeyData *key)
+{
+	SharedRelKeyEntry *entry;
+
+	if (rlocator->spcOid == GLOBALTABLESPACE_OID)
+		return false;
+
+	entry = (SharedRelKeyEntry *) dshash_find(get_rel_key_hash(), rlocator, false);
+	if (entry == NULL)
+		return false;
+
+	memset(key, 0, sizeof(RelKeyData));
+	memcpy(key->internal_key.key, entry->key, INTERNAL_KEY_LEN);
+	key->internal_key.page_cipher = entry->page_cipher;
+	dshash_release_lock(get_rel_key_hash(), entry);
+
+	return true;
+}
+
+/*
+ * Adds the decrypted key of the relation to the cache. An existing entry is
+ * kept as is: the key of a relation never changes while its map entry is
+ * valid, and the entry is evicted before the relation number can be reused.
+ *
+ * We don't want relation keys to end up paged to the swap, so a new entry
+ * allocated outside of the locked part of the DSA area is removed again
+ * before anyone can see it, and the key is left to the backend caches.
+ * Returns false in that case.
+ */
+bool
+pg_tde_shared_key_cache_put(const RelFileLocator *rlocator, const RelKeyData *key)
+{
+	SharedRelKeyEntry *entry;
+	bool		found;
+
+	if (rlocator->spcOid == GLOBALTABLESPACE_OID)
+		return false;
+
+	entry = (SharedRelKeyEntry *) dshash_find_or_insert(get_rel_key_hash(), rlocator, &found);
+	if (found)
+	{
+		dshash_release_lock(get_rel_key_hash(), entry);
+		return true;
+	}
+
+	if (!TdeDsaAddressIsLocked(entry, sizeof(SharedRelKeyEntry)))
+	{
+		dshash_delete_entry(get_rel_key_hash(), entry);
+		return false;
+	}
+
+	memcpy(entry->key, key->internal_key.key, INTERNAL_KEY_LEN);
+	entry->page_cipher = key->internal_key.page_cipher;
+	dshash_release_lock(get_rel_key_hash(), entry);
+
+	return true;
+}
+
+void
+pg_tde_shared_key_cache_evict(const RelFileLocator *rlocator)
+{
+	SharedRelKeyEntry *entry;
+
+	if (rlocator->spcOid == GLOBALTABLESPACE_OID)
+		return;
+
+	entry = (SharedRelKeyEntry *) dshash_find(get_rel_key_hash(), rlocator, true);
+	if (entry)
+	{
+		explicit_bzero(entry->key, INTERNAL_KEY_LEN);
+		dshash_delete_entry(get_rel_key_hash(), entry);
+	}
+
+	/* Keys bound to storage manager relations have to be looked up again */
+	pg_atomic_fetch_add_u64(&relKeyCacheLocalState.sharedState->keyGeneration, 1);
+}
+
+/*
+ * Removes the keys of all relations of the database.
+ */
+void
+pg_tde_shared_key_cache_evict_db(Oid dbOid)
+{
+	dshash_seq_status status;
+	SharedRelKeyEntry *entry;
+
+	dshash_seq_init(&status, get_rel_key_hash(), true);
+	while ((entry = (SharedRelKeyEntry *) dshash_seq_next(&status)) != NULL)
+	{
+		if (entry->rlocator.dbOid != dbOid)
+			continue;
+
+		explicit_bzero(entry->key, INTERNAL_KEY_LEN);
+		dshash_delete_current(&status);
+	}
+	dshash_seq_term(&status);
+
+	pg_atomic_fetch_add_u64(&relKeyCacheLocalState.sharedState->keyGeneration, 1);
+}
+
+/*
+ * ------------------------------
+ * Negative cache
+ */
+
+static inline void
+key_filter_hashes(const RelFileLocator *rlocator, uint32 *h1, uint32 *h2)
+{
+	uint64		h = hash_bytes_extended((const unsigned char *) rlocator, sizeof(RelFileLocator), 0);
+
+	*h1 = (uint32) h;
+	*h2 = (uint32) (h >> 32) | 1;
+}
+
+static void
+key_filter_add(SharedRelKeyCacheState *state, const RelFileLocator *rlocator)
+{
+	uint32		h1,
+				h2;
+
+	key_filter_hashes(rlocator, &h1, &h2);
+	for (int i = 0; i < KEY_FILTER_HASHES; i++)
+	{
+		uint32		bit = (h1 + i * h2) % KEY_FILTER_BITS;
+
+		pg_atomic_fetch_or_u32(&state->filter[bit / 32], (uint32) 1 << (bit % 32));
+	}
+}
+
+static bool
+key_filter_test(SharedRelKeyCacheState *state, const RelFileLocator *rlocator)
+{
+	uint32		h1,
+				h2;
+
+	key_filter_hashes(rlocator, &h1, &h2);
+	for (int i = 0; i < KEY_FILTER_HASHES; i++)
+	{
+		uint32		bit = (h1 + i * h2) % KEY_FILTER_BITS;
+
+		if ((pg_atomic_read_u32(&state->filter[bit / 32]) & ((uint32) 1 << (bit % 32))) == 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Looks up the slot of the space of the relation in filterSpaces, claiming a
+ * free slot if claim is true. Returns -1 if the space isn't there, -2 if it
+ * isn't there and there is no free slot left.
+ */
+static int
+key_filter_find_space(SharedRelKeyCacheState *state, const RelFileLocator *rlocator, bool claim)
+{
+	uint64		space = ((uint64) rlocator->spcOid << 32) | rlocator->dbOid;
+	int			start = hash_bytes_uint32(rlocator->dbOid ^ rlocator->spcOid) % KEY_FILTER_SPACES;
+
+	for (int i = 0; i < KEY_FILTER_SPACES; i++)
+	{
+		int			slot = (start + i) % KEY_FILTER_SPACES;
+		uint64		cur = pg_atomic_read_u64(&state->filterSpaces[slot]);
+
+		if (cur == space)
+			return slot;
+		if (cur != 0)
+			continue;
+		if (!claim)
+			return -1;
+		if (pg_atomic_compare_exchange_u64(&state->filterSpaces[slot], &cur, space))
+			return slot;
+		/* Somebody else took the slot, maybe for the same space */
+		if (cur == space)
+			return slot;
+	}
+	return -2;
+}
+
+/*
+ * Adds the keys of all the relations of the space of the relation to the
+ * filter, then marks the space as loaded. Returns false if there is no room
+ * left to track the space, so the filter can't be used for it.
+ */
+static bool
+key_filter_load_space(SharedRelKeyCacheState *state, const RelFileLocator *rlocator)
+{
+	RelFileNumber *relnumbers;
+	RelFileLocator rloc = *rlocator;
+	int			count;
+
+	/*
+	 * Loading the same space twice is harmless. Keys created meanwhile are
+	 * added by their creators, whether the space is loaded or not.
+	 */
+	relnumbers = pg_tde_get_keyed_relations(rlocator->dbOid, rlocator->spcOid, &count);
+	for (int i = 0; i < count; i++)
+	{
+		rloc.relNumber = relnumbers[i];
+		key_filter_add(state, &rloc);
+	}
+	if (relnumbers)
+		pfree(relnumbers);
+
+	/* The atomic operations above are full barriers */
+	return key_filter_find_space(state, rlocator, true) >= 0;
+}
+
+/*
+ * Returns the current key generation of the cluster, which changes every time
+ * a relation key is created or removed. Lookups that may end up in
+ * pg_tde_rel_has_no_key() have to fetch it first, and so do the users of a
+ * key kept outside of the caches (see pg_tde_smgr.c).
+ */
+uint64
+pg_tde_key_generation(void)
+{
+	if (relKeyCacheLocalState.sharedState == NULL)
+		return 0;
+
+	return pg_atomic_read_u64(&relKeyCacheLocalState.sharedState->keyGeneration);
+}
+
+/*
+ * Returns false if the relation certainly has no key. It costs a few reads
+ * of shared memory, so it is fine on every I/O.
+ */
+bool
+pg_tde_rel_may_have_key(const RelFileLocator *rlocator)
+{
+	SharedRelKeyCacheState *state = relKeyCacheLocalState.sharedState;
+	int			slot;
+
+	if (state == NULL || rlocator->spcOid == GLOBALTABLESPACE_OID)
+		return true;
+
+	slot = key_filter_find_space(state, rlocator, false);
+	if (slot == -2)
+		return true;
+	if (slot == -1 && !key_filter_load_space(state, rlocator))
+		return true;
+
+	/* Pairs with the barriers of key_filter_load_space() */
+	pg_read_barrier();
+
+	if (!key_filter_test(state, rlocator))
+		return false;
+
+	if (noKeyRels == NULL)
+		return true;
+
+	if (noKeyRelsGeneration != pg_atomic_read_u64(&state->keyGeneration))
+	{
+		hash_destroy(noKeyRels);
+		noKeyRels = NULL;
+		return true;
+	}
+
+	return hash_search(noKeyRels, rlocator, HASH_FIND, NULL) == NULL;
+}
+
+/*
+ * Remembers that the map file has no key for the relation. The generation is
+ * the one fetched before the map file was searched, so a key created in the
+ * meantime resets the set before the answer is ever used.
+ */
+void
+pg_tde_rel_has_no_key(const RelFileLocator *rlocator, uint64 generation)
+{
+	if (relKeyCacheLocalState.sharedState == NULL || rlocator->spcOid == GLOBALTABLESPACE_OID)
+		return;
+
+	if (noKeyRels != NULL && noKeyRelsGeneration != generation)
+	{
+		hash_destroy(noKeyRels);
+		noKeyRels = NULL;
+	}
+
+	if (noKeyRels == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(RelFileLocator);
+		ctl.entrysize = sizeof(RelFileLocator);
+		ctl.hcxt = TopMemoryContext;
+		noKeyRels = hash_create("pg_tde relations without key", 64, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		noKeyRelsGeneration = generation;
+	}
+
+	(void) hash_search(noKeyRels, rlocator, HASH_ENTER, NULL);
+}
+
+/*
+ * Called for every new map entry, before the relation can be used by anyone.
+ */
+void
+pg_tde_rel_key_created(const RelFileLocator *rlocator)
+{
+	SharedRelKeyCacheState *state = relKeyCacheLocalState.sharedState;
+
+	if (state == NULL || rlocator->spcOid == GLOBALTABLESPACE_OID)
+		return;
+
+	key_filter_add(state, rlocator);
+	pg_atomic_fetch_add_u64(&state->keyGeneration, 1);
+}
+
+/*
+ * ------------------------------
+ * Key prewarm worker
+ */
+
+static void
+register_key_prewarm_worker(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	strcpy(worker.bgw_library_name, "pg_tde");
+	strcpy(worker.bgw_function_name, "pg_tde_key_prewarm_main");
+	strcpy(worker.bgw_name, "pg_tde key prewarm");
+	strcpy(worker.bgw_type, "pg_tde key prewarm");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Loads the keys of all databases into the shared caches. The worker connects
+ * to no database, so it only reads pg_database to find the databases; the
+ * keys themselves are read from the key files and the key providers, exactly
+ * as a backend of the database would do on first access.
+ */
+void
+pg_tde_key_prewarm_main(Datum main_arg)
+{
+	PrewarmDatabase *databases;
+	int			ndatabases = 0;
+	int			maxdatabases = 16;
+	int			nkeys = 0;
+	Relation	rel;
+	TableScanDesc scan;
+	HeapTuple	tup;
+
+	BackgroundWorkerUnblockSignals();
+	BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+
+	/* The list has to survive the transaction used to build it */
+	databases = MemoryContextAlloc(TopMemoryContext, maxdatabases * sizeof(PrewarmDatabase));
+
+	StartTransactionCommand();
+	(void) GetTransactionSnapshot();
+
+	rel = table_open(DatabaseRelationId, AccessShareLock);
+	scan = table_beginscan_catalog(rel, 0, NULL);
+
+	while (HeapTupleIsValid(tup = heap_getnext(scan, ForwardScanDirection)))
+	{
+		Form_pg_database pgdatabase = (Form_pg_database) GETSTRUCT(tup);
+
+		if (database_is_invalid_form(pgdatabase))
+			continue;
+
+		if (ndatabases == maxdatabases)
+		{
+			maxdatabases *= 2;
+			databases = repalloc(databases, maxdatabases * sizeof(PrewarmDatabase));
+		}
+		databases[ndatabases].dbOid = pgdatabase->oid;
+		databases[ndatabases].spcOid = pgdatabase->dattablespace;
+		ndatabases++;
+	}
+
+	table_endscan(scan);
+	table_close(rel, AccessShareLock);
+
+	CommitTransactionCommand();
+
+	for (int i = 0; i < ndatabases; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		nkeys += pg_tde_prewarm_rel_keys(databases[i].dbOid, databases[i].spcOid);
+	}
+
+	ereport(LOG,
+			(errmsg("pg_tde key prewarm loaded %d relation keys of %d databases",
+					nkeys, ndatabases)));
+
+	pfree(databases);
+	proc_exit(0);
+}
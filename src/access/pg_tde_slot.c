@@ -23,6 +23,7 @@
 #include "catalog/pg_type.h"
 #include "funcapi.h"
 #include "nodes/nodeFuncs.h"
+#include "port/pg_bitutils.h"
 #include "storage/bufmgr.h"
 #include "utils/builtins.h"
 #include "utils/expandeddatum.h"
@@ -44,17 +45,134 @@ static inline void tdeheap_tts_buffer_heap_store_tuple(TupleTableSlot *slot,
 											   Buffer buffer,
 											   bool transfer_pin);
 static inline RelKeyData *get_current_slot_relation_key(TDEBufferHeapTupleTableSlot *bslot, Relation rel);
+
+/*
+ * Tuple data is decrypted in chunks of this size, so that deforming a row
+ * attribute by attribute doesn't call into the cipher for every attribute.
+ */
+#define TDE_SLOT_DECRYPT_CHUNK	64
+
+/* Smallest allocation for the decrypted tuple of a slot */
+#define TDE_SLOT_MIN_DECRYPTED_BUFFER	256
+
+/*
+ * Decrypts the tuple data of the slot up to (at least) upto bytes, continuing
+ * where the previous call stopped. CTR mode allows to start at any offset, so
+ * the already decrypted prefix is never touched again.
+ */
+static void
+tdeheap_slot_decrypt_range(TDEBufferHeapTupleTableSlot *bslot, uint32 upto)
+{
+	HeapTupleHeader tup = ((HeapTuple) bslot->decrypted_buffer)->t_data;
+	char	   *out = (char *) tup + tup->t_hoff;
+	uint32		start = bslot->decrypted_len;
+
+	upto = Min(TYPEALIGN(TDE_SLOT_DECRYPT_CHUNK, upto), bslot->encrypted_len);
+
+	PG_TDE_DECRYPT_DATA(bslot->iv_prefix, start, bslot->encrypted_data + start,
+						upto - start, out + start, bslot->cached_relation_key);
+
+	bslot->decrypted_len = upto;
+	if (upto == bslot->encrypted_len)
+		bslot->encrypted_data = NULL;
+}
+
+static inline void
+tdeheap_slot_decrypt_upto(TDEBufferHeapTupleTableSlot *bslot, uint32 upto)
+{
+	if (bslot->encrypted_data != NULL && upto > bslot->decrypted_len)
+		tdeheap_slot_decrypt_range(bslot, upto);
+}
+
+/*
+ * Has to be called before the tuple of the slot is handed out as a whole.
+ */
+static inline void
+tdeheap_slot_decrypt_all(TDEBufferHeapTupleTableSlot *bslot)
+{
+	if (bslot->encrypted_data != NULL)
+		tdeheap_slot_decrypt_range(bslot, bslot->encrypted_len);
+}
+
+/*
+ * Makes sure that the attribute starting at off (already aligned) is
+ * decrypted.
+ */
+static pg_attribute_always_inline void
+tdeheap_slot_decrypt_att(TDEBufferHeapTupleTableSlot *bslot, Form_pg_attribute att,
+						 char *tp, uint32 off)
+{
+	if (bslot->encrypted_data == NULL)
+		return;
+
+	if (att->attlen > 0)
+		tdeheap_slot_decrypt_upto(bslot, off + att->attlen);
+	else if (att->attlen == -1)
+	{
+		/* Length word first, then the rest of the value */
+		tdeheap_slot_decrypt_upto(bslot, off + VARHDRSZ);
+		tdeheap_slot_decrypt_upto(bslot, off + VARSIZE_ANY(tp + off));
+	}
+	else
+		tdeheap_slot_decrypt_all(bslot);
+}
+
+/*
+ * If the stored tuple is the decrypted copy in the slot's own buffer, hands
+ * that buffer over as the materialized tuple instead of copying it once more:
+ * it has the layout of a palloc'd HeapTuple (the header followed by the tuple
+ * at HEAPTUPLESIZE) and already lives in tts_mcxt. The slot allocates a new
+ * buffer for the next tuple.
+ *
+ * No other slot references the buffer: copyslot copies decrypted tuples
+ * instead of sharing them, see tdeheap_tts_buffer_heap_copyslot().
+ *
+ * Returns NULL if the tuple is not in the buffer, or if the buffer is too
+ * large for the tuple to be worth keeping around.
+ */
+static HeapTuple
+tdeheap_slot_take_decrypted_tuple(TDEBufferHeapTupleTableSlot *bslot)
+{
+	HeapTuple	tuple = bslot->base.tuple;
+	HeapTuple	decrypted = (HeapTuple) bslot->decrypted_buffer;
+
+	if (decrypted == NULL || tuple->t_data != decrypted->t_data)
+		return NULL;
+
+	if (bslot->decrypted_buffer_size > 2 * (HEAPTUPLESIZE + tuple->t_len))
+		return NULL;
+
+	tdeheap_slot_decrypt_all(bslot);
+
+	decrypted->t_len = tuple->t_len;
+	decrypted->t_self = tuple->t_self;
+	decrypted->t_tableOid = tuple->t_tableOid;
+
+	bslot->decrypted_buffer = NULL;
+	bslot->decrypted_buffer_size = 0;
+
+	return decrypted;
+}
+
 static void
 tdeheap_tts_buffer_heap_init(TupleTableSlot *slot)
 {
     TDEBufferHeapTupleTableSlot *bslot = (TDEBufferHeapTupleTableSlot *) slot;
 	bslot->cached_relation_key = NULL;
+	bslot->encrypted_data = NULL;
+	bslot->decrypted_buffer = NULL;
+	bslot->decrypted_buffer_size = 0;
 }
 
 static void
 tdeheap_tts_buffer_heap_release(TupleTableSlot *slot)
 {
 	TDEBufferHeapTupleTableSlot *bslot = (TDEBufferHeapTupleTableSlot *) slot;
+
+	if (bslot->decrypted_buffer != NULL)
+		pfree(bslot->decrypted_buffer);
+	bslot->decrypted_buffer = NULL;
+	bslot->decrypted_buffer_size = 0;
 }
 
 static void
@@ -85,6 +203,7 @@ tdeheap_tts_buffer_heap_clear(TupleTableSlot *slot)
 	bslot->base.tuple = NULL;
 	bslot->base.off = 0;
 	bslot->buffer = InvalidBuffer;
+	bslot->encrypted_data = NULL;
 }
 
 static void
@@ -176,7 +295,16 @@ tdeheap_tts_buffer_heap_materialize(TupleTableSlot *slot)
 	}
 	else
 	{
-		bslot->base.tuple = tdeheap_copytuple(bslot->base.tuple);
+		HeapTuple	tuple;
+
+		/* Take over the decrypted tuple if possible, copy it otherwise */
+		tuple = tdeheap_slot_take_decrypted_tuple((TDEBufferHeapTupleTableSlot *) slot);
+		if (tuple == NULL)
+		{
+			tdeheap_slot_decrypt_all((TDEBufferHeapTupleTableSlot *) slot);
+			tuple = tdeheap_copytuple(bslot->base.tuple);
+		}
+		bslot->base.tuple = tuple;
 
 		/*
 		 * A heap tuple stored in a BufferHeapTupleTableSlot should have a
@@ -199,6 +327,20 @@ tdeheap_tts_buffer_heap_materialize(TupleTableSlot *slot)
 	MemoryContextSwitchTo(oldContext);
 }
 
+/*
+ * Whether the tuple of the slot lives in the page of its buffer. Otherwise it
+ * is a decrypted copy owned by the slot or by the scan, which the buffer pin
+ * doesn't keep around.
+ */
+static inline bool
+tdeheap_slot_tuple_in_buffer(BufferHeapTupleTableSlot *bslot)
+{
+	char	   *page = (char *) BufferGetPage(bslot->buffer);
+	char	   *data = (char *) bslot->base.tuple->t_data;
+
+	return data >= page && data < page + BLCKSZ;
+}
+
 static void
 tdeheap_tts_buffer_heap_copyslot(TupleTableSlot *dstslot, TupleTableSlot *srcslot)
 {
@@ -207,12 +349,16 @@ tdeheap_tts_buffer_heap_copyslot(TupleTableSlot *dstslot, TupleTableSlot *srcslo
 
 	/*
 	 * If the source slot is of a different kind, or is a buffer slot that has
-	 * been materialized / is virtual, make a new copy of the tuple. Otherwise
-	 * make a new reference to the in-buffer tuple.
+	 * been materialized / is virtual, make a new copy of the tuple. Same if
+	 * the tuple is decrypted: the decrypted buffer of the source slot is
+	 * reused (or handed over) for its next tuple, and the decrypted page of
+	 * a scan for the next page. Otherwise make a new reference to the
+	 * in-buffer tuple.
 	 */
 	if (dstslot->tts_ops != srcslot->tts_ops ||
 		TTS_SHOULDFREE(srcslot) ||
-		!bsrcslot->base.tuple)
+		!bsrcslot->base.tuple ||
+		!tdeheap_slot_tuple_in_buffer(bsrcslot))
 	{
 		MemoryContext oldContext;
 
@@ -249,6 +395,8 @@ tdeheap_tts_buffer_heap_get_heap_tuple(TupleTableSlot *slot)
 
 	if (!bslot->base.tuple)
 		tdeheap_tts_buffer_heap_materialize(slot);
+	else
+		tdeheap_slot_decrypt_all((TDEBufferHeapTupleTableSlot *) slot);
 	return bslot->base.tuple;
 }
 
@@ -261,6 +409,8 @@ tdeheap_tts_buffer_heap_copy_heap_tuple(TupleTableSlot *slot)
 
 	if (!bslot->base.tuple)
 		tdeheap_tts_buffer_heap_materialize(slot);
+	else
+		tdeheap_slot_decrypt_all((TDEBufferHeapTupleTableSlot *) slot);
 
 	return tdeheap_copytuple(bslot->base.tuple);
 }
@@ -274,6 +424,8 @@ tdeheap_tts_buffer_heap_copy_minimal_tuple(TupleTableSlot *slot)
 
 	if (!bslot->base.tuple)
 		tdeheap_tts_buffer_heap_materialize(slot);
+	else
+		tdeheap_slot_decrypt_all((TDEBufferHeapTupleTableSlot *) slot);
 
 	return minimal_tuple_from_heap_tuple(bslot->base.tuple);
 }
@@ -298,6 +450,7 @@ tdeheap_tts_buffer_heap_store_tuple(TupleTableSlot *slot, HeapTuple tuple,
 	bslot->base.tuple = tuple;
 	bslot->base.off = 0;
 	slot->tts_tid = tuple->t_self;
+	((TDEBufferHeapTupleTableSlot *) slot)->encrypted_data = NULL;
 
 	/*
 	 * If tuple is on a disk page, keep the page pinned as long as we hold a
@@ -343,11 +496,15 @@ tdeheap_tts_buffer_heap_store_tuple(TupleTableSlot *slot, HeapTuple tuple,
  *
  * This is marked as always inline, so the different offp for different types
  * of slots gets optimized away.
+ *
+ * The tuple data is decrypted on the go, only as far as the extracted
+ * attributes reach.
  */
 static pg_attribute_always_inline void
 tdeheap_slot_deform_heap_tuple(TupleTableSlot *slot, HeapTuple tuple, uint32 *offp,
 							  int natts)
 {
+	TDEBufferHeapTupleTableSlot *tdeslot = (TDEBufferHeapTupleTableSlot *) slot;
 	TupleDesc	tupleDesc = slot->tts_tupleDescriptor;
 	Datum	   *values = slot->tts_values;
 	bool	   *isnull = slot->tts_isnull;
@@ -410,6 +567,8 @@ tdeheap_slot_deform_heap_tuple(TupleTableSlot *slot, HeapTuple tuple, uint32 *of
 				thisatt->attcacheoff = off;
 			else
 			{
+				/* alignment padding is detected by looking at the data */
+				tdeheap_slot_decrypt_upto(tdeslot, off + 1);
 				off = att_align_pointer(off, thisatt->attalign, -1,
 										tp + off);
 				slow = true;
@@ -424,6 +583,8 @@ tdeheap_slot_deform_heap_tuple(TupleTableSlot *slot, HeapTuple tuple, uint32 *of
 				thisatt->attcacheoff = off;
 		}
 
+		tdeheap_slot_decrypt_att(tdeslot, thisatt, tp, off);
+
 		values[attnum] = fetchatt(thisatt, tp + off);
 
 		off = att_addlength_pointer(off, thisatt->attlen, tp + off);
@@ -461,6 +622,45 @@ slot_copytuple(void* buffer, HeapTuple tuple)
 	return newTuple;
 }
 
+/*
+ * Copies the header of the on-disk tuple into the decrypted buffer of the
+ * slot and points the tuple to it. The data is left encrypted, returns the
+ * pointer to it (NULL if there is no data) to be stored in the slot once the
+ * tuple is.
+ */
+static const char *
+slot_prepare_decrypt(TDEBufferHeapTupleTableSlot *bslot, Relation rel, HeapTuple tuple)
+{
+	const char *encrypted_data = (char *) tuple->t_data + tuple->t_data->t_hoff;
+	uint32		needed = HEAPTUPLESIZE + tuple->t_len;
+
+	/*
+	 * The previous content of the buffer is not needed anymore, so there is no
+	 * point in repalloc() copying it.
+	 */
+	if (bslot->decrypted_buffer_size < needed)
+	{
+		uint32		size = Max(pg_nextpower2_32(needed), TDE_SLOT_MIN_DECRYPTED_BUFFER);
+
+		if (bslot->decrypted_buffer != NULL)
+			pfree(bslot->decrypted_buffer);
+		bslot->decrypted_buffer = MemoryContextAlloc(bslot->base.base.tts_mcxt, size);
+		bslot->decrypted_buffer_size = size;
+	}
+
+	get_current_slot_relation_key(bslot, rel);
+	slot_copytuple(bslot->decrypted_buffer, tuple);
+
+	memset(bslot->iv_prefix, 0, sizeof(bslot->iv_prefix));
+	SetIVPrefix(&tuple->t_self, bslot->iv_prefix);
+	bslot->encrypted_len = tuple->t_len - tuple->t_data->t_hoff;
+	bslot->decrypted_len = 0;
+
+	tuple->t_data = ((HeapTuple) bslot->decrypted_buffer)->t_data;
+
+	return bslot->encrypted_len > 0 ? encrypted_data : NULL;
+}
+
 const TupleTableSlotOps TTSOpsTDEBufferHeapTuple = {
 	.base_slot_size = sizeof(TDEBufferHeapTupleTableSlot),
 	.init = tdeheap_tts_buffer_heap_init,
@@ -507,6 +707,7 @@ PGTdeExecStoreBufferHeapTuple(Relation rel,
 {
 
 	TDEBufferHeapTupleTableSlot *bslot = (TDEBufferHeapTupleTableSlot *)slot;
+	const char *encrypted_data = NULL;
 	/*
 	 * sanity checks
 	 */
@@ -520,15 +721,13 @@ PGTdeExecStoreBufferHeapTuple(Relation rel,
 		elog(ERROR, "trying to store an on-disk heap tuple into wrong type of slot");
 
 	if (rel->rd_rel->relkind != RELKIND_TOASTVALUE)
-	{
-		RelKeyData *key = get_current_slot_relation_key(bslot, rel);
-		slot_copytuple(bslot->decrypted_buffer, tuple);
-		PG_TDE_DECRYPT_TUPLE_EX(tuple, (HeapTuple)bslot->decrypted_buffer, key, "ExecStoreBuffer");
-		tuple->t_data = ((HeapTuple)bslot->decrypted_buffer)->t_data;
-	}
+		encrypted_data = slot_prepare_decrypt(bslot, rel, tuple);
 
 	tdeheap_tts_buffer_heap_store_tuple(slot, tuple, buffer, false);
 
+	/* Data is decrypted later, as the attributes get deformed */
+	bslot->encrypted_data = encrypted_data;
+
 	slot->tts_tableOid = tuple->t_tableOid;
 
 	return slot;
@@ -545,6 +744,7 @@ PGTdeExecStorePinnedBufferHeapTuple(Relation rel,
                              Buffer buffer)
 {
 	TDEBufferHeapTupleTableSlot *bslot = (TDEBufferHeapTupleTableSlot *)slot;
+	const char *encrypted_data = NULL;
 	/*
 	 * sanity checks
 	 */
@@ -558,17 +758,43 @@ PGTdeExecStorePinnedBufferHeapTuple(Relation rel,
 		elog(ERROR, "trying to store an on-disk heap tuple into wrong type of slot");
 
 	if (rel->rd_rel->relkind != RELKIND_TOASTVALUE)
-	{
-		RelKeyData *key = get_current_slot_relation_key(bslot,rel);
-
-		slot_copytuple(bslot->decrypted_buffer, tuple);
-		PG_TDE_DECRYPT_TUPLE_EX(tuple, (HeapTuple)bslot->decrypted_buffer, key, "ExecStorePinnedBuffer");
-		/* TODO: revisit this */
-		tuple->t_data = ((HeapTuple)bslot->decrypted_buffer)->t_data;
-	}
+		encrypted_data = slot_prepare_decrypt(bslot, rel, tuple);
 
 	tdeheap_tts_buffer_heap_store_tuple(slot, tuple, buffer, true);
 
+	/* Data is decrypted later, as the attributes get deformed */
+	bslot->encrypted_data = encrypted_data;
+
+	slot->tts_tableOid = tuple->t_tableOid;
+
+	return slot;
+}
+
+/*
+ * Like ExecStoreBufferHeapTuple, but for a tuple which data is already
+ * decrypted, e.g. by a page-at-a-time scan into its decrypted page. The slot
+ * just references it, the caller has to keep the decrypted copy around until
+ * it stores the next tuple in the slot. The pin doesn't protect the copy, so
+ * copyslot copies such tuples instead of referencing them.
+ */
+TupleTableSlot *
+PGTdeExecStoreDecryptedBufferHeapTuple(HeapTuple tuple,
+									   TupleTableSlot *slot,
+									   Buffer buffer)
+{
+	/*
+	 * sanity checks
+	 */
+	Assert(tuple != NULL);
+	Assert(slot != NULL);
+	Assert(slot->tts_tupleDescriptor != NULL);
+	Assert(BufferIsValid(buffer));
+
+	if (unlikely(!TTS_IS_TDE_BUFFERTUPLE(slot)))
+		elog(ERROR, "trying to store an on-disk heap tuple into wrong type of slot");
+
+	tdeheap_tts_buffer_heap_store_tuple(slot, tuple, buffer, false);
+
 	slot->tts_tableOid = tuple->t_tableOid;
 
 	return slot;
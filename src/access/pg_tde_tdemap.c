@@ -13,6 +13,7 @@
 #include "postgres.h"
 #include "access/pg_tde_tdemap.h"
 #include "common/file_perm.h"
+#include "common/hashfn.h"
 #include "transam/pg_tde_xact_handler.h"
 #include "storage/fd.h"
 #include "utils/wait_event.h"
@@ -24,6 +25,7 @@
 #include "miscadmin.h"
 
 #include "access/pg_tde_tdemap.h"
+#include "access/pg_tde_keycache.h"
 #include "access/pg_tde_xlog.h"
 #include "catalog/tde_principal_key.h"
 #include "encryption/enc_aes.h"
@@ -58,27 +60,96 @@
 #define PG_TDE_MAP_FILENAME				"pg_tde.map"
 #define PG_TDE_KEYDATA_FILENAME			"pg_tde.dat"
 
-#define PG_TDE_FILEMAGIC				0x01454454	/* version ID value = TDE 01 */
+#define PG_TDE_FILEMAGIC_V1				0x01454454	/* version ID value = TDE 01 */
+#define PG_TDE_FILEMAGIC				0x02454454	/* version ID value = TDE 02 */
 
 #define MAP_ENTRY_FREE					0x00
 #define MAP_ENTRY_VALID					0x01
+#define MAP_ENTRY_STATE_MASK			0x0F
+
+/* Bits 4..7 of the map entry flags keep the page cipher (TDE_PAGE_CIPHER_*) */
+#define MAP_ENTRY_PAGE_CIPHER_SHIFT		4
+#define MAP_ENTRY_PAGE_CIPHER_MASK		0xF0
+#define MAP_ENTRY_PAGE_CIPHER(_flags)	(((_flags) & MAP_ENTRY_PAGE_CIPHER_MASK) >> MAP_ENTRY_PAGE_CIPHER_SHIFT)
+#define MAP_ENTRY_FLAGS(_state, _page_cipher) \
+	((_state) | (((_page_cipher) << MAP_ENTRY_PAGE_CIPHER_SHIFT) & MAP_ENTRY_PAGE_CIPHER_MASK))
 
 #define MAP_ENTRY_SIZE					sizeof(TDEMapEntry)
+#define MAP_ENTRY_SIZE_V1				offsetof(TDEMapEntry, next)
 #define TDE_FILE_HEADER_SIZE			sizeof(TDEFileHeader)
 
+#define MAP_INIT_BUCKETS				64
+
+/* Layout of the v2 map file, see comments on TDEMapIndexHeader */
+#define MAP_INDEX_HEADER_OFFSET			TDE_FILE_HEADER_SIZE
+#define MAP_BUCKET_OFFSET(_bucket) \
+	(MAP_INDEX_HEADER_OFFSET + sizeof(TDEMapIndexHeader) + (off_t) (_bucket) * sizeof(int32))
+#define MAP_ENTRY_OFFSET(_nbuckets, _idx) \
+	(MAP_BUCKET_OFFSET(_nbuckets) + (off_t) (_idx) * MAP_ENTRY_SIZE)
+#define MAP_BUCKET(_relNumber, _nbuckets) \
+	(hash_bytes_uint32(_relNumber) & ((_nbuckets) - 1))
+
 typedef struct TDEFileHeader
 {
 	int32 file_version;
 	TDEPrincipalKeyInfo principal_key_info;
 } TDEFileHeader;
 
+/*
+ * Map entry. The position of an entry in the map file is the index of the
+ * relation key in the key data file, key_index repeats it.
+ *
+ * v1 files (PG_TDE_FILEMAGIC_V1) have no index and entries without `next`,
+ * so a lookup reads the file entry by entry. They are still read as is, and
+ * are upgraded to v2 by the first process modifying the map.
+ */
 typedef struct TDEMapEntry
 {
 	RelFileNumber relNumber;
 	int32 flags;
 	int32 key_index;
+	int32 next; /* next entry in the hash chain, or in the free list if the
+				 * entry is free. -1 if none */
 } TDEMapEntry;
 
+/*
+ * Key Map Table v2 [pg_tde.map]:
+ * 		header: {Format Version, Principal Key Name}
+ * 		index header: {nbuckets, nentries, free_head}
+ * 		buckets: {index of the first entry of the chain}[nbuckets]
+ * 		data: {OID, Flag, index of key in pg_tde.dat, next}[nentries]
+ *
+ * Entries are looked up by hashing relNumber into buckets and following the
+ * chain, so a lookup costs a few reads whatever the size of the map. Freed
+ * entries are kept in a list and reused first, along with their slot in the
+ * key data file. When nentries outgrows nbuckets, the whole file is rewritten
+ * with twice the buckets.
+ *
+ * A map file holding only the file header (as created by
+ * pg_tde_save_principal_key() or key rotation) has no entries yet, the index
+ * is added by the first write.
+ *
+ * Entries are updated in place, with an fsync between every write, so that a
+ * crash never leaves a chain pointing to an entry that isn't fully written,
+ * nor an entry both in a chain and in the free list:
+ *	- a new entry is taken off the free list (or written past nentries) first,
+ *	  then written, then linked in its chain.
+ *	- a freed entry is unlinked from its chain first, then marked free, then
+ *	  put on the free list.
+ * Linking and unlinking are single int32 writes, which are atomic. An entry
+ * is valid only if it is linked in its chain: a crash in the middle leaves at
+ * worst an entry which is in no chain and not on the free list. Such entries
+ * are treated as free when the map is read as a whole, and are reused once
+ * the file is rewritten.
+ */
+typedef struct TDEMapIndexHeader
+{
+	int32 nbuckets; /* always a power of 2 */
+	int32 nentries; /* valid and free entries in the file */
+	int32 free_head; /* first free entry, -1 if none */
+	int32 unused;
+} TDEMapIndexHeader;
+
 typedef struct TDEMapFilePath
 {
 	char map_path[MAXPGPATH];
@@ -89,45 +160,86 @@ typedef struct TDEMapFilePath
 typedef struct RelKeyCacheRec
 {
 	Oid rel_id;
+	int32 next; /* next record in the hash chain or in the free list, -1 if none */
 	RelKeyData key;
 } RelKeyCacheRec;
 
-/* 
+/*
  * Relation keys cache.
- * 
- * This is a slice backed by memory `*data`. Initially, we allocate one memory
- * page (usually 4Kb). We reallocate it by adding another page when we run out
- * of space. This memory is locked in the RAM so it won't be paged to the swap 
- * (we don't want decrypted keys on disk). We do allocations in mem pages as
- * these are the units `mlock()` operations are performed in.
- * 
- * Currently, the cache can only grow (no eviction). The data is located in 
- * TopMemoryContext hence being wiped when the process exits, as well as memory
- * is being unlocked by OS.
+ *
+ * Records are kept in segments of REL_KEY_CACHE_SEGMENT_PAGES memory pages.
+ * A new segment is allocated when all the existing ones are full, segments
+ * never move, so pointers to the keys handed out by GetRelationKey() stay
+ * valid. Every segment is locked in RAM so it won't be paged to the swap (we
+ * don't want decrypted keys on disk). We allocate in mem pages as these are
+ * the units `mlock()` operations are performed in.
+ *
+ * Records are looked up through a chained hash table on rel_id: `buckets`
+ * holds the index of the first record of every chain and records are linked
+ * by `next`. Buckets contain no key material, so they are not locked and are
+ * simply reallocated (doubled) as the cache grows.
+ *
+ * A key is evicted when the map entry of its relation is freed, i.e. when a
+ * relation drop commits or a relation creation aborts. The record is wiped
+ * and put on the free list for reuse. A relation which is alive is never
+ * evicted, as its key may be referenced by scans and slots.
+ *
+ * The data is located in TopMemoryContext hence being wiped when the process
+ * exits, as well as memory is being unlocked by OS.
  */
+#define REL_KEY_CACHE_SEGMENT_PAGES		4
+#define REL_KEY_CACHE_INIT_BUCKETS		256
+#define REL_KEY_CACHE_INIT_SEGMENTS		16
+
 typedef struct RelKeyCache
 {
-	RelKeyCacheRec *data; /* must be a multiple of a memory page (usually 4Kb) */
-	int len; /* num of RelKeyCacheRecs currenty in cache */
-	int cap; /* max amount of RelKeyCacheRec data can fit */
+	RelKeyCacheRec **segments;
+	int nsegments;
+	int max_segments; /* allocated size of segments */
+	int recs_per_segment;
+	int32 *buckets;
+	int32 nbuckets; /* always a power of 2 */
+	int32 len; /* num of RelKeyCacheRecs currenty in cache */
+	int32 high_water; /* records with index below this were handed out once */
+	int32 free_list; /* first evicted record available for reuse, -1 if none */
 } RelKeyCache;
 
+#define REL_KEY_CACHE_REC(_idx) \
+	(&tde_rel_key_cache->segments[(_idx) / tde_rel_key_cache->recs_per_segment] \
+								 [(_idx) % tde_rel_key_cache->recs_per_segment])
+
+#define REL_KEY_CACHE_BUCKET(_rel_id) \
+	(tde_rel_key_cache->buckets[hash_bytes_uint32(_rel_id) & (tde_rel_key_cache->nbuckets - 1)])
+
 RelKeyCache *tde_rel_key_cache = NULL;
 
-static int32 pg_tde_process_map_entry(const RelFileLocator *rlocator, char *db_map_path, off_t *offset, bool should_delete);
+static int32 pg_tde_process_map_entry(const RelFileLocator *rlocator, char *db_map_path, off_t *offset, bool should_delete, int32 *flags);
 static RelKeyData* pg_tde_read_keydata(char *db_keydata_path, int32 key_index, TDEPrincipalKey *principal_key);
 static int pg_tde_open_file_basic(char *tde_filename, int fileFlags, bool ignore_missing);
 static int pg_tde_file_header_read(char *tde_filename, int fd, TDEFileHeader *fheader, bool *is_new_file, off_t *bytes_read);
 static bool pg_tde_read_one_map_entry(int fd, const RelFileLocator *rlocator, int flags, TDEMapEntry *map_entry, off_t *offset);
+static int32 pg_tde_find_map_entry_v1(int map_fd, const RelFileLocator *rlocator, TDEMapEntry *map_entry, off_t *offset);
+static int pg_tde_open_map_file(char *db_map_path, TDEPrincipalKeyInfo *principal_key_info, int fileFlags, int32 *file_version);
+static bool pg_tde_read_map_index(int fd, char *db_map_path, TDEMapIndexHeader *ihdr);
+static int32 pg_tde_map_lookup(int fd, char *db_map_path, const TDEMapIndexHeader *ihdr, RelFileNumber relNumber, TDEMapEntry *map_entry, int32 *prev_index);
+static TDEMapEntry *pg_tde_read_map_entries(int fd, char *db_map_path, int32 file_version, int32 *nentries);
+static void pg_tde_read_map_data(int fd, char *db_map_path, void *data, Size size, off_t offset);
 static RelKeyData* pg_tde_read_one_keydata(int keydata_fd, int32 key_index, TDEPrincipalKey *principal_key);
 static int pg_tde_open_file(char *tde_filename, TDEPrincipalKeyInfo *principal_key_info, bool should_fill_info, int fileFlags, bool *is_new_file, off_t *offset);
 static RelKeyData *pg_tde_get_key_from_cache(Oid rel_id);
+static void pg_tde_evict_key_from_cache(Oid rel_id);
 
 #ifndef FRONTEND
 
 static int pg_tde_file_header_write(char *tde_filename, int fd, TDEPrincipalKeyInfo *principal_key_info, off_t *bytes_written);
-static int32 pg_tde_write_map_entry(const RelFileLocator *rlocator, char *db_map_path, TDEPrincipalKeyInfo *principal_key_info);
-static off_t pg_tde_write_one_map_entry(int fd, const RelFileLocator *rlocator, int flags, int32 key_index, TDEMapEntry *map_entry, off_t *offset);
+static int32 pg_tde_write_map_entry(const RelFileLocator *rlocator, char *db_map_path, char *db_keydata_path, RelKeyData *enc_rel_key_data, TDEPrincipalKeyInfo *principal_key_info);
+static void pg_tde_free_map_entry(int fd, char *db_map_path, TDEMapIndexHeader *ihdr, int32 key_index, TDEMapEntry *map_entry, int32 prev_index);
+static int pg_tde_prepare_map_for_write(int fd, char *db_map_path, int32 file_version, TDEMapIndexHeader *ihdr);
+static int pg_tde_rewrite_map_file(char *db_map_path, int fd, int32 file_version, int32 min_buckets);
+static void pg_tde_write_map_file(int fd, char *db_map_path, TDEPrincipalKeyInfo *principal_key_info, TDEMapEntry *map_entries, int32 nentries, int32 nbuckets);
+static void pg_tde_write_map_data(int fd, char *db_map_path, const void *data, Size size, off_t offset);
+static void pg_tde_sync_map_file(int fd, char *db_map_path);
+static int32 pg_tde_map_nbuckets(int32 nentries);
 static void pg_tde_write_keydata(char *db_keydata_path, TDEPrincipalKeyInfo *principal_key_info, int32 key_index, RelKeyData *enc_rel_key_data);
 static void pg_tde_write_one_keydata(int keydata_fd, int32 key_index, RelKeyData *enc_rel_key_data);
 static int keyrotation_init_file(TDEPrincipalKeyInfo *new_principal_key_info, char *rotated_filename, char *filename, bool *is_new_file, off_t *curr_pos);
@@ -135,16 +247,18 @@ static void finalize_key_rotation(char *m_path_old, char *k_path_old, char *m_pa
 
 /*
  * Generate an encrypted key for the relation and store it in the keymap file.
+ * page_cipher (TDE_PAGE_CIPHER_*) is recorded in the map entry and defines
+ * how the storage manager encrypts the relation pages.
  */
 RelKeyData*
-pg_tde_create_key_map_entry(const RelFileLocator *newrlocator)
+pg_tde_create_key_map_entry(const RelFileLocator *newrlocator, uint32 page_cipher)
 {
 	InternalKey int_key;
 	RelKeyData *rel_key_data;
 	RelKeyData *enc_rel_key_data;
 	TDEPrincipalKey *principal_key;
 	XLogRelKey xlrec;
-    LWLock *lock_pk = tde_lwlock_enc_keys();
+    LWLock *lock_pk = tde_lwlock_enc_keys(newrlocator->dbOid);
 
 	LWLockAcquire(lock_pk, LW_EXCLUSIVE);
 	principal_key = GetPrincipalKey(newrlocator->dbOid, newrlocator->spcOid, LW_EXCLUSIVE);
@@ -158,6 +272,7 @@ pg_tde_create_key_map_entry(const RelFileLocator *newrlocator)
 	}
 
 	memset(&int_key, 0, sizeof(InternalKey));
+	int_key.page_cipher = page_cipher;
 
 	if (!RAND_bytes(int_key.key, INTERNAL_KEY_LEN))
 	{
@@ -171,7 +286,7 @@ pg_tde_create_key_map_entry(const RelFileLocator *newrlocator)
 	}
 
 	/* Encrypt the key */
-	rel_key_data = tde_create_rel_key(newrlocator->relNumber, &int_key, &principal_key->keyInfo);
+	rel_key_data = tde_create_rel_key(newrlocator->relNumber, &int_key);
 	enc_rel_key_data = tde_encrypt_rel_key(principal_key, rel_key_data, newrlocator);
 
 	/*
@@ -210,10 +325,9 @@ tde_sprint_key(InternalKey *k)
  * created key.
  */
 RelKeyData *
-tde_create_rel_key(Oid rel_id, InternalKey *key, TDEPrincipalKeyInfo *principal_key_info)
+tde_create_rel_key(Oid rel_id, InternalKey *key)
 {
 	RelKeyData 	rel_key_data;
-	memcpy(&rel_key_data.principal_key_id, &principal_key_info->keyId, sizeof(TDEPrincipalKeyId));
 	memcpy(&rel_key_data.internal_key, key, sizeof(InternalKey));
 	rel_key_data.internal_key.ctx = NULL;
 
@@ -250,6 +364,8 @@ pg_tde_delete_tde_files(Oid dbOid, Oid spcOid)
 	/* Remove these files without emitting any error */
 	PathNameDeleteTemporaryFile(db_map_path, false);
 	PathNameDeleteTemporaryFile(db_keydata_path, false);
+
+	pg_tde_shared_key_cache_evict_db(dbOid);
 }
 
 /*
@@ -330,99 +446,288 @@ pg_tde_file_header_write(char *tde_filename, int fd, TDEPrincipalKeyInfo *princi
 }
 
 /*
- * Key Map Table [pg_tde.map]:
- * 		header: {Format Version, Principal Key Name}
- * 		data: {OID, Flag, index of key in pg_tde.dat}...
+ * Adds the map entry of the relation to the key map table [pg_tde.map], see
+ * comments on TDEMapIndexHeader for the format, and writes the encrypted key
+ * to the key data file before the entry becomes valid.
  *
- * Returns the index of the key to be written in the key data file.
+ * Returns the index of the key in the key data file.
  * The caller must hold an exclusive lock on the map file to avoid
  * concurrent in place updates leading to data conflicts.
  */
 static int32
-pg_tde_write_map_entry(const RelFileLocator *rlocator, char *db_map_path, TDEPrincipalKeyInfo *principal_key_info)
+pg_tde_write_map_entry(const RelFileLocator *rlocator, char *db_map_path, char *db_keydata_path, RelKeyData *enc_rel_key_data, TDEPrincipalKeyInfo *principal_key_info)
 {
 	int map_fd = -1;
-	int32 key_index = 0;
+	int32 key_index;
+	int32 flags = MAP_ENTRY_FLAGS(MAP_ENTRY_VALID, enc_rel_key_data->internal_key.page_cipher);
+	int32 file_version;
+	int32 bucket;
 	TDEMapEntry map_entry;
-	bool is_new_file;
-	off_t curr_pos  = 0;
-	off_t prev_pos = 0;
-	bool found = false;
+	TDEMapIndexHeader ihdr;
 
 	/* Open and vaidate file for basic correctness. */
-	map_fd = pg_tde_open_file(db_map_path, principal_key_info, false, O_RDWR | O_CREAT, &is_new_file, &curr_pos);
-	prev_pos = curr_pos;
+	map_fd = pg_tde_open_map_file(db_map_path, principal_key_info, O_RDWR | O_CREAT, &file_version);
+	map_fd = pg_tde_prepare_map_for_write(map_fd, db_map_path, file_version, &ihdr);
 
 	/*
-	 * Read until we find an empty slot. Otherwise, read until end. This seems
-	 * to be less frequent than vacuum. So let's keep this function here rather
-	 * than overloading the vacuum process.
+	 * A valid entry may already exist if the relation number is reused
+	 * without its previous entry being freed, as on a standby. Take it over
+	 * along with its key data slot.
 	 */
-	while(1)
+	key_index = pg_tde_map_lookup(map_fd, db_map_path, &ihdr, rlocator->relNumber, &map_entry, NULL);
+
+	if (key_index != -1)
 	{
-		prev_pos = curr_pos;
-		found = pg_tde_read_one_map_entry(map_fd, NULL, MAP_ENTRY_FREE, &map_entry, &curr_pos);
+		/* The entry is already linked, update its key and flags in place */
+		pg_tde_write_keydata(db_keydata_path, principal_key_info, key_index, enc_rel_key_data);
+		map_entry.flags = flags;
+		pg_tde_write_map_data(map_fd, db_map_path, &map_entry, MAP_ENTRY_SIZE, MAP_ENTRY_OFFSET(ihdr.nbuckets, key_index));
+		pg_tde_sync_map_file(map_fd, db_map_path);
+	}
+	else
+	{
+		bucket = MAP_BUCKET(rlocator->relNumber, ihdr.nbuckets);
+
+		map_entry.relNumber = rlocator->relNumber;
+		map_entry.flags = flags;
+		pg_tde_read_map_data(map_fd, db_map_path, &map_entry.next, sizeof(int32), MAP_BUCKET_OFFSET(bucket));
+
+		/*
+		 * Reuse a free entry if any, taking it off the free list before it
+		 * is overwritten. Otherwise, append one, writing it before it is
+		 * counted in nentries.
+		 */
+		if (ihdr.free_head != -1)
+		{
+			TDEMapEntry free_entry;
 
-		/* We either reach EOF or found an empty slot in the middle of the file */
-		if (prev_pos == curr_pos || found)
-			break;
+			key_index = ihdr.free_head;
+			pg_tde_read_map_data(map_fd, db_map_path, &free_entry, MAP_ENTRY_SIZE, MAP_ENTRY_OFFSET(ihdr.nbuckets, key_index));
+			ihdr.free_head = free_entry.next;
+			pg_tde_write_map_data(map_fd, db_map_path, &ihdr, sizeof(TDEMapIndexHeader), MAP_INDEX_HEADER_OFFSET);
+			pg_tde_sync_map_file(map_fd, db_map_path);
 
-		/* Increment the offset and the key index */
-		key_index++;
-	}
+			map_entry.key_index = key_index;
+			pg_tde_write_map_data(map_fd, db_map_path, &map_entry, MAP_ENTRY_SIZE, MAP_ENTRY_OFFSET(ihdr.nbuckets, key_index));
+			pg_tde_sync_map_file(map_fd, db_map_path);
+		}
+		else
+		{
+			key_index = ihdr.nentries++;
+
+			map_entry.key_index = key_index;
+			pg_tde_write_map_data(map_fd, db_map_path, &map_entry, MAP_ENTRY_SIZE, MAP_ENTRY_OFFSET(ihdr.nbuckets, key_index));
+			pg_tde_sync_map_file(map_fd, db_map_path);
+
+			pg_tde_write_map_data(map_fd, db_map_path, &ihdr, sizeof(TDEMapIndexHeader), MAP_INDEX_HEADER_OFFSET);
+			pg_tde_sync_map_file(map_fd, db_map_path);
+		}
 
-	/* Write the given entry at the location pointed by prev_pos; i.e. the free entry */
-	curr_pos = prev_pos;
-	pg_tde_write_one_map_entry(map_fd, rlocator, MAP_ENTRY_VALID, key_index, &map_entry, &prev_pos);
+		pg_tde_write_keydata(db_keydata_path, principal_key_info, key_index, enc_rel_key_data);
+
+		/* Link the entry at the head of its chain, which makes it valid */
+		pg_tde_write_map_data(map_fd, db_map_path, &key_index, sizeof(int32), MAP_BUCKET_OFFSET(bucket));
+		pg_tde_sync_map_file(map_fd, db_map_path);
+	}
 
 	/* Let's close the file. */
 	close(map_fd);
 
 	/* Register the entry to be freed in case the transaction aborts */
-	RegisterEntryForDeletion(rlocator, curr_pos, false);
+	RegisterEntryForDeletion(rlocator, false);
 
 	return key_index;
 }
 
 /*
- * Based on the given arguments, creates and write the entry into the key
- * map file.
+ * Unlinks the valid entry key_index from its hash chain and puts it on the
+ * free list. prev_index is the previous entry of the chain, -1 if the entry
+ * is the first one.
  */
-static off_t
-pg_tde_write_one_map_entry(int fd, const RelFileLocator *rlocator, int flags, int32 key_index, TDEMapEntry *map_entry, off_t *offset)
+static void
+pg_tde_free_map_entry(int fd, char *db_map_path, TDEMapIndexHeader *ihdr, int32 key_index, TDEMapEntry *map_entry, int32 prev_index)
 {
-	int bytes_written = 0;
+	/* Unlinking the entry frees it, the rest is only about reusing it */
+	if (prev_index == -1)
+	{
+		int32 bucket = MAP_BUCKET(map_entry->relNumber, ihdr->nbuckets);
 
-	Assert(map_entry);
+		pg_tde_write_map_data(fd, db_map_path, &map_entry->next, sizeof(int32), MAP_BUCKET_OFFSET(bucket));
+	}
+	else
+		pg_tde_write_map_data(fd, db_map_path, &map_entry->next, sizeof(int32),
+							  MAP_ENTRY_OFFSET(ihdr->nbuckets, prev_index) + offsetof(TDEMapEntry, next));
+	pg_tde_sync_map_file(fd, db_map_path);
+
+	map_entry->relNumber = 0;
+	map_entry->flags = MAP_ENTRY_FREE;
+	map_entry->next = ihdr->free_head;
+	pg_tde_write_map_data(fd, db_map_path, map_entry, MAP_ENTRY_SIZE, MAP_ENTRY_OFFSET(ihdr->nbuckets, key_index));
+	pg_tde_sync_map_file(fd, db_map_path);
+
+	ihdr->free_head = key_index;
+	pg_tde_write_map_data(fd, db_map_path, ihdr, sizeof(TDEMapIndexHeader), MAP_INDEX_HEADER_OFFSET);
+	pg_tde_sync_map_file(fd, db_map_path);
+}
+
+/*
+ * Makes sure the map file opened for writing is a v2 file with an index able
+ * to take one more entry, rewriting it if needed, and reads its index header.
+ * Returns the descriptor of the file, which changes if it was rewritten.
+ */
+static int
+pg_tde_prepare_map_for_write(int fd, char *db_map_path, int32 file_version, TDEMapIndexHeader *ihdr)
+{
+	if (file_version == PG_TDE_FILEMAGIC_V1)
+	{
+		ereport(LOG,
+				(errmsg("upgrading tde map file \"%s\" to a new format", db_map_path)));
+		fd = pg_tde_rewrite_map_file(db_map_path, fd, file_version, MAP_INIT_BUCKETS);
+	}
+	else if (!pg_tde_read_map_index(fd, db_map_path, ihdr))
+	{
+		/* The file has no entries yet, add an empty index */
+		fd = pg_tde_rewrite_map_file(db_map_path, fd, file_version, MAP_INIT_BUCKETS);
+	}
+	else if (ihdr->free_head == -1 && ihdr->nentries >= ihdr->nbuckets)
+		fd = pg_tde_rewrite_map_file(db_map_path, fd, file_version, ihdr->nbuckets * 2);
+	else
+		return fd;
 
-	/* Fill in the map entry structure */
-	map_entry->relNumber = (rlocator == NULL) ? 0 : rlocator->relNumber;
-	map_entry->flags = flags;
-	map_entry->key_index = key_index;
+	pg_tde_read_map_index(fd, db_map_path, ihdr);
+	return fd;
+}
 
-	/* TODO: pgstat_report_wait_start / pgstat_report_wait_end */
-	bytes_written = pg_pwrite(fd, map_entry, MAP_ENTRY_SIZE, *offset);
+/*
+ * Rewrites the map file as a v2 file with at least min_buckets buckets. It
+ * goes through a temporary file, so a crash leaves either the old or the new
+ * file in place. Key indexes are kept, so the key data file is unchanged.
+ *
+ * Closes fd and returns the descriptor of the new file.
+ */
+static int
+pg_tde_rewrite_map_file(char *db_map_path, int fd, int32 file_version, int32 min_buckets)
+{
+	TDEFileHeader fheader;
+	TDEMapEntry *map_entries;
+	int32		nentries;
+	int32		nbuckets;
+	int			new_fd;
+	bool		is_new_file;
+	off_t		bytes_read = 0;
+	char		tmp_path[MAXPGPATH];
+
+	pg_tde_file_header_read(db_map_path, fd, &fheader, &is_new_file, &bytes_read);
+	map_entries = pg_tde_read_map_entries(fd, db_map_path, file_version, &nentries);
+
+	nbuckets = pg_tde_map_nbuckets(nentries);
+	while (nbuckets < min_buckets)
+		nbuckets *= 2;
+
+	snprintf(tmp_path, MAXPGPATH, "%s.u", db_map_path);
+	new_fd = pg_tde_open_file_basic(tmp_path, O_RDWR | O_CREAT | O_TRUNC, false);
+	pg_tde_write_map_file(new_fd, tmp_path, &fheader.principal_key_info, map_entries, nentries, nbuckets);
+
+	close(fd);
+	durable_rename(tmp_path, db_map_path, ERROR);
+
+	pfree(map_entries);
+
+	return new_fd;
+}
+
+/*
+ * Writes a whole v2 map file with the given entries, valid and free, with a
+ * single write. The position of an entry in the array is its key index.
+ */
+static void
+pg_tde_write_map_file(int fd, char *db_map_path, TDEPrincipalKeyInfo *principal_key_info, TDEMapEntry *map_entries, int32 nentries, int32 nbuckets)
+{
+	Size		size = MAP_ENTRY_OFFSET(nbuckets, nentries);
+	char	   *buf = palloc0(size);
+	TDEFileHeader *fheader = (TDEFileHeader *) buf;
+	TDEMapIndexHeader *ihdr = (TDEMapIndexHeader *) (buf + MAP_INDEX_HEADER_OFFSET);
+	int32	   *buckets = (int32 *) (buf + MAP_BUCKET_OFFSET(0));
+	TDEMapEntry *file_entries = (TDEMapEntry *) (buf + MAP_ENTRY_OFFSET(nbuckets, 0));
+
+	Assert(nentries <= nbuckets);
+
+	fheader->file_version = PG_TDE_FILEMAGIC;
+	memcpy(&fheader->principal_key_info, principal_key_info, sizeof(TDEPrincipalKeyInfo));
+
+	ihdr->nbuckets = nbuckets;
+	ihdr->nentries = nentries;
+	ihdr->free_head = -1;
+
+	for (int32 bucket = 0; bucket < nbuckets; bucket++)
+		buckets[bucket] = -1;
+
+	/* Link backwards, so chains and the free list are in the file order */
+	for (int32 key_index = nentries - 1; key_index >= 0; key_index--)
+	{
+		TDEMapEntry *map_entry = &file_entries[key_index];
+
+		*map_entry = map_entries[key_index];
+		map_entry->key_index = key_index;
+
+		if ((map_entry->flags & MAP_ENTRY_STATE_MASK) == MAP_ENTRY_VALID)
+		{
+			int32 bucket = MAP_BUCKET(map_entry->relNumber, nbuckets);
+
+			map_entry->next = buckets[bucket];
+			buckets[bucket] = key_index;
+		}
+		else
+		{
+			map_entry->relNumber = 0;
+			map_entry->flags = MAP_ENTRY_FREE;
+			map_entry->next = ihdr->free_head;
+			ihdr->free_head = key_index;
+		}
+	}
+
+	pg_tde_write_map_data(fd, db_map_path, buf, size, 0);
+	pg_tde_sync_map_file(fd, db_map_path);
+
+	pfree(buf);
+}
 
-	/* Add the entry to the file */
-	if (bytes_written != MAP_ENTRY_SIZE)
+static void
+pg_tde_write_map_data(int fd, char *db_map_path, const void *data, Size size, off_t offset)
+{
+	/* TODO: pgstat_report_wait_start / pgstat_report_wait_end */
+	if (pg_pwrite(fd, data, size, offset) != size)
 	{
-		char db_map_path[MAXPGPATH] = {0};
-		pg_tde_set_db_file_paths(rlocator->dbOid, rlocator->spcOid, db_map_path, NULL);
 		ereport(FATAL,
 				(errcode_for_file_access(),
 					errmsg("could not write tde map file \"%s\": %m",
 						db_map_path)));
 	}
+}
+
+static void
+pg_tde_sync_map_file(int fd, char *db_map_path)
+{
 	if (pg_fsync(fd) != 0)
 	{
-		char db_map_path[MAXPGPATH] = {0};
-		pg_tde_set_db_file_paths(rlocator->dbOid, rlocator->spcOid, db_map_path, NULL);
 		ereport(data_sync_elevel(ERROR),
 				(errcode_for_file_access(),
 				 errmsg("could not fsync file \"%s\": %m", db_map_path)));
 	}
+}
+
+/*
+ * Number of buckets of an index able to take one more entry than nentries
+ */
+static int32
+pg_tde_map_nbuckets(int32 nentries)
+{
+	int32 nbuckets = MAP_INIT_BUCKETS;
+
+	while (nbuckets <= nentries)
+		nbuckets *= 2;
 
-	return (*offset + bytes_written);
+	return nbuckets;
 }
 
 /*
@@ -481,29 +786,30 @@ pg_tde_write_one_keydata(int fd, int32 key_index, RelKeyData *enc_rel_key_data)
 }
 
 /*
- * Calls the create map entry function to get an index into the keydata. This
- * The keydata function will then write the encrypted key on the desired
- * location.
+ * Adds the map entry of the relation and writes its encrypted key to the key
+ * data file at the index of the entry.
  *
  * The caller must hold an exclusive lock tde_lwlock_enc_keys.
  */
 void
 pg_tde_write_key_map_entry(const RelFileLocator *rlocator, RelKeyData *enc_rel_key_data, TDEPrincipalKeyInfo *principal_key_info)
 {
-	int32	key_index = 0;
 	char	db_map_path[MAXPGPATH] = {0};
 	char	db_keydata_path[MAXPGPATH] = {0};
 
 	Assert(rlocator);
 
+	/* The relation number may be reused, drop the key of its previous owner */
+	pg_tde_shared_key_cache_evict(rlocator);
+
 	/* Set the file paths */
 	pg_tde_set_db_file_paths(rlocator->dbOid, rlocator->spcOid, db_map_path, db_keydata_path);
 
-	/* Create the map entry and then add the encrypted key to the data file */
-	key_index = pg_tde_write_map_entry(rlocator, db_map_path, principal_key_info);
+	/* Create the map entry, which also adds the encrypted key to the data file */
+	pg_tde_write_map_entry(rlocator, db_map_path, db_keydata_path, enc_rel_key_data, principal_key_info);
 
-	/* Add the encrypted key to the data file. */
-	pg_tde_write_keydata(db_keydata_path, principal_key_info, key_index, enc_rel_key_data);
+	/* Backends may have cached that the relation has no key */
+	pg_tde_rel_key_created(rlocator);
 }
 
 /*
@@ -515,7 +821,7 @@ pg_tde_delete_key_map_entry(const RelFileLocator *rlocator)
 {
 	int32	key_index = 0;
 	off_t	offset = 0;
-	LWLock	*lock_files = tde_lwlock_enc_keys();
+	LWLock	*lock_files = tde_lwlock_enc_keys(rlocator->dbOid);
 	char	db_map_path[MAXPGPATH] = {0};
 	char	db_keydata_path[MAXPGPATH] = {0};
 
@@ -527,7 +833,7 @@ pg_tde_delete_key_map_entry(const RelFileLocator *rlocator)
 	errno = 0;
 	/* Remove the map entry if found */
 	LWLockAcquire(lock_files, LW_EXCLUSIVE);
-	key_index = pg_tde_process_map_entry(rlocator, db_map_path, &offset, false);
+	key_index = pg_tde_process_map_entry(rlocator, db_map_path, &offset, false, NULL);
 	LWLockRelease(lock_files);
 
 	if (key_index == -1)
@@ -542,7 +848,7 @@ pg_tde_delete_key_map_entry(const RelFileLocator *rlocator)
 	}
 
 	/* Register the entry to be freed when transaction commits */
-	RegisterEntryForDeletion(rlocator, offset, true);
+	RegisterEntryForDeletion(rlocator, true);
 }
 
 /*
@@ -553,14 +859,14 @@ pg_tde_delete_key_map_entry(const RelFileLocator *rlocator)
  * that transaction will commit more often then getting aborted avoids
  * unnecessary locking.
  *
- * The offset allows us to simply seek to the desired location and mark the entry
- * as MAP_ENTRY_FREE without needing any further processing.
+ * The entry is found through the map index.
  */
 void
-pg_tde_free_key_map_entry(const RelFileLocator *rlocator, off_t offset)
+pg_tde_free_key_map_entry(const RelFileLocator *rlocator)
 {
 	int32	key_index = 0;
-	LWLock	*lock_files = tde_lwlock_enc_keys();
+	off_t	offset = 0;
+	LWLock	*lock_files = tde_lwlock_enc_keys(rlocator->dbOid);
 	char	db_map_path[MAXPGPATH] = {0};
 	char	db_keydata_path[MAXPGPATH] = {0};
 
@@ -571,9 +877,13 @@ pg_tde_free_key_map_entry(const RelFileLocator *rlocator, off_t offset)
 
 	/* Remove the map entry if found */
 	LWLockAcquire(lock_files, LW_EXCLUSIVE);
-	key_index = pg_tde_process_map_entry(rlocator, db_map_path, &offset, true);
+	key_index = pg_tde_process_map_entry(rlocator, db_map_path, &offset, true, NULL);
 	LWLockRelease(lock_files);
 
+	/* The relation is gone, and its number may be reused with a new key */
+	pg_tde_evict_key_from_cache(rlocator->relNumber);
+	pg_tde_shared_key_cache_evict(rlocator);
+
 	if (key_index == -1)
 	{
 		ereport(WARNING,
@@ -629,7 +939,6 @@ pg_tde_perform_rotate_key(TDEPrincipalKey *principal_key, TDEPrincipalKey *new_p
 #define PRINCIPAL_KEY_COUNT	2
 
 	off_t curr_pos[PRINCIPAL_KEY_COUNT]  = {0};
-	off_t prev_pos[PRINCIPAL_KEY_COUNT]  = {0};
 	int32 key_index[PRINCIPAL_KEY_COUNT]  = {0};
 	RelKeyData *rel_key_data[PRINCIPAL_KEY_COUNT];
 	RelKeyData *enc_rel_key_data[PRINCIPAL_KEY_COUNT];
@@ -637,9 +946,10 @@ pg_tde_perform_rotate_key(TDEPrincipalKey *principal_key, TDEPrincipalKey *new_p
 	int k_fd[PRINCIPAL_KEY_COUNT] = {-1};
 	char m_path[PRINCIPAL_KEY_COUNT][MAXPGPATH];
 	char k_path[PRINCIPAL_KEY_COUNT][MAXPGPATH];
-	TDEMapEntry map_entry;
+	TDEMapEntry *map_entries[PRINCIPAL_KEY_COUNT];
+	int32 nentries;
+	int32 file_version;
 	RelFileLocator rloc;
-	bool found = false;
 	off_t read_pos_tmp = 0;
 	bool is_new_file;
 	off_t map_size;
@@ -659,28 +969,29 @@ pg_tde_perform_rotate_key(TDEPrincipalKey *principal_key, TDEPrincipalKey *new_p
 	strncpy(k_path[OLD_PRINCIPAL_KEY], db_keydata_path, MAXPGPATH);
 
 	/* Open both files in read only mode. We don't need to track the current position of the keydata file. We always use the key index */
-	m_fd[OLD_PRINCIPAL_KEY] = pg_tde_open_file(m_path[OLD_PRINCIPAL_KEY], &principal_key->keyInfo, false, O_RDONLY, &is_new_file, &curr_pos[OLD_PRINCIPAL_KEY]);
+	m_fd[OLD_PRINCIPAL_KEY] = pg_tde_open_map_file(m_path[OLD_PRINCIPAL_KEY], NULL, O_RDONLY, &file_version);
 	k_fd[OLD_PRINCIPAL_KEY] = pg_tde_open_file(k_path[OLD_PRINCIPAL_KEY], &principal_key->keyInfo, false, O_RDONLY, &is_new_file, &read_pos_tmp);
 
 	m_fd[NEW_PRINCIPAL_KEY] = keyrotation_init_file(&new_principal_key->keyInfo, m_path[NEW_PRINCIPAL_KEY], m_path[OLD_PRINCIPAL_KEY], &is_new_file, &curr_pos[NEW_PRINCIPAL_KEY]);
 	k_fd[NEW_PRINCIPAL_KEY] = keyrotation_init_file(&new_principal_key->keyInfo, k_path[NEW_PRINCIPAL_KEY], k_path[OLD_PRINCIPAL_KEY], &is_new_file, &read_pos_tmp);
 
-	/* Read all entries until EOF */
-	for(key_index[OLD_PRINCIPAL_KEY] = 0; ; key_index[OLD_PRINCIPAL_KEY]++)
-	{
-		prev_pos[OLD_PRINCIPAL_KEY] = curr_pos[OLD_PRINCIPAL_KEY];
-		found = pg_tde_read_one_map_entry(m_fd[OLD_PRINCIPAL_KEY], NULL, MAP_ENTRY_VALID, &map_entry, &curr_pos[OLD_PRINCIPAL_KEY]);
+	/*
+	 * Read all entries at once. Free entries are dropped, so the rotated
+	 * files are compacted, and the new map is always written in v2 format.
+	 */
+	map_entries[OLD_PRINCIPAL_KEY] = pg_tde_read_map_entries(m_fd[OLD_PRINCIPAL_KEY], m_path[OLD_PRINCIPAL_KEY], file_version, &nentries);
+	map_entries[NEW_PRINCIPAL_KEY] = palloc(Max(nentries, 1) * sizeof(TDEMapEntry));
 
-		/* We either reach EOF */
-		if (prev_pos[OLD_PRINCIPAL_KEY] == curr_pos[OLD_PRINCIPAL_KEY])
-			break;
+	for(key_index[OLD_PRINCIPAL_KEY] = 0; key_index[OLD_PRINCIPAL_KEY] < nentries; key_index[OLD_PRINCIPAL_KEY]++)
+	{
+		TDEMapEntry *map_entry = &map_entries[OLD_PRINCIPAL_KEY][key_index[OLD_PRINCIPAL_KEY]];
 
 		/* We didn't find a valid entry */
-		if (found == false)
+		if ((map_entry->flags & MAP_ENTRY_STATE_MASK) != MAP_ENTRY_VALID)
 			continue;
 
 		/* Set the relNumber of rlocator. Ignore the tablespace Oid since we only place our files under the default. */
-		rloc.relNumber = map_entry.relNumber;
+		rloc.relNumber = map_entry->relNumber;
 		rloc.dbOid = principal_key->keyInfo.databaseId;
 		rloc.spcOid = DEFAULTTABLESPACE_OID;
 
@@ -691,15 +1002,20 @@ pg_tde_perform_rotate_key(TDEPrincipalKey *principal_key, TDEPrincipalKey *new_p
 		rel_key_data[OLD_PRINCIPAL_KEY] = tde_decrypt_rel_key(principal_key, enc_rel_key_data[OLD_PRINCIPAL_KEY], &rloc);
 		enc_rel_key_data[NEW_PRINCIPAL_KEY] = tde_encrypt_rel_key(new_principal_key, rel_key_data[OLD_PRINCIPAL_KEY], &rloc);
 
-		/* Write the given entry at the location pointed by prev_pos */
-		prev_pos[NEW_PRINCIPAL_KEY] = curr_pos[NEW_PRINCIPAL_KEY];
-		curr_pos[NEW_PRINCIPAL_KEY] = pg_tde_write_one_map_entry(m_fd[NEW_PRINCIPAL_KEY], &rloc, MAP_ENTRY_VALID, key_index[NEW_PRINCIPAL_KEY], &map_entry, &prev_pos[NEW_PRINCIPAL_KEY]);
+		/* The map file is written once all the keys are */
+		map_entries[NEW_PRINCIPAL_KEY][key_index[NEW_PRINCIPAL_KEY]] = *map_entry;
 		pg_tde_write_one_keydata(k_fd[NEW_PRINCIPAL_KEY], key_index[NEW_PRINCIPAL_KEY], enc_rel_key_data[NEW_PRINCIPAL_KEY]);
 
 		/* Increment the key index for the new principal key */
 		key_index[NEW_PRINCIPAL_KEY]++;
 	}
 
+	pg_tde_write_map_file(m_fd[NEW_PRINCIPAL_KEY], m_path[NEW_PRINCIPAL_KEY], &new_principal_key->keyInfo,
+						  map_entries[NEW_PRINCIPAL_KEY], key_index[NEW_PRINCIPAL_KEY],
+						  pg_tde_map_nbuckets(key_index[NEW_PRINCIPAL_KEY]));
+	pfree(map_entries[OLD_PRINCIPAL_KEY]);
+	pfree(map_entries[NEW_PRINCIPAL_KEY]);
+
 	/* Close unrotated files */
 	close(m_fd[OLD_PRINCIPAL_KEY]);
 	close(k_fd[OLD_PRINCIPAL_KEY]);
@@ -822,6 +1138,126 @@ FINALIZE:
 	return !is_err;
 }
 
+/*
+ * Loads the keys of all the relations of the database into the shared key
+ * cache, along with the principal key of the database. Returns the number of
+ * relation keys cached.
+ */
+int
+pg_tde_prewarm_rel_keys(Oid dbOid, Oid spcOid)
+{
+	TDEPrincipalKey *principal_key;
+	RelKeyData	*rel_key_data;
+	RelKeyData	*enc_rel_key_data;
+	TDEMapEntry	*map_entries;
+	RelFileLocator rloc;
+	LWLock		*lock_pk = tde_lwlock_enc_keys(dbOid);
+	char		db_map_path[MAXPGPATH] = {0};
+	char		db_keydata_path[MAXPGPATH] = {0};
+	off_t		read_pos = 0;
+	bool		is_new_file;
+	int32		file_version;
+	int32		nentries;
+	int			m_fd;
+	int			k_fd;
+	int			count = 0;
+
+	pg_tde_set_db_file_paths(dbOid, spcOid, db_map_path, db_keydata_path);
+
+	/* pg_tde was never used in this database */
+	if (access(db_map_path, F_OK) != 0)
+		return 0;
+
+	/* Same locking as in pg_tde_get_key_from_file() */
+	LWLockAcquire(lock_pk, LW_SHARED);
+	principal_key = GetPrincipalKey(dbOid, spcOid, LW_SHARED);
+	if (principal_key == NULL)
+	{
+		LWLockRelease(lock_pk);
+		ereport(LOG,
+				(errmsg("could not load the principal key of database %u, its keys are not prewarmed", dbOid)));
+		return 0;
+	}
+
+	m_fd = pg_tde_open_map_file(db_map_path, NULL, O_RDONLY, &file_version);
+	k_fd = pg_tde_open_file(db_keydata_path, &principal_key->keyInfo, false, O_RDONLY, &is_new_file, &read_pos);
+
+	map_entries = pg_tde_read_map_entries(m_fd, db_map_path, file_version, &nentries);
+
+	for (int32 key_index = 0; key_index < nentries; key_index++)
+	{
+		if ((map_entries[key_index].flags & MAP_ENTRY_STATE_MASK) != MAP_ENTRY_VALID)
+			continue;
+
+		rloc.spcOid = spcOid;
+		rloc.dbOid = dbOid;
+		rloc.relNumber = map_entries[key_index].relNumber;
+
+		enc_rel_key_data = pg_tde_read_one_keydata(k_fd, key_index, principal_key);
+		enc_rel_key_data->internal_key.page_cipher = MAP_ENTRY_PAGE_CIPHER(map_entries[key_index].flags);
+		rel_key_data = tde_decrypt_rel_key(principal_key, enc_rel_key_data, &rloc);
+
+		if (pg_tde_shared_key_cache_put(&rloc, rel_key_data))
+			count++;
+
+		explicit_bzero(rel_key_data, sizeof(RelKeyData));
+		pfree(rel_key_data);
+		pfree(enc_rel_key_data);
+	}
+
+	pfree(map_entries);
+	close(m_fd);
+	close(k_fd);
+	LWLockRelease(lock_pk);
+
+	return count;
+}
+
+/*
+ * Returns the relation numbers of all the relations of the database that have
+ * a key, NULL if there is none. *count is set to the number of relations.
+ */
+RelFileNumber *
+pg_tde_get_keyed_relations(Oid dbOid, Oid spcOid, int *count)
+{
+	TDEMapEntry	*map_entries;
+	RelFileNumber *relnumbers;
+	LWLock		*lock_pk = tde_lwlock_enc_keys(dbOid);
+	char		db_map_path[MAXPGPATH] = {0};
+	int32		file_version;
+	int32		nentries;
+	int			m_fd;
+
+	*count = 0;
+
+	pg_tde_set_db_file_paths(dbOid, spcOid, db_map_path, NULL);
+
+	LWLockAcquire(lock_pk, LW_SHARED);
+
+	/* pg_tde was never used in this database */
+	if (access(db_map_path, F_OK) != 0)
+	{
+		LWLockRelease(lock_pk);
+		return NULL;
+	}
+
+	m_fd = pg_tde_open_map_file(db_map_path, NULL, O_RDONLY, &file_version);
+	map_entries = pg_tde_read_map_entries(m_fd, db_map_path, file_version, &nentries);
+	close(m_fd);
+
+	LWLockRelease(lock_pk);
+
+	relnumbers = palloc(Max(nentries, 1) * sizeof(RelFileNumber));
+	for (int32 key_index = 0; key_index < nentries; key_index++)
+	{
+		if ((map_entries[key_index].flags & MAP_ENTRY_STATE_MASK) == MAP_ENTRY_VALID)
+			relnumbers[(*count)++] = map_entries[key_index].relNumber;
+	}
+	pfree(map_entries);
+
+	return relnumbers;
+}
+
 #endif		/* !FRONTEND */
 
 /*
@@ -836,7 +1272,8 @@ pg_tde_get_key_from_file(const RelFileLocator *rlocator)
 	RelKeyData	*rel_key_data;
 	RelKeyData	*enc_rel_key_data;
 	off_t		offset = 0;
-	LWLock		*lock_pk = tde_lwlock_enc_keys();
+	int32		map_flags = 0;
+	LWLock		*lock_pk = tde_lwlock_enc_keys(rlocator->dbOid);
 	char		db_map_path[MAXPGPATH] = {0};
 	char		db_keydata_path[MAXPGPATH] = {0};
 
@@ -868,7 +1305,7 @@ pg_tde_get_key_from_file(const RelFileLocator *rlocator)
 	pg_tde_set_db_file_paths(rlocator->dbOid, rlocator->spcOid, db_map_path, db_keydata_path);
 
 	/* Read the map entry and get the index of the relation key */
-	key_index = pg_tde_process_map_entry(rlocator, db_map_path, &offset, false);
+	key_index = pg_tde_process_map_entry(rlocator, db_map_path, &offset, false, &map_flags);
 
 	if (key_index == -1)
 	{
@@ -877,6 +1314,7 @@ pg_tde_get_key_from_file(const RelFileLocator *rlocator)
 	}
 
 	enc_rel_key_data = pg_tde_read_keydata(db_keydata_path, key_index, principal_key);
+	enc_rel_key_data->internal_key.page_cipher = MAP_ENTRY_PAGE_CIPHER(map_flags);
 	LWLockRelease(lock_pk);
 
 	rel_key_data = tde_decrypt_rel_key(principal_key, enc_rel_key_data, rlocator);
@@ -900,21 +1338,20 @@ pg_tde_set_db_file_paths(Oid dbOid, Oid spcOid, char *map_path, char *keydata_pa
  * Returns the index of the read map if we find a valid match; i.e.
  * 	 - flags is set to MAP_ENTRY_VALID and the relNumber matches the one
  * 	   provided in rlocator.
- *   - If should_delete is true, we delete the entry. An offset value may
- *     be passed to speed up the file reading operation.
+ *   - If should_delete is true, we delete the entry.
+ *   - If flags is not NULL, it is set to the flags of the found entry.
  *
- * The function expects that the offset points to a valid map start location.
+ * The offset of the found entry in the map file is returned in offset.
  */
 static int32
-pg_tde_process_map_entry(const RelFileLocator *rlocator, char *db_map_path, off_t *offset, bool should_delete)
+pg_tde_process_map_entry(const RelFileLocator *rlocator, char *db_map_path, off_t *offset, bool should_delete, int32 *flags)
 {
-	File map_fd = -1;
-	int32 key_index = 0;
+	int map_fd = -1;
+	int32 key_index = -1;
+	int32 prev_index;
+	int32 file_version;
 	TDEMapEntry map_entry;
-	bool is_new_file;
-	bool found = false;
-	off_t prev_pos = 0;
-	off_t curr_pos = 0;
+	TDEMapIndexHeader ihdr;
 
 	Assert(offset);
 
@@ -922,55 +1359,71 @@ pg_tde_process_map_entry(const RelFileLocator *rlocator, char *db_map_path, off_
 	 * Open and validate file for basic correctness. DO NOT create it.
 	 * The file should pre-exist otherwise we should never be here.
 	 */
-	map_fd = pg_tde_open_file(db_map_path, NULL, false, O_RDWR, &is_new_file, &curr_pos);
+	map_fd = pg_tde_open_map_file(db_map_path, NULL, should_delete ? O_RDWR : O_RDONLY, &file_version);
 
-	/*
-	 * If we need to delete an entry, we expect an offset value to the start
-	 * of the entry to speed up the operation. Otherwise, we'd be sequntially
-	 * scanning the entire map file.
-	 */
-	if (should_delete == true && *offset > 0)
+	if (file_version == PG_TDE_FILEMAGIC_V1)
 	{
-		curr_pos = lseek(map_fd, *offset, SEEK_SET);
-
-		if (curr_pos == -1)
+#ifndef FRONTEND
+		/* Upgrade the file, then delete the entry as for any v2 file */
+		if (should_delete)
+			map_fd = pg_tde_rewrite_map_file(db_map_path, map_fd, file_version, MAP_INIT_BUCKETS);
+		else
+#endif
 		{
-			ereport(FATAL,
-					(errcode_for_file_access(),
-						errmsg("could not seek in tde map file \"%s\": %m",
-						db_map_path)));
+			key_index = pg_tde_find_map_entry_v1(map_fd, rlocator, &map_entry, offset);
+			if (key_index != -1 && flags)
+				*flags = map_entry.flags;
+
+			close(map_fd);
+			return key_index;
 		}
 	}
-	else
+
+	if (pg_tde_read_map_index(map_fd, db_map_path, &ihdr))
+		key_index = pg_tde_map_lookup(map_fd, db_map_path, &ihdr, rlocator->relNumber, &map_entry, &prev_index);
+
+	if (key_index != -1)
 	{
-		/* Otherwise, let's just offset to zero */
-		*offset = 0;
+		*offset = MAP_ENTRY_OFFSET(ihdr.nbuckets, key_index);
+		if (flags)
+			*flags = map_entry.flags;
+#ifndef FRONTEND
+		if (should_delete)
+			pg_tde_free_map_entry(map_fd, db_map_path, &ihdr, key_index, &map_entry, prev_index);
+#endif
 	}
 
-	/*
-	 * Read until we find an empty slot. Otherwise, read until end. This seems
-	 * to be less frequent than vacuum. So let's keep this function here rather
-	 * than overloading the vacuum process.
-	 */
+	/* Let's close the file. */
+	close(map_fd);
+
+	/* Return -1 indicating that no entry was found */
+	return key_index;
+}
+
+/*
+ * Finds the valid entry of the relation in a v1 map file, which has no index,
+ * by reading the file entry by entry.
+ */
+static int32
+pg_tde_find_map_entry_v1(int map_fd, const RelFileLocator *rlocator, TDEMapEntry *map_entry, off_t *offset)
+{
+	int32 key_index = 0;
+	bool found = false;
+	off_t prev_pos = 0;
+	off_t curr_pos = TDE_FILE_HEADER_SIZE;
+
 	while(1)
 	{
 		prev_pos = curr_pos;
-		found = pg_tde_read_one_map_entry(map_fd, rlocator, MAP_ENTRY_VALID, &map_entry, &curr_pos);
+		found = pg_tde_read_one_map_entry(map_fd, rlocator, MAP_ENTRY_VALID, map_entry, &curr_pos);
 
 		/* We've reached EOF */
 		if (curr_pos == prev_pos)
 			break;
 
-		/* We found a valid entry for the relNumber */
 		if (found)
 		{
-#ifndef FRONTEND
-			/* Mark the entry pointed by prev_pos as free */
-			if (should_delete)
-			{
-				pg_tde_write_one_map_entry(map_fd, NULL, MAP_ENTRY_FREE, 0, &map_entry, &prev_pos);
-			}
-#endif
+			*offset = prev_pos;
 			break;
 		}
 
@@ -978,13 +1431,199 @@ pg_tde_process_map_entry(const RelFileLocator *rlocator, char *db_map_path, off_
 		key_index++;
 	}
 
-	/* Let's close the file. */
-	close(map_fd);
-
-	/* Return -1 indicating that no entry was removed */
 	return ((found) ? key_index : -1);
 }
 
+/*
+ * Opens the map file and returns the format version of its header. A new
+ * file gets the header of the current version if principal_key_info is given.
+ */
+static int
+pg_tde_open_map_file(char *db_map_path, TDEPrincipalKeyInfo *principal_key_info, int fileFlags, int32 *file_version)
+{
+	int fd;
+	TDEFileHeader fheader;
+	bool is_new_file;
+	off_t bytes_read = 0;
+	off_t bytes_written = 0;
+
+	fd = pg_tde_open_file_basic(db_map_path, fileFlags, false);
+	pg_tde_file_header_read(db_map_path, fd, &fheader, &is_new_file, &bytes_read);
+
+	*file_version = is_new_file ? PG_TDE_FILEMAGIC : fheader.file_version;
+
+#ifndef FRONTEND
+	if (is_new_file && principal_key_info)
+		pg_tde_file_header_write(db_map_path, fd, principal_key_info, &bytes_written);
+#endif
+
+	return fd;
+}
+
+/*
+ * Reads the index header of a v2 map file. Returns false if the file has no
+ * entries yet.
+ */
+static bool
+pg_tde_read_map_index(int fd, char *db_map_path, TDEMapIndexHeader *ihdr)
+{
+	off_t bytes_read;
+
+	/* TODO: pgstat_report_wait_start / pgstat_report_wait_end */
+	bytes_read = pg_pread(fd, ihdr, sizeof(TDEMapIndexHeader), MAP_INDEX_HEADER_OFFSET);
+
+	if (bytes_read == 0)
+		return false;
+
+	if (bytes_read != sizeof(TDEMapIndexHeader)
+			|| ihdr->nbuckets <= 0
+			|| (ihdr->nbuckets & (ihdr->nbuckets - 1)) != 0
+			|| ihdr->nentries < 0)
+	{
+		ereport(FATAL,
+				(errcode_for_file_access(),
+				 errmsg("TDE map file \"%s\" is corrupted: %m",
+						 db_map_path)));
+	}
+
+	return true;
+}
+
+/*
+ * Finds the valid entry of relNumber through the index. Returns its key
+ * index, or -1 if there is none. If prev_index is not NULL, it is set to the
+ * previous entry of the chain, -1 if the entry is the first one.
+ */
+static int32
+pg_tde_map_lookup(int fd, char *db_map_path, const TDEMapIndexHeader *ihdr, RelFileNumber relNumber, TDEMapEntry *map_entry, int32 *prev_index)
+{
+	int32 bucket = MAP_BUCKET(relNumber, ihdr->nbuckets);
+	int32 key_index;
+	int32 prev = -1;
+
+	pg_tde_read_map_data(fd, db_map_path, &key_index, sizeof(int32), MAP_BUCKET_OFFSET(bucket));
+
+	/* A chain can't be longer than the number of entries */
+	for (int32 i = 0; key_index != -1; i++)
+	{
+		if (key_index < 0 || key_index >= ihdr->nentries || i >= ihdr->nentries)
+		{
+			ereport(FATAL,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("TDE map file \"%s\" is corrupted",
+							 db_map_path)));
+		}
+
+		pg_tde_read_map_data(fd, db_map_path, map_entry, MAP_ENTRY_SIZE, MAP_ENTRY_OFFSET(ihdr->nbuckets, key_index));
+
+		if (map_entry->relNumber == relNumber &&
+			(map_entry->flags & MAP_ENTRY_STATE_MASK) == MAP_ENTRY_VALID)
+			break;
+
+		prev = key_index;
+		key_index = map_entry->next;
+	}
+
+	if (prev_index)
+		*prev_index = prev;
+
+	return key_index;
+}
+
+/*
+ * Reads all the entries of the map file, valid and free, with a single read.
+ * The position of an entry in the returned array is its key index. The array
+ * is palloc'ed even if there are no entries.
+ *
+ * Entries of a v2 file which are in no chain, as left by a crash in the
+ * middle of an update, are returned as free.
+ */
+static TDEMapEntry *
+pg_tde_read_map_entries(int fd, char *db_map_path, int32 file_version, int32 *nentries)
+{
+	TDEMapEntry *map_entries;
+
+	if (file_version == PG_TDE_FILEMAGIC_V1)
+	{
+		off_t file_size = lseek(fd, 0, SEEK_END);
+		char *buf;
+
+		*nentries = (file_size - TDE_FILE_HEADER_SIZE) / MAP_ENTRY_SIZE_V1;
+		map_entries = palloc(Max(*nentries, 1) * sizeof(TDEMapEntry));
+		buf = palloc(Max(*nentries, 1) * MAP_ENTRY_SIZE_V1);
+
+		pg_tde_read_map_data(fd, db_map_path, buf, *nentries * MAP_ENTRY_SIZE_V1, TDE_FILE_HEADER_SIZE);
+
+		for (int32 key_index = 0; key_index < *nentries; key_index++)
+		{
+			memcpy(&map_entries[key_index], buf + key_index * MAP_ENTRY_SIZE_V1, MAP_ENTRY_SIZE_V1);
+			map_entries[key_index].key_index = key_index;
+			map_entries[key_index].next = -1;
+		}
+		pfree(buf);
+	}
+	else
+	{
+		TDEMapIndexHeader ihdr;
+
+		*nentries = 0;
+		if (pg_tde_read_map_index(fd, db_map_path, &ihdr))
+			*nentries = ihdr.nentries;
+
+		map_entries = palloc(Max(*nentries, 1) * sizeof(TDEMapEntry));
+		if (*nentries > 0)
+		{
+			int32	   *buckets = palloc(ihdr.nbuckets * sizeof(int32));
+			bool	   *linked = palloc0(*nentries * sizeof(bool));
+
+			pg_tde_read_map_data(fd, db_map_path, buckets, ihdr.nbuckets * sizeof(int32), MAP_BUCKET_OFFSET(0));
+			pg_tde_read_map_data(fd, db_map_path, map_entries, *nentries * MAP_ENTRY_SIZE, MAP_ENTRY_OFFSET(ihdr.nbuckets, 0));
+
+			for (int32 bucket = 0; bucket < ihdr.nbuckets; bucket++)
+			{
+				for (int32 key_index = buckets[bucket]; key_index != -1; key_index = map_entries[key_index].next)
+				{
+					if (key_index < 0 || key_index >= *nentries || linked[key_index])
+					{
+						ereport(FATAL,
+								(errcode(ERRCODE_DATA_CORRUPTED),
+								 errmsg("TDE map file \"%s\" is corrupted",
+										 db_map_path)));
+					}
+					linked[key_index] = true;
+				}
+			}
+
+			for (int32 key_index = 0; key_index < *nentries; key_index++)
+			{
+				if (!linked[key_index])
+				{
+					map_entries[key_index].relNumber = 0;
+					map_entries[key_index].flags = MAP_ENTRY_FREE;
+				}
+			}
+
+			pfree(linked);
+			pfree(buckets);
+		}
+	}
+
+	return map_entries;
+}
+
+static void
+pg_tde_read_map_data(int fd, char *db_map_path, void *data, Size size, off_t offset)
+{
+	/* TODO: pgstat_report_wait_start / pgstat_report_wait_end */
+	if (pg_pread(fd, data, size, offset) != size)
+	{
+		ereport(FATAL,
+				(errcode_for_file_access(),
+				 errmsg("could not read tde map file \"%s\": %m",
+						 db_map_path)));
+	}
+}
+
 
 /*
  * Open the file and read the required key data from file and return encrypted key.
@@ -1115,7 +1754,8 @@ pg_tde_file_header_read(char *tde_filename, int fd, TDEFileHeader *fheader, bool
 		return fd;
 
 	if (*bytes_read != TDE_FILE_HEADER_SIZE
-			|| fheader->file_version != PG_TDE_FILEMAGIC)
+			|| (fheader->file_version != PG_TDE_FILEMAGIC
+				&& fheader->file_version != PG_TDE_FILEMAGIC_V1))
 	{
 		/* Corrupt file */
 		ereport(FATAL,
@@ -1129,6 +1769,8 @@ pg_tde_file_header_read(char *tde_filename, int fd, TDEFileHeader *fheader, bool
 
 
 /*
+ * Reads a single entry of a v1 map file.
+ *
  * Returns true if a valid map entry if found. Otherwise, it only increments
  * the offset and returns false. If the same offset value is set, it indicates
  * to the caller that nothing was read.
@@ -1150,16 +1792,16 @@ pg_tde_read_one_map_entry(File map_file, const RelFileLocator *rlocator, int fla
 
 	/* Read the entry at the given offset */
 	/* TODO: pgstat_report_wait_start / pgstat_report_wait_end */
-	bytes_read = pg_pread(map_file, map_entry, MAP_ENTRY_SIZE, *offset);
+	bytes_read = pg_pread(map_file, map_entry, MAP_ENTRY_SIZE_V1, *offset);
 
 	/* We've reached the end of the file. */
-	if (bytes_read != MAP_ENTRY_SIZE)
+	if (bytes_read != MAP_ENTRY_SIZE_V1)
 		return false;
 
 	*offset += bytes_read;
 
 	/* We found a valid entry for the relNumber */
-	found = (map_entry->flags == flags);
+	found = ((map_entry->flags & MAP_ENTRY_STATE_MASK) == flags);
 
 	/* If a valid rlocator is provided, let's compare and set found value */
 	found &= (rlocator == NULL) ? true : (map_entry->relNumber == rlocator->relNumber);
@@ -1178,9 +1820,7 @@ pg_tde_read_one_keydata(int keydata_fd, int32 key_index, TDEPrincipalKey *princi
 	off_t read_pos = 0;
 
 	/* Allocate and fill in the structure */
-	enc_rel_key_data = (RelKeyData *) palloc(sizeof(RelKeyData));
-
-	strncpy(enc_rel_key_data->principal_key_id.name, principal_key->keyInfo.keyId.name, PRINCIPAL_KEY_NAME_LEN);
+	enc_rel_key_data = (RelKeyData *) palloc0(sizeof(RelKeyData));
 
 	/* Calculate the reading position in the file. */
 	read_pos += (key_index * INTERNAL_KEY_LEN) + TDE_FILE_HEADER_SIZE;
@@ -1259,14 +1899,19 @@ pg_tde_get_principal_key_info(Oid dbOid, Oid spcOid)
 
 /*
  * Returns TDE key for a given relation.
- * First it looks in a cache. If nothing found in the cache, it reads data from
- * the tde fork file and populates cache.
+ * First it looks in the backend cache, then in the shared one. If nothing is
+ * found in the caches, it reads data from the tde fork file and populates both.
+ * Relations known to have no key (see pg_tde_keycache.c) never get to the
+ * file.
  */
 RelKeyData *
 GetRelationKey(RelFileLocator rel)
 {
 	RelKeyData *key;
 	Oid rel_id = rel.relNumber;
+#ifndef FRONTEND
+	uint64		generation;
+#endif
 
 	key = pg_tde_get_key_from_cache(rel_id);
 	if (key != NULL)
@@ -1274,15 +1919,56 @@ GetRelationKey(RelFileLocator rel)
 		return key;
 	}
 
+#ifndef FRONTEND
+	if (!pg_tde_rel_may_have_key(&rel))
+		return NULL;
+
+	generation = pg_tde_key_generation();
+
+	/* Some other backend may have loaded the key already */
+	{
+		RelKeyData	shared_key;
+
+		if (pg_tde_shared_key_cache_get(&rel, &shared_key))
+		{
+			key = pg_tde_put_key_into_cache(rel_id, &shared_key);
+			explicit_bzero(&shared_key, sizeof(shared_key));
+			return key;
+		}
+	}
+#endif
+
 	key = pg_tde_get_key_from_file(&rel);
 
 	if (key != NULL)
 	{
 		RelKeyData* cached_key = pg_tde_put_key_into_cache(rel.relNumber, key);
+#ifndef FRONTEND
+		pg_tde_shared_key_cache_put(&rel, key);
+#endif
 		pfree(key);
 		return cached_key;
 	}
 
+#ifndef FRONTEND
+	pg_tde_rel_has_no_key(&rel, generation);
+#endif
+
+	return NULL;
+}
+
+static RelKeyCacheRec *
+pg_tde_find_key_cache_rec(Oid rel_id)
+{
+	for (int32 idx = REL_KEY_CACHE_BUCKET(rel_id); idx != -1;)
+	{
+		RelKeyCacheRec *rec = REL_KEY_CACHE_REC(idx);
+
+		if (rec->rel_id == rel_id)
+			return rec;
+		idx = rec->next;
+	}
+
 	return NULL;
 }
 
@@ -1294,95 +1980,208 @@ pg_tde_get_key_from_cache(Oid rel_id)
 	if (tde_rel_key_cache == NULL)
 		return NULL;
 
-	for (int i = 0; i < tde_rel_key_cache->len; i++)
+	rec = pg_tde_find_key_cache_rec(rel_id);
+
+	return rec != NULL ? &rec->key : NULL;
+}
+
+/*
+ * Allocates zeroed memory for the cache bookkeeping, which outlives any
+ * memory context but TopMemoryContext.
+ */
+static void *
+pg_tde_key_cache_alloc(Size size)
+{
+#ifndef FRONTEND
+	return MemoryContextAllocZero(TopMemoryContext, size);
+#else
+	return palloc0(size);
+#endif
+}
+
+static int32 *
+pg_tde_key_cache_alloc_buckets(int32 nbuckets)
+{
+	int32		*buckets = pg_tde_key_cache_alloc(nbuckets * sizeof(int32));
+
+	for (int32 i = 0; i < nbuckets; i++)
+		buckets[i] = -1;
+
+	return buckets;
+}
+
+/*
+ * Doubles the hash table and redistributes the records over the new buckets.
+ * The records themselves don't move.
+ */
+static void
+pg_tde_key_cache_grow_buckets(void)
+{
+	int32		*old_buckets = tde_rel_key_cache->buckets;
+	int32		old_nbuckets = tde_rel_key_cache->nbuckets;
+
+	tde_rel_key_cache->nbuckets = old_nbuckets * 2;
+	tde_rel_key_cache->buckets = pg_tde_key_cache_alloc_buckets(tde_rel_key_cache->nbuckets);
+
+	for (int32 b = 0; b < old_nbuckets; b++)
 	{
-		rec = tde_rel_key_cache->data+i;
-		if (rec != NULL && rec->rel_id == rel_id)
+		int32		idx = old_buckets[b];
+
+		while (idx != -1)
 		{
-			return &rec->key;
+			RelKeyCacheRec *rec = REL_KEY_CACHE_REC(idx);
+			int32		next = rec->next;
+
+			rec->next = REL_KEY_CACHE_BUCKET(rec->rel_id);
+			REL_KEY_CACHE_BUCKET(rec->rel_id) = idx;
+			idx = next;
 		}
 	}
 
-	return NULL;
+	pfree(old_buckets);
 }
 
-/* Add key to cache. See comments on `RelKeyCache`.
- * 
- * TODO: add tests.
+/*
+ * Allocates and mlocks a new segment of records.
  */
-RelKeyData *
-pg_tde_put_key_into_cache(Oid rel_id, RelKeyData *key)
+static void
+pg_tde_key_cache_add_segment(long pageSize)
 {
-	static long			pageSize = 0;
-	RelKeyCacheRec		*rec;
-	MemoryContext		oldCtx;
+	Size		size = pageSize * REL_KEY_CACHE_SEGMENT_PAGES;
+	RelKeyCacheRec *segment;
 
-	if (pageSize == 0)
+	if (tde_rel_key_cache->nsegments == tde_rel_key_cache->max_segments)
 	{
-	#ifndef _SC_PAGESIZE
-		pageSize = getpagesize();
-	#else
-		pageSize = sysconf(_SC_PAGESIZE);
-	#endif
+		RelKeyCacheRec **segments;
+
+		segments = pg_tde_key_cache_alloc(tde_rel_key_cache->max_segments * 2 * sizeof(RelKeyCacheRec *));
+		memcpy(segments, tde_rel_key_cache->segments, tde_rel_key_cache->nsegments * sizeof(RelKeyCacheRec *));
+		pfree(tde_rel_key_cache->segments);
+		tde_rel_key_cache->segments = segments;
+		tde_rel_key_cache->max_segments *= 2;
 	}
 
-	if (tde_rel_key_cache == NULL)
-	{
 #ifndef FRONTEND
-		oldCtx = MemoryContextSwitchTo(TopMemoryContext);
-		tde_rel_key_cache = palloc(sizeof(RelKeyCache));
-		tde_rel_key_cache->data = palloc_aligned(pageSize, pageSize, MCXT_ALLOC_ZERO);
-		MemoryContextSwitchTo(oldCtx);
+	segment = MemoryContextAllocAligned(TopMemoryContext, size, pageSize, MCXT_ALLOC_ZERO);
 #else
-		tde_rel_key_cache = palloc(sizeof(RelKeyCache));
-		tde_rel_key_cache->data = aligned_alloc(pageSize, pageSize);
-		memset(tde_rel_key_cache->data, 0, pageSize);
+	segment = aligned_alloc(pageSize, size);
+	memset(segment, 0, size);
 #endif
 
-		if (mlock(tde_rel_key_cache->data, pageSize) == -1)
-			elog(ERROR, "could not mlock internal key initial cache page: %m");
+	if (mlock(segment, size) == -1)
+		elog(ERROR, "could not mlock internal key cache segment: %m");
+
+	tde_rel_key_cache->segments[tde_rel_key_cache->nsegments++] = segment;
+}
+
+/*
+ * Returns the index of an unused record, reusing evicted ones first.
+ */
+static int32
+pg_tde_key_cache_new_rec(void)
+{
+	static long			pageSize = 0;
+	int32				idx;
 
-		tde_rel_key_cache->len = 0;
-		tde_rel_key_cache->cap = pageSize / sizeof(RelKeyCacheRec);
+	if (tde_rel_key_cache->free_list != -1)
+	{
+		idx = tde_rel_key_cache->free_list;
+		tde_rel_key_cache->free_list = REL_KEY_CACHE_REC(idx)->next;
+		return idx;
 	}
 
-	/* Add another mem page if there is no more room left for another key. We 
-	 * allocate `current_memory_size` + 1 page and copy data there.
-	 */
-	if (tde_rel_key_cache->len+1 > 
-		(tde_rel_key_cache->cap * sizeof(RelKeyCacheRec)) / sizeof(RelKeyCacheRec))
+	if (pageSize == 0)
 	{
-		size_t size;
-		size_t old_size;
-		RelKeyCacheRec		*chachePage;
+	#ifndef _SC_PAGESIZE
+		pageSize = getpagesize();
+	#else
+		pageSize = sysconf(_SC_PAGESIZE);
+	#endif
+	}
 
-		size = TYPEALIGN(pageSize, (tde_rel_key_cache->cap+1) * sizeof(RelKeyCacheRec));
-		old_size = TYPEALIGN(pageSize, (tde_rel_key_cache->cap) * sizeof(RelKeyCacheRec));
+	if (tde_rel_key_cache->recs_per_segment == 0)
+		tde_rel_key_cache->recs_per_segment = pageSize * REL_KEY_CACHE_SEGMENT_PAGES / sizeof(RelKeyCacheRec);
 
-#ifndef FRONTEND
-		oldCtx = MemoryContextSwitchTo(TopMemoryContext);
-		chachePage = palloc_aligned(size, pageSize, MCXT_ALLOC_ZERO);
-		MemoryContextSwitchTo(oldCtx);
-#else
-		chachePage = aligned_alloc(pageSize, size);
-		memset(chachePage, 0, size);
-#endif
+	if (tde_rel_key_cache->high_water == tde_rel_key_cache->nsegments * tde_rel_key_cache->recs_per_segment)
+		pg_tde_key_cache_add_segment(pageSize);
 
-		memcpy(chachePage, tde_rel_key_cache->data, old_size);
-		pfree(tde_rel_key_cache->data);
-		tde_rel_key_cache->data = chachePage;
+	return tde_rel_key_cache->high_water++;
+}
+
+/* Add key to cache. See comments on `RelKeyCache`.
+ *
+ * If the cache already has a key for rel_id (the relation number got reused)
+ * it is replaced in place.
+ */
+RelKeyData *
+pg_tde_put_key_into_cache(Oid rel_id, RelKeyData *key)
+{
+	RelKeyCacheRec		*rec;
+	int32				idx;
 
-		if (mlock(tde_rel_key_cache->data, pageSize) == -1)
-			elog(ERROR, "could not mlock internal key cache page: %m");
+	if (tde_rel_key_cache == NULL)
+	{
+		tde_rel_key_cache = pg_tde_key_cache_alloc(sizeof(RelKeyCache));
+		tde_rel_key_cache->max_segments = REL_KEY_CACHE_INIT_SEGMENTS;
+		tde_rel_key_cache->segments = pg_tde_key_cache_alloc(REL_KEY_CACHE_INIT_SEGMENTS * sizeof(RelKeyCacheRec *));
+		tde_rel_key_cache->nbuckets = REL_KEY_CACHE_INIT_BUCKETS;
+		tde_rel_key_cache->buckets = pg_tde_key_cache_alloc_buckets(REL_KEY_CACHE_INIT_BUCKETS);
+		tde_rel_key_cache->free_list = -1;
+	}
 
-		tde_rel_key_cache->cap = size / sizeof(RelKeyCacheRec);
+	rec = pg_tde_find_key_cache_rec(rel_id);
+	if (rec != NULL)
+	{
+		AesFreeKeyCtx(&rec->key.internal_key.ctx);
+		memcpy(&rec->key, key, sizeof(RelKeyData));
+		return &rec->key;
 	}
 
-	rec = tde_rel_key_cache->data + tde_rel_key_cache->len;
+	/* Keep the load factor at most 1 */
+	if (tde_rel_key_cache->len >= tde_rel_key_cache->nbuckets)
+		pg_tde_key_cache_grow_buckets();
+
+	idx = pg_tde_key_cache_new_rec();
+	rec = REL_KEY_CACHE_REC(idx);
 
 	rec->rel_id = rel_id;
-	memcpy(&rec->key, key, sizeof(RelKeyCacheRec));
+	memcpy(&rec->key, key, sizeof(RelKeyData));
+	rec->next = REL_KEY_CACHE_BUCKET(rel_id);
+	REL_KEY_CACHE_BUCKET(rel_id) = idx;
 	tde_rel_key_cache->len++;
 
 	return &rec->key;
+}
+
+/*
+ * Removes the key of a relation from the cache, wiping it. See comments on
+ * `RelKeyCache` for when it is safe to do so.
+ */
+static void
+pg_tde_evict_key_from_cache(Oid rel_id)
+{
+	int32		*link;
+
+	if (tde_rel_key_cache == NULL)
+		return;
+
+	for (link = &REL_KEY_CACHE_BUCKET(rel_id); *link != -1; link = &REL_KEY_CACHE_REC(*link)->next)
+	{
+		int32		idx = *link;
+		RelKeyCacheRec *rec = REL_KEY_CACHE_REC(idx);
+
+		if (rec->rel_id != rel_id)
+			continue;
+
+		*link = rec->next;
+
+		AesFreeKeyCtx(&rec->key.internal_key.ctx);
+		explicit_bzero(rec, sizeof(RelKeyCacheRec));
+
+		rec->rel_id = InvalidOid;
+		rec->next = tde_rel_key_cache->free_list;
+		tde_rel_key_cache->free_list = idx;
+		tde_rel_key_cache->len--;
+		return;
+	}
 }
\ No newline at end of file
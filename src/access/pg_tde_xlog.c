@@ -39,17 +39,37 @@ tdeheap_rmgr_redo(XLogReaderState *record)
 	{
 		XLogRelKey *xlrec = (XLogRelKey *) XLogRecGetData(record);
 
-		LWLockAcquire(tde_lwlock_enc_keys(), LW_EXCLUSIVE);
+		if (XLogRecGetDataLen(record) != sizeof(XLogRelKey))
+			elog(PANIC, "pg_tde_redo: invalid relation key record length %u", XLogRecGetDataLen(record));
+
+		LWLockAcquire(tde_lwlock_enc_keys(xlrec->rlocator.dbOid), LW_EXCLUSIVE);
 		pg_tde_write_key_map_entry(&xlrec->rlocator, &xlrec->relKey, NULL);
-		LWLockRelease(tde_lwlock_enc_keys());
+		LWLockRelease(tde_lwlock_enc_keys(xlrec->rlocator.dbOid));
+	}
+	else if (info == XLOG_TDE_ADD_RELATION_KEY_V1)
+	{
+		XLogRelKeyV1 *xlrec = (XLogRelKeyV1 *) XLogRecGetData(record);
+		RelKeyData	relKey;
+
+		if (XLogRecGetDataLen(record) != sizeof(XLogRelKeyV1))
+			elog(PANIC, "pg_tde_redo: invalid relation key record length %u", XLogRecGetDataLen(record));
+
+		/* The principal key is the one of the key map file */
+		memset(&relKey, 0, sizeof(relKey));
+		memcpy(relKey.internal_key.key, xlrec->relKey.internal_key.key, INTERNAL_KEY_LEN);
+		relKey.internal_key.page_cipher = TDE_PAGE_CIPHER_CBC;
+
+		LWLockAcquire(tde_lwlock_enc_keys(xlrec->rlocator.dbOid), LW_EXCLUSIVE);
+		pg_tde_write_key_map_entry(&xlrec->rlocator, &relKey, NULL);
+		LWLockRelease(tde_lwlock_enc_keys(xlrec->rlocator.dbOid));
 	}
 	else if (info == XLOG_TDE_ADD_PRINCIPAL_KEY)
 	{
 		TDEPrincipalKeyInfo *mkey = (TDEPrincipalKeyInfo *) XLogRecGetData(record);
 
-		LWLockAcquire(tde_lwlock_enc_keys(), LW_EXCLUSIVE);
+		LWLockAcquire(tde_lwlock_enc_keys(mkey->databaseId), LW_EXCLUSIVE);
 		save_principal_key_info(mkey);
-		LWLockRelease(tde_lwlock_enc_keys());
+		LWLockRelease(tde_lwlock_enc_keys(mkey->databaseId));
 	}
 	else if (info == XLOG_TDE_EXTENSION_INSTALL_KEY)
 	{
@@ -68,9 +88,9 @@ tdeheap_rmgr_redo(XLogReaderState *record)
 	{
 		XLogPrincipalKeyRotate *xlrec = (XLogPrincipalKeyRotate *) XLogRecGetData(record);
 
-		LWLockAcquire(tde_lwlock_enc_keys(), LW_EXCLUSIVE);
+		LWLockAcquire(tde_lwlock_enc_keys(xlrec->databaseId), LW_EXCLUSIVE);
 		xl_tde_perform_rotate_key(xlrec);
-		LWLockRelease(tde_lwlock_enc_keys());
+		LWLockRelease(tde_lwlock_enc_keys(xlrec->databaseId));
 	}
 	else
 	{
@@ -89,6 +109,12 @@ tdeheap_rmgr_desc(StringInfo buf, XLogReaderState *record)
 
 		appendStringInfo(buf, "add tde internal key for relation %u/%u", xlrec->rlocator.dbOid, xlrec->rlocator.relNumber);
 	}
+	if (info == XLOG_TDE_ADD_RELATION_KEY_V1)
+	{
+		XLogRelKeyV1 *xlrec = (XLogRelKeyV1 *) XLogRecGetData(record);
+
+		appendStringInfo(buf, "add tde internal key for relation %u/%u", xlrec->rlocator.dbOid, xlrec->rlocator.relNumber);
+	}
 	if (info == XLOG_TDE_ADD_PRINCIPAL_KEY)
 	{
 		TDEPrincipalKeyInfo *xlrec = (TDEPrincipalKeyInfo *) XLogRecGetData(record);
@@ -121,6 +147,9 @@ tdeheap_rmgr_identify(uint8 info)
 	if ((info & ~XLR_INFO_MASK) == XLOG_TDE_ADD_RELATION_KEY)
 		return "XLOG_TDE_ADD_RELATION_KEY";
 
+	if ((info & ~XLR_INFO_MASK) == XLOG_TDE_ADD_RELATION_KEY_V1)
+		return "XLOG_TDE_ADD_RELATION_KEY_V1";
+
 	if ((info & ~XLR_INFO_MASK) == XLOG_TDE_ADD_PRINCIPAL_KEY)
 		return "XLOG_TDE_ADD_PRINCIPAL_KEY";
 
@@ -3,6 +3,42 @@
  * pg_tde_xlog_encrypt.c
  *	  Encrypted XLog storage manager
  *
+ * WAL pages are encrypted with AES-CTR, the IV of a page depends only on its
+ * timeline and address. So the keystream of the pages about to be written
+ * is known in advance: with pg_tde.wal_keystream_pages > 0, a background
+ * worker generates it for the pages following the write position into a
+ * shared ring, and XLogWrite() (holding WALWriteLock) only has to XOR the
+ * data with it. Pages missing from the ring are encrypted as before.
+ *
+ * Every page has its own IV, so the pages of a large write can also be
+ * encrypted in parallel: with pg_tde.wal_encrypt_workers > 0, writes of at
+ * least WAL_CRYPT_PARALLEL_MIN_PAGES pages are split into one segment per
+ * page, which the writing backend and the crypto workers claim one by one.
+ * The WAL buffers and the encryption buffer are both in shared memory, so
+ * the workers read and write them directly. XLogWrite() never waits long for
+ * a worker: it encrypts itself the segments of the workers that exit or fall
+ * behind.
+ *
+ * Physical walsenders normally decrypt the WAL they ship and the standbys
+ * encrypt it again. With pg_tde.wal_passthrough, the pages are shipped as
+ * they are stored to the WAL receivers having the WAL key of the primary (as
+ * a base backup has), which write them verbatim, they are only decrypted when
+ * read for replay. A receiver proves it has the key by giving its fingerprint
+ * (see pg_tde_wal_key_fingerprint()) in pg_tde.wal_peer_fingerprint when it
+ * connects: the walsender refuses a receiver with another key, and ships the
+ * WAL decrypted to the receivers giving no fingerprint. The option can only
+ * be set at server start, so a walsender never switches modes in the middle
+ * of a page.
+ *
+ * Walsenders and logical decoding following the insert position all read
+ * the same recent pages. The first of them to decrypt a page generates the
+ * keystream of the whole page into a shared cache of
+ * pg_tde.wal_decrypt_cache_pages pages, the others only XOR the data with it.
+ * Caching the keystream rather than the plaintext keeps the cache valid
+ * whatever the reader finds in the file, such as a partially received page.
+ * The cache lives in (locked) shared memory only. During recovery, a worker
+ * fills it ahead of the startup process, which then only XORs the pages it
+ * replays.
  *
  * IDENTIFICATION
  *	  src/access/pg_tde_xlog_encrypt.c
@@ -13,19 +49,34 @@
 #include "postgres.h"
 
 #ifdef PERCONA_EXT
+#include <sys/mman.h>
+
 #include "pg_tde.h"
 #include "pg_tde_defines.h"
 #include "access/xlog.h"
 #include "access/xlog_internal.h"
 #include "access/xloginsert.h"
+#include "access/xlogprefetcher.h"
+#include "access/xlogrecovery.h"
 #include "catalog/pg_tablespace_d.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "replication/walsender.h"
 #include "storage/bufmgr.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/s_lock.h"
 #include "storage/shmem.h"
 #include "utils/guc.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
 
 #include "access/pg_tde_xlog_encrypt.h"
 #include "catalog/tde_global_space.h"
+#include "encryption/enc_aes.h"
 #include "encryption/enc_tde.h"
 
 #ifdef FRONTEND
@@ -36,15 +87,160 @@ static XLogPageHeaderData DecryptCurrentPageHrd;
 
 static void SetXLogPageIVPrefix(TimeLineID tli, XLogRecPtr lsn, char* iv_prefix);
 
+#ifdef FRONTEND
+/* There is no shared memory in the frontend tools */
+#define TDEXLogDecryptCached(tli, pageaddr, iv_ctr, data, len, key)	false
+#define TDEXLogDecryptAheadFrom(tli, pageaddr)	((void) 0)
+#endif
+
 #ifndef FRONTEND
 /* GUC */
 static bool EncryptXLog = false;
+static int	WALKeystreamPages = 128;
 
 static XLogPageHeaderData EncryptCurrentPageHrd;
 
+/* Keystream of the page data, which is at most a page minus a short header */
+#define WAL_KEYSTREAM_BLOCKS	((XLOG_BLCKSZ - SizeOfXLogShortPHD + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE)
+#define WAL_KEYSTREAM_SIZE		(WAL_KEYSTREAM_BLOCKS * AES_BLOCK_SIZE)
+
+/*
+ * A page of the keystream ring. Only the keystream worker writes it, readers
+ * check seq before and after using the keystream (a seqlock).
+ */
+typedef struct WALKeystreamPage
+{
+	pg_atomic_uint64 seq;		/* odd while the keystream is being written */
+	TimeLineID	tli;
+	XLogRecPtr	pageaddr;
+	unsigned char keystream[WAL_KEYSTREAM_SIZE];
+} WALKeystreamPage;
+
+typedef struct WALKeystreamState
+{
+	Latch	   *workerLatch;	/* NULL if the worker isn't running */
+	WALKeystreamPage pages[FLEXIBLE_ARRAY_MEMBER];
+} WALKeystreamState;
+
+static WALKeystreamState *WALKeystream = NULL;
+
+/* GUC */
+static int	WALCryptWorkers = 0;
+static bool WALPassthrough = false;
+static char *WALPeerFingerprint = NULL;
+
+#define WAL_CRYPT_MAX_WORKERS			16
+#define WAL_CRYPT_PARALLEL_MIN_PAGES	16
+
+/*
+ * The claim word of the current job packs the job number, the number of
+ * segments and the next segment to claim, so that a worker can't claim a
+ * segment of a job it didn't see being published.
+ */
+#define WAL_CRYPT_FIELD_BITS	20
+#define WAL_CRYPT_FIELD_MASK	((UINT64CONST(1) << WAL_CRYPT_FIELD_BITS) - 1)
+#define WAL_CRYPT_CLAIM(job, nsegments, next) \
+	(((uint64) (job) << (2 * WAL_CRYPT_FIELD_BITS)) | ((uint64) (nsegments) << WAL_CRYPT_FIELD_BITS) | (uint64) (next))
+
+/* Part of a page to encrypt */
+typedef struct WALCryptSegment
+{
+	const char *in;
+	char	   *out;
+	uint32		len;
+	uint32		iv_ctr;
+	TimeLineID	tli;
+	XLogRecPtr	pageaddr;
+} WALCryptSegment;
+
+/*
+ * The state word of a segment tells who owns it: a worker encrypts a
+ * CLAIMED segment into a private buffer and only copies the result out if
+ * it still owns the segment (CLAIMED -> COPYING). Until then the writer can
+ * take the segment back and encrypt it itself, so a worker that exits or
+ * stalls with a claimed segment never blocks the write. The job number
+ * keeps a late worker from taking a segment of a later job for its own.
+ */
+#define WAL_CRYPT_SEG_PENDING	0
+#define WAL_CRYPT_SEG_CLAIMED	1
+#define WAL_CRYPT_SEG_COPYING	2
+#define WAL_CRYPT_SEG_DONE		3
+
+/* Owner of the segments the writing process encrypts */
+#define WAL_CRYPT_WRITER		WAL_CRYPT_MAX_WORKERS
+
+#define WAL_CRYPT_SEG_STATE(job, owner, phase) \
+	(((uint64) (job) << 8) | ((uint64) (owner) << 2) | (uint64) (phase))
+#define WAL_CRYPT_SEG_JOB(state)	((state) >> 8)
+#define WAL_CRYPT_SEG_OWNER(state)	((int) (((state) >> 2) & 0x3F))
+#define WAL_CRYPT_SEG_PHASE(state)	((int) ((state) & 0x3))
+
+/* How long the writer lets the workers encrypt the segments they claimed */
+#define WAL_CRYPT_WAIT_MS		10
+
+typedef struct WALCryptSlot
+{
+	pg_atomic_uint64 state;
+	WALCryptSegment seg;		/* changed only while no worker may use it */
+} WALCryptSlot;
+
+/*
+ * There is at most one job at a time, as writes are serialized by
+ * WALWriteLock.
+ */
+typedef struct WALCryptState
+{
+	pg_atomic_uint64 claim;
+	pg_atomic_uint32 done;		/* segments of the current job encrypted */
+	uint64		job;			/* number of the current job */
+	Latch	   *workerLatches[WAL_CRYPT_MAX_WORKERS];
+	WALCryptSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} WALCryptState;
+
+static WALCryptState *WALCrypt = NULL;
+
+/* GUC */
+static int	WALDecryptCachePages = 256;
+
+/*
+ * Keystream of the pages recently decrypted by the WAL readers. Any reader
+ * may fill a page: it takes it by moving seq from even to odd, the others
+ * skip it meanwhile.
+ *
+ * During recovery, the startup process publishes the page it read last and
+ * the decrypt-ahead worker fills the pages following it.
+ */
+typedef struct WALDecryptCacheState
+{
+	Latch	   *aheadLatch;		/* NULL if the worker isn't running */
+	pg_atomic_uint32 readTLI;
+	pg_atomic_uint64 readPageAddr;
+	WALKeystreamPage pages[FLEXIBLE_ARRAY_MEMBER];
+} WALDecryptCacheState;
+
+static WALDecryptCacheState *WALDecryptCache = NULL;
+
 static ssize_t TDEXLogWriteEncryptedPages(int fd, const void *buf, size_t count, off_t offset);
 static char *TDEXLogEncryptBuf = NULL;
 static int XLOGChooseNumBuffers(void);
+static bool TDEXLogXorKeystream(TimeLineID tli, XLogRecPtr pageaddr, uint32 iv_ctr, const char *in, size_t len, char *out);
+static void TDEXLogFillKeystream(RelKeyData *key);
+static void TDEXLogKeystreamShutdown(int code, Datum arg);
+static int	TDEXLogCryptMaxSegments(void);
+static void TDEXLogCryptSegment(const WALCryptSegment *seg, char *out, RelKeyData *key);
+static void TDEXLogCryptReclaimSegment(int segno, bool expired, RelKeyData *key);
+static void TDEXLogCryptWorkerSegment(int segno, int worker, RelKeyData *key);
+static void TDEXLogCryptClaimSegments(int worker, RelKeyData *key);
+static void TDEXLogCryptParallel(int nsegments, RelKeyData *key);
+static void TDEXLogCryptShutdown(int code, Datum arg);
+static bool TDEXLogDecryptCached(TimeLineID tli, XLogRecPtr pageaddr, uint32 iv_ctr, char *data, size_t len, RelKeyData *key);
+static bool TDEXLogDecryptCacheFill(WALKeystreamPage *page, TimeLineID tli, XLogRecPtr pageaddr, RelKeyData *key, uint32 iv_ctr, char *data, size_t len);
+static int	TDEXLogDecryptAheadPages(void);
+static void TDEXLogDecryptAheadFrom(TimeLineID tli, XLogRecPtr pageaddr);
+static void TDEXLogDecryptAhead(RelKeyData *key);
+static void TDEXLogDecryptAheadShutdown(int code, Datum arg);
+static bool TDEXLogPassthrough(void);
+static void TDEXLogLogKeyFingerprint(void);
 
 void
 XLogInitGUC(void)
@@ -60,6 +256,125 @@ XLogInitGUC(void)
 							 NULL,	/* assign_hook */
 							 NULL	/* show_hook */
 		);
+
+	DefineCustomIntVariable("pg_tde.wal_keystream_pages",	/* name */
+							"Number of WAL pages to generate the encryption keystream for ahead of the write position.",	/* short_desc */
+							"0 disables the precomputation.",	/* long_desc */
+							&WALKeystreamPages,	/* value address */
+							128,	/* boot value */
+							0,	/* min value */
+							INT_MAX / XLOG_BLCKSZ,	/* max value */
+							PGC_POSTMASTER, /* context */
+							0,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	if (EncryptXLog && WALKeystreamPages > 0 && process_shared_preload_libraries_in_progress)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 5;
+		strcpy(worker.bgw_library_name, "pg_tde");
+		strcpy(worker.bgw_function_name, "pg_tde_wal_keystream_main");
+		strcpy(worker.bgw_name, "pg_tde wal keystream");
+		strcpy(worker.bgw_type, "pg_tde wal keystream");
+
+		RegisterBackgroundWorker(&worker);
+	}
+
+	DefineCustomIntVariable("pg_tde.wal_encrypt_workers",	/* name */
+							"Number of background workers helping to encrypt large WAL writes.",	/* short_desc */
+							"0 encrypts all the writes in the writing process.",	/* long_desc */
+							&WALCryptWorkers,	/* value address */
+							0,	/* boot value */
+							0,	/* min value */
+							WAL_CRYPT_MAX_WORKERS,	/* max value */
+							PGC_POSTMASTER, /* context */
+							0,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	DefineCustomBoolVariable("pg_tde.wal_passthrough",	/* name */
+							 "Ship encrypted WAL to the standbys without decrypting it.",	/* short_desc */
+							 "The standbys must have the same WAL key as the primary.",	/* long_desc */
+							 &WALPassthrough, /* value address */
+							 false,	/* boot value */
+							 PGC_POSTMASTER,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomStringVariable("pg_tde.wal_peer_fingerprint",	/* name */
+							   "Fingerprint of the WAL key of the WAL receiver on this connection.",	/* short_desc */
+							   "Set in the connection options of a WAL receiver to receive encrypted WAL with pg_tde.wal_passthrough.",	/* long_desc */
+							   &WALPeerFingerprint, /* value address */
+							   "",	/* boot value */
+							   PGC_BACKEND, /* context */
+							   0,	/* flags */
+							   NULL,	/* check_hook */
+							   NULL,	/* assign_hook */
+							   NULL /* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_tde.wal_decrypt_cache_pages",	/* name */
+							"Number of recently decrypted WAL pages shared by the WAL readers.",	/* short_desc */
+							"0 disables the cache.",	/* long_desc */
+							&WALDecryptCachePages,	/* value address */
+							256,	/* boot value */
+							0,	/* min value */
+							INT_MAX / XLOG_BLCKSZ,	/* max value */
+							PGC_POSTMASTER, /* context */
+							0,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	/* Started with the postmaster so it helps crash recovery as well */
+	if (EncryptXLog && WALDecryptCachePages > 0 && process_shared_preload_libraries_in_progress)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+		worker.bgw_restart_time = 5;
+		strcpy(worker.bgw_library_name, "pg_tde");
+		strcpy(worker.bgw_function_name, "pg_tde_wal_decrypt_ahead_main");
+		strcpy(worker.bgw_name, "pg_tde wal decrypt ahead");
+		strcpy(worker.bgw_type, "pg_tde wal decrypt ahead");
+
+		RegisterBackgroundWorker(&worker);
+	}
+
+	if (EncryptXLog && process_shared_preload_libraries_in_progress)
+	{
+		for (int i = 0; i < WALCryptWorkers; i++)
+		{
+			BackgroundWorker worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+			worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+			worker.bgw_restart_time = 5;
+			worker.bgw_main_arg = Int32GetDatum(i);
+			strcpy(worker.bgw_library_name, "pg_tde");
+			strcpy(worker.bgw_function_name, "pg_tde_wal_crypt_main");
+			snprintf(worker.bgw_name, BGW_MAXLEN, "pg_tde wal crypt %d", i);
+			strcpy(worker.bgw_type, "pg_tde wal crypt");
+
+			RegisterBackgroundWorker(&worker);
+		}
+	}
 }
 
 static int
@@ -112,6 +427,762 @@ TDEXLogShmemInit(void)
 
 		elog(DEBUG1, "pg_tde: initialized encryption buffer %lu bytes", XLOG_TDE_ENC_BUFF_ALIGNED_SIZE);
 	}
+
+	if (TDEXLogKeystreamShmemSize() > 0)
+	{
+		bool	foundKeystream;
+
+		WALKeystream = (WALKeystreamState *)
+			ShmemInitStruct("TDE XLog Keystream",
+							TDEXLogKeystreamShmemSize(),
+							&foundKeystream);
+
+		if (!foundKeystream)
+		{
+			WALKeystream->workerLatch = NULL;
+			for (int i = 0; i < WALKeystreamPages; i++)
+			{
+				pg_atomic_init_u64(&WALKeystream->pages[i].seq, 0);
+				WALKeystream->pages[i].tli = 0;
+				WALKeystream->pages[i].pageaddr = InvalidXLogRecPtr;
+			}
+
+			/* Keep the keystream out of swap */
+			if (mlock(WALKeystream, TDEXLogKeystreamShmemSize()) == -1)
+				ereport(WARNING,
+						(errmsg("could not lock the WAL keystream in memory: %m")));
+		}
+	}
+
+	if (TDEXLogCryptShmemSize() > 0)
+	{
+		bool	foundCrypt;
+
+		WALCrypt = (WALCryptState *)
+			ShmemInitStruct("TDE XLog Crypt Workers",
+							TDEXLogCryptShmemSize(),
+							&foundCrypt);
+
+		if (!foundCrypt)
+		{
+			pg_atomic_init_u64(&WALCrypt->claim, WAL_CRYPT_CLAIM(0, 0, 0));
+			pg_atomic_init_u32(&WALCrypt->done, 0);
+			WALCrypt->job = 0;
+			for (int i = 0; i < WAL_CRYPT_MAX_WORKERS; i++)
+				WALCrypt->workerLatches[i] = NULL;
+			for (int i = 0; i < TDEXLogCryptMaxSegments(); i++)
+				pg_atomic_init_u64(&WALCrypt->slots[i].state,
+								   WAL_CRYPT_SEG_STATE(0, WAL_CRYPT_WRITER, WAL_CRYPT_SEG_DONE));
+		}
+	}
+
+	if (TDEXLogDecryptCacheShmemSize() > 0)
+	{
+		bool	foundCache;
+
+		WALDecryptCache = (WALDecryptCacheState *)
+			ShmemInitStruct("TDE XLog Decrypt Cache",
+							TDEXLogDecryptCacheShmemSize(),
+							&foundCache);
+
+		if (!foundCache)
+		{
+			WALDecryptCache->aheadLatch = NULL;
+			pg_atomic_init_u32(&WALDecryptCache->readTLI, 0);
+			pg_atomic_init_u64(&WALDecryptCache->readPageAddr, InvalidXLogRecPtr);
+			for (int i = 0; i < WALDecryptCachePages; i++)
+			{
+				pg_atomic_init_u64(&WALDecryptCache->pages[i].seq, 0);
+				WALDecryptCache->pages[i].tli = 0;
+				WALDecryptCache->pages[i].pageaddr = InvalidXLogRecPtr;
+			}
+
+			/* Keep the keystream out of swap */
+			if (mlock(WALDecryptCache, TDEXLogDecryptCacheShmemSize()) == -1)
+				ereport(WARNING,
+						(errmsg("could not lock the decrypted WAL cache in memory: %m")));
+		}
+	}
+}
+
+/* A write covers at most all the WAL buffers, plus a partial page */
+static int
+TDEXLogCryptMaxSegments(void)
+{
+	return TDEXLogEncryptBuffSize() / XLOG_BLCKSZ + 1;
+}
+
+/*
+ * Defines the size of the crypto workers' job
+ */
+Size
+TDEXLogCryptShmemSize(void)
+{
+	if (!EncryptXLog || WALCryptWorkers == 0)
+		return 0;
+
+	return add_size(offsetof(WALCryptState, slots),
+					mul_size(TDEXLogCryptMaxSegments(), sizeof(WALCryptSlot)));
+}
+
+/*
+ * Defines the size of the decrypted WAL cache
+ */
+Size
+TDEXLogDecryptCacheShmemSize(void)
+{
+	if (!EncryptXLog || WALDecryptCachePages == 0)
+		return 0;
+
+	return add_size(offsetof(WALDecryptCacheState, pages),
+					mul_size(WALDecryptCachePages, sizeof(WALKeystreamPage)));
+}
+
+/*
+ * Defines the size of the keystream ring
+ */
+Size
+TDEXLogKeystreamShmemSize(void)
+{
+	if (!EncryptXLog || WALKeystreamPages == 0)
+		return 0;
+
+	return add_size(offsetof(WALKeystreamState, pages),
+					mul_size(WALKeystreamPages, sizeof(WALKeystreamPage)));
+}
+
+static inline WALKeystreamPage *
+TDEXLogKeystreamPage(XLogRecPtr pageaddr)
+{
+	return &WALKeystream->pages[(pageaddr / XLOG_BLCKSZ) % WALKeystreamPages];
+}
+
+static void
+TDEXLogXorBytes(const unsigned char *ks, const char *in, size_t len, char *out)
+{
+	size_t		i = 0;
+
+	for (; i + sizeof(uint64) <= len; i += sizeof(uint64))
+	{
+		uint64		d;
+		uint64		k;
+
+		memcpy(&d, in + i, sizeof(uint64));
+		memcpy(&k, ks + i, sizeof(uint64));
+		d ^= k;
+		memcpy(out + i, &d, sizeof(uint64));
+	}
+	for (; i < len; i++)
+		out[i] = in[i] ^ ks[i];
+}
+
+/*
+ * XORs the data of the page at `pageaddr`, starting `iv_ctr` bytes after its
+ * header, with the keystream held by `page`. Returns false if `page` holds
+ * the keystream of another page, or was replaced while in use.
+ */
+static bool
+TDEXLogXorKeystreamPage(WALKeystreamPage *page, TimeLineID tli, XLogRecPtr pageaddr, uint32 iv_ctr, const char *in, size_t len, char *out)
+{
+	uint64		seq;
+
+	Assert(iv_ctr + len <= WAL_KEYSTREAM_SIZE);
+
+	seq = pg_atomic_read_u64(&page->seq);
+	if (seq % 2 != 0)
+		return false;
+	pg_read_barrier();
+
+	if (page->pageaddr != pageaddr || page->tli != tli)
+		return false;
+
+	TDEXLogXorBytes(page->keystream + iv_ctr, in, len, out);
+
+	pg_read_barrier();
+	return pg_atomic_read_u64(&page->seq) == seq;
+}
+
+/*
+ * XORs the data of the page with the precomputed keystream. Returns false if
+ * the keystream of the page is not in the ring, or was replaced while in use.
+ */
+static bool
+TDEXLogXorKeystream(TimeLineID tli, XLogRecPtr pageaddr, uint32 iv_ctr, const char *in, size_t len, char *out)
+{
+	if (WALKeystream == NULL)
+		return false;
+
+	return TDEXLogXorKeystreamPage(TDEXLogKeystreamPage(pageaddr), tli, pageaddr, iv_ctr, in, len, out);
+}
+
+/*
+ * Generates the keystream of the pages from the current write position on,
+ * skipping the pages already in the ring.
+ */
+static void
+TDEXLogFillKeystream(RelKeyData *key)
+{
+	XLogRecPtr	write_ptr = GetXLogWriteRecPtr();
+	TimeLineID	tli = GetWALInsertionTimeLine();
+	XLogRecPtr	first = write_ptr - write_ptr % XLOG_BLCKSZ;
+
+	for (int i = 0; i < WALKeystreamPages; i++)
+	{
+		XLogRecPtr	pageaddr = first + (XLogRecPtr) i * XLOG_BLCKSZ;
+		WALKeystreamPage *page = TDEXLogKeystreamPage(pageaddr);
+		uint64		seq = pg_atomic_read_u64(&page->seq);
+		char		iv_prefix[16] = {0,};
+
+		if (seq % 2 == 0 && page->pageaddr == pageaddr && page->tli == tli)
+			continue;
+
+		/* A previous worker may have died while writing the page */
+		if (seq % 2 != 0)
+			seq++;
+
+		pg_atomic_write_u64(&page->seq, seq + 1);
+		pg_write_barrier();
+
+		page->pageaddr = pageaddr;
+		page->tli = tli;
+		SetXLogPageIVPrefix(tli, pageaddr, iv_prefix);
+		Aes128EncryptedZeroBlocks(&key->internal_key.ctx, key->internal_key.key, iv_prefix,
+								  0, WAL_KEYSTREAM_BLOCKS, page->keystream);
+
+		pg_write_barrier();
+		pg_atomic_write_u64(&page->seq, seq + 2);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+static void
+TDEXLogKeystreamShutdown(int code, Datum arg)
+{
+	WALKeystream->workerLatch = NULL;
+}
+
+/*
+ * Keeps the keystream ring filled. Woken up by XLogWrite() whenever it
+ * consumed pages, and every 100ms anyway.
+ */
+void
+pg_tde_wal_keystream_main(Datum main_arg)
+{
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	Assert(WALKeystream != NULL);
+
+	before_shmem_exit(TDEXLogKeystreamShutdown, 0);
+	WALKeystream->workerLatch = MyLatch;
+
+	for (;;)
+	{
+		RelKeyData *key;
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		key = GetRelationKey(GLOBAL_SPACE_RLOCATOR(XLOG_TDE_OID));
+		if (key != NULL)
+			TDEXLogFillKeystream(key);
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 100L, PG_WAIT_EXTENSION);
+	}
+}
+
+static void
+TDEXLogCryptSegment(const WALCryptSegment *seg, char *out, RelKeyData *key)
+{
+	char	iv_prefix[16] = {0,};
+
+	if (TDEXLogXorKeystream(seg->tli, seg->pageaddr, seg->iv_ctr, seg->in, seg->len, out))
+		return;
+
+	SetXLogPageIVPrefix(seg->tli, seg->pageaddr, iv_prefix);
+	PG_TDE_ENCRYPT_DATA(iv_prefix, seg->iv_ctr, seg->in, seg->len, out, key);
+}
+
+/*
+ * Called by the writing process: encrypts the segment in place unless a
+ * worker is on it. A claimed segment is taken back if its worker exited, or
+ * with `expired` if the worker is late.
+ */
+static void
+TDEXLogCryptReclaimSegment(int segno, bool expired, RelKeyData *key)
+{
+	WALCryptSlot *slot = &WALCrypt->slots[segno];
+	uint64		state = pg_atomic_read_u64(&slot->state);
+	uint64		job = WAL_CRYPT_SEG_JOB(state);
+
+	switch (WAL_CRYPT_SEG_PHASE(state))
+	{
+		case WAL_CRYPT_SEG_PENDING:
+			break;
+		case WAL_CRYPT_SEG_CLAIMED:
+			if (!expired && WALCrypt->workerLatches[WAL_CRYPT_SEG_OWNER(state)] != NULL)
+				return;
+			break;
+		default:
+			/* Done, or a worker is copying out its result */
+			return;
+	}
+
+	if (!pg_atomic_compare_exchange_u64(&slot->state, &state,
+										WAL_CRYPT_SEG_STATE(job, WAL_CRYPT_WRITER, WAL_CRYPT_SEG_COPYING)))
+		return;
+
+	TDEXLogCryptSegment(&slot->seg, slot->seg.out, key);
+
+	pg_atomic_write_u64(&slot->state, WAL_CRYPT_SEG_STATE(job, WAL_CRYPT_WRITER, WAL_CRYPT_SEG_DONE));
+	pg_atomic_fetch_add_u32(&WALCrypt->done, 1);
+}
+
+/*
+ * Called by a crypto worker: encrypts the segment into a private buffer and
+ * copies the result out if the writer didn't take the segment back
+ * meanwhile.
+ */
+static void
+TDEXLogCryptWorkerSegment(int segno, int worker, RelKeyData *key)
+{
+	static PGAlignedXLogBlock out;
+	WALCryptSlot *slot = &WALCrypt->slots[segno];
+	WALCryptSegment seg;
+	uint64		state = pg_atomic_read_u64(&slot->state);
+	uint64		job = WAL_CRYPT_SEG_JOB(state);
+	uint64		claimed = WAL_CRYPT_SEG_STATE(job, worker, WAL_CRYPT_SEG_CLAIMED);
+
+	if (WAL_CRYPT_SEG_PHASE(state) != WAL_CRYPT_SEG_PENDING)
+		return;
+
+	if (!pg_atomic_compare_exchange_u64(&slot->state, &state, claimed))
+		return;
+
+	/*
+	 * If the writer takes the segment back, it may reuse the slot for the
+	 * next job while we copy it.
+	 */
+	seg = slot->seg;
+	pg_read_barrier();
+	if (pg_atomic_read_u64(&slot->state) != claimed)
+		return;
+
+	Assert(seg.len <= XLOG_BLCKSZ);
+	TDEXLogCryptSegment(&seg, out.data, key);
+
+	if (!pg_atomic_compare_exchange_u64(&slot->state, &claimed,
+										WAL_CRYPT_SEG_STATE(job, worker, WAL_CRYPT_SEG_COPYING)))
+		return;
+
+	memcpy(seg.out, out.data, seg.len);
+	pg_write_barrier();
+	pg_atomic_write_u64(&slot->state, WAL_CRYPT_SEG_STATE(job, worker, WAL_CRYPT_SEG_DONE));
+	pg_atomic_fetch_add_u32(&WALCrypt->done, 1);
+}
+
+/*
+ * Encrypts segments of the current job until none is left to claim.
+ */
+static void
+TDEXLogCryptClaimSegments(int worker, RelKeyData *key)
+{
+	for (;;)
+	{
+		uint64		claim = pg_atomic_read_u64(&WALCrypt->claim);
+		uint32		nsegments = (claim >> WAL_CRYPT_FIELD_BITS) & WAL_CRYPT_FIELD_MASK;
+		uint32		next = claim & WAL_CRYPT_FIELD_MASK;
+
+		if (next >= nsegments)
+			break;
+
+		if (!pg_atomic_compare_exchange_u64(&WALCrypt->claim, &claim, claim + 1))
+			continue;
+
+		if (worker == WAL_CRYPT_WRITER)
+			TDEXLogCryptReclaimSegment(next, false, key);
+		else
+			TDEXLogCryptWorkerSegment(next, worker, key);
+	}
+}
+
+/*
+ * Publishes the segments filled in WALCrypt->slots, helps the workers to
+ * encrypt them and waits until all of them are done. We're in a critical
+ * section holding WALWriteLock, so the wait must stay short: the segments
+ * left behind by a worker that exited are encrypted here right away, and
+ * those of the workers still busy after WAL_CRYPT_WAIT_MS as well. What
+ * remains is waiting for the workers copying out their results.
+ */
+static void
+TDEXLogCryptParallel(int nsegments, RelKeyData *key)
+{
+	SpinDelayStatus delay;
+	TimestampTz deadline;
+	bool		expired = false;
+
+	/* Nothing of the job may fail once a segment is claimed */
+	AesPrepareKeyCtx(&key->internal_key.ctx, key->internal_key.key);
+
+	WALCrypt->job++;
+	for (int i = 0; i < nsegments; i++)
+		pg_atomic_write_u64(&WALCrypt->slots[i].state,
+							WAL_CRYPT_SEG_STATE(WALCrypt->job, WAL_CRYPT_WRITER, WAL_CRYPT_SEG_PENDING));
+	pg_atomic_write_u32(&WALCrypt->done, 0);
+	pg_write_barrier();
+	pg_atomic_write_u64(&WALCrypt->claim,
+						WAL_CRYPT_CLAIM(WALCrypt->job & ((UINT64CONST(1) << (64 - 2 * WAL_CRYPT_FIELD_BITS)) - 1),
+										nsegments, 0));
+
+	for (int i = 0; i < WALCryptWorkers; i++)
+	{
+		Latch	   *latch = WALCrypt->workerLatches[i];
+
+		if (latch != NULL)
+			SetLatch(latch);
+	}
+
+	TDEXLogCryptClaimSegments(WAL_CRYPT_WRITER, key);
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), WAL_CRYPT_WAIT_MS);
+	init_local_spin_delay(&delay);
+	while (pg_atomic_read_u32(&WALCrypt->done) < nsegments)
+	{
+		if (!expired)
+			expired = GetCurrentTimestamp() >= deadline;
+
+		for (int i = 0; i < nsegments; i++)
+			TDEXLogCryptReclaimSegment(i, expired, key);
+
+		if (pg_atomic_read_u32(&WALCrypt->done) < nsegments)
+			perform_spin_delay(&delay);
+	}
+	finish_spin_delay(&delay);
+
+	pg_read_barrier();
+}
+
+static void
+TDEXLogCryptShutdown(int code, Datum arg)
+{
+	WALCrypt->workerLatches[DatumGetInt32(arg)] = NULL;
+}
+
+/*
+ * Crypto worker: encrypts segments of the large WAL writes, woken up by the
+ * writing process.
+ */
+void
+pg_tde_wal_crypt_main(Datum main_arg)
+{
+	int			worker = DatumGetInt32(main_arg);
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	Assert(WALCrypt != NULL);
+
+	before_shmem_exit(TDEXLogCryptShutdown, main_arg);
+	WALCrypt->workerLatches[worker] = MyLatch;
+
+	for (;;)
+	{
+		RelKeyData *key;
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		key = GetRelationKey(GLOBAL_SPACE_RLOCATOR(XLOG_TDE_OID));
+		if (key != NULL)
+		{
+			/* Fail here, if at all, rather than with a claimed segment */
+			AesPrepareKeyCtx(&key->internal_key.ctx, key->internal_key.key);
+			TDEXLogCryptClaimSegments(worker, key);
+		}
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L,
+						 PG_WAIT_EXTENSION);
+	}
+}
+
+static inline WALKeystreamPage *
+TDEXLogDecryptCachePage(XLogRecPtr pageaddr)
+{
+	return &WALDecryptCache->pages[(pageaddr / XLOG_BLCKSZ) % WALDecryptCachePages];
+}
+
+/*
+ * Decrypts in place `len` bytes of the data of the page at `pageaddr`,
+ * starting `iv_ctr` bytes after its header, with the keystream of the page
+ * from the decrypted WAL cache. On a miss, the keystream of the whole page is
+ * generated into the cache for the next readers. Returns false if the data
+ * was not decrypted.
+ */
+static bool
+TDEXLogDecryptCached(TimeLineID tli, XLogRecPtr pageaddr, uint32 iv_ctr, char *data, size_t len, RelKeyData *key)
+{
+	/* The keystream may be replaced while in use, so don't XOR in place */
+	static char plain[XLOG_BLCKSZ];
+	WALKeystreamPage *page;
+
+	if (WALDecryptCache == NULL)
+		return false;
+
+	page = TDEXLogDecryptCachePage(pageaddr);
+	if (TDEXLogXorKeystreamPage(page, tli, pageaddr, iv_ctr, data, len, plain))
+	{
+		memcpy(data, plain, len);
+		return true;
+	}
+
+	return TDEXLogDecryptCacheFill(page, tli, pageaddr, key, iv_ctr, data, len);
+}
+
+/*
+ * Generates the keystream of the page at `pageaddr` into its cache slot and,
+ * if `data` is given, decrypts it in place. Gives up if another process is
+ * filling the slot, or if a newer page holds it: readers lagging behind must
+ * not evict the pages the others are about to read.
+ */
+static bool
+TDEXLogDecryptCacheFill(WALKeystreamPage *page, TimeLineID tli, XLogRecPtr pageaddr, RelKeyData *key, uint32 iv_ctr, char *data, size_t len)
+{
+	uint64		seq;
+	char		iv_prefix[16] = {0,};
+
+	seq = pg_atomic_read_u64(&page->seq);
+	if (seq % 2 != 0 || !pg_atomic_compare_exchange_u64(&page->seq, &seq, seq + 1))
+		return false;
+
+	if (page->tli > tli || (page->tli == tli && page->pageaddr >= pageaddr))
+	{
+		/* Nothing changed, readers which saw seq before may go on */
+		pg_atomic_write_u64(&page->seq, seq);
+		return false;
+	}
+
+	page->pageaddr = pageaddr;
+	page->tli = tli;
+	SetXLogPageIVPrefix(tli, pageaddr, iv_prefix);
+	Aes128EncryptedZeroBlocks(&key->internal_key.ctx, key->internal_key.key, iv_prefix,
+							  0, WAL_KEYSTREAM_BLOCKS, page->keystream);
+	if (data != NULL)
+		TDEXLogXorBytes(page->keystream + iv_ctr, data, len, data);
+
+	pg_write_barrier();
+	pg_atomic_write_u64(&page->seq, seq + 2);
+
+	return true;
+}
+
+/*
+ * Number of pages to generate the keystream for ahead of the startup process.
+ * The WAL decoder already reads wal_decode_buffer_size ahead of the replay to
+ * prefetch the blocks (recovery_prefetch), we go the same distance ahead of
+ * the decoder. Half of the cache at most, so that the pages ahead don't evict
+ * the ones being read.
+ */
+static int
+TDEXLogDecryptAheadPages(void)
+{
+	if (recovery_prefetch == RECOVERY_PREFETCH_OFF)
+		return 0;
+
+	return Max(Min(wal_decode_buffer_size / XLOG_BLCKSZ, WALDecryptCachePages / 2), 1);
+}
+
+/*
+ * Called after reading the page at `pageaddr`. In the startup process, wakes
+ * up the decrypt-ahead worker once half of the pages ahead were read.
+ */
+static void
+TDEXLogDecryptAheadFrom(TimeLineID tli, XLogRecPtr pageaddr)
+{
+	static XLogRecPtr wokenAt = InvalidXLogRecPtr;
+	Latch	   *latch;
+
+	if (WALDecryptCache == NULL || !AmStartupProcess() ||
+		pageaddr == InvalidXLogRecPtr || TDEXLogDecryptAheadPages() == 0)
+		return;
+
+	pg_atomic_write_u32(&WALDecryptCache->readTLI, tli);
+	pg_atomic_write_u64(&WALDecryptCache->readPageAddr, pageaddr);
+
+	if (pageaddr >= wokenAt &&
+		pageaddr < wokenAt + (XLogRecPtr) (TDEXLogDecryptAheadPages() / 2) * XLOG_BLCKSZ)
+		return;
+
+	latch = WALDecryptCache->aheadLatch;
+	if (latch != NULL)
+		SetLatch(latch);
+	wokenAt = pageaddr;
+}
+
+/*
+ * Generates the keystream of the pages following the one the startup process
+ * read last, skipping the pages already in the cache.
+ */
+static void
+TDEXLogDecryptAhead(RelKeyData *key)
+{
+	TimeLineID	tli = pg_atomic_read_u32(&WALDecryptCache->readTLI);
+	XLogRecPtr	first = pg_atomic_read_u64(&WALDecryptCache->readPageAddr);
+	int			npages = TDEXLogDecryptAheadPages();
+
+	if (first == InvalidXLogRecPtr)
+		return;
+
+	for (int i = 1; i <= npages; i++)
+	{
+		XLogRecPtr	pageaddr = first + (XLogRecPtr) i * XLOG_BLCKSZ;
+		WALKeystreamPage *page = TDEXLogDecryptCachePage(pageaddr);
+
+		if (page->pageaddr == pageaddr && page->tli == tli)
+			continue;
+
+		(void) TDEXLogDecryptCacheFill(page, tli, pageaddr, key, 0, NULL, 0);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+static void
+TDEXLogDecryptAheadShutdown(int code, Datum arg)
+{
+	WALDecryptCache->aheadLatch = NULL;
+}
+
+/*
+ * Generates the keystream of the WAL pages the startup process is about to
+ * read, so that it only has to XOR them. Once the recovery is over the
+ * worker only waits: it is started again with the postmaster's other
+ * children when a crash reinitializes the server, but not if it exits
+ * cleanly.
+ */
+void
+pg_tde_wal_decrypt_ahead_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	Assert(WALDecryptCache != NULL);
+
+	before_shmem_exit(TDEXLogDecryptAheadShutdown, 0);
+	WALDecryptCache->aheadLatch = MyLatch;
+
+	for (;;)
+	{
+		RelKeyData *key;
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (!RecoveryInProgress())
+		{
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L,
+							 PG_WAIT_EXTENSION);
+			continue;
+		}
+
+		key = GetRelationKey(GLOBAL_SPACE_RLOCATOR(XLOG_TDE_OID));
+		if (key != NULL)
+			TDEXLogDecryptAhead(key);
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 1000L, PG_WAIT_EXTENSION);
+	}
+}
+
+/*
+ * Writes the fingerprint of the WAL key in hex into `buf`: the first bytes of
+ * the keystream of a counter block that no WAL page uses, as page addresses
+ * are aligned. Returns false if there is no WAL key.
+ */
+bool
+TDEXLogKeyFingerprint(char *buf)
+{
+	RelKeyData *key = GetRelationKey(GLOBAL_SPACE_RLOCATOR(XLOG_TDE_OID));
+	char		iv_prefix[16];
+	unsigned char block[AES_BLOCK_SIZE];
+
+	if (key == NULL)
+		return false;
+
+	memset(iv_prefix, 0xFF, sizeof(iv_prefix));
+	Aes128EncryptedZeroBlocks(&key->internal_key.ctx, key->internal_key.key, iv_prefix, 0, 1, block);
+
+	for (int i = 0; i < TDE_XLOG_KEY_FINGERPRINT_LEN; i++)
+		snprintf(buf + 2 * i, 3, "%02x", block[i]);
+	explicit_bzero(block, sizeof(block));
+
+	return true;
+}
+
+/*
+ * Tells if the walsender ships the WAL as it is stored. Only when the WAL
+ * receiver gave the fingerprint of the WAL key of this server: a receiver with
+ * another key could not decrypt the WAL, so it is refused. The decision holds
+ * for the whole connection.
+ */
+static bool
+TDEXLogPassthrough(void)
+{
+	static int	passthrough = -1;
+	char		fingerprint[TDE_XLOG_KEY_FINGERPRINT_LEN * 2 + 1];
+
+	if (passthrough >= 0)
+		return passthrough == 1;
+
+	if (WALPeerFingerprint == NULL || WALPeerFingerprint[0] == '\0' ||
+		!TDEXLogKeyFingerprint(fingerprint))
+	{
+		ereport(LOG,
+				(errmsg("pg_tde: shipping decrypted WAL, the WAL receiver gave no WAL key fingerprint"),
+				 errhint("Set pg_tde.wal_peer_fingerprint in the connection options of the WAL receiver to receive encrypted WAL.")));
+		passthrough = 0;
+		return false;
+	}
+
+	if (pg_strcasecmp(WALPeerFingerprint, fingerprint) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_tde: WAL key fingerprint %s of the WAL receiver does not match the WAL key of the server",
+						WALPeerFingerprint),
+				 errdetail("The WAL key fingerprint of the server is %s.", fingerprint),
+				 errhint("Encrypted WAL can only be shipped to a WAL receiver with the same WAL key.")));
+
+	ereport(LOG,
+			(errmsg("pg_tde: shipping encrypted WAL, WAL key fingerprint %s", fingerprint)));
+	passthrough = 1;
+	return true;
+}
+
+/*
+ * Logs the fingerprint of the WAL key the first time the process receives
+ * encrypted WAL.
+ */
+static void
+TDEXLogLogKeyFingerprint(void)
+{
+	static bool logged = false;
+	char		fingerprint[TDE_XLOG_KEY_FINGERPRINT_LEN * 2 + 1];
+
+	if (logged)
+		return;
+	logged = true;
+
+	if (TDEXLogKeyFingerprint(fingerprint))
+		ereport(LOG,
+				(errmsg("pg_tde: receiving encrypted WAL, WAL key fingerprint %s", fingerprint)));
 }
 
 /* 
@@ -128,6 +1199,8 @@ TDEXLogWriteEncryptedPages(int fd, const void *buf, size_t count, off_t offset)
 	off_t	enc_off;
 	size_t	page_size = XLOG_BLCKSZ - offset % XLOG_BLCKSZ;
 	uint32	iv_ctr = 0;
+	bool	parallel = WALCrypt != NULL && count >= WAL_CRYPT_PARALLEL_MIN_PAGES * XLOG_BLCKSZ;
+	int		nsegments = 0;
 
 #ifdef TDE_XLOG_DEBUG
 	elog(DEBUG1, "write encrypted WAL, pages amount: %d, size: %lu offset: %ld", count / (Size) XLOG_BLCKSZ, count, offset);
@@ -174,12 +1247,21 @@ TDEXLogWriteEncryptedPages(int fd, const void *buf, size_t count, off_t offset)
 			data_size = count - enc_off;
 		}
 
+		/*
+		 * The page was shipped encrypted by the primary (walreceiver with
+		 * pg_tde.wal_passthrough on the primary), keep it as is.
+		 */
+		if (curr_page_hdr->xlp_info & XLP_ENCRYPTED)
+		{
+			TDEXLogLogKeyFingerprint();
+			memcpy(TDEXLogEncryptBuf + enc_off, (char *) buf + enc_off, data_size);
+		}
 		/* 
 		 * The page is zeroed (no data), no sense to enctypt.
 		 * This may happen when base_backup or other requests XLOG SWITCH and
 		 * some pages in XLog buffer still not used.
 		*/
-		if (curr_page_hdr->xlp_magic == 0)
+		else if (curr_page_hdr->xlp_magic == 0)
 		{
 			/* ensure all the page is {0} */
 			Assert((*((char *) buf + enc_off) == 0) && 
@@ -187,7 +1269,21 @@ TDEXLogWriteEncryptedPages(int fd, const void *buf, size_t count, off_t offset)
 
 			memcpy((char *) enc_buf_page, (char *) buf + enc_off, data_size);
 		}
-		else
+		else if (parallel)
+		{
+			/* encrypted by TDEXLogCryptParallel() below */
+			WALCryptSegment *seg = &WALCrypt->slots[nsegments++].seg;
+
+			Assert(nsegments <= TDEXLogCryptMaxSegments());
+			seg->in = (char *) buf + enc_off;
+			seg->out = TDEXLogEncryptBuf + enc_off;
+			seg->len = data_size;
+			seg->iv_ctr = iv_ctr;
+			seg->tli = curr_page_hdr->xlp_tli;
+			seg->pageaddr = curr_page_hdr->xlp_pageaddr;
+		}
+		else if (!TDEXLogXorKeystream(curr_page_hdr->xlp_tli, curr_page_hdr->xlp_pageaddr, iv_ctr,
+									  (char *) buf + enc_off, data_size, TDEXLogEncryptBuf + enc_off))
 		{
 			SetXLogPageIVPrefix(curr_page_hdr->xlp_tli, curr_page_hdr->xlp_pageaddr, iv_prefix);
 			PG_TDE_ENCRYPT_DATA(iv_prefix, iv_ctr, (char *) buf + enc_off, data_size, 
@@ -198,6 +1294,13 @@ TDEXLogWriteEncryptedPages(int fd, const void *buf, size_t count, off_t offset)
 		enc_off += data_size;
 	}
 
+	if (nsegments > 0)
+		TDEXLogCryptParallel(nsegments, key);
+
+	/* Let the keystream worker refill the pages we used */
+	if (WALKeystream != NULL && WALKeystream->workerLatch != NULL)
+		SetLatch(WALKeystream->workerLatch);
+
 	return pg_pwrite(fd, TDEXLogEncryptBuf, count, offset);
 }
 #endif		/* !FRONTEND */
@@ -240,6 +1343,12 @@ tdeheap_xlog_seg_read(int fd, void *buf, size_t count, off_t offset)
 
 	readsz = pg_pread(fd, buf, count, offset);
 
+#ifndef FRONTEND
+	/* Physical walsenders may ship the pages encrypted, see the file header */
+	if (WALPassthrough && am_walsender && !am_db_walsender && TDEXLogPassthrough())
+		return readsz;
+#endif
+
 	/* 
 	 * Read the buf page by page and decypt ecnrypted pages.
 	 * We may start or fihish reading from/in the middle of the page (walreceiver)
@@ -277,7 +1386,9 @@ tdeheap_xlog_seg_read(int fd, void *buf, size_t count, off_t offset)
 			data_size = readsz - dec_off;
 		}
 
-		if (curr_page_hdr->xlp_info & XLP_ENCRYPTED)
+		if ((curr_page_hdr->xlp_info & XLP_ENCRYPTED) &&
+			!TDEXLogDecryptCached(curr_page_hdr->xlp_tli, curr_page_hdr->xlp_pageaddr, iv_ctr,
+								  (char *) buf + dec_off, data_size, key))
 		{
 			SetXLogPageIVPrefix(curr_page_hdr->xlp_tli, curr_page_hdr->xlp_pageaddr, iv_prefix);
 			PG_TDE_DECRYPT_DATA(
@@ -289,6 +1400,9 @@ tdeheap_xlog_seg_read(int fd, void *buf, size_t count, off_t offset)
 		dec_off += data_size;
 	}
 
+	if (readsz > 0)
+		TDEXLogDecryptAheadFrom(curr_page_hdr->xlp_tli, curr_page_hdr->xlp_pageaddr);
+
 	return readsz;
 }
 
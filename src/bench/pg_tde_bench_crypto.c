@@ -0,0 +1,351 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_tde_bench_crypto.c
+ *	  Microbenchmark of the pg_tde encryption routines.
+ *
+ * Built from the FRONTEND variants of enc_aes.c and enc_tde.c, so it
+ * measures exactly the code used by the server, without a server. For every
+ * crypto kernel supported by the CPU it runs:
+ *
+ *  - tuple	  decryption of tuple data of 16B..8KB (pg_tde_crypt)
+ *  - offset  1KB of data starting at unaligned offsets
+ *  - toast	  TOAST chunks and a whole 1MB TOAST value
+ *  - wal	  encryption of a WAL page body
+ *  - smgr	  CBC and XTS page encryption/decryption
+ *
+ * and reports ns/op, GB/s and cycles/byte (TSC cycles, x86-64 only).
+ *
+ * Before measuring anything, every operation is run with every kernel on the
+ * same data and the output is compared with the one of OpenSSL, so that a
+ * broken hardware kernel is reported instead of measured. --verify only does
+ * that check.
+ *
+ * src/bench/pg_tde_bench_crypto.c
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_tde_fe.h"
+
+#include <time.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+#include "access/pg_tde_tdemap.h"
+#include "access/xlog_internal.h"
+#include "encryption/enc_aes.h"
+#include "encryption/enc_tde.h"
+#include "getopt_long.h"
+
+#define BENCH_MAX_DATA		(1024 * 1024)
+#define BENCH_TOAST_CHUNK	1996	/* TOAST_MAX_CHUNK_SIZE with 8KB blocks */
+
+typedef enum BenchOp
+{
+	BENCH_OP_CRYPT,
+	BENCH_OP_CBC_ENCRYPT,
+	BENCH_OP_CBC_DECRYPT,
+	BENCH_OP_XTS_ENCRYPT,
+	BENCH_OP_XTS_DECRYPT
+} BenchOp;
+
+static const char *const kernel_names[] = {"auto", "openssl", "aesni", "vaes"};
+
+static double min_time = 0.2;
+static const char *only_case = NULL;
+
+static unsigned char *data_in;
+static unsigned char *data_out;
+static unsigned char *data_ref;
+static RelKeyData bench_key;
+
+static void
+usage(const char *progname)
+{
+	printf("%s measures the cost of the pg_tde encryption routines.\n\n", progname);
+	printf("Usage:\n  %s [OPTION]...\n\n", progname);
+	printf("Options:\n");
+	printf("  -k, --kernel=NAME     run only the given kernel (auto, openssl, aesni, vaes)\n");
+	printf("  -c, --case=NAME       run only the given case (tuple, offset, toast, wal, smgr)\n");
+	printf("  -t, --time=SECONDS    minimal run time of every measurement (default: %.1f)\n", min_time);
+	printf("  -v, --verify          only check that all kernels give the same output\n");
+	printf("  -?, --help            show this help, then exit\n");
+}
+
+static inline double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint64
+bench_cycles(void)
+{
+#ifdef BENCH_HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void
+run_op(BenchOp op, uint32 offset, uint32 len)
+{
+	char		iv[16] = "pg_tde_bench";
+	int			out_len;
+
+	switch (op)
+	{
+		case BENCH_OP_CRYPT:
+			pg_tde_crypt(iv, offset, (char *) data_in, len, (char *) data_out, &bench_key, NULL);
+			break;
+		case BENCH_OP_CBC_ENCRYPT:
+			AesEncryptWithCtx(&bench_key.internal_key.ctx, bench_key.internal_key.key, (unsigned char *) iv, data_in, len, data_out, &out_len);
+			break;
+		case BENCH_OP_CBC_DECRYPT:
+			AesDecryptWithCtx(&bench_key.internal_key.ctx, bench_key.internal_key.key, (unsigned char *) iv, data_in, len, data_out, &out_len);
+			break;
+		case BENCH_OP_XTS_ENCRYPT:
+			AesXtsEncryptWithCtx(&bench_key.internal_key.ctx, bench_key.internal_key.key, (unsigned char *) iv, data_in, len, data_out, &out_len);
+			break;
+		case BENCH_OP_XTS_DECRYPT:
+			AesXtsDecryptWithCtx(&bench_key.internal_key.ctx, bench_key.internal_key.key, (unsigned char *) iv, data_in, len, data_out, &out_len);
+			break;
+	}
+}
+
+/*
+ * Runs the operation in batches until min_time passes and prints the
+ * results. `chunk` splits `len` into consecutive calls of that size (as
+ * done for TOAST chunks), 0 means a single call.
+ */
+static void
+measure(const char *kernel, const char *name, BenchOp op, uint32 offset, uint32 len, uint32 chunk)
+{
+	uint64		iterations = 0;
+	uint64		batch = 1;
+	uint64		cycles_start;
+	uint64		cycles;
+	double		start;
+	double		elapsed;
+	double		bytes;
+
+	/* warm up, also creates the cipher contexts */
+	run_op(op, offset, Min(len, chunk ? chunk : len));
+
+	start = bench_now();
+	cycles_start = bench_cycles();
+	do
+	{
+		for (uint64 i = 0; i < batch; i++)
+		{
+			if (chunk == 0)
+				run_op(op, offset, len);
+			else
+			{
+				for (uint32 off = 0; off < len; off += chunk)
+					run_op(op, offset + off, Min(chunk, len - off));
+			}
+		}
+		iterations += batch;
+		batch *= 2;
+		elapsed = bench_now() - start;
+	} while (elapsed < min_time);
+	cycles = bench_cycles() - cycles_start;
+
+	bytes = (double) iterations * len;
+
+	printf("%-8s %-18s %8u %7u %12.1f %8.2f", kernel, name, len, offset,
+		   elapsed * 1e9 / iterations, bytes / elapsed / 1e9);
+#ifdef BENCH_HAVE_TSC
+	printf(" %8.2f\n", cycles / bytes);
+#else
+	(void) cycles;
+	printf(" %8s\n", "-");
+#endif
+}
+
+/*
+ * Runs the operation with every kernel supported by the CPU and fails if the
+ * output differs from the one of OpenSSL.
+ */
+static void
+verify_op(const char *name, BenchOp op, uint32 offset, uint32 len)
+{
+	AesSetKernel(AES_KERNEL_OPENSSL);
+	memset(data_out, 0, len);
+	run_op(op, offset, len);
+	memcpy(data_ref, data_out, len);
+
+	for (int kernel = AES_KERNEL_OPENSSL + 1; kernel < lengthof(kernel_names); kernel++)
+	{
+		if (!AesKernelIsSupported(kernel))
+			continue;
+
+		AesSetKernel(kernel);
+		memset(data_out, 0, len);
+		run_op(op, offset, len);
+
+		if (memcmp(data_out, data_ref, len) != 0)
+			pg_fatal("kernel %s: %s of %u bytes at offset %u differs from openssl",
+					 kernel_names[kernel], name, len, offset);
+	}
+}
+
+static void
+verify_kernels(void)
+{
+	static const uint32 sizes[] = {1, 15, 16, 17, 100, 1024, BENCH_TOAST_CHUNK, BLCKSZ, BENCH_MAX_DATA};
+	static const uint32 offsets[] = {0, 1, 7, 15, 16, 100};
+
+	for (int i = 0; i < lengthof(sizes); i++)
+		for (int j = 0; j < lengthof(offsets); j++)
+			verify_op("pg_tde_crypt", BENCH_OP_CRYPT, offsets[j], sizes[i]);
+
+	verify_op("cbc-encrypt", BENCH_OP_CBC_ENCRYPT, 0, BLCKSZ);
+	verify_op("cbc-decrypt", BENCH_OP_CBC_DECRYPT, 0, BLCKSZ);
+	verify_op("xts-encrypt", BENCH_OP_XTS_ENCRYPT, 0, BLCKSZ);
+	verify_op("xts-decrypt", BENCH_OP_XTS_DECRYPT, 0, BLCKSZ);
+
+	printf("# all supported kernels give the same output as openssl\n");
+}
+
+static bool
+case_enabled(const char *name)
+{
+	return only_case == NULL || strcmp(only_case, name) == 0;
+}
+
+static void
+run_kernel(int kernel)
+{
+	static const uint32 tuple_sizes[] = {16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192};
+	static const uint32 offsets[] = {0, 1, 7, 15, 16, 100};
+	const char *kname = kernel_names[kernel];
+
+	AesSetKernel(kernel);
+
+	if (case_enabled("tuple"))
+		for (int i = 0; i < lengthof(tuple_sizes); i++)
+			measure(kname, "tuple", BENCH_OP_CRYPT, 0, tuple_sizes[i], 0);
+
+	if (case_enabled("offset"))
+		for (int i = 0; i < lengthof(offsets); i++)
+			measure(kname, "offset", BENCH_OP_CRYPT, offsets[i], 1024, 0);
+
+	if (case_enabled("toast"))
+	{
+		measure(kname, "toast-chunk", BENCH_OP_CRYPT, 0, BENCH_TOAST_CHUNK, 0);
+		measure(kname, "toast-value", BENCH_OP_CRYPT, 0, BENCH_MAX_DATA, 0);
+		measure(kname, "toast-chunked", BENCH_OP_CRYPT, 0, BENCH_MAX_DATA, BENCH_TOAST_CHUNK);
+	}
+
+	if (case_enabled("wal"))
+		measure(kname, "wal-page", BENCH_OP_CRYPT, 0, XLOG_BLCKSZ - SizeOfXLogShortPHD, 0);
+
+	if (case_enabled("smgr"))
+	{
+		measure(kname, "smgr-cbc-encrypt", BENCH_OP_CBC_ENCRYPT, 0, BLCKSZ, 0);
+		measure(kname, "smgr-cbc-decrypt", BENCH_OP_CBC_DECRYPT, 0, BLCKSZ, 0);
+		measure(kname, "smgr-xts-encrypt", BENCH_OP_XTS_ENCRYPT, 0, BLCKSZ, 0);
+		measure(kname, "smgr-xts-decrypt", BENCH_OP_XTS_DECRYPT, 0, BLCKSZ, 0);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"kernel", required_argument, NULL, 'k'},
+		{"case", required_argument, NULL, 'c'},
+		{"time", required_argument, NULL, 't'},
+		{"verify", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *progname;
+	int			only_kernel = -1;
+	bool		verify_only = false;
+	int			c;
+	char		desc[256];
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	while ((c = getopt_long(argc, argv, "k:c:t:v?", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'k':
+				for (int i = 0; i < lengthof(kernel_names); i++)
+					if (strcmp(optarg, kernel_names[i]) == 0)
+						only_kernel = i;
+				if (only_kernel < 0)
+					pg_fatal("unknown kernel \"%s\"", optarg);
+				break;
+			case 'c':
+				only_case = optarg;
+				break;
+			case 't':
+				min_time = atof(optarg);
+				if (min_time <= 0)
+					pg_fatal("invalid time \"%s\"", optarg);
+				break;
+			case 'v':
+				verify_only = true;
+				break;
+			case '?':
+				if (optind <= argc && strcmp(argv[optind - 1], "-?") == 0)
+				{
+					usage(progname);
+					exit(0);
+				}
+				/* FALLTHROUGH */
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	AesInit();
+	AesDescribeKernels(desc, sizeof(desc));
+	printf("# %s\n", desc);
+
+	data_in = palloc(BENCH_MAX_DATA + AES_BLOCK_SIZE);
+	data_out = palloc(BENCH_MAX_DATA + AES_BLOCK_SIZE);
+	data_ref = palloc(BENCH_MAX_DATA + AES_BLOCK_SIZE);
+	for (int i = 0; i < BENCH_MAX_DATA + AES_BLOCK_SIZE; i++)
+		data_in[i] = (unsigned char) (i * 31);
+
+	memset(&bench_key, 0, sizeof(bench_key));
+	for (int i = 0; i < INTERNAL_KEY_LEN; i++)
+		bench_key.internal_key.key[i] = (uint8) (i * 7 + 1);
+
+	verify_kernels();
+	if (verify_only)
+		return 0;
+
+	printf("%-8s %-18s %8s %7s %12s %8s %8s\n",
+		   "kernel", "case", "bytes", "offset", "ns/op", "GB/s", "cyc/B");
+
+	for (int kernel = AES_KERNEL_OPENSSL; kernel < lengthof(kernel_names); kernel++)
+	{
+		if (only_kernel >= 0 && kernel != only_kernel)
+			continue;
+		if (!AesKernelIsSupported(kernel))
+			continue;
+
+		run_kernel(kernel);
+	}
+
+	if (only_kernel == AES_KERNEL_AUTO)
+		run_kernel(AES_KERNEL_AUTO);
+
+	return 0;
+}
@@ -4,6 +4,17 @@
  *      Deals with the tde keyring configuration
  *      routines.
  *
+ * The key providers of a database are stored in its pg_tde_keyrings file.
+ * Reading a provider means scanning the file and parsing the JSON options of
+ * the records, so the parsed providers are cached in shared memory, keyed by
+ * database, tablespace and provider id. The cache of a database is dropped
+ * whenever its file is written, which includes the redo of
+ * XLOG_TDE_ADD_KEY_PROVIDER_KEY on a standby, or deleted.
+ *
+ * Providers whose options fetch some of their values from an external
+ * source ("remote" or "file" field objects) are not cached, so changes of
+ * those values are still picked up on the next lookup.
+ *
  * IDENTIFICATION
  *    contrib/pg_tde/src/catalog/tde_keyring.c
  *
@@ -34,6 +45,7 @@
 #include "access/relation.h"
 #include "catalog/namespace.h"
 #include "executor/spi.h"
+#include "port/atomics.h"
 #else
 #include "fe_utils/simple_list.h"
 #include "pg_tde_fe.h"
@@ -83,9 +95,43 @@ static uint32 write_key_provider_info(KeyringProvideRecord *provider,
 static Size initialize_shared_state(void *start_address);
 static Size required_shared_mem_size(void);
 
+#define KEY_PROVIDER_CACHE_SIZE		64
+/* (database, tablespace) pairs whose providers are all in the cache */
+#define KEY_PROVIDER_CACHE_SPACES	16
+
+typedef union CachedKeyring
+{
+	GenericKeyring generic;
+	FileKeyring file;
+	VaultV2Keyring vault;
+} CachedKeyring;
+
+typedef struct KeyProviderCacheEntry
+{
+	bool		valid;
+	Oid			dbOid;
+	Oid			spcOid;
+	CachedKeyring keyring;
+} KeyProviderCacheEntry;
+
+typedef struct KeyProviderCacheSpace
+{
+	bool		complete;
+	Oid			dbOid;
+	Oid			spcOid;
+} KeyProviderCacheSpace;
+
+/*
+ * The cache is protected by the TDE_LWLOCK_PI_FILES lock, like the files
+ * themselves. Lookups hold it shared, changes exclusive.
+ */
 typedef struct TdeKeyProviderInfoSharedState
 {
 	LWLockPadded *Locks;
+	pg_atomic_uint64 cacheGeneration;	/* bumped whenever a file changes */
+	int			cacheClock;		/* next entry to evict */
+	KeyProviderCacheSpace cacheSpaces[KEY_PROVIDER_CACHE_SPACES];
+	KeyProviderCacheEntry cache[KEY_PROVIDER_CACHE_SIZE];
 } TdeKeyProviderInfoSharedState;
 
 TdeKeyProviderInfoSharedState*	sharedPrincipalKeyState = NULL; /* Lives in shared state */
@@ -107,7 +153,9 @@ static Size
 initialize_shared_state(void *start_address)
 {
 	sharedPrincipalKeyState = (TdeKeyProviderInfoSharedState *)start_address;
+	memset(sharedPrincipalKeyState, 0, sizeof(TdeKeyProviderInfoSharedState));
 	sharedPrincipalKeyState->Locks = GetNamedLWLockTranche(TDE_TRANCHE_NAME);
+	pg_atomic_init_u64(&sharedPrincipalKeyState->cacheGeneration, 0);
 
 	return sizeof(TdeKeyProviderInfoSharedState);
 }
@@ -119,6 +167,243 @@ tde_provider_info_lock(void)
 	return &sharedPrincipalKeyState->Locks[TDE_LWLOCK_PI_FILES].lock;
 }
 
+static Size
+keyring_size(ProviderType type)
+{
+	switch (type)
+	{
+	case FILE_KEY_PROVIDER:
+		return sizeof(FileKeyring);
+	case VAULT_V2_KEY_PROVIDER:
+		return sizeof(VaultV2Keyring);
+	default:
+		break;
+	}
+	return sizeof(GenericKeyring);
+}
+
+/*
+ * Options read from a file or a URL may change without the provider being
+ * modified, so such providers are read again every time.
+ */
+static bool
+key_provider_is_cacheable(GenericKeyring *keyring)
+{
+	return !keyring->external_options;
+}
+
+static GenericKeyring *
+key_provider_cache_copy(KeyProviderCacheEntry *entry)
+{
+	Size size = keyring_size(entry->keyring.generic.type);
+	GenericKeyring *keyring = palloc(size);
+
+	memcpy(keyring, &entry->keyring, size);
+	return keyring;
+}
+
+static KeyProviderCacheSpace *
+key_provider_cache_space(Oid dbOid, Oid spcOid)
+{
+	for (int i = 0; i < KEY_PROVIDER_CACHE_SPACES; i++)
+	{
+		KeyProviderCacheSpace *space = &sharedPrincipalKeyState->cacheSpaces[i];
+
+		if (space->complete && space->dbOid == dbOid && space->spcOid == spcOid)
+			return space;
+	}
+	return NULL;
+}
+
+/*
+ * Looks up a provider by name or id. Returns NULL if it isn't cached.
+ */
+static GenericKeyring *
+key_provider_cache_get(ProviderScanType scanType, void *scanKey, Oid dbOid, Oid spcOid)
+{
+	GenericKeyring *keyring = NULL;
+
+	Assert(scanType == PROVIDER_SCAN_BY_NAME || scanType == PROVIDER_SCAN_BY_ID);
+
+	LWLockAcquire(tde_provider_info_lock(), LW_SHARED);
+	for (int i = 0; i < KEY_PROVIDER_CACHE_SIZE; i++)
+	{
+		KeyProviderCacheEntry *entry = &sharedPrincipalKeyState->cache[i];
+
+		if (!entry->valid || entry->dbOid != dbOid || entry->spcOid != spcOid)
+			continue;
+
+		if ((scanType == PROVIDER_SCAN_BY_NAME &&
+			 strcasecmp(entry->keyring.generic.provider_name, (char *) scanKey) == 0) ||
+			(scanType == PROVIDER_SCAN_BY_ID &&
+			 entry->keyring.generic.key_id == *(int *) scanKey))
+		{
+			keyring = key_provider_cache_copy(entry);
+			break;
+		}
+	}
+	LWLockRelease(tde_provider_info_lock());
+
+	return keyring;
+}
+
+static int
+key_provider_id_cmp(const ListCell *a, const ListCell *b)
+{
+	GenericKeyring *ka = (GenericKeyring *) lfirst(a);
+	GenericKeyring *kb = (GenericKeyring *) lfirst(b);
+
+	if (ka->key_id < kb->key_id)
+		return -1;
+	return ka->key_id > kb->key_id ? 1 : 0;
+}
+
+/*
+ * Returns all the providers of the database if all of them are cached.
+ */
+static bool
+key_provider_cache_get_all(Oid dbOid, Oid spcOid, List **providers)
+{
+	bool complete;
+
+	*providers = NIL;
+
+	LWLockAcquire(tde_provider_info_lock(), LW_SHARED);
+	complete = key_provider_cache_space(dbOid, spcOid) != NULL;
+	if (complete)
+	{
+		for (int i = 0; i < KEY_PROVIDER_CACHE_SIZE; i++)
+		{
+			KeyProviderCacheEntry *entry = &sharedPrincipalKeyState->cache[i];
+
+			if (entry->valid && entry->dbOid == dbOid && entry->spcOid == spcOid)
+				*providers = lappend(*providers, key_provider_cache_copy(entry));
+		}
+	}
+	LWLockRelease(tde_provider_info_lock());
+
+	/* The file lists the providers in the order of their ids */
+	if (complete)
+		list_sort(*providers, key_provider_id_cmp);
+
+	return complete;
+}
+
+/*
+ * Drops all the cached providers of the database. The caller holds the lock
+ * exclusively.
+ */
+static void
+key_provider_cache_invalidate(Oid dbOid, Oid spcOid)
+{
+	KeyProviderCacheSpace *space;
+
+	Assert(LWLockHeldByMeInMode(tde_provider_info_lock(), LW_EXCLUSIVE));
+
+	pg_atomic_fetch_add_u64(&sharedPrincipalKeyState->cacheGeneration, 1);
+
+	space = key_provider_cache_space(dbOid, spcOid);
+	if (space != NULL)
+		space->complete = false;
+
+	for (int i = 0; i < KEY_PROVIDER_CACHE_SIZE; i++)
+	{
+		KeyProviderCacheEntry *entry = &sharedPrincipalKeyState->cache[i];
+
+		if (entry->valid && entry->dbOid == dbOid && entry->spcOid == spcOid)
+			entry->valid = false;
+	}
+}
+
+/*
+ * Caches providers read from the file. `generation` is the cache generation
+ * read before the file was scanned: if a file changed since, the providers
+ * may be stale and are not cached. With `complete`, the providers are all
+ * the providers of the database.
+ */
+static void
+key_provider_cache_put(List *providers, Oid dbOid, Oid spcOid, uint64 generation, bool complete)
+{
+	ListCell   *lc;
+
+	if (list_length(providers) > KEY_PROVIDER_CACHE_SIZE / 2)
+		complete = false;
+
+	LWLockAcquire(tde_provider_info_lock(), LW_EXCLUSIVE);
+
+	if (pg_atomic_read_u64(&sharedPrincipalKeyState->cacheGeneration) != generation)
+	{
+		LWLockRelease(tde_provider_info_lock());
+		return;
+	}
+
+	foreach(lc, providers)
+	{
+		GenericKeyring *keyring = (GenericKeyring *) lfirst(lc);
+		KeyProviderCacheEntry *entry = NULL;
+
+		if (!key_provider_is_cacheable(keyring))
+		{
+			complete = false;
+			continue;
+		}
+
+		for (int i = 0; i < KEY_PROVIDER_CACHE_SIZE; i++)
+		{
+			KeyProviderCacheEntry *e = &sharedPrincipalKeyState->cache[i];
+
+			if (e->valid && e->dbOid == dbOid && e->spcOid == spcOid &&
+				e->keyring.generic.key_id == keyring->key_id)
+			{
+				entry = e;
+				break;
+			}
+		}
+
+		if (entry == NULL)
+		{
+			KeyProviderCacheSpace *space;
+
+			entry = &sharedPrincipalKeyState->cache[sharedPrincipalKeyState->cacheClock];
+			sharedPrincipalKeyState->cacheClock = (sharedPrincipalKeyState->cacheClock + 1) % KEY_PROVIDER_CACHE_SIZE;
+
+			if (entry->valid)
+			{
+				/* The database of the evicted entry is no longer complete */
+				space = key_provider_cache_space(entry->dbOid, entry->spcOid);
+				if (space != NULL)
+					space->complete = false;
+				if (entry->dbOid == dbOid && entry->spcOid == spcOid)
+					complete = false;
+			}
+		}
+
+		memset(&entry->keyring, 0, sizeof(CachedKeyring));
+		memcpy(&entry->keyring, keyring, keyring_size(keyring->type));
+		entry->dbOid = dbOid;
+		entry->spcOid = spcOid;
+		entry->valid = true;
+	}
+
+	if (complete && key_provider_cache_space(dbOid, spcOid) == NULL)
+	{
+		for (int i = 0; i < KEY_PROVIDER_CACHE_SPACES; i++)
+		{
+			KeyProviderCacheSpace *space = &sharedPrincipalKeyState->cacheSpaces[i];
+
+			if (!space->complete)
+			{
+				space->complete = true;
+				space->dbOid = dbOid;
+				space->spcOid = spcOid;
+				break;
+			}
+		}
+	}
+
+	LWLockRelease(tde_provider_info_lock());
+}
+
 void InitializeKeyProviderInfo(void)
 {
 	ereport(LOG, (errmsg("initializing TDE key provider info")));
@@ -169,16 +454,35 @@ get_keyring_provider_typename(ProviderType p_type)
 List *
 GetAllKeyringProviders(Oid dbOid, Oid spcOid)
 {
-	return scan_key_provider_file(PROVIDER_SCAN_ALL, NULL, dbOid, spcOid);
+	List *providers;
+	uint64 generation;
+
+	if (key_provider_cache_get_all(dbOid, spcOid, &providers))
+		return providers;
+
+	generation = pg_atomic_read_u64(&sharedPrincipalKeyState->cacheGeneration);
+	providers = scan_key_provider_file(PROVIDER_SCAN_ALL, NULL, dbOid, spcOid);
+	key_provider_cache_put(providers, dbOid, spcOid, generation, true);
+
+	return providers;
 }
 
 GenericKeyring *
 GetKeyProviderByName(const char *provider_name, Oid dbOid, Oid spcOid)
 {
 	GenericKeyring *keyring = NULL;
-	List *providers = scan_key_provider_file(PROVIDER_SCAN_BY_NAME, (void*)provider_name, dbOid, spcOid);
+	List *providers;
+	uint64 generation;
+
+	keyring = key_provider_cache_get(PROVIDER_SCAN_BY_NAME, (void*)provider_name, dbOid, spcOid);
+	if (keyring != NULL)
+		return keyring;
+
+	generation = pg_atomic_read_u64(&sharedPrincipalKeyState->cacheGeneration);
+	providers = scan_key_provider_file(PROVIDER_SCAN_BY_NAME, (void*)provider_name, dbOid, spcOid);
 	if (providers != NIL)
 	{
+		key_provider_cache_put(providers, dbOid, spcOid, generation, false);
 		keyring = (GenericKeyring *)linitial(providers);
 		list_free(providers);
 	}
@@ -209,6 +513,7 @@ write_key_provider_info(KeyringProvideRecord *provider, Oid database_id,
 	get_keyring_infofile_path(kp_info_path, database_id, tablespace_id);
 
 	LWLockAcquire(tde_provider_info_lock(), LW_EXCLUSIVE);
+	key_provider_cache_invalidate(database_id, tablespace_id);
 
 	fd = BasicOpenFile(kp_info_path, O_CREAT | O_RDWR | PG_BINARY);
 	if (fd < 0)
@@ -311,7 +616,10 @@ cleanup_key_provider_info(Oid databaseId, Oid tablespaceId)
 	char kp_info_path[MAXPGPATH] = {0};
 
 	get_keyring_infofile_path(kp_info_path, databaseId, tablespaceId);
+	LWLockAcquire(tde_provider_info_lock(), LW_EXCLUSIVE);
 	PathNameDeleteTemporaryFile(kp_info_path, false);
+	key_provider_cache_invalidate(databaseId, tablespaceId);
+	LWLockRelease(tde_provider_info_lock());
 }
 
 Datum
@@ -397,9 +705,18 @@ GenericKeyring *
 GetKeyProviderByID(int provider_id, Oid dbOid, Oid spcOid)
 {
 	GenericKeyring *keyring = NULL;
-	List *providers = scan_key_provider_file(PROVIDER_SCAN_BY_ID, &provider_id, dbOid, spcOid);
+	List *providers;
+	uint64 generation;
+
+	keyring = key_provider_cache_get(PROVIDER_SCAN_BY_ID, &provider_id, dbOid, spcOid);
+	if (keyring != NULL)
+		return keyring;
+
+	generation = pg_atomic_read_u64(&sharedPrincipalKeyState->cacheGeneration);
+	providers = scan_key_provider_file(PROVIDER_SCAN_BY_ID, &provider_id, dbOid, spcOid);
 	if (providers != NIL)
 	{
+		key_provider_cache_put(providers, dbOid, spcOid, generation, false);
 		keyring = (GenericKeyring *)linitial(providers);
 		list_free(providers);
 	}
@@ -263,6 +263,7 @@ json_kring_object_end(void *state)
 				value = get_file_kring_value(parse->extern_path, JK_FIELD_NAMES[parent_field]);
 
 			json_kring_assign_scalar(parse, parent_field, value);
+			((GenericKeyring *) parse->provider_opts)->external_options = true;
 		}
 
 		parse->state = JK_EXPECT_TOP_FIELD;
@@ -29,9 +29,15 @@
 #include "access/pg_tde_tdemap.h"
 #include "catalog/tde_global_space.h"
 #ifndef FRONTEND
+#include "access/pg_tde_keycache.h"
 #include "common/pg_tde_shmem.h"
 #include "funcapi.h"
+#include "port/atomics.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
 #include "storage/lwlock.h"
+#include "storage/spin.h"
+#include "utils/hsearch.h"
 #else
 #include "pg_tde_fe.h"
 #endif
@@ -40,6 +46,19 @@
 
 #ifndef FRONTEND
 
+/* Maximum number of databases whose principal key is loaded concurrently */
+#define PRINCIPAL_KEY_LOAD_SLOTS 64
+
+/* principal_key_load_start() results that are not a slot */
+#define PRINCIPAL_KEY_LOAD_WAITED   (-1)
+#define PRINCIPAL_KEY_LOAD_NO_SLOT  (-2)
+
+typedef struct PrincipalKeyLoad
+{
+    Oid databaseId; /* database whose key is loaded, InvalidOid if free */
+    ConditionVariable cv; /* broadcast when the load is over */
+} PrincipalKeyLoad;
+
 typedef struct TdePrincipalKeySharedState
 {
     LWLockPadded *Locks;
@@ -47,6 +66,15 @@ typedef struct TdePrincipalKeySharedState
     dshash_table_handle hashHandle;
     void *rawDsaArea; /* DSA area pointer */
 
+    /*
+     * Bumped every time a principal key of a database of the lock partition
+     * is removed from the cache (rotation, cleanup).
+     */
+    pg_atomic_uint64 generations[TDE_LWLOCK_ENC_KEY_PARTITIONS];
+
+    /* Principal keys being loaded from their keyring, see load_principal_key() */
+    slock_t loadMutex;
+    PrincipalKeyLoad loads[PRINCIPAL_KEY_LOAD_SLOTS];
 } TdePrincipalKeySharedState;
 
 typedef struct TdePrincipalKeylocalState
@@ -67,6 +95,20 @@ static dshash_parameters principal_key_dsh_params = {
 
 TdePrincipalKeylocalState principalKeyLocalState;
 
+/*
+ * Backend copy of the principal key of a database. It is used without any
+ * lock as long as the generation of its lock partition doesn't change.
+ */
+typedef struct PrincipalKeySnapshot
+{
+    Oid databaseId; /* hash key, must be first */
+    bool valid;
+    uint64 generation;
+    TDEPrincipalKey key;
+} PrincipalKeySnapshot;
+
+static HTAB *principalKeySnapshots = NULL;
+
 static void principal_key_info_attach_shmem(void);
 static Size initialize_shared_state(void *start_address);
 static void initialize_objects_in_dsa_area(dsa_area *dsa, void *raw_dsa_area);
@@ -75,8 +117,16 @@ static Size required_shared_mem_size(void);
 static void shared_memory_shutdown(int code, Datum arg);
 static void principal_key_startup_cleanup(int tde_tbl_count, XLogExtensionInstall *ext_info, bool redo, void *arg);
 static void clear_principal_key_cache(Oid databaseId) ;
+static inline pg_atomic_uint64 *principal_key_generation(Oid dbOid);
+static TDEPrincipalKey *get_principal_key_snapshot(Oid dbOid);
+static TDEPrincipalKey *set_principal_key_snapshot(TDEPrincipalKey *principalKey, uint64 generation);
+static TDEPrincipalKey *lookup_principal_key(Oid dbOid);
+static TDEPrincipalKey *load_principal_key(Oid dbOid, Oid spcOid);
+static TDEPrincipalKey *fetch_principal_key(Oid dbOid, Oid spcOid, bool locked);
+static int principal_key_load_start(Oid dbOid);
+static void principal_key_load_end(int slot);
+static void principal_key_load_cleanup(int code, Datum arg);
 static inline dshash_table *get_principal_key_Hash(void);
-static TDEPrincipalKey *get_principal_key_from_keyring(Oid dbOid, Oid spcOid);
 static TDEPrincipalKey *get_principal_key_from_cache(Oid dbOid);
 static void push_principal_key_to_cache(TDEPrincipalKey *principalKey);
 static Datum pg_tde_get_key_info(PG_FUNCTION_ARGS, Oid dbOid, Oid spcOid);
@@ -103,15 +153,24 @@ void InitializePrincipalKeyInfo(void)
 }
 
 /*
- * Lock to guard internal/principal key. Usually, this lock has to be held until
- * the caller fetches an internal_key or rotates the principal.
+ * Lock to guard internal/principal key of the database. Usually, this lock has
+ * to be held until the caller fetches an internal_key or rotates the principal.
+ *
+ * The databases are spread over TDE_LWLOCK_ENC_KEY_PARTITIONS locks, so a key
+ * load or a rotation in one database doesn't stall the others.
  */
 LWLock *
-tde_lwlock_enc_keys(void)
+tde_lwlock_enc_keys(Oid dbOid)
 {
     Assert(principalKeyLocalState.sharedPrincipalKeyState);
 
-    return &principalKeyLocalState.sharedPrincipalKeyState->Locks[TDE_LWLOCK_ENC_KEY].lock;
+    return &principalKeyLocalState.sharedPrincipalKeyState->Locks[TDE_LWLOCK_ENC_KEY + dbOid % TDE_LWLOCK_ENC_KEY_PARTITIONS].lock;
+}
+
+static inline pg_atomic_uint64 *
+principal_key_generation(Oid dbOid)
+{
+    return &principalKeyLocalState.sharedPrincipalKeyState->generations[dbOid % TDE_LWLOCK_ENC_KEY_PARTITIONS];
 }
 
 static Size
@@ -142,6 +201,15 @@ initialize_shared_state(void *start_address)
     principalKeyLocalState.sharedHash = NULL;
 
     sharedState->Locks = GetNamedLWLockTranche(TDE_TRANCHE_NAME);
+    for (int i = 0; i < TDE_LWLOCK_ENC_KEY_PARTITIONS; i++)
+        pg_atomic_init_u64(&sharedState->generations[i], 0);
+
+    SpinLockInit(&sharedState->loadMutex);
+    for (int i = 0; i < PRINCIPAL_KEY_LOAD_SLOTS; i++)
+    {
+        sharedState->loads[i].databaseId = InvalidOid;
+        ConditionVariableInit(&sharedState->loads[i].cv);
+    }
 
     principalKeyLocalState.sharedPrincipalKeyState = sharedState;
     return sizeof(TdePrincipalKeySharedState);
@@ -184,14 +252,7 @@ principal_key_info_attach_shmem(void)
      */
     oldcontext = MemoryContextSwitchTo(TopMemoryContext);
 
-    principalKeyLocalState.dsa = dsa_attach_in_place(principalKeyLocalState.sharedPrincipalKeyState->rawDsaArea,
-                                                  NULL);
-
-    /*
-     * pin the attached area to keep the area attached until end of session or
-     * explicit detach.
-     */
-    dsa_pin_mapping(principalKeyLocalState.dsa);
+    principalKeyLocalState.dsa = TdeGetDsaArea();
 
     principal_key_dsh_params.tranche_id = principalKeyLocalState.sharedPrincipalKeyState->hashTrancheId;
     principalKeyLocalState.sharedHash = dshash_attach(principalKeyLocalState.dsa, &principal_key_dsh_params,
@@ -222,7 +283,7 @@ set_principal_key_with_keyring(const char *key_name, GenericKeyring *keyring,
                             Oid dbOid, Oid spcOid, bool ensure_new_key)
 {
     TDEPrincipalKey *principalKey = NULL;
-    LWLock *lock_files = tde_lwlock_enc_keys();
+    LWLock *lock_files = tde_lwlock_enc_keys(dbOid);
     bool is_dup_key = false;
 
     /*
@@ -366,6 +427,8 @@ RotatePrincipalKey(TDEPrincipalKey *current_key, const char *new_key_name, const
     if (is_rotated && current_key->keyInfo.tablespaceId != GLOBALTABLESPACE_OID) {
         clear_principal_key_cache(current_key->keyInfo.databaseId);
         push_principal_key_to_cache(&new_principal_key);
+        /* The key files were rewritten, reload the relation keys from them */
+        pg_tde_shared_key_cache_evict_db(current_key->keyInfo.databaseId);
     }
 
     MemoryContextSwitchTo(oldCtx);
@@ -384,6 +447,7 @@ xl_tde_perform_rotate_key(XLogPrincipalKeyRotate *xlrec)
 
     ret = pg_tde_write_map_keydata_files(xlrec->map_size, xlrec->buff, xlrec->keydata_size, &xlrec->buff[xlrec->map_size]);
     clear_principal_key_cache(xlrec->databaseId);
+    pg_tde_shared_key_cache_evict_db(xlrec->databaseId);
 
 	return ret;
 }
@@ -464,7 +528,7 @@ GetPrincipalKeyProviderId(void)
     TDEPrincipalKeyInfo *principalKeyInfo = NULL;
     Oid keyringId = InvalidOid;
     Oid dbOid = MyDatabaseId;
-    LWLock *lock_files = tde_lwlock_enc_keys();
+    LWLock *lock_files = tde_lwlock_enc_keys(dbOid);
 
     LWLockAcquire(lock_files, LW_SHARED);
 
@@ -591,6 +655,255 @@ clear_principal_key_cache(Oid databaseId)
     {
         dshash_delete_entry(get_principal_key_Hash(), cache_entry);
     }
+
+    /* Backends drop their copy of the key on next use */
+    pg_atomic_fetch_add_u64(principal_key_generation(databaseId), 1);
+}
+
+/*
+ * Returns the backend copy of the principal key of the database, NULL if there
+ * is none or it is outdated.
+ */
+static TDEPrincipalKey *
+get_principal_key_snapshot(Oid dbOid)
+{
+    PrincipalKeySnapshot *snapshot;
+
+    if (principalKeySnapshots == NULL)
+        return NULL;
+
+    snapshot = hash_search(principalKeySnapshots, &dbOid, HASH_FIND, NULL);
+    if (snapshot == NULL || !snapshot->valid)
+        return NULL;
+
+    if (snapshot->generation != pg_atomic_read_u64(principal_key_generation(dbOid)))
+    {
+        explicit_bzero(&snapshot->key, sizeof(TDEPrincipalKey));
+        snapshot->valid = false;
+        return NULL;
+    }
+
+    return &snapshot->key;
+}
+
+/*
+ * Stores a backend copy of the principal key. The generation must be read
+ * before the key itself.
+ */
+static TDEPrincipalKey *
+set_principal_key_snapshot(TDEPrincipalKey *principalKey, uint64 generation)
+{
+    PrincipalKeySnapshot *snapshot;
+    Oid databaseId = principalKey->keyInfo.databaseId;
+    bool found;
+
+    if (principalKeySnapshots == NULL)
+    {
+        HASHCTL ctl;
+
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(PrincipalKeySnapshot);
+        ctl.hcxt = TopMemoryContext;
+        principalKeySnapshots = hash_create("pg_tde principal key snapshots", 16, &ctl,
+                                            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    snapshot = hash_search(principalKeySnapshots, &databaseId, HASH_ENTER, &found);
+    if (!found)
+    {
+        /* we don't want principal keys to end up paged to the swap */
+        if (mlock(snapshot, sizeof(PrincipalKeySnapshot)) == -1)
+            elog(ERROR, "could not mlock principal key snapshot: %m");
+    }
+
+    memcpy(&snapshot->key, principalKey, sizeof(TDEPrincipalKey));
+    snapshot->generation = generation;
+    snapshot->valid = true;
+
+    return &snapshot->key;
+}
+
+/*
+ * Returns the principal key of the database like GetPrincipalKey(), but
+ * without requiring the caller to hold the key lock. Once the key has been
+ * loaded, this takes no lock at all: the backend keeps a copy of the key and
+ * checks it against the generation of the lock partition of the database.
+ * A rotation doesn't wait for such readers, they get the new key on their
+ * next call.
+ *
+ * The result is only good to check that the database has a principal key.
+ * Key files have to be read under the lock, with GetPrincipalKey().
+ */
+TDEPrincipalKey *
+GetPrincipalKeySnapshot(Oid dbOid, Oid spcOid)
+{
+    TDEPrincipalKey *principalKey;
+
+    if (spcOid != GLOBALTABLESPACE_OID)
+    {
+        principalKey = get_principal_key_snapshot(dbOid);
+        if (likely(principalKey))
+            return principalKey;
+    }
+
+    LWLockAcquire(tde_lwlock_enc_keys(dbOid), LW_SHARED);
+    principalKey = GetPrincipalKey(dbOid, spcOid, LW_SHARED);
+    LWLockRelease(tde_lwlock_enc_keys(dbOid));
+
+    return principalKey;
+}
+
+/*
+ * Returns the principal key of the database from the backend copy or from the
+ * shared cache, NULL if it is in neither. The caller must hold the key lock of
+ * the database.
+ */
+static TDEPrincipalKey *
+lookup_principal_key(Oid dbOid)
+{
+    TDEPrincipalKey *principalKey;
+    uint64 generation;
+
+    principalKey = get_principal_key_snapshot(dbOid);
+    if (likely(principalKey))
+        return principalKey;
+
+    generation = pg_atomic_read_u64(principal_key_generation(dbOid));
+    principalKey = get_principal_key_from_cache(dbOid);
+    if (principalKey)
+        return set_principal_key_snapshot(principalKey, generation);
+
+    return NULL;
+}
+
+/*
+ * Loads the principal key of the database from its keyring into the cache.
+ * Called by GetPrincipalKey() on a cache miss with the key lock of the
+ * database held in LW_SHARED mode, returns with the lock held again.
+ *
+ * The keyring may be slow to answer (Vault is an HTTP round trip), so the
+ * lock is not held meanwhile, and only one backend at a time loads the key
+ * of a given database: the others wait for it on the condition variable of
+ * its load slot, then find the key in the cache. Backends that need the key
+ * of any other database are not affected.
+ */
+static TDEPrincipalKey *
+load_principal_key(Oid dbOid, Oid spcOid)
+{
+    LWLock *lock = tde_lwlock_enc_keys(dbOid);
+    TDEPrincipalKey *principalKey;
+
+    for (;;)
+    {
+        int slot;
+        bool fetched = true;
+
+        LWLockRelease(lock);
+
+        principalKey = NULL;
+        slot = principal_key_load_start(dbOid);
+        if (slot >= 0)
+        {
+            PG_ENSURE_ERROR_CLEANUP(principal_key_load_cleanup, Int32GetDatum(slot));
+            {
+                principalKey = fetch_principal_key(dbOid, spcOid, false);
+            }
+            PG_END_ENSURE_ERROR_CLEANUP(principal_key_load_cleanup, Int32GetDatum(slot));
+            principal_key_load_end(slot);
+            fetched = principalKey != NULL;
+        }
+        else if (slot == PRINCIPAL_KEY_LOAD_NO_SLOT)
+        {
+            principalKey = fetch_principal_key(dbOid, spcOid, false);
+            fetched = principalKey != NULL;
+        }
+
+        /* The key is read from the cache, which may have a newer one */
+        if (principalKey != NULL)
+        {
+            explicit_bzero(principalKey, sizeof(TDEPrincipalKey));
+            pfree(principalKey);
+        }
+
+        LWLockAcquire(lock, LW_SHARED);
+
+        principalKey = lookup_principal_key(dbOid);
+        if (principalKey != NULL || !fetched)
+            return principalKey;
+
+        /*
+         * Either the key we fetched was rotated meanwhile, or the backend we
+         * waited for failed to load it. Try again.
+         */
+    }
+}
+
+/*
+ * Registers the current backend as the loader of the principal key of the
+ * database and returns its load slot. If another backend is loading the key
+ * already, waits for it to finish and returns PRINCIPAL_KEY_LOAD_WAITED. If
+ * all slots are in use, returns PRINCIPAL_KEY_LOAD_NO_SLOT.
+ */
+static int
+principal_key_load_start(Oid dbOid)
+{
+    TdePrincipalKeySharedState *sharedState = principalKeyLocalState.sharedPrincipalKeyState;
+    int busy_slot = -1;
+    int free_slot = PRINCIPAL_KEY_LOAD_NO_SLOT;
+
+    SpinLockAcquire(&sharedState->loadMutex);
+    for (int i = 0; i < PRINCIPAL_KEY_LOAD_SLOTS; i++)
+    {
+        if (sharedState->loads[i].databaseId == dbOid)
+        {
+            busy_slot = i;
+            break;
+        }
+        if (free_slot < 0 && sharedState->loads[i].databaseId == InvalidOid)
+            free_slot = i;
+    }
+    if (busy_slot < 0 && free_slot >= 0)
+        sharedState->loads[free_slot].databaseId = dbOid;
+    SpinLockRelease(&sharedState->loadMutex);
+
+    if (busy_slot < 0)
+        return free_slot;
+
+    ConditionVariablePrepareToSleep(&sharedState->loads[busy_slot].cv);
+    for (;;)
+    {
+        bool done;
+
+        SpinLockAcquire(&sharedState->loadMutex);
+        done = sharedState->loads[busy_slot].databaseId != dbOid;
+        SpinLockRelease(&sharedState->loadMutex);
+
+        if (done)
+            break;
+
+        ConditionVariableSleep(&sharedState->loads[busy_slot].cv, PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+
+    return PRINCIPAL_KEY_LOAD_WAITED;
+}
+
+static void
+principal_key_load_end(int slot)
+{
+    TdePrincipalKeySharedState *sharedState = principalKeyLocalState.sharedPrincipalKeyState;
+
+    SpinLockAcquire(&sharedState->loadMutex);
+    sharedState->loads[slot].databaseId = InvalidOid;
+    SpinLockRelease(&sharedState->loadMutex);
+
+    ConditionVariableBroadcast(&sharedState->loads[slot].cv);
+}
+
+static void
+principal_key_load_cleanup(int code, Datum arg)
+{
+    principal_key_load_end(DatumGetInt32(arg));
 }
 
 /*
@@ -647,10 +960,10 @@ pg_tde_rotate_principal_key_internal(PG_FUNCTION_ARGS)
                             new_provider_name,
                             is_global ? "cluster" : "database")));
 
-	LWLockAcquire(tde_lwlock_enc_keys(), LW_EXCLUSIVE);
+	LWLockAcquire(tde_lwlock_enc_keys(dbOid), LW_EXCLUSIVE);
     current_key = GetPrincipalKey(dbOid, spcOid, LW_EXCLUSIVE);
     ret = RotatePrincipalKey(current_key, new_principal_key_name, new_provider_name, ensure_new_key);
-	LWLockRelease(tde_lwlock_enc_keys());
+	LWLockRelease(tde_lwlock_enc_keys(dbOid));
 
     PG_RETURN_BOOL(ret);
 }
@@ -689,9 +1002,7 @@ pg_tde_get_key_info(PG_FUNCTION_ARGS, Oid dbOid, Oid spcOid)
                 (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
                     errmsg("function returning record called in context that cannot accept type record")));
 
-	LWLockAcquire(tde_lwlock_enc_keys(), LW_SHARED);
-    principal_key = GetPrincipalKey(dbOid, spcOid, LW_SHARED);
-	LWLockRelease(tde_lwlock_enc_keys());
+    principal_key = GetPrincipalKeySnapshot(dbOid, spcOid);
     if (principal_key == NULL)
 	{
 		ereport(ERROR,
@@ -742,22 +1053,45 @@ pg_tde_get_key_info(PG_FUNCTION_ARGS, Oid dbOid, Oid spcOid)
 }
 #endif /* FRONTEND */
 
-/* 
- * Gets principal key form the keyring and pops it into cache if key exists
- * Caller should hold an exclusive tde_lwlock_enc_keys lock
+/*
+ * Fetches the principal key of the database from its keyring and adds it to
+ * the cache. Returns a palloc'd copy of the key, NULL if the database has no
+ * principal key or the keyring doesn't provide it. The key of the global space
+ * is not cached.
+ *
+ * With `locked`, the caller holds the key lock of the database in LW_EXCLUSIVE
+ * mode for the whole fetch. Otherwise the caller must not hold it: the key
+ * info is read under the lock, the keyring is asked without it, and the key is
+ * only added to the cache if it wasn't rotated meanwhile.
  */
-TDEPrincipalKey *
-get_principal_key_from_keyring(Oid dbOid, Oid spcOid)
+static TDEPrincipalKey *
+fetch_principal_key(Oid dbOid, Oid spcOid, bool locked)
 {
+    LWLock *lock = tde_lwlock_enc_keys(dbOid);
     GenericKeyring *keyring;
     TDEPrincipalKey *principalKey = NULL;
     TDEPrincipalKeyInfo *principalKeyInfo = NULL;
     const keyInfo *keyInfo = NULL;
     KeyringReturnCodes keyring_ret;
+#ifndef FRONTEND
+    uint64 generation = 0;
+#endif
 
-    Assert(LWLockHeldByMeInMode(tde_lwlock_enc_keys(), LW_EXCLUSIVE));
+    if (locked)
+    {
+        Assert(LWLockHeldByMeInMode(lock, LW_EXCLUSIVE));
+        principalKeyInfo = pg_tde_get_principal_key_info(dbOid, spcOid);
+    }
+#ifndef FRONTEND
+    else
+    {
+        LWLockAcquire(lock, LW_SHARED);
+        generation = pg_atomic_read_u64(principal_key_generation(dbOid));
+        principalKeyInfo = pg_tde_get_principal_key_info(dbOid, spcOid);
+        LWLockRelease(lock);
+    }
+#endif
 
-    principalKeyInfo = pg_tde_get_principal_key_info(dbOid, spcOid);
     if (principalKeyInfo == NULL)
     {
         return NULL;
@@ -766,12 +1100,14 @@ get_principal_key_from_keyring(Oid dbOid, Oid spcOid)
     keyring = GetKeyProviderByID(principalKeyInfo->keyringId, dbOid, spcOid);
     if (keyring == NULL)
     {
+        pfree(principalKeyInfo);
         return NULL;
     }
 
     keyInfo = KeyringGetKey(keyring, principalKeyInfo->keyId.versioned_name, false, &keyring_ret);
     if (keyInfo == NULL)
     {
+        pfree(principalKeyInfo);
         return NULL;
     }
 
@@ -780,6 +1116,7 @@ get_principal_key_from_keyring(Oid dbOid, Oid spcOid)
     memcpy(&principalKey->keyInfo, principalKeyInfo, sizeof(principalKey->keyInfo));
     memcpy(principalKey->keyData, keyInfo->data.data, keyInfo->data.len);
     principalKey->keyLength = keyInfo->data.len;
+    pfree(principalKeyInfo);
 
     Assert(dbOid == principalKey->keyInfo.databaseId);
 
@@ -787,13 +1124,19 @@ get_principal_key_from_keyring(Oid dbOid, Oid spcOid)
     /* We don't store global space key in cache */
     if (spcOid != GLOBALTABLESPACE_OID)
     {
-        push_principal_key_to_cache(principalKey);
+        if (locked)
+            push_principal_key_to_cache(principalKey);
+        else
+        {
+            /* Don't publish the key if it was rotated while we were fetching it */
+            LWLockAcquire(lock, LW_EXCLUSIVE);
+            if (generation == pg_atomic_read_u64(principal_key_generation(dbOid)))
+                push_principal_key_to_cache(principalKey);
+            LWLockRelease(lock);
+        }
     }
 #endif
 
-    if (principalKeyInfo)
-        pfree(principalKeyInfo);
-
     return principalKey;
 }
 
@@ -804,13 +1147,18 @@ get_principal_key_from_keyring(Oid dbOid, Oid spcOid)
  * When the principal key is not set for the database. The function returns
  * throws an error.
  * 
- * The caller must hold a `tde_lwlock_enc_keys` lock and pass its obtained mode
- * via the `lockMode` param (LW_SHARED or LW_EXCLUSIVE). We expect the key to be
- * most likely in the cache. So the caller should use LW_SHARED if there are no
- * principal key changes planned as this is faster and creates less contention.
- * But if there is no key in the cache, we have to switch the lock 
- * (LWLockRelease + LWLockAcquire) to LW_EXCLUSIVE mode to write the key to the
- * cache.
+ * The caller must hold the `tde_lwlock_enc_keys` lock of the database and pass
+ * its obtained mode via the `lockMode` param (LW_SHARED or LW_EXCLUSIVE). We
+ * expect the key to be most likely in the backend copy or in the cache. So the
+ * caller should use LW_SHARED if there are no principal key changes planned as
+ * this is faster and creates less contention.
+ * But if there is no key in the cache and the lock is held in LW_SHARED mode,
+ * the lock is released while the key is loaded from the keyring (see
+ * load_principal_key()) and taken again, so the caller must not rely on
+ * anything it read under the lock before. A caller holding the lock in
+ * LW_EXCLUSIVE mode keeps it, and the keyring is asked under the lock. The key
+ * of the global space is not cached, for it we have to switch the lock
+ * (LWLockRelease + LWLockAcquire) to LW_EXCLUSIVE mode instead.
  */
 TDEPrincipalKey *
 GetPrincipalKey(Oid dbOid, Oid spcOid, LWLockMode lockMode)
@@ -818,24 +1166,33 @@ GetPrincipalKey(Oid dbOid, Oid spcOid, LWLockMode lockMode)
 #ifndef FRONTEND
     TDEPrincipalKey *principalKey = NULL;
 
-    Assert(LWLockHeldByMeInMode(tde_lwlock_enc_keys(), lockMode));
+    Assert(LWLockHeldByMeInMode(tde_lwlock_enc_keys(dbOid), lockMode));
     /* We don't store global space key in cache */
     if (spcOid != GLOBALTABLESPACE_OID)
     {
-        principalKey = get_principal_key_from_cache(dbOid);
-    }
+        principalKey = lookup_principal_key(dbOid);
+        if (likely(principalKey))
+            return principalKey;
 
-    if (likely(principalKey))
-	{
-        return principalKey;
-	}
+        if (lockMode != LW_EXCLUSIVE)
+            return load_principal_key(dbOid, spcOid);
+
+        principalKey = fetch_principal_key(dbOid, spcOid, true);
+        if (principalKey == NULL)
+            return NULL;
+
+        explicit_bzero(principalKey, sizeof(TDEPrincipalKey));
+        pfree(principalKey);
+
+        return lookup_principal_key(dbOid);
+    }
 
     if (lockMode != LW_EXCLUSIVE)
     {
-        LWLockRelease(tde_lwlock_enc_keys());
-        LWLockAcquire(tde_lwlock_enc_keys(), LW_EXCLUSIVE);
+        LWLockRelease(tde_lwlock_enc_keys(dbOid));
+        LWLockAcquire(tde_lwlock_enc_keys(dbOid), LW_EXCLUSIVE);
     }
 #endif
 
-    return get_principal_key_from_keyring(dbOid, spcOid);
+    return fetch_principal_key(dbOid, spcOid, true);
 }
\ No newline at end of file
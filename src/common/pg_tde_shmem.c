@@ -14,12 +14,16 @@
 #include "common/pg_tde_shmem.h"
 #include "nodes/pg_list.h"
 #include "storage/lwlock.h"
+#include "utils/memutils.h"
+
+#include <sys/mman.h>
 
 typedef struct TdeSharedState
 {
 	LWLock *principalKeyLock;
 	int principalKeyHashTrancheId;
 	void *rawDsaArea; /* DSA area pointer to store cache hashes */
+	Size rawDsaAreaSize; /* size of the part of the area in this struct */
 	dshash_table_handle principalKeyHashHandle;
 } TdeSharedState;
 
@@ -34,6 +38,9 @@ typedef struct TDELocalState
 
 static void tde_shmem_shutdown(int code, Datum arg);
 
+static TdeSharedState *tdeSharedState = NULL;
+static dsa_area *tdeDsaArea = NULL;
+
 List *registeredShmemRequests = NIL;
 bool shmemInited = false;
 
@@ -72,6 +79,7 @@ void TdeShmemInit(void)
 	/* Create or attach to the shared memory state */
 	ereport(NOTICE, (errmsg("TdeShmemInit: requested %ld bytes", required_shmem_size)));
 	tdeState = ShmemInitStruct("pg_tde", required_shmem_size, &found);
+	tdeSharedState = tdeState;
 
 	if (!found)
 	{
@@ -101,6 +109,16 @@ void TdeShmemInit(void)
 		dsa_area_size = required_shmem_size - used_size;
 		Assert(dsa_area_size > 0);
 		tdeState->rawDsaArea = p;
+		tdeState->rawDsaAreaSize = dsa_area_size;
+
+		/*
+		 * Keep the whole struct, including the part of the DSA area placed
+		 * in it, out of swap. The pages stay locked as long as the postmaster
+		 * maps them, so this is done once for all processes.
+		 */
+		if (mlock(tdeState, required_shmem_size) == -1)
+			ereport(WARNING,
+					(errmsg("could not lock pg_tde shared memory: %m")));
 
 		ereport(LOG, (errmsg("creating DSA area of size %lu", dsa_area_size)));
 		dsa = dsa_create_in_place(tdeState->rawDsaArea,
@@ -126,6 +144,43 @@ void TdeShmemInit(void)
 	on_shmem_exit(tde_shmem_shutdown, (Datum)0);
 }
 
+/*
+ * Returns the pg_tde DSA area attached to the current process. A process may
+ * map a DSM segment only once, so all the caches living in the area have to
+ * share this attachment. It stays pinned until the process exits.
+ */
+dsa_area *
+TdeGetDsaArea(void)
+{
+	MemoryContext oldcontext;
+
+	if (tdeDsaArea)
+		return tdeDsaArea;
+
+	Assert(tdeSharedState != NULL);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	tdeDsaArea = dsa_attach_in_place(tdeSharedState->rawDsaArea, NULL);
+	dsa_pin_mapping(tdeDsaArea);
+	MemoryContextSwitchTo(oldcontext);
+
+	return tdeDsaArea;
+}
+
+/*
+ * Returns true if the object lies in the part of the pg_tde DSA area placed
+ * in the main shared memory, which is locked in memory. Once that part is
+ * full, the area grows into DSM segments that are not.
+ */
+bool
+TdeDsaAddressIsLocked(const void *ptr, Size size)
+{
+	const char *start = (const char *) tdeSharedState->rawDsaArea;
+
+	return (const char *) ptr >= start &&
+		(const char *) ptr + size <= start + tdeSharedState->rawDsaAreaSize;
+}
+
 static void
 tde_shmem_shutdown(int code, Datum arg)
 {
@@ -3,6 +3,7 @@
 #include "postgres.h"
 #else
 #include <assert.h>
+#include <stdbool.h>
 #define Assert(p) assert(p)
 #endif
 
@@ -15,10 +16,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
 
 /* Implementation notes
  * =====================
@@ -44,10 +49,142 @@
  */
 
 
+/*
+ * Hardware CTR keystream kernels
+ * ===============================
+ *
+ * On x86-64 we don't go through OpenSSL for the CTR keystream at all. The
+ * round keys are expanded once per relation key and kept next to it (see
+ * AesKeyCtx), the counter blocks are built in registers and 8 AES-NI blocks
+ * (or 4x4 blocks with VAES on AVX-512 hosts) are kept in flight, so the
+ * pipelined AES units are saturated. The result is stored (or XORed into the
+ * data) directly, without any intermediate counter buffer.
+ *
+ * The counter block layout is exactly the same as in the OpenSSL-based path:
+ * 12 bytes of the IV prefix followed by the 4 byte block counter in the CPU
+ * byte order, so both paths produce identical keystreams.
+ */
+#if (defined(__x86_64__) || defined(_M_AMD64)) && (defined(__GNUC__) || defined(__clang__))
+#define USE_AES_HW_KERNELS 1
+#endif
+
+#ifdef USE_AES_HW_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AES_TARGET_NI		__attribute__((target("aes,sse4.1")))
+#define AES_TARGET_VAES		__attribute__((target("aes,sse4.1,avx512f,vaes")))
+#define AES_TARGET_AVX2		__attribute__((target("avx2")))
+#define AES_TARGET_AVX512	__attribute__((target("avx512f")))
+
+/*
+ * The kernels rely on the per-round and per-block loops being fully
+ * unrolled, so all the blocks in flight and the round keys stay in
+ * registers. -O2 doesn't do it on its own.
+ */
+#define AES_UNROLL			_Pragma("GCC unroll 16")
+#endif
+
+#define AES128_ROUNDS		10
+
+/*
+ * Per-key encryption state, kept in InternalKey.ctx.
+ *
+ * It is allocated on the first use of the key in the backend and lives as
+ * long as the key stays in the backend's key cache. Expanded round keys are
+ * as sensitive as the key itself, so the memory is locked in RAM.
+ */
+typedef struct AesKeyCtx
+{
+	unsigned char	round_keys[(AES128_ROUNDS + 1) * AES_BLOCK_SIZE];
+	unsigned char	dec_round_keys[(AES128_ROUNDS + 1) * AES_BLOCK_SIZE];
+	EVP_CIPHER_CTX *ecb_ctx;	/* used by the OpenSSL fallback only */
+	EVP_CIPHER_CTX *cbc_enc_ctx;	/* page encryption, see AesEncryptWithCtx */
+	EVP_CIPHER_CTX *cbc_dec_ctx;	/* page decryption, see AesDecryptWithCtx */
+	EVP_CIPHER_CTX *xts_enc_ctx;	/* see AesXtsEncryptWithCtx */
+	EVP_CIPHER_CTX *xts_dec_ctx;	/* see AesXtsDecryptWithCtx */
+} AesKeyCtx;
+
+/*
+ * Kernel registry
+ * ===============
+ *
+ * Every operation has a few implementations. AesSetKernel() picks one per
+ * operation based on the CPU features (probed once) or pins the ones
+ * requested by the pg_tde.crypto_kernel GUC:
+ *
+ *                  CTR keystream   CBC pages   XOR
+ *   openssl        openssl         openssl     scalar
+ *   aesni          aesni           aesni       sse2
+ *   vaes           vaes            aesni       avx512
+ *   auto           the best one the CPU supports, for each operation
+ *
+ * XTS always goes through OpenSSL, which already uses AES-NI/VAES for it.
+ */
+typedef enum AesCtrKernel
+{
+	AES_CTR_KERNEL_OPENSSL = 0,
+	AES_CTR_KERNEL_AESNI,
+	AES_CTR_KERNEL_VAES
+} AesCtrKernel;
+
+typedef enum AesCbcKernel
+{
+	AES_CBC_KERNEL_OPENSSL = 0,
+	AES_CBC_KERNEL_AESNI
+} AesCbcKernel;
+
+typedef enum AesXorKernel
+{
+	AES_XOR_KERNEL_SCALAR = 0,
+	AES_XOR_KERNEL_SSE2,
+	AES_XOR_KERNEL_AVX2,
+	AES_XOR_KERNEL_AVX512
+} AesXorKernel;
+
+static const char *const aes_ctr_kernel_names[] = {"openssl", "aesni", "vaes"};
+static const char *const aes_cbc_kernel_names[] = {"openssl", "aesni"};
+static const char *const aes_xor_kernel_names[] = {"scalar", "sse2", "avx2", "avx512"};
+
 const EVP_CIPHER* cipher = NULL;
 const EVP_CIPHER* cipher2 = NULL;
+const EVP_CIPHER* cipher_xts = NULL;
 int cipher_block_size = 0;
 
+/* CPU features, see aes_probe_cpu() */
+static bool aes_cpu_probed = false;
+static bool aes_cpu_aesni = false;	/* AES-NI and SSE4.1 */
+static bool aes_cpu_vaes = false;	/* VAES and AVX-512F, enabled by the OS */
+static bool aes_cpu_avx2 = false;
+static bool aes_cpu_avx512 = false;
+static bool aes_cpu_pclmul = false;
+
+static bool aes_kernel_selected = false;
+static AesCtrKernel aes_ctr_kernel = AES_CTR_KERNEL_OPENSSL;
+static AesCbcKernel aes_cbc_kernel = AES_CBC_KERNEL_OPENSSL;
+static AesXorKernel aes_xor_kernel = AES_XOR_KERNEL_SCALAR;
+
+/*
+ * The key contexts are carved out of locked segments of whole pages, and
+ * recycled through a free list rather than unlocked: mlock isn't reference
+ * counted, unlocking a context would unlock its neighbours on the page too.
+ */
+#define AES_KEY_ARENA_SEGMENT_SIZE	(64 * 1024)
+
+typedef union AesKeyArenaChunk
+{
+	AesKeyCtx	ctx;
+	union AesKeyArenaChunk *next;	/* while on the free list */
+} AesKeyArenaChunk;
+
+static AesKeyArenaChunk *aes_key_arena_free = NULL;
+static bool aes_key_arena_lock_failed = false;
+
+static void aes_probe_cpu(void);
+static AesKeyCtx *aes_key_arena_alloc(void);
+static AesKeyCtx *aes_get_key_ctx(AesKeyCtx **ctxPtr, const unsigned char *key);
+static void aes_prepare_ecb_ctx(AesKeyCtx *ctx, int enc, const unsigned char *key, const unsigned char *iv);
+
 void AesInit(void)
 {
 	static int initialized = 0;
@@ -56,39 +193,719 @@ void AesInit(void)
 		OpenSSL_add_all_algorithms();
 		ERR_load_crypto_strings();
 	
-		cipher = EVP_aes_128_cbc();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		/*
+		 * Fetch the ciphers once. Passing the legacy EVP_aes_128_*() objects
+		 * to EVP_CipherInit_ex makes OpenSSL 3 do an implicit (and costly)
+		 * provider fetch on every init.
+		 */
+		cipher = EVP_CIPHER_fetch(NULL, "AES-128-CBC", NULL);
+		cipher2 = EVP_CIPHER_fetch(NULL, "AES-128-ECB", NULL);
+		cipher_xts = EVP_CIPHER_fetch(NULL, "AES-128-XTS", NULL);
+#endif
+		if (cipher == NULL)
+			cipher = EVP_aes_128_cbc();
+		if (cipher2 == NULL)
+			cipher2 = EVP_aes_128_ecb();
+		if (cipher_xts == NULL)
+			cipher_xts = EVP_aes_128_xts();
 		cipher_block_size = EVP_CIPHER_block_size(cipher); // == buffer size
-		cipher2 = EVP_aes_128_ecb();
+
+		/* Kernels could be already pinned by the GUC */
+		if (!aes_kernel_selected)
+			AesSetKernel(AES_KERNEL_AUTO);
 
 		initialized = 1;
 	}
 }
 
-// TODO: a few things could be optimized in this. It's good enough for a prototype.
+/*
+ * Returns true if the kernel (AES_KERNEL_*) can run on this CPU.
+ */
+bool
+AesKernelIsSupported(int kernel)
+{
+	aes_probe_cpu();
+
+	switch (kernel)
+	{
+		case AES_KERNEL_AUTO:
+		case AES_KERNEL_OPENSSL:
+			return true;
+		case AES_KERNEL_AESNI:
+			return aes_cpu_aesni;
+		case AES_KERNEL_VAES:
+			return aes_cpu_vaes;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Selects the implementation of every operation. An unsupported kernel
+ * falls back to AES_KERNEL_AUTO, callers are expected to check it with
+ * AesKernelIsSupported() first.
+ *
+ * Keys can be used with any kernel, so it is safe to switch kernels at any
+ * time.
+ */
+void
+AesSetKernel(int kernel)
+{
+	if (!AesKernelIsSupported(kernel))
+		kernel = AES_KERNEL_AUTO;
+
+	switch (kernel)
+	{
+		case AES_KERNEL_OPENSSL:
+			aes_ctr_kernel = AES_CTR_KERNEL_OPENSSL;
+			aes_cbc_kernel = AES_CBC_KERNEL_OPENSSL;
+			aes_xor_kernel = AES_XOR_KERNEL_SCALAR;
+			break;
+		case AES_KERNEL_AESNI:
+			aes_ctr_kernel = AES_CTR_KERNEL_AESNI;
+			aes_cbc_kernel = AES_CBC_KERNEL_AESNI;
+			aes_xor_kernel = AES_XOR_KERNEL_SSE2;
+			break;
+		case AES_KERNEL_VAES:
+			aes_ctr_kernel = AES_CTR_KERNEL_VAES;
+			aes_cbc_kernel = AES_CBC_KERNEL_AESNI;
+			aes_xor_kernel = AES_XOR_KERNEL_AVX512;
+			break;
+		default:
+			aes_ctr_kernel = aes_cpu_vaes ? AES_CTR_KERNEL_VAES :
+				aes_cpu_aesni ? AES_CTR_KERNEL_AESNI : AES_CTR_KERNEL_OPENSSL;
+			aes_cbc_kernel = aes_cpu_aesni ? AES_CBC_KERNEL_AESNI : AES_CBC_KERNEL_OPENSSL;
+#ifdef USE_AES_HW_KERNELS
+			/* SSE2 is part of the x86-64 baseline */
+			aes_xor_kernel = aes_cpu_avx512 ? AES_XOR_KERNEL_AVX512 :
+				aes_cpu_avx2 ? AES_XOR_KERNEL_AVX2 : AES_XOR_KERNEL_SSE2;
+#else
+			aes_xor_kernel = AES_XOR_KERNEL_SCALAR;
+#endif
+			break;
+	}
+
+	aes_kernel_selected = true;
+}
+
+/*
+ * Describes the active kernels and the relevant CPU features, e.g.
+ * "ctr=vaes cbc=aesni xor=avx512 (cpu: aes vaes avx2 avx512f pclmul)".
+ */
+void
+AesDescribeKernels(char *buf, size_t len)
+{
+	aes_probe_cpu();
+
+	snprintf(buf, len, "ctr=%s cbc=%s xor=%s (cpu:%s%s%s%s%s)",
+			 aes_ctr_kernel_names[aes_ctr_kernel],
+			 aes_cbc_kernel_names[aes_cbc_kernel],
+			 aes_xor_kernel_names[aes_xor_kernel],
+			 aes_cpu_aesni ? " aes" : "",
+			 aes_cpu_vaes ? " vaes" : "",
+			 aes_cpu_avx2 ? " avx2" : "",
+			 aes_cpu_avx512 ? " avx512f" : "",
+			 aes_cpu_pclmul ? " pclmul" : "");
+}
+
+#ifdef USE_AES_HW_KERNELS
+
+/*
+ * Checks if the OS saves the given XCR0 state components on context switch,
+ * i.e. if it is safe to use the wider registers.
+ */
+static bool
+aes_os_supports_xsave_state(uint32_t mask)
+{
+	uint32_t	xcr0_lo;
+	uint32_t	xcr0_hi;
+
+	__asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+
+	return (xcr0_lo & mask) == mask;
+}
+
 static void
-AesRunCtr(EVP_CIPHER_CTX** ctxPtr, int enc, const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len)
+aes_probe_cpu(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	bool		has_osxsave;
+	bool		has_ymm;
+	bool		has_zmm;
+
+	if (aes_cpu_probed)
+		return;
+	aes_cpu_probed = true;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+
+	aes_cpu_aesni = (ecx & bit_AES) && (ecx & bit_SSE4_1);
+	aes_cpu_pclmul = (ecx & bit_PCLMUL) != 0;
+	has_osxsave = (ecx & bit_OSXSAVE) != 0;
+
+	if (!has_osxsave || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return;
+
+	/* YMM state; ZMM and opmask states for AVX-512 */
+	has_ymm = aes_os_supports_xsave_state(0x06);
+	has_zmm = aes_os_supports_xsave_state(0xE6);
+
+	aes_cpu_avx2 = has_ymm && (ebx & bit_AVX2);
+	aes_cpu_avx512 = has_zmm && (ebx & bit_AVX512F);
+	aes_cpu_vaes = aes_cpu_aesni && aes_cpu_avx512 && (ecx & bit_VAES);
+}
+
+#define AES128_KEY_EXPAND_STEP(_key, _rcon) \
+	aes128_key_expand_step(_key, _mm_aeskeygenassist_si128(_key, _rcon))
+
+static inline AES_TARGET_NI __m128i
+aes128_key_expand_step(__m128i key, __m128i keygened)
+{
+	keygened = _mm_shuffle_epi32(keygened, _MM_SHUFFLE(3, 3, 3, 3));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, keygened);
+}
+
+/*
+ * Expands the encryption round keys and, for the CBC decryption, the
+ * equivalent inverse cipher round keys.
+ */
+static AES_TARGET_NI void
+aesni_expand_key128(const unsigned char *key, unsigned char *round_keys, unsigned char *dec_round_keys)
+{
+	__m128i		rk[AES128_ROUNDS + 1];
+
+	rk[0] = _mm_loadu_si128((const __m128i *) key);
+	rk[1] = AES128_KEY_EXPAND_STEP(rk[0], 0x01);
+	rk[2] = AES128_KEY_EXPAND_STEP(rk[1], 0x02);
+	rk[3] = AES128_KEY_EXPAND_STEP(rk[2], 0x04);
+	rk[4] = AES128_KEY_EXPAND_STEP(rk[3], 0x08);
+	rk[5] = AES128_KEY_EXPAND_STEP(rk[4], 0x10);
+	rk[6] = AES128_KEY_EXPAND_STEP(rk[5], 0x20);
+	rk[7] = AES128_KEY_EXPAND_STEP(rk[6], 0x40);
+	rk[8] = AES128_KEY_EXPAND_STEP(rk[7], 0x80);
+	rk[9] = AES128_KEY_EXPAND_STEP(rk[8], 0x1B);
+	rk[10] = AES128_KEY_EXPAND_STEP(rk[9], 0x36);
+
+	AES_UNROLL
+	for (int i = 0; i <= AES128_ROUNDS; i++)
+		_mm_storeu_si128((__m128i *) (round_keys + i * AES_BLOCK_SIZE), rk[i]);
+
+	_mm_storeu_si128((__m128i *) dec_round_keys, rk[AES128_ROUNDS]);
+	AES_UNROLL
+	for (int i = 1; i < AES128_ROUNDS; i++)
+		_mm_storeu_si128((__m128i *) (dec_round_keys + i * AES_BLOCK_SIZE),
+						 _mm_aesimc_si128(rk[AES128_ROUNDS - i]));
+	_mm_storeu_si128((__m128i *) (dec_round_keys + AES128_ROUNDS * AES_BLOCK_SIZE), rk[0]);
+
+	/* don't leave key material on the stack */
+	memset(rk, 0, sizeof(rk));
+	__asm__ __volatile__("" : : "r"(rk) : "memory");
+}
+
+/*
+ * Builds the first counter block: 12 bytes of the IV prefix and a 32-bit
+ * counter in the CPU byte order in the last lane.
+ */
+static inline AES_TARGET_NI __m128i
+aesni_ctr_first_block(const char *iv_prefix, uint32_t counter)
+{
+	unsigned char block[AES_BLOCK_SIZE];
+
+	memcpy(block, iv_prefix, 12);
+	memcpy(block + 12, &counter, sizeof(counter));
+
+	return _mm_loadu_si128((const __m128i *) block);
+}
+
+/*
+ * AES-128-CTR with 8 blocks in flight. Writes the keystream into `out` if
+ * `in` is NULL, otherwise XORs the keystream with `in` into `out` (`in` and
+ * `out` may be the same buffer).
+ */
+static AES_TARGET_NI void
+aesni_ctr128(const unsigned char *round_keys, const char *iv_prefix, uint32_t counter,
+			 size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+	__m128i		rk[AES128_ROUNDS + 1];
+	__m128i		ctr = aesni_ctr_first_block(iv_prefix, counter);
+	const __m128i one = _mm_set_epi32(1, 0, 0, 0);
+	const __m128i eight = _mm_set_epi32(8, 0, 0, 0);
+
+	AES_UNROLL
+	for (int i = 0; i <= AES128_ROUNDS; i++)
+		rk[i] = _mm_loadu_si128((const __m128i *) (round_keys + i * AES_BLOCK_SIZE));
+
+	while (nblocks >= 8)
+	{
+		__m128i		b[8];
+
+		b[0] = ctr;
+		AES_UNROLL
+		for (int i = 1; i < 8; i++)
+			b[i] = _mm_add_epi32(b[i - 1], one);
+		ctr = _mm_add_epi32(ctr, eight);
+
+		AES_UNROLL
+		for (int i = 0; i < 8; i++)
+			b[i] = _mm_xor_si128(b[i], rk[0]);
+		AES_UNROLL
+		for (int r = 1; r < AES128_ROUNDS; r++)
+			AES_UNROLL
+			for (int i = 0; i < 8; i++)
+				b[i] = _mm_aesenc_si128(b[i], rk[r]);
+		AES_UNROLL
+		for (int i = 0; i < 8; i++)
+			b[i] = _mm_aesenclast_si128(b[i], rk[AES128_ROUNDS]);
+
+		if (in != NULL)
+		{
+			AES_UNROLL
+			for (int i = 0; i < 8; i++)
+				b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *) (in + i * AES_BLOCK_SIZE)));
+			in += 8 * AES_BLOCK_SIZE;
+		}
+		AES_UNROLL
+		for (int i = 0; i < 8; i++)
+			_mm_storeu_si128((__m128i *) (out + i * AES_BLOCK_SIZE), b[i]);
+
+		out += 8 * AES_BLOCK_SIZE;
+		nblocks -= 8;
+	}
+
+	while (nblocks > 0)
+	{
+		__m128i		b = _mm_xor_si128(ctr, rk[0]);
+
+		ctr = _mm_add_epi32(ctr, one);
+
+		AES_UNROLL
+		for (int r = 1; r < AES128_ROUNDS; r++)
+			b = _mm_aesenc_si128(b, rk[r]);
+		b = _mm_aesenclast_si128(b, rk[AES128_ROUNDS]);
+
+		if (in != NULL)
+		{
+			b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *) in));
+			in += AES_BLOCK_SIZE;
+		}
+		_mm_storeu_si128((__m128i *) out, b);
+
+		out += AES_BLOCK_SIZE;
+		nblocks--;
+	}
+}
+
+/*
+ * AES-128-CBC encryption. Each block depends on the previous one, so there
+ * is nothing to interleave, but we skip the EVP machinery.
+ */
+static AES_TARGET_NI void
+aesni_cbc128_encrypt(const unsigned char *round_keys, const unsigned char *iv,
+					 size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+	__m128i		rk[AES128_ROUNDS + 1];
+	__m128i		b = _mm_loadu_si128((const __m128i *) iv);
+
+	AES_UNROLL
+	for (int i = 0; i <= AES128_ROUNDS; i++)
+		rk[i] = _mm_loadu_si128((const __m128i *) (round_keys + i * AES_BLOCK_SIZE));
+
+	for (size_t n = 0; n < nblocks; n++)
+	{
+		b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *) (in + n * AES_BLOCK_SIZE)));
+		b = _mm_xor_si128(b, rk[0]);
+		AES_UNROLL
+		for (int r = 1; r < AES128_ROUNDS; r++)
+			b = _mm_aesenc_si128(b, rk[r]);
+		b = _mm_aesenclast_si128(b, rk[AES128_ROUNDS]);
+		_mm_storeu_si128((__m128i *) (out + n * AES_BLOCK_SIZE), b);
+	}
+}
+
+/*
+ * AES-128-CBC decryption, 8 blocks in flight. `in` and `out` may be the same
+ * buffer: all the ciphertext blocks of a group are loaded before any of them
+ * is overwritten.
+ */
+static AES_TARGET_NI void
+aesni_cbc128_decrypt(const unsigned char *dec_round_keys, const unsigned char *iv,
+					 size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+	__m128i		rk[AES128_ROUNDS + 1];
+	__m128i		prev = _mm_loadu_si128((const __m128i *) iv);
+
+	AES_UNROLL
+	for (int i = 0; i <= AES128_ROUNDS; i++)
+		rk[i] = _mm_loadu_si128((const __m128i *) (dec_round_keys + i * AES_BLOCK_SIZE));
+
+	while (nblocks >= 8)
+	{
+		__m128i		c[8];
+		__m128i		b[8];
+
+		AES_UNROLL
+		for (int i = 0; i < 8; i++)
+		{
+			c[i] = _mm_loadu_si128((const __m128i *) (in + i * AES_BLOCK_SIZE));
+			b[i] = _mm_xor_si128(c[i], rk[0]);
+		}
+		AES_UNROLL
+		for (int r = 1; r < AES128_ROUNDS; r++)
+			AES_UNROLL
+			for (int i = 0; i < 8; i++)
+				b[i] = _mm_aesdec_si128(b[i], rk[r]);
+		AES_UNROLL
+		for (int i = 0; i < 8; i++)
+			b[i] = _mm_aesdeclast_si128(b[i], rk[AES128_ROUNDS]);
+
+		_mm_storeu_si128((__m128i *) out, _mm_xor_si128(b[0], prev));
+		AES_UNROLL
+		for (int i = 1; i < 8; i++)
+			_mm_storeu_si128((__m128i *) (out + i * AES_BLOCK_SIZE), _mm_xor_si128(b[i], c[i - 1]));
+		prev = c[7];
+
+		in += 8 * AES_BLOCK_SIZE;
+		out += 8 * AES_BLOCK_SIZE;
+		nblocks -= 8;
+	}
+
+	while (nblocks > 0)
+	{
+		__m128i		c = _mm_loadu_si128((const __m128i *) in);
+		__m128i		b = _mm_xor_si128(c, rk[0]);
+
+		AES_UNROLL
+		for (int r = 1; r < AES128_ROUNDS; r++)
+			b = _mm_aesdec_si128(b, rk[r]);
+		b = _mm_aesdeclast_si128(b, rk[AES128_ROUNDS]);
+		_mm_storeu_si128((__m128i *) out, _mm_xor_si128(b, prev));
+		prev = c;
+
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+		nblocks--;
+	}
+}
+
+/*
+ * Same as aesni_ctr128() but with VAES: four 512-bit registers hold 16
+ * blocks in flight. The remainder (less than 16 blocks) goes through the
+ * AES-NI kernel.
+ */
+static AES_TARGET_VAES void
+vaes_ctr128(const unsigned char *round_keys, const char *iv_prefix, uint32_t counter,
+			size_t nblocks, const unsigned char *in, unsigned char *out)
+{
+	__m512i		rk[AES128_ROUNDS + 1];
+	__m512i		ctr;
+	const __m512i four = _mm512_set_epi32(4, 0, 0, 0, 4, 0, 0, 0,
+										  4, 0, 0, 0, 4, 0, 0, 0);
+	size_t		done = 0;
+
+	if (nblocks < 16)
+	{
+		aesni_ctr128(round_keys, iv_prefix, counter, nblocks, in, out);
+		return;
+	}
+
+	AES_UNROLL
+	for (int i = 0; i <= AES128_ROUNDS; i++)
+		rk[i] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) (round_keys + i * AES_BLOCK_SIZE)));
+
+	ctr = _mm512_add_epi32(_mm512_broadcast_i32x4(aesni_ctr_first_block(iv_prefix, counter)),
+						   _mm512_set_epi32(3, 0, 0, 0, 2, 0, 0, 0,
+											1, 0, 0, 0, 0, 0, 0, 0));
+
+	while (nblocks - done >= 16)
+	{
+		__m512i		b[4];
+
+		b[0] = ctr;
+		b[1] = _mm512_add_epi32(b[0], four);
+		b[2] = _mm512_add_epi32(b[1], four);
+		b[3] = _mm512_add_epi32(b[2], four);
+		ctr = _mm512_add_epi32(b[3], four);
+
+		AES_UNROLL
+		for (int i = 0; i < 4; i++)
+			b[i] = _mm512_xor_si512(b[i], rk[0]);
+		AES_UNROLL
+		for (int r = 1; r < AES128_ROUNDS; r++)
+			AES_UNROLL
+			for (int i = 0; i < 4; i++)
+				b[i] = _mm512_aesenc_epi128(b[i], rk[r]);
+		AES_UNROLL
+		for (int i = 0; i < 4; i++)
+			b[i] = _mm512_aesenclast_epi128(b[i], rk[AES128_ROUNDS]);
+
+		if (in != NULL)
+		{
+			AES_UNROLL
+			for (int i = 0; i < 4; i++)
+				b[i] = _mm512_xor_si512(b[i], _mm512_loadu_si512((const void *) (in + (done + i * 4) * AES_BLOCK_SIZE)));
+		}
+		AES_UNROLL
+		for (int i = 0; i < 4; i++)
+			_mm512_storeu_si512((void *) (out + (done + i * 4) * AES_BLOCK_SIZE), b[i]);
+
+		done += 16;
+	}
+
+	if (done < nblocks)
+		aesni_ctr128(round_keys, iv_prefix, counter + (uint32_t) done, nblocks - done,
+					 in != NULL ? in + done * AES_BLOCK_SIZE : NULL,
+					 out + done * AES_BLOCK_SIZE);
+}
+
+static void
+sse2_xor_bytes(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t		i = 0;
+
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *) (out + i),
+						 _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)),
+									   _mm_loadu_si128((const __m128i *) (b + i))));
+	for (; i < len; i++)
+		out[i] = a[i] ^ b[i];
+}
+
+static AES_TARGET_AVX2 void
+avx2_xor_bytes(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t		i = 0;
+
+	for (; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i *) (out + i),
+							_mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)),
+											 _mm256_loadu_si256((const __m256i *) (b + i))));
+	sse2_xor_bytes(out + i, a + i, b + i, len - i);
+}
+
+static AES_TARGET_AVX512 void
+avx512_xor_bytes(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t		i = 0;
+
+	for (; i + 64 <= len; i += 64)
+		_mm512_storeu_si512((void *) (out + i),
+							_mm512_xor_si512(_mm512_loadu_si512((const void *) (a + i)),
+											 _mm512_loadu_si512((const void *) (b + i))));
+	sse2_xor_bytes(out + i, a + i, b + i, len - i);
+}
+
+#else							/* !USE_AES_HW_KERNELS */
+
+static void
+aes_probe_cpu(void)
+{
+	aes_cpu_probed = true;
+}
+
+#endif							/* USE_AES_HW_KERNELS */
+
+static void
+scalar_xor_bytes(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t		i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+	{
+		uint64_t	wa;
+		uint64_t	wb;
+
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		wa ^= wb;
+		memcpy(out + i, &wa, sizeof(wa));
+	}
+	for (; i < len; i++)
+		out[i] = a[i] ^ b[i];
+}
+
+/*
+ * out = a XOR b, `len` bytes. `out` may be the same as `a` or `b`.
+ */
+void
+AesXorBytes(unsigned char *out, const unsigned char *a, const unsigned char *b, size_t len)
 {
-	if (*ctxPtr == NULL)
+	switch (aes_xor_kernel)
 	{
-		*ctxPtr = EVP_CIPHER_CTX_new();
-		EVP_CIPHER_CTX_init(*ctxPtr);
-		
-		if(EVP_CipherInit_ex(*ctxPtr, cipher2, NULL, key, iv, enc) == 0)
+#ifdef USE_AES_HW_KERNELS
+		case AES_XOR_KERNEL_AVX512:
+			avx512_xor_bytes(out, a, b, len);
+			return;
+		case AES_XOR_KERNEL_AVX2:
+			avx2_xor_bytes(out, a, b, len);
+			return;
+		case AES_XOR_KERNEL_SSE2:
+			sse2_xor_bytes(out, a, b, len);
+			return;
+#endif
+		default:
+			scalar_xor_bytes(out, a, b, len);
+			return;
+	}
+}
+
+/*
+ * Takes a zeroed key context from the arena, adding a segment if needed.
+ *
+ * Contexts are created on the first use of a key, possibly inside a critical
+ * section (XLogWrite), so failing to lock a segment is only reported once and
+ * the segment used anyway.
+ */
+static AesKeyCtx *
+aes_key_arena_alloc(void)
+{
+	AesKeyArenaChunk *chunk;
+
+	if (aes_key_arena_free == NULL)
+	{
+		char	   *segment;
+		size_t		nchunks = AES_KEY_ARENA_SEGMENT_SIZE / sizeof(AesKeyArenaChunk);
+
+		if (posix_memalign((void **) &segment, AES_KEY_ARENA_SEGMENT_SIZE, AES_KEY_ARENA_SEGMENT_SIZE) != 0)
 		{
 			#ifdef FRONTEND
-				fprintf(stderr, "ERROR: EVP_CipherInit_ex failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+				fprintf(stderr, "ERROR: out of memory\n");
+				exit(1);
 			#else
 				ereport(ERROR,
-					(errmsg("EVP_CipherInit_ex failed. OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))));
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory")));
 			#endif
+		}
 
-			return;
+		/* we don't want expanded keys to end up paged to the swap */
+		if (mlock(segment, AES_KEY_ARENA_SEGMENT_SIZE) == -1 && !aes_key_arena_lock_failed)
+		{
+			aes_key_arena_lock_failed = true;
+			#ifdef FRONTEND
+				fprintf(stderr, "WARNING: could not mlock internal key contexts: %s\n", strerror(errno));
+			#else
+				elog(WARNING, "could not mlock internal key contexts: %m");
+			#endif
+		}
+
+		for (size_t i = 0; i < nchunks; i++)
+		{
+			chunk = (AesKeyArenaChunk *) (segment + i * sizeof(AesKeyArenaChunk));
+			chunk->next = aes_key_arena_free;
+			aes_key_arena_free = chunk;
 		}
+	}
+
+	chunk = aes_key_arena_free;
+	aes_key_arena_free = chunk->next;
+
+	memset(chunk, 0, sizeof(AesKeyArenaChunk));
+	return &chunk->ctx;
+}
+
+/*
+ * Returns the per-key state, creating it on the first use of the key.
+ */
+static AesKeyCtx *
+aes_get_key_ctx(AesKeyCtx **ctxPtr, const unsigned char *key)
+{
+	AesKeyCtx  *ctx = *ctxPtr;
+
+	if (ctx != NULL)
+		return ctx;
+
+	ctx = aes_key_arena_alloc();
+
+#ifdef USE_AES_HW_KERNELS
+	/* Done regardless of the active kernel, so the kernel can be switched */
+	if (aes_cpu_aesni)
+		aesni_expand_key128(key, ctx->round_keys, ctx->dec_round_keys);
+#endif
+
+	*ctxPtr = ctx;
+	return ctx;
+}
+
+/*
+ * Creates the per-key state ahead of its first use, for the callers which
+ * will use the key where errors must not happen (a critical section). The
+ * OpenSSL context of the CTR fallback is set up as well, so encrypting with
+ * the key allocates nothing.
+ */
+void
+AesPrepareKeyCtx(void **ctxPtr, const unsigned char *key)
+{
+	AesKeyCtx  *ctx = aes_get_key_ctx((AesKeyCtx **) ctxPtr, key);
+
+	aes_prepare_ecb_ctx(ctx, 1, key, NULL);
+}
+
+/*
+ * Frees the per-key state created by the *WithCtx functions, wiping the
+ * expanded keys. *ctxPtr may be NULL and is reset to NULL.
+ */
+void
+AesFreeKeyCtx(void **ctxPtr)
+{
+	AesKeyCtx  *ctx = (AesKeyCtx *) *ctxPtr;
+	AesKeyArenaChunk *chunk = (AesKeyArenaChunk *) ctx;
+
+	if (ctx == NULL)
+		return;
+
+	EVP_CIPHER_CTX_free(ctx->ecb_ctx);
+	EVP_CIPHER_CTX_free(ctx->cbc_enc_ctx);
+	EVP_CIPHER_CTX_free(ctx->cbc_dec_ctx);
+	EVP_CIPHER_CTX_free(ctx->xts_enc_ctx);
+	EVP_CIPHER_CTX_free(ctx->xts_dec_ctx);
 
-		EVP_CIPHER_CTX_set_padding(*ctxPtr, 0);
+	/* The segment stays locked, the chunk goes back to the free list */
+	explicit_bzero(chunk, sizeof(AesKeyArenaChunk));
+	chunk->next = aes_key_arena_free;
+	aes_key_arena_free = chunk;
+
+	*ctxPtr = NULL;
+}
+
+/*
+ * Sets up the OpenSSL context of the key used by the CTR fallback.
+ */
+static void
+aes_prepare_ecb_ctx(AesKeyCtx *ctx, int enc, const unsigned char *key, const unsigned char *iv)
+{
+	if (ctx->ecb_ctx != NULL)
+		return;
+
+	ctx->ecb_ctx = EVP_CIPHER_CTX_new();
+	EVP_CIPHER_CTX_init(ctx->ecb_ctx);
+	
+	if(EVP_CipherInit_ex(ctx->ecb_ctx, cipher2, NULL, key, iv, enc) == 0)
+	{
+		#ifdef FRONTEND
+			fprintf(stderr, "ERROR: EVP_CipherInit_ex failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		#else
+			ereport(ERROR,
+				(errmsg("EVP_CipherInit_ex failed. OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))));
+		#endif
+
+		return;
 	}
 
-	if(EVP_CipherUpdate(*ctxPtr, out, out_len, in, in_len) == 0)
+	EVP_CIPHER_CTX_set_padding(ctx->ecb_ctx, 0);
+}
+
+// TODO: a few things could be optimized in this. It's good enough for a prototype.
+static void
+AesRunCtr(AesKeyCtx* ctx, int enc, const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len)
+{
+	aes_prepare_ecb_ctx(ctx, enc, key, iv);
+
+	if(EVP_CipherUpdate(ctx->ecb_ctx, out, out_len, in, in_len) == 0)
 	{
 		#ifdef FRONTEND
 			fprintf(stderr, "ERROR: EVP_CipherUpdate failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
@@ -164,6 +981,186 @@ void AesDecrypt(const unsigned char* key, const unsigned char* iv, const unsigne
 	AesRunCbc(0, key, iv, in, in_len, out, out_len);
 }
 
+/*
+ * The two keys of AES-XTS are derived from the internal key with
+ * HKDF-SHA256 (RFC 5869), so the key files keep storing a single AES-128 key
+ * per relation:
+ *    PRK = HMAC-SHA256(0^32, key)
+ *    key1 || key2 = HMAC-SHA256(PRK, XTS_KEY_INFO || 0x01)
+ * The output of SHA-256 is exactly the 32 bytes of the XTS key, so one block
+ * of the expand step is enough.
+ */
+static const char XTS_KEY_INFO[] = "pg_tde XTS page key";
+
+static void
+aes_xts_derive_key(const unsigned char* key, unsigned char* xts_key)
+{
+	unsigned char salt[SHA256_DIGEST_LENGTH] = {0};
+	unsigned char prk[SHA256_DIGEST_LENGTH];
+	unsigned char info[sizeof(XTS_KEY_INFO)];
+	unsigned int len;
+
+	StaticAssertStmt(SHA256_DIGEST_LENGTH == 2 * AES_BLOCK_SIZE, "XTS key is one SHA-256 block");
+
+	memcpy(info, XTS_KEY_INFO, sizeof(XTS_KEY_INFO) - 1);
+	info[sizeof(XTS_KEY_INFO) - 1] = 0x01;
+
+	if (HMAC(EVP_sha256(), salt, sizeof(salt), key, AES_BLOCK_SIZE, prk, &len) == NULL ||
+		HMAC(EVP_sha256(), prk, sizeof(prk), info, sizeof(info), xts_key, &len) == NULL)
+	{
+		memset(prk, 0, sizeof(prk));
+		#ifdef FRONTEND
+			fprintf(stderr, "ERROR: HMAC failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+			exit(1);
+		#else
+			ereport(ERROR,
+				(errmsg("HMAC failed. OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))));
+		#endif
+	}
+
+	memset(prk, 0, sizeof(prk));
+}
+
+/*
+ * Returns the cached CBC or XTS context for the key, creating and keying it
+ * on the first use.
+ */
+static EVP_CIPHER_CTX*
+aes_get_cipher_ctx(AesKeyCtx* ctx, bool xts, int enc, const unsigned char* key)
+{
+	EVP_CIPHER_CTX** cipher_ctx;
+	unsigned char xts_key[2 * AES_BLOCK_SIZE];
+	int res;
+
+	if (xts)
+		cipher_ctx = enc ? &ctx->xts_enc_ctx : &ctx->xts_dec_ctx;
+	else
+		cipher_ctx = enc ? &ctx->cbc_enc_ctx : &ctx->cbc_dec_ctx;
+
+	if (*cipher_ctx != NULL)
+		return *cipher_ctx;
+
+	*cipher_ctx = EVP_CIPHER_CTX_new();
+	if (*cipher_ctx == NULL)
+		res = 0;
+	else if (xts)
+	{
+		aes_xts_derive_key(key, xts_key);
+		res = EVP_CipherInit_ex(*cipher_ctx, cipher_xts, NULL, xts_key, NULL, enc);
+		memset(xts_key, 0, sizeof(xts_key));
+	}
+	else
+		res = EVP_CipherInit_ex(*cipher_ctx, cipher, NULL, key, NULL, enc);
+
+	if (res == 0)
+	{
+		EVP_CIPHER_CTX_free(*cipher_ctx);
+		*cipher_ctx = NULL;
+
+		#ifdef FRONTEND
+			fprintf(stderr, "ERROR: EVP_CipherInit_ex failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+			exit(1);
+		#else
+			ereport(ERROR,
+				(errmsg("EVP_CipherInit_ex failed. OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))));
+		#endif
+	}
+
+	EVP_CIPHER_CTX_set_padding(*cipher_ctx, 0);
+
+	return *cipher_ctx;
+}
+
+/*
+ * Same as AesRunCbc, but uses the cipher contexts cached in the key context
+ * (InternalKey.ctx). The key schedule is done once per key, each call only
+ * resets the IV (or the XTS tweak).
+ */
+static void
+AesRunWithCtx(void* ctxPtr, bool xts, int enc, const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len)
+{
+	int out_len_final = 0;
+	AesKeyCtx* ctx = aes_get_key_ctx((AesKeyCtx **) ctxPtr, key);
+	EVP_CIPHER_CTX* cbc_ctx;
+
+	Assert(in_len % cipher_block_size == 0);
+
+#ifdef USE_AES_HW_KERNELS
+	if (!xts && aes_cbc_kernel == AES_CBC_KERNEL_AESNI)
+	{
+		if (enc)
+			aesni_cbc128_encrypt(ctx->round_keys, iv, in_len / AES_BLOCK_SIZE, in, out);
+		else
+			aesni_cbc128_decrypt(ctx->dec_round_keys, iv, in_len / AES_BLOCK_SIZE, in, out);
+		*out_len = in_len;
+		return;
+	}
+#endif
+
+	cbc_ctx = aes_get_cipher_ctx(ctx, xts, enc, key);
+
+	if(EVP_CipherInit_ex(cbc_ctx, NULL, NULL, NULL, iv, enc) == 0)
+	{
+		#ifdef FRONTEND
+			fprintf(stderr, "ERROR: EVP_CipherInit_ex failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		#else
+			ereport(ERROR,
+				(errmsg("EVP_CipherInit_ex failed. OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))));
+		#endif
+		return;
+	}
+
+	if(EVP_CipherUpdate(cbc_ctx, out, out_len, in, in_len) == 0)
+	{
+		#ifdef FRONTEND
+			fprintf(stderr, "ERROR: EVP_CipherUpdate failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		#else
+			ereport(ERROR,
+				(errmsg("EVP_CipherUpdate failed. OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))));
+		#endif
+		return;
+	}
+
+	if(EVP_CipherFinal_ex(cbc_ctx, out + *out_len, &out_len_final) == 0)
+	{
+		#ifdef FRONTEND
+			fprintf(stderr, "ERROR: EVP_CipherFinal_ex failed. OpenSSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		#else
+			ereport(ERROR,
+				(errmsg("EVP_CipherFinal_ex failed. OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))));
+		#endif
+		return;
+	}
+
+	*out_len += out_len_final;
+	Assert(in_len == *out_len);
+}
+
+void AesEncryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len)
+{
+	AesRunWithCtx(ctxPtr, false, 1, key, iv, in, in_len, out, out_len);
+}
+
+void AesDecryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len)
+{
+	AesRunWithCtx(ctxPtr, false, 0, key, iv, in, in_len, out, out_len);
+}
+
+/*
+ * AES-128-XTS with the XTS key derived from `key`. Unlike CBC, XTS blocks
+ * are independent of each other and are encrypted in parallel by OpenSSL.
+ * `tweak` is 16 bytes.
+ */
+void AesXtsEncryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* tweak, const unsigned char* in, int in_len, unsigned char* out, int* out_len)
+{
+	AesRunWithCtx(ctxPtr, true, 1, key, tweak, in, in_len, out, out_len);
+}
+
+void AesXtsDecryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* tweak, const unsigned char* in, int in_len, unsigned char* out, int* out_len)
+{
+	AesRunWithCtx(ctxPtr, true, 0, key, tweak, in, in_len, out, out_len);
+}
+
 /* This function assumes that the out buffer is big enough: at least (blockNumber2 - blockNumber1) * 16 bytes
  */
 void Aes128EncryptedZeroBlocks(void* ctxPtr, const unsigned char* key, const char* iv_prefix, uint64_t blockNumber1, uint64_t blockNumber2, unsigned char* out)
@@ -171,10 +1168,29 @@ void Aes128EncryptedZeroBlocks(void* ctxPtr, const unsigned char* key, const cha
 	const unsigned char iv[16] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
 	const unsigned dataLen = (blockNumber2 - blockNumber1) * 16;
+	AesKeyCtx* ctx;
 	int outLen;
 
 	Assert(blockNumber2 >= blockNumber1);
 
+	ctx = aes_get_key_ctx((AesKeyCtx **) ctxPtr, key);
+
+#ifdef USE_AES_HW_KERNELS
+	switch (aes_ctr_kernel)
+	{
+		case AES_CTR_KERNEL_VAES:
+			vaes_ctr128(ctx->round_keys, iv_prefix, (uint32_t) blockNumber1,
+						blockNumber2 - blockNumber1, NULL, out);
+			return;
+		case AES_CTR_KERNEL_AESNI:
+			aesni_ctr128(ctx->round_keys, iv_prefix, (uint32_t) blockNumber1,
+						 blockNumber2 - blockNumber1, NULL, out);
+			return;
+		case AES_CTR_KERNEL_OPENSSL:
+			break;
+	}
+#endif
+
 	for(int j=blockNumber1;j<blockNumber2;++j)
 	{
 		/*
@@ -187,6 +1203,52 @@ void Aes128EncryptedZeroBlocks(void* ctxPtr, const unsigned char* key, const cha
 		memcpy(out + (16*(j-blockNumber1)) + 12, (char*)&j, 4);
 	}
 
-	AesRunCtr(ctxPtr, 1, key, iv, out, dataLen, out, &outLen);
+	AesRunCtr(ctx, 1, key, iv, out, dataLen, out, &outLen);
 	Assert(outLen == dataLen);
 }
+
+/*
+ * Encrypts/decrypts full AES blocks blockNumber1..blockNumber2 (exclusive)
+ * of `in` into `out` with AES-CTR: out = in XOR keystream. `in` and `out`
+ * may point to the same buffer. With the hardware kernels the keystream is
+ * XORed into the data right in the registers, otherwise it goes through a
+ * bounded stack buffer.
+ */
+void
+Aes128CtrXorBlocks(void* ctxPtr, const unsigned char* key, const char* iv_prefix, uint64_t blockNumber1, uint64_t blockNumber2, const unsigned char* in, unsigned char* out)
+{
+	unsigned char	enc_key[DATA_BYTES_PER_AES_BATCH];
+	AesKeyCtx* ctx;
+
+	Assert(blockNumber2 >= blockNumber1);
+
+	ctx = aes_get_key_ctx((AesKeyCtx **) ctxPtr, key);
+
+#ifdef USE_AES_HW_KERNELS
+	switch (aes_ctr_kernel)
+	{
+		case AES_CTR_KERNEL_VAES:
+			vaes_ctr128(ctx->round_keys, iv_prefix, (uint32_t) blockNumber1,
+						blockNumber2 - blockNumber1, in, out);
+			return;
+		case AES_CTR_KERNEL_AESNI:
+			aesni_ctr128(ctx->round_keys, iv_prefix, (uint32_t) blockNumber1,
+						 blockNumber2 - blockNumber1, in, out);
+			return;
+		case AES_CTR_KERNEL_OPENSSL:
+			break;
+	}
+#else
+	(void) ctx;
+#endif
+
+	for (uint64_t batch_start = blockNumber1; batch_start < blockNumber2; batch_start += NUM_AES_BLOCKS_IN_BATCH)
+	{
+		uint64_t	batch_end = blockNumber2 - batch_start > NUM_AES_BLOCKS_IN_BATCH ?
+			batch_start + NUM_AES_BLOCKS_IN_BATCH : blockNumber2;
+		size_t		offset = (batch_start - blockNumber1) * AES_BLOCK_SIZE;
+
+		Aes128EncryptedZeroBlocks(ctxPtr, key, iv_prefix, batch_start, batch_end, enc_key);
+		AesXorBytes(out + offset, in + offset, enc_key, (batch_end - batch_start) * AES_BLOCK_SIZE);
+	}
+}
@@ -10,6 +10,10 @@
 #include "storage/bufmgr.h"
 #include "keyring/keyring_api.h"
 
+#ifndef FRONTEND
+#include "utils/guc.h"
+#endif
+
 #ifdef ENCRYPTION_DEBUG
 static void iv_prefix_debug(const char* iv_prefix, char* out_hex)
 {
@@ -20,7 +24,7 @@ static void iv_prefix_debug(const char* iv_prefix, char* out_hex)
 }
 #endif
 
-static void
+void
 SetIVPrefix(ItemPointerData* ip, char* iv_prefix)
 {
 	/* We have up to 16 bytes for the entire IV
@@ -44,126 +48,139 @@ SetIVPrefix(ItemPointerData* ip, char* iv_prefix)
  */
 
 /* 
- * pg_tde_crypt_simple:
- * Encrypts/decrypts `data` with a given `key`. The result is written to `out`.
- * start_offset: is the absolute location of start of data in the file.
- * This function assumes that everything is in a single block, and has an assertion ensuring this
+ * pg_tde_crypt_partial_block:
+ * Encrypts/decrypts `len` bytes of a single AES block `aes_block`, starting at
+ * `block_offset` within that block. Used for the unaligned head and tail of
+ * the data.
  */
 static void
-pg_tde_crypt_simple(const char* iv_prefix, uint32 start_offset, const char* data, uint32 data_len, char* out, RelKeyData* key, const char* context)
+pg_tde_crypt_partial_block(const char* iv_prefix, uint64 aes_block, uint32 block_offset, const char* data, uint32 len, char* out, RelKeyData* key)
 {
-	const uint64 aes_start_block = start_offset / AES_BLOCK_SIZE;
-	const uint64 aes_end_block = (start_offset + data_len + (AES_BLOCK_SIZE - 1)) / AES_BLOCK_SIZE;
-	const uint64 aes_block_no = start_offset % AES_BLOCK_SIZE;
+	unsigned char enc_key[AES_BLOCK_SIZE];
 
-	unsigned char enc_key[DATA_BYTES_PER_AES_BATCH + AES_BLOCK_SIZE];
+	Assert(block_offset + len <= AES_BLOCK_SIZE);
 
-	Assert(aes_end_block - aes_start_block <= NUM_AES_BLOCKS_IN_BATCH + 1);
-
-	Aes128EncryptedZeroBlocks(&(key->internal_key.ctx), key->internal_key.key, iv_prefix, aes_start_block, aes_end_block, enc_key);
-
-#ifdef ENCRYPTION_DEBUG
-{
-	char ivp_debug[33];
-	iv_prefix_debug(iv_prefix, ivp_debug);
-	ereport(LOG,
-		(errmsg("%s: Start offset: %lu Data_Len: %u, aes_start_block: %lu, aes_end_block: %lu, IV prefix: %s",
-			context?context:"", start_offset, data_len, aes_start_block, aes_end_block, ivp_debug)));
-}
-#endif
+	Aes128EncryptedZeroBlocks(&(key->internal_key.ctx), key->internal_key.key, iv_prefix, aes_block, aes_block + 1, enc_key);
 
-	for(uint32 i = 0; i < data_len; ++i)
+	for(uint32 i = 0; i < len; ++i)
 	{
-		out[i] = data[i] ^ enc_key[i + aes_block_no];
+		out[i] = data[i] ^ enc_key[i + block_offset];
 	}
 }
 
-
 /* 
- * pg_tde_crypt_complex:
+ * pg_tde_crypt:
  * Encrypts/decrypts `data` with a given `key`. The result is written to `out`.
  * start_offset: is the absolute location of start of data in the file.
- * This is a generic function intended for large data, that do not fit into a single block
+ *
+ * The keystream is aligned to the absolute offset, not to the start of the
+ * data: the N-th byte of the file is always crypted with the (N % 16)-th byte
+ * of the (N / 16)-th keystream block, regardless of what start_offset the
+ * function was called with. For example start_offset = 10:
+ * 		data:                              [10 11 12 13 14 15 16 ...]
+ * 		encKey: [0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15][0 1 ...]
+ * So the data is split into an unaligned head (up to the next 16 byte
+ * boundary), a body of whole AES blocks and an unaligned tail. The body is
+ * XORed with the keystream in one fused pass, without an intermediate buffer.
  */
-static void
-pg_tde_crypt_complex(const char* iv_prefix, uint32 start_offset, const char* data, uint32 data_len, char* out, RelKeyData* key, const char* context)
+void
+pg_tde_crypt(const char* iv_prefix, uint32 start_offset, const char* data, uint32 data_len, char* out, RelKeyData* key, const char* context)
 {
 	const uint64 aes_start_block = start_offset / AES_BLOCK_SIZE;
-	const uint64 aes_end_block = (start_offset + data_len + (AES_BLOCK_SIZE -1)) / AES_BLOCK_SIZE;
-	const uint64 aes_block_no = start_offset % AES_BLOCK_SIZE;
-	uint32 batch_no = 0;
+	const uint32 aes_block_no = start_offset % AES_BLOCK_SIZE;
+	uint64 body_start_block = aes_start_block;
+	uint64 body_blocks;
 	uint32 data_index = 0;
-	uint64 batch_end_block;
-	uint32 current_batch_bytes;
-	unsigned char enc_key[DATA_BYTES_PER_AES_BATCH];
-
-	/* do max NUM_AES_BLOCKS_IN_BATCH blocks at a time */
-	for (uint64 batch_start_block = aes_start_block; batch_start_block < aes_end_block; batch_start_block += NUM_AES_BLOCKS_IN_BATCH)
-	{
-		batch_end_block = Min(batch_start_block + NUM_AES_BLOCKS_IN_BATCH, aes_end_block);
 
-		Aes128EncryptedZeroBlocks(&(key->internal_key.ctx), key->internal_key.key, iv_prefix, batch_start_block, batch_end_block, enc_key);
 #ifdef ENCRYPTION_DEBUG
 {
+	const uint64 aes_end_block = (start_offset + data_len + (AES_BLOCK_SIZE - 1)) / AES_BLOCK_SIZE;
 	char ivp_debug[33];
 	iv_prefix_debug(iv_prefix, ivp_debug);
-		ereport(LOG,
-			(errmsg("%s: Batch-No:%d Start offset: %lu Data_Len: %u, batch_start_block: %lu, batch_end_block: %lu, IV prefix: %s",
-				context?context:"", batch_no, start_offset, data_len, batch_start_block, batch_end_block, ivp_debug)));
+	ereport(LOG,
+		(errmsg("%s: Start offset: %u Data_Len: %u, aes_start_block: %lu, aes_end_block: %lu, IV prefix: %s",
+			context?context:"", start_offset, data_len, aes_start_block, aes_end_block, ivp_debug)));
 }
 #endif
 
-		current_batch_bytes = ((batch_end_block - batch_start_block) * AES_BLOCK_SIZE)
-										- (batch_no > 0 ? 0 : aes_block_no); /* first batch skips `aes_block_no`-th bytes of enc_key */
-		if ((data_index + current_batch_bytes) > data_len)
-			current_batch_bytes = data_len - data_index;
-
-		for(uint32 i = 0; i < current_batch_bytes; ++i)
-		{
-			/* 
-			 * As the size of enc_key always is a multiple of 16 we 
-			 * start from `aes_block_no`-th index of the enc_key[]
-			 * so N-th will be crypted with the same enc_key byte despite
-			 * what start_offset the function was called with.
-			 * For example start_offset = 10; MAX_AES_ENC_BATCH_KEY_SIZE = 6:
-			 * 		data:                 [10 11 12 13 14 15 16]
-			 * 		encKey: [...][0 1 2 3  4  5][0  1  2  3  4  5]
-			 * so the 10th data byte is encoded with the 4th byte of the 2nd enc_key etc.
-			 * We need this shift so each byte will be coded the same despite
-			 * the initial offset.
-			 * Let's see the same data but sent to the func starting from the offset 0:
-			 * 		data:    [0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16]
-			 * 		encKey: [0 1 2 3 4 5][0 1 2 3 4 5][ 0 1  2  3  4  5]
-			 * again, the 10th data byte is encoded with the 4th byte of the 2nd enc_key etc.
-			 */
-			uint32  enc_key_index = i + (batch_no > 0 ? 0 : aes_block_no);
-			out[data_index] = data[data_index] ^ enc_key[enc_key_index];
-
-			data_index++;
-		}
-		batch_no++;
-    }
-}
+	if (data_len == 0)
+		return;
 
-/* 
- * pg_tde_crypt:
- * Encrypts/decrypts `data` with a given `key`. The result is written to `out`.
- * start_offset: is the absolute location of start of data in the file.
- * This function simply selects between the two above variations based on the data length
- */
-void
-pg_tde_crypt(const char* iv_prefix, uint32 start_offset, const char* data, uint32 data_len, char* out, RelKeyData* key, const char* context)
-{
-	if(data_len >= DATA_BYTES_PER_AES_BATCH)
+	/* head: the rest of the first AES block if we don't start at its beginning */
+	if (aes_block_no != 0)
 	{
-		pg_tde_crypt_complex(iv_prefix, start_offset, data, data_len, out, key, context);
-	} else
+		uint32 head_len = Min(AES_BLOCK_SIZE - aes_block_no, data_len);
+
+		pg_tde_crypt_partial_block(iv_prefix, aes_start_block, aes_block_no, data, head_len, out, key);
+		data_index += head_len;
+		body_start_block++;
+	}
+
+	/* body: whole AES blocks */
+	body_blocks = (data_len - data_index) / AES_BLOCK_SIZE;
+	if (body_blocks > 0)
+	{
+		Aes128CtrXorBlocks(&(key->internal_key.ctx), key->internal_key.key, iv_prefix,
+						   body_start_block, body_start_block + body_blocks,
+						   (const unsigned char*) data + data_index, (unsigned char*) out + data_index);
+		data_index += body_blocks * AES_BLOCK_SIZE;
+	}
+
+	/* tail: the beginning of the last AES block */
+	if (data_index < data_len)
 	{
-		pg_tde_crypt_simple(iv_prefix, start_offset, data, data_len, out, key, context);
+		pg_tde_crypt_partial_block(iv_prefix, body_start_block + body_blocks, 0,
+								   data + data_index, data_len - data_index, out + data_index, key);
 	}
 }
 
 #ifndef FRONTEND
+/* GUC */
+static int CryptoKernel = AES_KERNEL_AUTO;
+
+static const struct config_enum_entry crypto_kernel_options[] = {
+	{"auto", AES_KERNEL_AUTO, false},
+	{"openssl", AES_KERNEL_OPENSSL, false},
+	{"aesni", AES_KERNEL_AESNI, false},
+	{"vaes", AES_KERNEL_VAES, false},
+	{NULL, 0, false}
+};
+
+static bool
+check_crypto_kernel(int *newval, void **extra, GucSource source)
+{
+	if (!AesKernelIsSupported(*newval))
+	{
+		GUC_check_errdetail("The CPU does not support this crypto kernel.");
+		return false;
+	}
+
+	return true;
+}
+
+static void
+assign_crypto_kernel(int newval, void *extra)
+{
+	AesSetKernel(newval);
+}
+
+void
+CryptoInitGUC(void)
+{
+	DefineCustomEnumVariable("pg_tde.crypto_kernel",	/* name */
+							 "Forces the implementation of the encryption routines.",	/* short_desc */
+							 "\"auto\" picks the fastest one supported by the CPU.",	/* long_desc */
+							 &CryptoKernel, /* value address */
+							 AES_KERNEL_AUTO,	/* boot value */
+							 crypto_kernel_options,	/* options */
+							 PGC_SUSET,	/* context */
+							 0, /* flags */
+							 check_crypto_kernel,	/* check_hook */
+							 assign_crypto_kernel,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+}
+
 /*
  * pg_tde_crypt_tuple:
  * Does the encryption/decryption of tuple data in place
@@ -190,6 +207,33 @@ pg_tde_crypt_tuple(HeapTuple tuple, HeapTuple out_tuple, RelKeyData* key, const
     pg_tde_crypt(iv_prefix, 0, tup_data, data_len, out_data, key, context);
 }
 
+/*
+ * pg_tde_decrypt_page_tuples:
+ * Decrypts the given tuples of a heap page in one go. Every tuple is written
+ * to out at the same offset it has on the page, so the line pointers of the
+ * page can be used to find the decrypted tuples.
+ * */
+void
+pg_tde_decrypt_page_tuples(Page page, BlockNumber blkno, const OffsetNumber *offsets, int ntuples, char *out, RelKeyData* key)
+{
+	char iv_prefix[16] = {0};
+	ItemPointerData ip;
+
+	for (int i = 0; i < ntuples; i++)
+	{
+		ItemId		lp = PageGetItemId(page, offsets[i]);
+		HeapTupleHeader tup = (HeapTupleHeader) PageGetItem(page, lp);
+		char	   *out_tup = out + ItemIdGetOffset(lp);
+
+		memcpy(out_tup, tup, tup->t_hoff);
+
+		ItemPointerSet(&ip, blkno, offsets[i]);
+		SetIVPrefix(&ip, iv_prefix);
+
+		pg_tde_crypt(iv_prefix, 0, (char *) tup + tup->t_hoff, ItemIdGetLength(lp) - tup->t_hoff,
+					 out_tup + tup->t_hoff, key, "DECRYPT-PAGE-TUPLES");
+	}
+}
 
 // ================================================================
 // HELPER FUNCTIONS FOR ENCRYPTION
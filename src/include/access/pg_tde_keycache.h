@@ -0,0 +1,32 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_tde_keycache.h
+ *	  Cluster-wide cache of decrypted relation keys.
+ *
+ * src/include/access/pg_tde_keycache.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TDE_KEYCACHE_H
+#define PG_TDE_KEYCACHE_H
+
+#include "access/pg_tde_tdemap.h"
+#include "storage/relfilelocator.h"
+
+extern bool	tde_prewarm_keys;
+
+extern void InitializeSharedRelKeyCache(void);
+
+extern bool pg_tde_shared_key_cache_get(const RelFileLocator *rlocator, RelKeyData *key);
+extern bool pg_tde_shared_key_cache_put(const RelFileLocator *rlocator, const RelKeyData *key);
+extern void pg_tde_shared_key_cache_evict(const RelFileLocator *rlocator);
+extern void pg_tde_shared_key_cache_evict_db(Oid dbOid);
+
+extern uint64 pg_tde_key_generation(void);
+extern bool pg_tde_rel_may_have_key(const RelFileLocator *rlocator);
+extern void pg_tde_rel_has_no_key(const RelFileLocator *rlocator, uint64 generation);
+extern void pg_tde_rel_key_created(const RelFileLocator *rlocator);
+
+extern PGDLLEXPORT void pg_tde_key_prewarm_main(Datum main_arg);
+
+#endif							/* PG_TDE_KEYCACHE_H */
@@ -30,8 +30,26 @@ typedef struct TDEBufferHeapTupleTableSlot
 	 * such a case, since presumably base.tuple is pointing into the buffer.)
 	 */
 	Buffer		buffer;			/* tuple's buffer, or InvalidBuffer */
-	char		decrypted_buffer[BLCKSZ];
+
+	/*
+	 * Decrypted copy of the stored tuple, allocated in tts_mcxt when first
+	 * needed and grown to fit the largest tuple seen. Slots that are only
+	 * given already decrypted tuples never allocate it.
+	 */
+	char	   *decrypted_buffer;
+	uint32		decrypted_buffer_size;
 	RelKeyData *cached_relation_key;
+
+	/*
+	 * Tuple data is decrypted lazily, while deforming: encrypted_data points
+	 * to the still encrypted data of the stored tuple (in the pinned buffer)
+	 * and only its first decrypted_len bytes are valid in decrypted_buffer.
+	 * encrypted_data is NULL if the tuple needs no further decryption.
+	 */
+	const char *encrypted_data;
+	uint32		encrypted_len;
+	uint32		decrypted_len;
+	char		iv_prefix[16];
 } TDEBufferHeapTupleTableSlot;
 
 extern PGDLLIMPORT const TupleTableSlotOps TTSOpsTDEBufferHeapTuple;
@@ -46,5 +64,8 @@ extern TupleTableSlot *PGTdeExecStoreBufferHeapTuple(Relation rel,
                          HeapTuple tuple,
 						 TupleTableSlot *slot,
 						 Buffer buffer);
+extern TupleTableSlot *PGTdeExecStoreDecryptedBufferHeapTuple(HeapTuple tuple,
+						 TupleTableSlot *slot,
+						 Buffer buffer);
 
 #endif /* PG_TDE_SLOT_H */
\ No newline at end of file
@@ -14,15 +14,26 @@
 #include "catalog/tde_principal_key.h"
 #include "storage/relfilelocator.h"
 
+/*
+ * Cipher used by the storage manager for the relation data pages. It is
+ * chosen when the relation is created and is kept in the key map entry.
+ */
+#define TDE_PAGE_CIPHER_CBC		0	/* AES-128-CBC, IV from the block number */
+#define TDE_PAGE_CIPHER_XTS		1	/* AES-128-XTS, tweak from (fork, block) */
+
 typedef struct InternalKey
 {
     uint8   key[INTERNAL_KEY_LEN];
+    uint32  page_cipher; /* TDE_PAGE_CIPHER_*, not stored in the key data file */
 	void*   ctx; // TODO: shouldn't be here / written to the disk
 } InternalKey;
 
+/*
+ * The principal key a relation key is encrypted with is recorded in the
+ * header of the key files, so it's not repeated here.
+ */
 typedef struct RelKeyData
 {
-    TDEPrincipalKeyId  principal_key_id;
     InternalKey     internal_key;
 } RelKeyData;
 
@@ -33,10 +44,33 @@ typedef struct XLogRelKey
 	RelKeyData      relKey;
 } XLogRelKey;
 
-extern RelKeyData* pg_tde_create_key_map_entry(const RelFileLocator *newrlocator);
+/*
+ * Layout of XLOG_TDE_ADD_RELATION_KEY_V1 records, written when the relation
+ * keys still carried the principal key id and all used the CBC page cipher.
+ * Kept to replay the WAL of older versions.
+ */
+typedef struct InternalKeyV1
+{
+    uint8   key[INTERNAL_KEY_LEN];
+	void*   ctx;
+} InternalKeyV1;
+
+typedef struct RelKeyDataV1
+{
+    TDEPrincipalKeyId  principal_key_id;
+    InternalKeyV1   internal_key;
+} RelKeyDataV1;
+
+typedef struct XLogRelKeyV1
+{
+	RelFileLocator  rlocator;
+	RelKeyDataV1    relKey;
+} XLogRelKeyV1;
+
+extern RelKeyData* pg_tde_create_key_map_entry(const RelFileLocator *newrlocator, uint32 page_cipher);
 extern void pg_tde_write_key_map_entry(const RelFileLocator *rlocator, RelKeyData *enc_rel_key_data, TDEPrincipalKeyInfo *principal_key_info);
 extern void pg_tde_delete_key_map_entry(const RelFileLocator *rlocator);
-extern void pg_tde_free_key_map_entry(const RelFileLocator *rlocator, off_t offset);
+extern void pg_tde_free_key_map_entry(const RelFileLocator *rlocator);
 
 extern RelKeyData *GetRelationKey(RelFileLocator rel);
 
@@ -46,11 +80,14 @@ extern TDEPrincipalKeyInfo *pg_tde_get_principal_key_info(Oid dbOid, Oid spcOid)
 extern bool pg_tde_save_principal_key(TDEPrincipalKeyInfo *principal_key_info);
 extern bool pg_tde_perform_rotate_key(TDEPrincipalKey *principal_key, TDEPrincipalKey *new_principal_key);
 extern bool pg_tde_write_map_keydata_files(off_t map_size, char *m_file_data, off_t keydata_size, char *k_file_data);
-extern RelKeyData* tde_create_rel_key(Oid rel_id, InternalKey *key, TDEPrincipalKeyInfo *principal_key_info);
+extern RelKeyData* tde_create_rel_key(Oid rel_id, InternalKey *key);
 extern RelKeyData *tde_encrypt_rel_key(TDEPrincipalKey *principal_key, RelKeyData *rel_key_data, const RelFileLocator *rlocator);
 extern RelKeyData *tde_decrypt_rel_key(TDEPrincipalKey *principal_key, RelKeyData *enc_rel_key_data, const RelFileLocator *rlocator);
 extern RelKeyData *pg_tde_get_key_from_file(const RelFileLocator *rlocator);
 
+extern int pg_tde_prewarm_rel_keys(Oid dbOid, Oid spcOid);
+extern RelFileNumber *pg_tde_get_keyed_relations(Oid dbOid, Oid spcOid, int *count);
+
 extern void pg_tde_set_db_file_paths(Oid dbOid, Oid spcOid, char *map_path, char *keydata_path);
 
 const char * tde_sprint_key(InternalKey *k);
@@ -16,11 +16,12 @@
 #include "access/xlog_internal.h"
 
 /* TDE XLOG resource manager */
-#define XLOG_TDE_ADD_RELATION_KEY		0x00
+#define XLOG_TDE_ADD_RELATION_KEY_V1	0x00	/* XLogRelKeyV1, replay only */
 #define XLOG_TDE_ADD_PRINCIPAL_KEY		0x10
 #define XLOG_TDE_EXTENSION_INSTALL_KEY	0x20
 #define XLOG_TDE_ROTATE_KEY				0x30
 #define XLOG_TDE_ADD_KEY_PROVIDER_KEY 	0x40
+#define XLOG_TDE_ADD_RELATION_KEY		0x50	/* XLogRelKey */
 
 /* TODO: ID has to be registedred and changed: https://wiki.postgresql.org/wiki/CustomWALResourceManagers */
 #define RM_TDERMGR_ID	RM_EXPERIMENTAL_ID
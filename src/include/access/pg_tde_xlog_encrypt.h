@@ -18,6 +18,14 @@ extern Size TDEXLogEncryptBuffSize(void);
 #define XLOG_TDE_ENC_BUFF_ALIGNED_SIZE	add_size(TDEXLogEncryptBuffSize(), PG_IO_ALIGN_SIZE)
 
 extern void TDEXLogShmemInit(void);
+extern Size TDEXLogKeystreamShmemSize(void);
+extern Size TDEXLogCryptShmemSize(void);
+extern Size TDEXLogDecryptCacheShmemSize(void);
+
+/* Bytes of the WAL key fingerprint, twice as many hex digits */
+#define TDE_XLOG_KEY_FINGERPRINT_LEN	8
+
+extern bool TDEXLogKeyFingerprint(char *buf);
 
 extern ssize_t tdeheap_xlog_seg_read(int fd, void *buf, size_t count, off_t offset);
 extern ssize_t tdeheap_xlog_seg_write(int fd, const void *buf, size_t count, off_t offset);
@@ -30,6 +38,10 @@ static const XLogSmgr tde_xlog_smgr = {
 extern void TDEXLogSmgrInit(void);
 extern void XLogInitGUC(void);
 
+extern PGDLLEXPORT void pg_tde_wal_keystream_main(Datum main_arg);
+extern PGDLLEXPORT void pg_tde_wal_crypt_main(Datum main_arg);
+extern PGDLLEXPORT void pg_tde_wal_decrypt_ahead_main(Datum main_arg);
+
 #endif							/* PERCONA_EXT */
 
 #endif							/* PG_TDE_XLOGENCRYPT_H */
\ No newline at end of file
@@ -39,6 +39,7 @@ typedef struct GenericKeyring
 	Oid key_id;
 	char provider_name[MAX_PROVIDER_NAME_LEN];
 	char options[MAX_KEYRING_OPTION_LEN]; /* User provided options string*/
+	bool external_options; /* Some options are read from a file or a URL */
 } GenericKeyring;
 
 typedef struct FileKeyring
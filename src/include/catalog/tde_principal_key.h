@@ -61,8 +61,9 @@ extern void InitializePrincipalKeyInfo(void);
 extern void cleanup_principal_key_info(Oid databaseId, Oid tablespaceId);
 
 #ifndef FRONTEND
-extern LWLock *tde_lwlock_enc_keys(void);
+extern LWLock *tde_lwlock_enc_keys(Oid dbOid);
 extern TDEPrincipalKey* GetPrincipalKey(Oid dbOid, Oid spcOid, LWLockMode lockMode);
+extern TDEPrincipalKey* GetPrincipalKeySnapshot(Oid dbOid, Oid spcOid);
 #else
 extern TDEPrincipalKey* GetPrincipalKey(Oid dbOid, Oid spcOid, void *lockMode);
 #endif
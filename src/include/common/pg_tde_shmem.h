@@ -16,13 +16,18 @@
 
 #define TDE_TRANCHE_NAME "pg_tde_tranche"
 
+/* Number of locks the key files and principal keys are partitioned into */
+#define TDE_LWLOCK_ENC_KEY_PARTITIONS 16
+
 typedef enum
 {
-    TDE_LWLOCK_ENC_KEY,
     TDE_LWLOCK_PI_FILES,
+    TDE_LWLOCK_KEYRING_CACHE,
+    /* First of the TDE_LWLOCK_ENC_KEY_PARTITIONS key locks */
+    TDE_LWLOCK_ENC_KEY,
 
     /* Must be the last entry in the enum */
-    TDE_LWLOCK_COUNT
+    TDE_LWLOCK_COUNT = TDE_LWLOCK_ENC_KEY + TDE_LWLOCK_ENC_KEY_PARTITIONS
 } TDELockTypes;
 
 typedef struct TDEShmemSetupRoutine
@@ -56,5 +61,7 @@ extern void RegisterShmemRequest(const TDEShmemSetupRoutine *routine);
 extern void TdeShmemInit(void);
 extern Size TdeRequiredSharedMemorySize(void);
 extern int TdeRequiredLocksCount(void);
+extern dsa_area *TdeGetDsaArea(void);
+extern bool TdeDsaAddressIsLocked(const void *ptr, Size size);
 
 #endif /*PG_TDE_SHMEM_H*/
\ No newline at end of file
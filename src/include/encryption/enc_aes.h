@@ -10,14 +10,33 @@
 #ifndef ENC_AES_H
 #define ENC_AES_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define AES_BLOCK_SIZE 		        16
 #define NUM_AES_BLOCKS_IN_BATCH     200
 #define DATA_BYTES_PER_AES_BATCH    (NUM_AES_BLOCKS_IN_BATCH * AES_BLOCK_SIZE)
 
+/* Crypto kernels, see AesSetKernel() */
+#define AES_KERNEL_AUTO				0
+#define AES_KERNEL_OPENSSL			1
+#define AES_KERNEL_AESNI			2
+#define AES_KERNEL_VAES				3
+
 void AesInit(void);
+extern bool AesKernelIsSupported(int kernel);
+extern void AesSetKernel(int kernel);
+extern void AesDescribeKernels(char* buf, size_t len);
 extern void Aes128EncryptedZeroBlocks(void* ctxPtr, const unsigned char* key, const char* iv_prefix, uint64_t blockNumber1, uint64_t blockNumber2, unsigned char* out);
+extern void Aes128CtrXorBlocks(void* ctxPtr, const unsigned char* key, const char* iv_prefix, uint64_t blockNumber1, uint64_t blockNumber2, const unsigned char* in, unsigned char* out);
+extern void AesPrepareKeyCtx(void **ctxPtr, const unsigned char *key);
+extern void AesFreeKeyCtx(void **ctxPtr);
+extern void AesXorBytes(unsigned char* out, const unsigned char* a, const unsigned char* b, size_t len);
+extern void AesEncryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len);
+extern void AesDecryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len);
+extern void AesXtsEncryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* tweak, const unsigned char* in, int in_len, unsigned char* out, int* out_len);
+extern void AesXtsDecryptWithCtx(void* ctxPtr, const unsigned char* key, const unsigned char* tweak, const unsigned char* in, int in_len, unsigned char* out, int* out_len);
 
 /* Only used for testing */
 extern void AesEncrypt(const unsigned char* key, const unsigned char* iv, const unsigned char* in, int in_len, unsigned char* out, int* out_len);
@@ -17,10 +17,17 @@
 #include "access/pg_tde_tdemap.h"
 #include "keyring/keyring_api.h"
 
+extern void CryptoInitGUC(void);
+
+extern void
+SetIVPrefix(ItemPointerData* ip, char* iv_prefix);
+
 extern void
 pg_tde_crypt(const char* iv_prefix, uint32 start_offset, const char* data, uint32 data_len, char* out, RelKeyData* key, const char* context);
 extern void
 pg_tde_crypt_tuple(HeapTuple tuple, HeapTuple out_tuple, RelKeyData* key, const char* context);
+extern void
+pg_tde_decrypt_page_tuples(Page page, BlockNumber blkno, const OffsetNumber *offsets, int ntuples, char *out, RelKeyData* key);
 
 /* A wrapper to encrypt a tuple before adding it to the buffer */
 extern OffsetNumber
@@ -0,0 +1,30 @@
+/*-------------------------------------------------------------------------
+ *
+ * keyring_broker.h
+ *      Background worker fetching keys from the key providers on behalf
+ *      of the backends.
+ *
+ * IDENTIFICATION
+ * src/include/keyring/keyring_broker.h
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef KEYRING_BROKER_H
+#define KEYRING_BROKER_H
+
+#include "keyring/keyring_api.h"
+
+extern bool tde_keyring_broker;
+extern int	tde_keyring_cache_ttl;
+extern int	tde_keyring_broker_timeout;
+
+extern void InitializeKeyringBroker(void);
+
+extern bool KeyringBrokerUsable(void);
+extern bool KeyringBrokerGetKey(GenericKeyring *keyring, const char *key_name, bool throw_error, KeyringReturnCodes *returnCode, keyInfo **key);
+extern void KeyringBrokerForgetKey(GenericKeyring *keyring, const char *key_name);
+
+extern PGDLLEXPORT void pg_tde_keyring_broker_main(Datum main_arg);
+
+#endif /* KEYRING_BROKER_H */
@@ -81,7 +81,7 @@ static int	tde_fe_error_level = 0;
 #define LWLockMode void*
 #define LW_SHARED NULL
 #define LW_EXCLUSIVE NULL
-#define tde_lwlock_enc_keys() NULL
+#define tde_lwlock_enc_keys(dbOid) NULL
 
 #define BasicOpenFile(fileName, fileFlags) open(fileName, fileFlags, PG_FILE_MODE_OWNER)
 
@@ -11,5 +11,6 @@
 #define PG_TDE_SMGR_H
 
 extern void RegisterStorageMgr(void);
+extern void TDESmgrInitGUC(void);
 
 #endif /* PG_TDE_SMGR_H */
\ No newline at end of file
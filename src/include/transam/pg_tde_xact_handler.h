@@ -15,7 +15,7 @@ extern void pg_tde_xact_callback(XactEvent event, void *arg);
 extern void pg_tde_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
                        SubTransactionId parentSubid, void *arg);
 
-extern void RegisterEntryForDeletion(const RelFileLocator *rlocator, off_t map_entry_offset, bool atCommit);
+extern void RegisterEntryForDeletion(const RelFileLocator *rlocator, bool atCommit);
 
 
 #endif                            /* PG_TDE_XACT_HANDLER_H */
\ No newline at end of file
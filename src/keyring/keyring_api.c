@@ -11,6 +11,8 @@
 #ifdef FRONTEND
 #include "fe_utils/simple_list.h"
 #include "pg_tde_fe.h"
+#else
+#include "keyring/keyring_broker.h"
 #endif
 
 #include <assert.h>
@@ -105,6 +107,15 @@ KeyringGetKey(GenericKeyring *keyring, const char *key_name, bool throw_error, K
 		*returnCode = KEYRING_CODE_INVALID_PROVIDER;
 		return NULL;
 	}
+#ifndef FRONTEND
+	if (KeyringBrokerUsable())
+	{
+		keyInfo    *key;
+
+		if (KeyringBrokerGetKey(keyring, key_name, throw_error, returnCode, &key))
+			return key;
+	}
+#endif
 	return kp->routine->keyring_get_key(keyring, key_name, throw_error, returnCode);
 }
 
@@ -118,6 +129,9 @@ KeyringStoreKey(GenericKeyring *keyring, keyInfo *key, bool throw_error)
 				(errmsg("Key provider of type %d not registered", keyring->type)));
 		return KEYRING_CODE_INVALID_PROVIDER;
 	}
+#ifndef FRONTEND
+	KeyringBrokerForgetKey(keyring, key->name.name);
+#endif
 	return kp->routine->keyring_store_key(keyring, key, throw_error);
 }
 
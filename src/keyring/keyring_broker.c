@@ -0,0 +1,881 @@
+/*-------------------------------------------------------------------------
+ *
+ * keyring_broker.c
+ *      Background worker fetching keys from the key providers on behalf
+ *      of the backends.
+ *
+ * Without the broker, every backend talks to the key providers itself: it
+ * opens its own connection to Vault (TCP and TLS handshake included) the
+ * first time it needs a principal key, and the keys it fetched die with it.
+ * With pg_tde.keyring_broker enabled, a single background worker owns the
+ * provider connections and keeps them open between requests, and the keys
+ * it fetched are kept in shared memory for pg_tde.keyring_cache_ttl seconds,
+ * so that all backends profit from them.
+ *
+ * A backend posts its request to one of the request slots in shared memory,
+ * sets the latch of the broker and waits on the condition variable of the
+ * slot. The broker serves the requests one after another and copies the
+ * result, or the error message of the provider, back into the slot.
+ *
+ * The backends fall back to fetching the keys themselves whenever the broker
+ * can't help: when it is not running, when all the slots are taken, when it
+ * exits while serving their request, or when it doesn't answer within
+ * pg_tde.keyring_broker_timeout (a slow provider, or requests queued behind
+ * one). pg_tde_keyring_broker_stats() tells how the requests were served.
+ *
+ * Keys are cached by a SHA-256 hash of the provider configuration (not by the
+ * provider name or id), so all databases using the same Vault share the
+ * cached keys. The Vault token is part of the hash, so a changed token never
+ * returns the keys fetched with the old one, but the cache doesn't keep the
+ * token itself. The token of a request is wiped from its slot once the
+ * request is served.
+ *
+ * IDENTIFICATION
+ *	  src/keyring/keyring_broker.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "common/cryptohash.h"
+#include "common/pg_tde_shmem.h"
+#include "common/sha2.h"
+#include "funcapi.h"
+#include "keyring/keyring_api.h"
+#include "keyring/keyring_broker.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include <sys/mman.h>
+
+#define KEYRING_BROKER_SLOTS	32
+#define KEYRING_CACHE_SIZE		64
+#define KEYRING_ERROR_LEN		256
+
+typedef union BrokerKeyring
+{
+	GenericKeyring generic;
+	FileKeyring file;
+	VaultV2Keyring vault;
+} BrokerKeyring;
+
+typedef enum BrokerSlotState
+{
+	BROKER_SLOT_FREE,
+	BROKER_SLOT_FILLING,		/* claimed by a backend */
+	BROKER_SLOT_REQUESTED,		/* waiting for the broker */
+	BROKER_SLOT_IN_PROGRESS,	/* the broker is fetching the key */
+	BROKER_SLOT_ABANDONED,		/* the backend left while the broker was at it */
+	BROKER_SLOT_DONE,			/* the result is in the slot */
+	BROKER_SLOT_FAILED			/* the broker exited, fetch the key directly */
+} BrokerSlotState;
+
+typedef struct BrokerSlot
+{
+	BrokerSlotState state;
+	ConditionVariable cv;		/* broadcast when the request is served */
+
+	/* request */
+	BrokerKeyring keyring;
+	char		key_name[TDE_KEY_NAME_LEN];
+
+	/* result, the key data itself is in KeyringBrokerState.slotKeys */
+	bool		found;
+	KeyringReturnCodes return_code;
+	int			sqlerrcode;
+	char		error[KEYRING_ERROR_LEN];	/* empty if the provider succeeded */
+	char		errdetail[KEYRING_ERROR_LEN];	/* empty if none */
+} BrokerSlot;
+
+typedef struct KeyringCacheEntry
+{
+	bool		valid;
+	TimestampTz fetched_at;
+	uint8		keyring_id[PG_SHA256_DIGEST_LENGTH];	/* see keyring_cache_id() */
+	char		key_name[TDE_KEY_NAME_LEN];
+} KeyringCacheEntry;
+
+typedef struct KeyringBrokerState
+{
+	slock_t		mutex;			/* protects brokerLatch and the slot states */
+	Latch	   *brokerLatch;	/* NULL if the broker isn't running */
+	LWLock	   *cacheLock;		/* protects cache and cacheKeys */
+	BrokerSlot	slots[KEYRING_BROKER_SLOTS];
+	KeyringCacheEntry cache[KEYRING_CACHE_SIZE];
+
+	/* Statistics, see pg_tde_keyring_broker_stats() */
+	pg_atomic_uint64 requestsServed;	/* by the broker */
+	pg_atomic_uint64 cacheHits;	/* served from the cache by the backends */
+	pg_atomic_uint64 timeouts;	/* abandoned after keyring_broker_timeout */
+
+	/*
+	 * Key data is kept apart from the rest, so that only these few pages have
+	 * to be locked in memory.
+	 */
+	keyData		slotKeys[KEYRING_BROKER_SLOTS];
+	keyData		cacheKeys[KEYRING_CACHE_SIZE];
+} KeyringBrokerState;
+
+bool		tde_keyring_broker = false;
+int			tde_keyring_cache_ttl = 60;
+int			tde_keyring_broker_timeout = 10000;
+
+static KeyringBrokerState *brokerState = NULL;
+static bool am_keyring_broker = false;
+static MemoryContext brokerContext = NULL;
+
+static Size keyring_broker_shared_state_size(void);
+static Size initialize_shared_state(void *start_address);
+static void shared_memory_shutdown(int code, Datum arg);
+static void register_keyring_broker(void);
+static void keyring_copy(BrokerKeyring *dst, const GenericKeyring *src);
+static void keyring_cache_id(const BrokerKeyring *keyring, uint8 *id);
+static bool keyring_cache_lookup(const BrokerKeyring *keyring, const char *key_name, keyData *key);
+static void keyring_cache_insert(const BrokerKeyring *keyring, const char *key_name, const keyData *key);
+static int	broker_slot_claim(void);
+static void broker_slot_release(int slotno);
+static void broker_slot_abandon(int code, Datum arg);
+static void keyring_broker_serve(void);
+static void keyring_broker_fetch(int slotno);
+static void keyring_broker_shutdown(int code, Datum arg);
+
+static const TDEShmemSetupRoutine keyring_broker_shmem_routine = {
+	.init_shared_state = initialize_shared_state,
+	.init_dsa_area_objects = NULL,
+	.required_shared_mem_size = keyring_broker_shared_state_size,
+	.shmem_kill = shared_memory_shutdown
+};
+
+void
+InitializeKeyringBroker(void)
+{
+	DefineCustomBoolVariable("pg_tde.keyring_broker",	/* name */
+							 "Fetch keys from the key providers through a background worker.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &tde_keyring_broker,	/* value address */
+							 false,	/* boot value */
+							 PGC_POSTMASTER,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_tde.keyring_cache_ttl",	/* name */
+							"Time the keys fetched by the keyring broker are kept in shared memory.",	/* short_desc */
+							"0 disables the cache.",	/* long_desc */
+							&tde_keyring_cache_ttl,	/* value address */
+							60, /* boot value */
+							0,	/* min value */
+							INT_MAX / 1000, /* max value */
+							PGC_SIGHUP, /* context */
+							GUC_UNIT_S, /* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	DefineCustomIntVariable("pg_tde.keyring_broker_timeout",	/* name */
+							"Time a backend waits for the keyring broker before fetching a key itself.",	/* short_desc */
+							NULL,	/* long_desc */
+							&tde_keyring_broker_timeout,	/* value address */
+							10000,	/* boot value */
+							1,	/* min value */
+							INT_MAX,	/* max value */
+							PGC_SIGHUP, /* context */
+							GUC_UNIT_MS,	/* flags */
+							NULL,	/* check_hook */
+							NULL,	/* assign_hook */
+							NULL	/* show_hook */
+		);
+
+	RegisterShmemRequest(&keyring_broker_shmem_routine);
+
+	if (tde_keyring_broker && process_shared_preload_libraries_in_progress)
+		register_keyring_broker();
+}
+
+static Size
+keyring_broker_shared_state_size(void)
+{
+	if (!tde_keyring_broker)
+		return 0;
+
+	return MAXALIGN(sizeof(KeyringBrokerState));
+}
+
+static Size
+initialize_shared_state(void *start_address)
+{
+	KeyringBrokerState *state = (KeyringBrokerState *) start_address;
+
+	if (!tde_keyring_broker)
+		return 0;
+
+	memset(state, 0, sizeof(KeyringBrokerState));
+	SpinLockInit(&state->mutex);
+	state->brokerLatch = NULL;
+	state->cacheLock = &GetNamedLWLockTranche(TDE_TRANCHE_NAME)[TDE_LWLOCK_KEYRING_CACHE].lock;
+	for (int i = 0; i < KEYRING_BROKER_SLOTS; i++)
+	{
+		state->slots[i].state = BROKER_SLOT_FREE;
+		ConditionVariableInit(&state->slots[i].cv);
+	}
+	pg_atomic_init_u64(&state->requestsServed, 0);
+	pg_atomic_init_u64(&state->cacheHits, 0);
+	pg_atomic_init_u64(&state->timeouts, 0);
+
+	brokerState = state;
+
+	return sizeof(KeyringBrokerState);
+}
+
+static void
+shared_memory_shutdown(int code, Datum arg)
+{
+	brokerState = NULL;
+}
+
+/*
+ * Whether the keys of this process should be fetched through the broker. The
+ * broker itself, and processes without a PGPROC (the postmaster, the startup
+ * code), talk to the providers directly.
+ */
+bool
+KeyringBrokerUsable(void)
+{
+	return brokerState != NULL && IsUnderPostmaster && MyProc != NULL &&
+		!am_keyring_broker;
+}
+
+/*
+ * Keyrings are copied field by field, and identified by the fields that tell
+ * where the keys come from, so that the unused bytes of the name buffers
+ * don't matter.
+ */
+static void
+keyring_copy(BrokerKeyring *dst, const GenericKeyring *src)
+{
+	memset(dst, 0, sizeof(BrokerKeyring));
+	dst->generic.type = src->type;
+	dst->generic.key_id = src->key_id;
+	strlcpy(dst->generic.provider_name, src->provider_name, sizeof(dst->generic.provider_name));
+	strlcpy(dst->generic.options, src->options, sizeof(dst->generic.options));
+
+	switch (src->type)
+	{
+		case FILE_KEY_PROVIDER:
+			{
+				const FileKeyring *file = (const FileKeyring *) src;
+
+				strlcpy(dst->file.file_name, file->file_name, sizeof(dst->file.file_name));
+				break;
+			}
+		case VAULT_V2_KEY_PROVIDER:
+			{
+				const VaultV2Keyring *vault = (const VaultV2Keyring *) src;
+
+				strlcpy(dst->vault.vault_token, vault->vault_token, sizeof(dst->vault.vault_token));
+				strlcpy(dst->vault.vault_url, vault->vault_url, sizeof(dst->vault.vault_url));
+				strlcpy(dst->vault.vault_ca_path, vault->vault_ca_path, sizeof(dst->vault.vault_ca_path));
+				strlcpy(dst->vault.vault_mount_path, vault->vault_mount_path, sizeof(dst->vault.vault_mount_path));
+				break;
+			}
+		default:
+			break;
+	}
+}
+
+/*
+ * SHA-256 of the provider type and of the fields that tell where the keys come
+ * from, each with its terminating zero.
+ */
+static void
+keyring_cache_id(const BrokerKeyring *keyring, uint8 *id)
+{
+	pg_cryptohash_ctx *ctx = pg_cryptohash_create(PG_SHA256);
+	const char *fields[4] = {NULL};
+	bool		ok;
+
+	switch (keyring->generic.type)
+	{
+		case FILE_KEY_PROVIDER:
+			fields[0] = keyring->file.file_name;
+			break;
+		case VAULT_V2_KEY_PROVIDER:
+			fields[0] = keyring->vault.vault_url;
+			fields[1] = keyring->vault.vault_mount_path;
+			fields[2] = keyring->vault.vault_ca_path;
+			fields[3] = keyring->vault.vault_token;
+			break;
+		default:
+			break;
+	}
+
+	ok = pg_cryptohash_init(ctx) == 0 &&
+		pg_cryptohash_update(ctx, (const uint8 *) &keyring->generic.type, sizeof(ProviderType)) == 0;
+	for (int i = 0; ok && i < lengthof(fields) && fields[i] != NULL; i++)
+		ok = pg_cryptohash_update(ctx, (const uint8 *) fields[i], strlen(fields[i]) + 1) == 0;
+	if (ok)
+		ok = pg_cryptohash_final(ctx, id, PG_SHA256_DIGEST_LENGTH) == 0;
+
+	if (!ok)
+		elog(ERROR, "could not compute the keyring cache hash: %s", pg_cryptohash_error(ctx));
+
+	pg_cryptohash_free(ctx);
+}
+
+/*
+ * ------------------------------
+ * Key cache
+ */
+
+static bool
+keyring_cache_entry_expired(KeyringCacheEntry *entry, TimestampTz now)
+{
+	return TimestampDifferenceExceeds(entry->fetched_at, now, tde_keyring_cache_ttl * 1000);
+}
+
+static bool
+keyring_cache_lookup(const BrokerKeyring *keyring, const char *key_name, keyData *key)
+{
+	TimestampTz now;
+	uint8		id[PG_SHA256_DIGEST_LENGTH];
+	bool		found = false;
+
+	if (tde_keyring_cache_ttl <= 0)
+		return false;
+
+	now = GetCurrentTimestamp();
+	keyring_cache_id(keyring, id);
+
+	LWLockAcquire(brokerState->cacheLock, LW_SHARED);
+	for (int i = 0; i < KEYRING_CACHE_SIZE; i++)
+	{
+		KeyringCacheEntry *entry = &brokerState->cache[i];
+
+		if (entry->valid && !keyring_cache_entry_expired(entry, now) &&
+			strcmp(entry->key_name, key_name) == 0 &&
+			memcmp(entry->keyring_id, id, sizeof(id)) == 0)
+		{
+			memcpy(key, &brokerState->cacheKeys[i], sizeof(keyData));
+			found = true;
+			break;
+		}
+	}
+	LWLockRelease(brokerState->cacheLock);
+
+	return found;
+}
+
+/*
+ * Replaces the entry of the same key if there is one, then a free or expired
+ * entry, then the oldest one.
+ */
+static void
+keyring_cache_insert(const BrokerKeyring *keyring, const char *key_name, const keyData *key)
+{
+	TimestampTz now;
+	uint8		id[PG_SHA256_DIGEST_LENGTH];
+	int			victim = -1;
+	int			free_entry = -1;
+	int			oldest = 0;
+
+	if (tde_keyring_cache_ttl <= 0)
+		return;
+
+	now = GetCurrentTimestamp();
+	keyring_cache_id(keyring, id);
+
+	LWLockAcquire(brokerState->cacheLock, LW_EXCLUSIVE);
+	for (int i = 0; i < KEYRING_CACHE_SIZE; i++)
+	{
+		KeyringCacheEntry *entry = &brokerState->cache[i];
+
+		if (!entry->valid || keyring_cache_entry_expired(entry, now))
+		{
+			if (free_entry < 0)
+				free_entry = i;
+			continue;
+		}
+
+		if (strcmp(entry->key_name, key_name) == 0 &&
+			memcmp(entry->keyring_id, id, sizeof(id)) == 0)
+		{
+			victim = i;
+			break;
+		}
+
+		if (entry->fetched_at < brokerState->cache[oldest].fetched_at)
+			oldest = i;
+	}
+
+	if (victim < 0)
+		victim = free_entry >= 0 ? free_entry : oldest;
+
+	brokerState->cache[victim].valid = true;
+	brokerState->cache[victim].fetched_at = now;
+	memcpy(brokerState->cache[victim].keyring_id, id, sizeof(id));
+	strlcpy(brokerState->cache[victim].key_name, key_name, TDE_KEY_NAME_LEN);
+	memcpy(&brokerState->cacheKeys[victim], key, sizeof(keyData));
+	LWLockRelease(brokerState->cacheLock);
+}
+
+/*
+ * Drops the cached copy of a key, called when a key is stored, so that the
+ * cache never returns a key the provider doesn't have anymore.
+ */
+void
+KeyringBrokerForgetKey(GenericKeyring *keyring, const char *key_name)
+{
+	BrokerKeyring target;
+	uint8		id[PG_SHA256_DIGEST_LENGTH];
+
+	if (brokerState == NULL)
+		return;
+
+	keyring_copy(&target, keyring);
+	keyring_cache_id(&target, id);
+	explicit_bzero(&target, sizeof(target));
+
+	LWLockAcquire(brokerState->cacheLock, LW_EXCLUSIVE);
+	for (int i = 0; i < KEYRING_CACHE_SIZE; i++)
+	{
+		KeyringCacheEntry *entry = &brokerState->cache[i];
+
+		if (entry->valid && strcmp(entry->key_name, key_name) == 0 &&
+			memcmp(entry->keyring_id, id, sizeof(id)) == 0)
+		{
+			entry->valid = false;
+			explicit_bzero(&brokerState->cacheKeys[i], sizeof(keyData));
+		}
+	}
+	LWLockRelease(brokerState->cacheLock);
+}
+
+/*
+ * ------------------------------
+ * Backend side
+ */
+
+static int
+broker_slot_claim(void)
+{
+	int			slotno = -1;
+
+	SpinLockAcquire(&brokerState->mutex);
+	for (int i = 0; i < KEYRING_BROKER_SLOTS; i++)
+	{
+		if (brokerState->slots[i].state == BROKER_SLOT_FREE)
+		{
+			brokerState->slots[i].state = BROKER_SLOT_FILLING;
+			slotno = i;
+			break;
+		}
+	}
+	SpinLockRelease(&brokerState->mutex);
+
+	return slotno;
+}
+
+static void
+broker_slot_release(int slotno)
+{
+	explicit_bzero(&brokerState->slots[slotno].keyring, sizeof(BrokerKeyring));
+
+	SpinLockAcquire(&brokerState->mutex);
+	explicit_bzero(&brokerState->slotKeys[slotno], sizeof(keyData));
+	brokerState->slots[slotno].state = BROKER_SLOT_FREE;
+	SpinLockRelease(&brokerState->mutex);
+}
+
+/*
+ * Gives the slot back if the backend errors out while waiting. If the broker
+ * is busy with the request, it frees the slot once it's done.
+ */
+static void
+broker_slot_abandon(int code, Datum arg)
+{
+	int			slotno = DatumGetInt32(arg);
+	BrokerSlot *slot = &brokerState->slots[slotno];
+
+	ConditionVariableCancelSleep();
+
+	SpinLockAcquire(&brokerState->mutex);
+	if (slot->state == BROKER_SLOT_IN_PROGRESS)
+		slot->state = BROKER_SLOT_ABANDONED;
+	else
+	{
+		explicit_bzero(&slot->keyring, sizeof(BrokerKeyring));
+		explicit_bzero(&brokerState->slotKeys[slotno], sizeof(keyData));
+		slot->state = BROKER_SLOT_FREE;
+	}
+	SpinLockRelease(&brokerState->mutex);
+}
+
+/*
+ * Fetches the key through the broker. Returns false if the broker couldn't
+ * serve the request, in which case the caller has to ask the provider itself.
+ * Errors of the provider are reported as if the caller had called it.
+ */
+bool
+KeyringBrokerGetKey(GenericKeyring *keyring, const char *key_name, bool throw_error, KeyringReturnCodes *returnCode, keyInfo **key)
+{
+	BrokerKeyring request;
+	keyData		data;
+	Latch	   *latch;
+	int			slotno;
+	BrokerSlot *slot;
+	BrokerSlotState state;
+	TimestampTz deadline;
+	bool		timed_out = false;
+	bool		found;
+	KeyringReturnCodes code;
+	int			sqlerrcode;
+	char		error[KEYRING_ERROR_LEN];
+	char		detail[KEYRING_ERROR_LEN];
+
+	Assert(KeyringBrokerUsable());
+
+	if (keyring->type != FILE_KEY_PROVIDER && keyring->type != VAULT_V2_KEY_PROVIDER)
+		return false;
+
+	keyring_copy(&request, keyring);
+
+	if (keyring_cache_lookup(&request, key_name, &data))
+	{
+		pg_atomic_fetch_add_u64(&brokerState->cacheHits, 1);
+		*key = palloc(sizeof(keyInfo));
+		strlcpy((*key)->name.name, key_name, sizeof((*key)->name.name));
+		memcpy(&(*key)->data, &data, sizeof(keyData));
+		explicit_bzero(&data, sizeof(keyData));
+		*returnCode = KEYRING_CODE_SUCCESS;
+		explicit_bzero(&request, sizeof(request));
+		return true;
+	}
+
+	slotno = broker_slot_claim();
+	if (slotno < 0)
+	{
+		explicit_bzero(&request, sizeof(request));
+		return false;
+	}
+
+	slot = &brokerState->slots[slotno];
+	memcpy(&slot->keyring, &request, sizeof(BrokerKeyring));
+	strlcpy(slot->key_name, key_name, sizeof(slot->key_name));
+	explicit_bzero(&request, sizeof(request));
+
+	SpinLockAcquire(&brokerState->mutex);
+	latch = brokerState->brokerLatch;
+	if (latch != NULL)
+		slot->state = BROKER_SLOT_REQUESTED;
+	else
+	{
+		explicit_bzero(&slot->keyring, sizeof(BrokerKeyring));
+		slot->state = BROKER_SLOT_FREE;
+	}
+	SpinLockRelease(&brokerState->mutex);
+
+	if (latch == NULL)
+		return false;
+
+	SetLatch(latch);
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), tde_keyring_broker_timeout);
+
+	PG_ENSURE_ERROR_CLEANUP(broker_slot_abandon, Int32GetDatum(slotno));
+	{
+		ConditionVariablePrepareToSleep(&slot->cv);
+		for (;;)
+		{
+			long		timeout;
+
+			SpinLockAcquire(&brokerState->mutex);
+			state = slot->state;
+			SpinLockRelease(&brokerState->mutex);
+
+			if (state == BROKER_SLOT_DONE || state == BROKER_SLOT_FAILED)
+				break;
+
+			timeout = TimestampDifferenceMilliseconds(GetCurrentTimestamp(), deadline);
+			if (timeout <= 0)
+			{
+				timed_out = true;
+				break;
+			}
+
+			(void) ConditionVariableTimedSleep(&slot->cv, timeout, PG_WAIT_EXTENSION);
+		}
+		ConditionVariableCancelSleep();
+	}
+	PG_END_ENSURE_ERROR_CLEANUP(broker_slot_abandon, Int32GetDatum(slotno));
+
+	/* The broker frees the slot if it is still at it */
+	if (timed_out)
+	{
+		broker_slot_abandon(0, Int32GetDatum(slotno));
+		pg_atomic_fetch_add_u64(&brokerState->timeouts, 1);
+		ereport(LOG,
+				(errmsg("pg_tde keyring broker did not answer within %d ms, fetching key \"%s\" directly",
+						tde_keyring_broker_timeout, key_name)));
+		return false;
+	}
+
+	if (state == BROKER_SLOT_FAILED)
+	{
+		broker_slot_release(slotno);
+		return false;
+	}
+
+	found = slot->found;
+	code = slot->return_code;
+	sqlerrcode = slot->sqlerrcode;
+	strlcpy(error, slot->error, sizeof(error));
+	strlcpy(detail, slot->errdetail, sizeof(detail));
+	if (found)
+		memcpy(&data, &brokerState->slotKeys[slotno], sizeof(keyData));
+	broker_slot_release(slotno);
+
+	if (error[0] != '\0')
+		ereport(throw_error ? ERROR : WARNING,
+				(errcode(sqlerrcode),
+				 errmsg("%s", error),
+				 detail[0] != '\0' ? errdetail("%s", detail) : 0));
+
+	*returnCode = code;
+	*key = NULL;
+	if (found)
+	{
+		*key = palloc(sizeof(keyInfo));
+		strlcpy((*key)->name.name, key_name, sizeof((*key)->name.name));
+		memcpy(&(*key)->data, &data, sizeof(keyData));
+		explicit_bzero(&data, sizeof(keyData));
+	}
+
+	return true;
+}
+
+/*
+ * ------------------------------
+ * Broker
+ */
+
+static void
+register_keyring_broker(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 5;
+	strcpy(worker.bgw_library_name, "pg_tde");
+	strcpy(worker.bgw_function_name, "pg_tde_keyring_broker_main");
+	strcpy(worker.bgw_name, "pg_tde keyring broker");
+	strcpy(worker.bgw_type, "pg_tde keyring broker");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Asks the provider for the key of the slot. Errors are caught and handed to
+ * the requesting backend, which raises them as its own.
+ */
+static void
+keyring_broker_fetch(int slotno)
+{
+	BrokerSlot *slot = &brokerState->slots[slotno];
+	MemoryContext oldcontext = MemoryContextSwitchTo(brokerContext);
+	keyInfo    *volatile key = NULL;
+
+	slot->found = false;
+	slot->return_code = KEYRING_CODE_SUCCESS;
+	slot->sqlerrcode = 0;
+	slot->error[0] = '\0';
+	slot->errdetail[0] = '\0';
+
+	PG_TRY();
+	{
+		KeyringReturnCodes code;
+
+		key = KeyringGetKey(&slot->keyring.generic, slot->key_name, true, &code);
+		slot->return_code = code;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(brokerContext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		LWLockReleaseAll();
+
+		slot->sqlerrcode = edata->sqlerrcode;
+		strlcpy(slot->error, edata->message, sizeof(slot->error));
+		if (edata->detail != NULL)
+			strlcpy(slot->errdetail, edata->detail, sizeof(slot->errdetail));
+		slot->return_code = KEYRING_CODE_RESOURCE_NOT_ACCESSABLE;
+		key = NULL;
+	}
+	PG_END_TRY();
+
+	if (key != NULL)
+	{
+		slot->found = true;
+		memcpy(&brokerState->slotKeys[slotno], &key->data, sizeof(keyData));
+		keyring_cache_insert(&slot->keyring, slot->key_name, &key->data);
+		explicit_bzero(key, sizeof(keyInfo));
+	}
+
+	/* The request is served, the token isn't needed anymore */
+	explicit_bzero(&slot->keyring, sizeof(BrokerKeyring));
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(brokerContext);
+}
+
+static void
+keyring_broker_serve(void)
+{
+	for (int i = 0; i < KEYRING_BROKER_SLOTS; i++)
+	{
+		BrokerSlot *slot = &brokerState->slots[i];
+		bool		requested;
+
+		SpinLockAcquire(&brokerState->mutex);
+		requested = slot->state == BROKER_SLOT_REQUESTED;
+		if (requested)
+			slot->state = BROKER_SLOT_IN_PROGRESS;
+		SpinLockRelease(&brokerState->mutex);
+
+		if (!requested)
+			continue;
+
+		keyring_broker_fetch(i);
+		pg_atomic_fetch_add_u64(&brokerState->requestsServed, 1);
+
+		SpinLockAcquire(&brokerState->mutex);
+		if (slot->state == BROKER_SLOT_ABANDONED)
+		{
+			explicit_bzero(&brokerState->slotKeys[i], sizeof(keyData));
+			slot->state = BROKER_SLOT_FREE;
+		}
+		else
+			slot->state = BROKER_SLOT_DONE;
+		SpinLockRelease(&brokerState->mutex);
+
+		ConditionVariableBroadcast(&slot->cv);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Stops accepting requests and sends the waiting backends to the providers.
+ */
+static void
+keyring_broker_shutdown(int code, Datum arg)
+{
+	SpinLockAcquire(&brokerState->mutex);
+	brokerState->brokerLatch = NULL;
+	for (int i = 0; i < KEYRING_BROKER_SLOTS; i++)
+	{
+		BrokerSlot *slot = &brokerState->slots[i];
+
+		if (slot->state == BROKER_SLOT_REQUESTED || slot->state == BROKER_SLOT_IN_PROGRESS)
+			slot->state = BROKER_SLOT_FAILED;
+		else if (slot->state == BROKER_SLOT_ABANDONED)
+		{
+			explicit_bzero(&slot->keyring, sizeof(BrokerKeyring));
+			slot->state = BROKER_SLOT_FREE;
+		}
+	}
+	SpinLockRelease(&brokerState->mutex);
+
+	for (int i = 0; i < KEYRING_BROKER_SLOTS; i++)
+		ConditionVariableBroadcast(&brokerState->slots[i].cv);
+}
+
+void
+pg_tde_keyring_broker_main(Datum main_arg)
+{
+	am_keyring_broker = true;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* Keep the keys out of swap */
+	if (mlock(brokerState->slotKeys, sizeof(brokerState->slotKeys) + sizeof(brokerState->cacheKeys)) == -1)
+		ereport(WARNING,
+				(errmsg("could not lock the keyring broker keys in memory: %m")));
+
+	brokerContext = AllocSetContextCreate(TopMemoryContext,
+										  "pg_tde keyring broker",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	before_shmem_exit(keyring_broker_shutdown, 0);
+
+	SpinLockAcquire(&brokerState->mutex);
+	brokerState->brokerLatch = MyLatch;
+	SpinLockRelease(&brokerState->mutex);
+
+	ereport(LOG,
+			(errmsg("pg_tde keyring broker started")));
+
+	for (;;)
+	{
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		keyring_broker_serve();
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L,
+						 PG_WAIT_EXTENSION);
+	}
+}
+
+/*
+ * Returns the number of requests served by the broker, of keys the backends
+ * found in the cache, and of requests the backends gave up waiting for.
+ * All zero if the broker is disabled.
+ */
+PG_FUNCTION_INFO_V1(pg_tde_keyring_broker_stats);
+Datum
+pg_tde_keyring_broker_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		isnull[3] = {false, false, false};
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context that cannot accept type record")));
+
+	values[0] = Int64GetDatum(brokerState ? pg_atomic_read_u64(&brokerState->requestsServed) : 0);
+	values[1] = Int64GetDatum(brokerState ? pg_atomic_read_u64(&brokerState->cacheHits) : 0);
+	values[2] = Int64GetDatum(brokerState ? pg_atomic_read_u64(&brokerState->timeouts) : 0);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, isnull)));
+}
@@ -31,6 +31,11 @@ size_t write_func(void *ptr, size_t size, size_t nmemb, struct CurlString *s)
 	return size*nmemb;
 }
 
+/*
+ * The easy handle lives as long as the process. curl_easy_reset() keeps its
+ * connection cache, so consecutive requests to the same server reuse the
+ * connection instead of doing the TCP and TLS handshakes again.
+ */
 bool curlSetupSession(const char* url, const char* caFile, CurlString* outStr)
 {
 	if(keyringCurl == NULL)
@@ -51,6 +56,7 @@ bool curlSetupSession(const char* url, const char* caFile, CurlString* outStr)
 	if(curl_easy_setopt(keyringCurl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK) return 0;
 	if(curl_easy_setopt(keyringCurl, CURLOPT_CONNECTTIMEOUT, 3) != CURLE_OK) return 0;
 	if(curl_easy_setopt(keyringCurl, CURLOPT_TIMEOUT, 10) != CURLE_OK) return 0;
+	if(curl_easy_setopt(keyringCurl, CURLOPT_TCP_KEEPALIVE, 1L) != CURLE_OK) return 0;
 	if(curl_easy_setopt(keyringCurl, CURLOPT_HTTP_VERSION,(long)CURL_HTTP_VERSION_1_1) != CURLE_OK) return 0;
 	if(curl_easy_setopt(keyringCurl, CURLOPT_WRITEFUNCTION,write_func) != CURLE_OK) return 0;
 	if(curl_easy_setopt(keyringCurl, CURLOPT_WRITEDATA,outStr) != CURLE_OK) return 0;
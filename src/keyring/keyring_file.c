@@ -4,6 +4,17 @@
  *	  Implements the file provider keyring
  *	  routines.
  *
+ * The keyring file is a plain array of keyInfo records, which only ever
+ * grows: keys are appended, never changed or removed. Every process keeps an
+ * in-memory index of the files it has read, mapping the hash of a key name to
+ * the record holding the key, so a lookup reads a single record instead of
+ * scanning the whole file. The index is checked against the size, the mtime
+ * and the inode of the file on every access: records appended since (by this
+ * or another process) are added to it, any other change rebuilds it.
+ *
+ * The key data itself is not kept in memory, only the position of the
+ * records.
+ *
  * IDENTIFICATION
  *	contrib/pg_tde/src/keyring/keyring_file.c
  *
@@ -15,86 +26,318 @@
 #include "keyring/keyring_file.h"
 #include "catalog/tde_keyring.h"
 #include "common/file_perm.h"
+#include "common/hashfn.h"
 #include "keyring/keyring_api.h"
 #include "storage/fd.h"
 #include "utils/wait_event.h"
 
 #ifdef FRONTEND
 #include "pg_tde_fe.h"
+#else
+#include "utils/memutils.h"
 #endif
 
 #include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+/* Records read at once when indexing a file */
+#define KEYRING_INDEX_READ_BATCH 64
+
+typedef struct FileKeyringIndex
+{
+	struct FileKeyringIndex *next;
+	char file_name[MAXPGPATH];
+
+	/* State of the file when it was last indexed */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+
+	uint32 nkeys;			/* number of records indexed */
+	bool partial;			/* the file ends with an incomplete record */
+	uint32 maxkeys;			/* allocated size of hashes */
+	uint32 *hashes;			/* hash of the lowercased name of every record */
+
+	/* Open addressing table of record numbers + 1, 0 for an empty slot */
+	uint32 nslots;			/* a power of 2, always more than 2 * nkeys */
+	uint32 *slots;
+} FileKeyringIndex;
+
+static FileKeyringIndex *fileKeyringIndexes = NULL;
+
 static keyInfo* get_key_by_name(GenericKeyring* keyring, const char* key_name, bool throw_error, KeyringReturnCodes *return_code);
 static KeyringReturnCodes set_key_by_name(GenericKeyring* keyring, keyInfo *key, bool throw_error);
+static uint32 key_name_hash(const char *key_name);
+static void *index_alloc(Size size);
+static FileKeyringIndex *get_file_index(const char *file_name);
+static void file_index_reset(FileKeyringIndex *index);
+static void file_index_insert(FileKeyringIndex *index, uint32 recno);
+static void file_index_add(FileKeyringIndex *index, uint32 hash);
+static bool file_index_refresh(FileKeyringIndex *index, int fd, bool throw_error, KeyringReturnCodes *return_code);
+static keyInfo *file_index_lookup(FileKeyringIndex *index, int fd, const char *key_name, bool throw_error, KeyringReturnCodes *return_code);
+
+/*
+ * Key names are compared case insensitively, so they are hashed lowercased.
+ */
+static uint32
+key_name_hash(const char *key_name)
+{
+	char lower[TDE_KEY_NAME_LEN];
+	int len;
 
-const TDEKeyringRoutine keyringFileRoutine = {
-	.keyring_get_key = get_key_by_name,
-	.keyring_store_key = set_key_by_name
-};
+	for (len = 0; len < TDE_KEY_NAME_LEN && key_name[len] != '\0'; len++)
+		lower[len] = pg_tolower((unsigned char) key_name[len]);
 
-bool
-InstallFileKeyring(void)
+	return hash_bytes((unsigned char *) lower, len);
+}
+
+/*
+ * The indexes live as long as the process.
+ */
+static void *
+index_alloc(Size size)
 {
-	return RegisterKeyProvider(&keyringFileRoutine, FILE_KEY_PROVIDER);
+#ifndef FRONTEND
+	return MemoryContextAllocZero(TopMemoryContext, size);
+#else
+	return palloc0(size);
+#endif
 }
 
+static FileKeyringIndex *
+get_file_index(const char *file_name)
+{
+	FileKeyringIndex *index;
 
-static keyInfo*
-get_key_by_name(GenericKeyring* keyring, const char* key_name, bool throw_error, KeyringReturnCodes *return_code)
+	for (index = fileKeyringIndexes; index != NULL; index = index->next)
+	{
+		if (strcmp(index->file_name, file_name) == 0)
+			return index;
+	}
+
+	index = index_alloc(sizeof(FileKeyringIndex));
+	strlcpy(index->file_name, file_name, sizeof(index->file_name));
+	index->maxkeys = 32;
+	index->hashes = index_alloc(index->maxkeys * sizeof(uint32));
+	index->nslots = 64;
+	index->slots = index_alloc(index->nslots * sizeof(uint32));
+
+	index->next = fileKeyringIndexes;
+	fileKeyringIndexes = index;
+
+	return index;
+}
+
+static void
+file_index_reset(FileKeyringIndex *index)
 {
-	keyInfo* key = NULL;
-	int fd = -1;
-	FileKeyring* file_keyring = (FileKeyring*)keyring;
-	off_t bytes_read = 0;
-	off_t curr_pos = 0;
+	memset(index->slots, 0, index->nslots * sizeof(uint32));
+	index->nkeys = 0;
+	index->partial = false;
+	index->dev = 0;
+	index->ino = 0;
+	index->size = 0;
+	index->mtime = 0;
+}
 
-	*return_code = KEYRING_CODE_SUCCESS;
+/*
+ * Linear probing keeps the records of the same hash in the order they are
+ * inserted, which is the order of the file, so a lookup finds the first of
+ * duplicate names, as a scan of the file would.
+ */
+static void
+file_index_insert(FileKeyringIndex *index, uint32 recno)
+{
+	uint32 mask = index->nslots - 1;
+	uint32 pos;
 
-	fd = BasicOpenFile(file_keyring->file_name, PG_BINARY);
-	if (fd < 0)
-		return NULL;
+	for (pos = index->hashes[recno] & mask; index->slots[pos] != 0; pos = (pos + 1) & mask)
+		;
+
+	index->slots[pos] = recno + 1;
+}
+
+static void
+file_index_add(FileKeyringIndex *index, uint32 hash)
+{
+	if (index->nkeys == index->maxkeys)
+	{
+		uint32 *hashes = index_alloc(index->maxkeys * 2 * sizeof(uint32));
+
+		memcpy(hashes, index->hashes, index->nkeys * sizeof(uint32));
+		pfree(index->hashes);
+		index->hashes = hashes;
+		index->maxkeys *= 2;
+	}
+
+	index->hashes[index->nkeys++] = hash;
+
+	if (index->nkeys * 2 > index->nslots)
+	{
+		pfree(index->slots);
+		index->nslots *= 2;
+		index->slots = index_alloc(index->nslots * sizeof(uint32));
+
+		for (uint32 recno = 0; recno < index->nkeys; recno++)
+			file_index_insert(index, recno);
+	}
+	else
+		file_index_insert(index, index->nkeys - 1);
+}
+
+/*
+ * Brings the index up to date with the file open as fd. Records appended
+ * since the last call are indexed, any other change of the file rebuilds the
+ * index from scratch.
+ */
+static bool
+file_index_refresh(FileKeyringIndex *index, int fd, bool throw_error, KeyringReturnCodes *return_code)
+{
+	struct stat st;
+	keyInfo *records;
+	off_t curr_pos;
+
+	if (fstat(fd, &st) != 0)
+	{
+		*return_code = KEYRING_CODE_RESOURCE_NOT_ACCESSABLE;
+		ereport(throw_error?ERROR:WARNING,
+			(errcode_for_file_access(),
+				errmsg("could not stat keyring file \"%s\": %m",
+					index->file_name)));
+		return false;
+	}
+
+	if (st.st_dev == index->dev && st.st_ino == index->ino &&
+		st.st_size == index->size && st.st_mtime == index->mtime)
+		return true;
 
-	key = palloc(sizeof(keyInfo));
-	while(true)
+	if (st.st_dev != index->dev || st.st_ino != index->ino ||
+		st.st_size < index->size ||
+		(st.st_size == index->size && st.st_mtime != index->mtime))
+		file_index_reset(index);
+
+	records = palloc(KEYRING_INDEX_READ_BATCH * sizeof(keyInfo));
+	curr_pos = (off_t) index->nkeys * sizeof(keyInfo);
+	while (curr_pos < st.st_size)
 	{
-		bytes_read = pg_pread(fd, key, sizeof(keyInfo), curr_pos);
-		curr_pos += bytes_read;
+		ssize_t bytes_read;
+		int nrecords;
 
-		if (bytes_read == 0 )
+		bytes_read = pg_pread(fd, records, KEYRING_INDEX_READ_BATCH * sizeof(keyInfo), curr_pos);
+		if (bytes_read < 0)
 		{
-			/*
-			 * Empty keyring file is considered as a valid keyring file that has no keys
-			 */
-			close(fd);
-			pfree(key);
-			return NULL;
+			explicit_bzero(records, KEYRING_INDEX_READ_BATCH * sizeof(keyInfo));
+			pfree(records);
+			*return_code = KEYRING_CODE_RESOURCE_NOT_ACCESSABLE;
+			ereport(throw_error?ERROR:WARNING,
+				(errcode_for_file_access(),
+					errmsg("could not read keyring file \"%s\": %m",
+						index->file_name)));
+			return false;
 		}
+
+		nrecords = bytes_read / sizeof(keyInfo);
+		for (int i = 0; i < nrecords; i++)
+			file_index_add(index, key_name_hash(records[i].name.name));
+		curr_pos += (off_t) nrecords * sizeof(keyInfo);
+
+		if (bytes_read < KEYRING_INDEX_READ_BATCH * sizeof(keyInfo))
+			break;
+	}
+	explicit_bzero(records, KEYRING_INDEX_READ_BATCH * sizeof(keyInfo));
+	pfree(records);
+
+	index->partial = curr_pos < st.st_size;
+	index->dev = st.st_dev;
+	index->ino = st.st_ino;
+	index->size = st.st_size;
+	index->mtime = st.st_mtime;
+
+	return true;
+}
+
+/*
+ * Reads the records the index points to for the key name until one of them
+ * has the name.
+ */
+static keyInfo *
+file_index_lookup(FileKeyringIndex *index, int fd, const char *key_name, bool throw_error, KeyringReturnCodes *return_code)
+{
+	uint32 hash = key_name_hash(key_name);
+	uint32 mask = index->nslots - 1;
+	keyInfo *key = palloc(sizeof(keyInfo));
+
+	for (uint32 pos = hash & mask; index->slots[pos] != 0; pos = (pos + 1) & mask)
+	{
+		uint32 recno = index->slots[pos] - 1;
+		off_t bytes_read;
+
+		if (index->hashes[recno] != hash)
+			continue;
+
+		bytes_read = pg_pread(fd, key, sizeof(keyInfo), (off_t) recno * sizeof(keyInfo));
 		if (bytes_read != sizeof(keyInfo))
 		{
-			close(fd);
 			pfree(key);
-			/* Corrupt file */
 			*return_code = KEYRING_CODE_DATA_CORRUPTED;
 			ereport(throw_error?ERROR:WARNING,
 				(errcode_for_file_access(),
 					errmsg("keyring file \"%s\" is corrupted: %m",
-						file_keyring->file_name),
-						errdetail("invalid key size %llu expected %lu", bytes_read, sizeof(keyInfo))));
+						index->file_name),
+						errdetail("invalid key size %llu expected %lu", (unsigned long long) bytes_read, sizeof(keyInfo))));
 			return NULL;
 		}
+
 		if (strncasecmp(key->name.name, key_name, sizeof(key->name.name)) == 0)
-		{
-			close(fd);
 			return key;
-		}
 	}
-	close(fd);
+
+	explicit_bzero(key, sizeof(keyInfo));
 	pfree(key);
+
+	if (index->partial)
+	{
+		/* The key might be the one being written, or the file is corrupt */
+		*return_code = KEYRING_CODE_DATA_CORRUPTED;
+		ereport(throw_error?ERROR:WARNING,
+			(errcode_for_file_access(),
+				errmsg("keyring file \"%s\" is corrupted",
+					index->file_name),
+					errdetail("file size %llu is not a multiple of the key size %lu",
+						(unsigned long long) index->size, sizeof(keyInfo))));
+	}
+
 	return NULL;
 }
 
+static keyInfo*
+get_key_by_name(GenericKeyring* keyring, const char* key_name, bool throw_error, KeyringReturnCodes *return_code)
+{
+	keyInfo* key = NULL;
+	int fd = -1;
+	FileKeyring* file_keyring = (FileKeyring*)keyring;
+	FileKeyringIndex *index;
+
+	*return_code = KEYRING_CODE_SUCCESS;
+
+	fd = BasicOpenFile(file_keyring->file_name, PG_BINARY);
+	if (fd < 0)
+		return NULL;
+
+	index = get_file_index(file_keyring->file_name);
+	if (file_index_refresh(index, fd, throw_error, return_code))
+		key = file_index_lookup(index, fd, key_name, throw_error, return_code);
+
+	close(fd);
+	return key;
+}
+
+/*
+ * Appends the key to the keyring file. A key with the same name must not
+ * exist in the keyring yet.
+ */
 static KeyringReturnCodes
 set_key_by_name(GenericKeyring* keyring, keyInfo *key, bool throw_error)
 {
@@ -102,21 +345,40 @@ set_key_by_name(GenericKeyring* keyring, keyInfo *key, bool throw_error)
 	off_t curr_pos = 0;
 	int fd;
 	FileKeyring* file_keyring = (FileKeyring*)keyring;
+	FileKeyringIndex *index;
 	keyInfo *existing_key;
 	KeyringReturnCodes return_code = KEYRING_CODE_SUCCESS;
 
 	Assert(key != NULL);
-	/* See if the key with same name already exists */
-	existing_key = get_key_by_name(keyring, key->name.name, false, &return_code);
-	if (existing_key)
+
+	/*
+	 * See if a key with the same name already exists. The file is only
+	 * created once we know the key can be added to it.
+	 */
+	fd = BasicOpenFile(file_keyring->file_name, O_RDWR | PG_BINARY);
+	if (fd >= 0)
 	{
-		pfree(existing_key);
-		ereport(throw_error ? ERROR : WARNING,
-				(errmsg("Key with name %s already exists in keyring", key->name.name)));
-		return KEYRING_CODE_INVALID_OPERATION;
+		index = get_file_index(file_keyring->file_name);
+		if (!file_index_refresh(index, fd, throw_error, &return_code))
+		{
+			close(fd);
+			return return_code;
+		}
+
+		existing_key = file_index_lookup(index, fd, key->name.name, false, &return_code);
+		if (existing_key)
+		{
+			explicit_bzero(existing_key, sizeof(keyInfo));
+			pfree(existing_key);
+			close(fd);
+			ereport(throw_error ? ERROR : WARNING,
+					(errmsg("Key with name %s already exists in keyring", key->name.name)));
+			return KEYRING_CODE_INVALID_OPERATION;
+		}
 	}
+	else if (errno == ENOENT)
+		fd = BasicOpenFile(file_keyring->file_name, O_CREAT | O_RDWR | PG_BINARY);
 
-	fd = BasicOpenFile(file_keyring->file_name, O_CREAT | O_RDWR | PG_BINARY);
 	if (fd < 0)
 	{
 		ereport(throw_error?ERROR:WARNING,
@@ -124,6 +386,7 @@ set_key_by_name(GenericKeyring* keyring, keyInfo *key, bool throw_error)
 			errmsg("Failed to open keyring file %s :%m", file_keyring->file_name)));
 		return KEYRING_CODE_RESOURCE_NOT_ACCESSABLE;
 	}
+
 	/* Write key to the end of file */
 	curr_pos = lseek(fd, 0, SEEK_END);
 	bytes_written = pg_pwrite(fd, key, sizeof(keyInfo), curr_pos);
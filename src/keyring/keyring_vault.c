@@ -65,6 +65,7 @@ static JsonParseErrorType parse_json_response(JsonVaultRespState	*parse, JsonLex
 struct curl_slist *curlList = NULL;
 
 static bool curl_setup_token(VaultV2Keyring *keyring);
+static void curl_clear_token(void);
 static char *get_keyring_vault_url(VaultV2Keyring *keyring, const char *key_name, char *out, size_t out_size);
 static bool curl_perform(VaultV2Keyring *keyring, const char *url, CurlString *outStr, long *httpCode, const char *postData);
 
@@ -82,27 +83,45 @@ bool InstallVaultV2Keyring(void)
 	return RegisterKeyProvider(&keyringVaultV2Routine, VAULT_V2_KEY_PROVIDER);
 }
 
+/*
+ * The headers carry the token, so they are built for every request and wiped
+ * by curl_clear_token() as soon as it is done. The connection itself is kept
+ * by the curl handle.
+ */
 static bool
 curl_setup_token(VaultV2Keyring *keyring)
 {
-	if(curlList == NULL)
-	{
-		char tokenHeader[256];
-		strcpy(tokenHeader, "X-Vault-Token:");
-		strcat(tokenHeader, keyring->vault_token);
+	char tokenHeader[256];
 
-		curlList = curl_slist_append(curlList, tokenHeader);
-		if(curlList == NULL) return 0;
+	curl_clear_token();
 
-		curlList = curl_slist_append(curlList, "Content-Type: application/json");
-		if(curlList == NULL) return 0;
-	}
+	snprintf(tokenHeader, sizeof(tokenHeader), "X-Vault-Token:%s", keyring->vault_token);
+	curlList = curl_slist_append(curlList, tokenHeader);
+	explicit_bzero(tokenHeader, sizeof(tokenHeader));
+	if(curlList == NULL) return 0;
+
+	if(curl_slist_append(curlList, "Content-Type: application/json") == NULL) return 0;
 
 	if(curl_easy_setopt(keyringCurl, CURLOPT_HTTPHEADER, curlList) != CURLE_OK) return 0;
 
 	return 1;
 }
 
+static void
+curl_clear_token(void)
+{
+	if(curlList == NULL)
+		return;
+
+	curl_easy_setopt(keyringCurl, CURLOPT_HTTPHEADER, NULL);
+
+	for(struct curl_slist *item = curlList; item != NULL; item = item->next)
+		explicit_bzero(item->data, strlen(item->data));
+
+	curl_slist_free_all(curlList);
+	curlList = NULL;
+}
+
 static bool
 curl_perform(VaultV2Keyring *keyring, const char *url, CurlString *outStr, long *httpCode, const char *postData)
 {
@@ -121,14 +140,22 @@ curl_perform(VaultV2Keyring *keyring, const char *url, CurlString *outStr, long
 		return 0;
 
 	if (!curl_setup_token(keyring))
+	{
+		curl_clear_token();
 		return 0;
+	}
 
 	if(postData != NULL)
 	{
-		if(curl_easy_setopt(keyringCurl, CURLOPT_POSTFIELDS, postData) != CURLE_OK) return 0;
+		if(curl_easy_setopt(keyringCurl, CURLOPT_POSTFIELDS, postData) != CURLE_OK)
+		{
+			curl_clear_token();
+			return 0;
+		}
 	}
 
 	ret = curl_easy_perform(keyringCurl);
+	curl_clear_token();
 	if (ret != CURLE_OK)
 	{
 		elog(LOG, "curl_easy_perform failed with return code: %d", ret);
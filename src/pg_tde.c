@@ -19,13 +19,16 @@
 #include "storage/lwlock.h"
 #include "storage/shmem.h"
 #include "access/pg_tde_ddl.h"
+#include "access/pg_tde_keycache.h"
 #include "access/pg_tde_xlog.h"
 #include "access/pg_tde_xlog_encrypt.h"
 #include "encryption/enc_aes.h"
+#include "encryption/enc_tde.h"
 #include "access/pg_tde_tdemap.h"
 #include "access/xlog.h"
 #include "access/xloginsert.h"
 #include "keyring/keyring_api.h"
+#include "keyring/keyring_broker.h"
 #include "common/pg_tde_shmem.h"
 #include "common/pg_tde_utils.h"
 #include "catalog/tde_principal_key.h"
@@ -54,12 +57,16 @@ static void run_extension_install_callbacks(XLogExtensionInstall *xlrec, bool re
 void _PG_init(void);
 Datum pg_tde_extension_initialize(PG_FUNCTION_ARGS);
 Datum pg_tde_version(PG_FUNCTION_ARGS);
+Datum pg_tde_crypto_kernel(PG_FUNCTION_ARGS);
+Datum pg_tde_wal_key_fingerprint(PG_FUNCTION_ARGS);
 
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
 
 PG_FUNCTION_INFO_V1(pg_tde_extension_initialize);
 PG_FUNCTION_INFO_V1(pg_tde_version);
+PG_FUNCTION_INFO_V1(pg_tde_crypto_kernel);
+PG_FUNCTION_INFO_V1(pg_tde_wal_key_fingerprint);
 static void
 tde_shmem_request(void)
 {
@@ -68,6 +75,9 @@ tde_shmem_request(void)
 
 #ifdef PERCONA_EXT
 	sz = add_size(sz, XLOG_TDE_ENC_BUFF_ALIGNED_SIZE);
+	sz = add_size(sz, TDEXLogKeystreamShmemSize());
+	sz = add_size(sz, TDEXLogCryptShmemSize());
+	sz = add_size(sz, TDEXLogDecryptCacheShmemSize());
 #endif
 
 	if (prev_shmem_request_hook)
@@ -103,9 +113,13 @@ _PG_init(void)
 	}
 
 	InitializePrincipalKeyInfo();
+	InitializeSharedRelKeyCache();
 	InitializeKeyProviderInfo();
+	InitializeKeyringBroker();
+	CryptoInitGUC();
 #ifdef PERCONA_EXT
 	XLogInitGUC();
+	TDESmgrInitGUC();
 #endif
 	prev_shmem_request_hook = shmem_request_hook;
 	shmem_request_hook = tde_shmem_request;
@@ -190,3 +204,28 @@ pg_tde_version(PG_FUNCTION_ARGS)
 {
 	PG_RETURN_TEXT_P(cstring_to_text(pg_tde_package_string()));
 }
+
+/* Returns the active crypto kernels */
+Datum
+pg_tde_crypto_kernel(PG_FUNCTION_ARGS)
+{
+	char		buf[256];
+
+	AesDescribeKernels(buf, sizeof(buf));
+
+	PG_RETURN_TEXT_P(cstring_to_text(buf));
+}
+
+/* Returns the fingerprint of the WAL key, NULL if there is none */
+Datum
+pg_tde_wal_key_fingerprint(PG_FUNCTION_ARGS)
+{
+#ifdef PERCONA_EXT
+	char		buf[TDE_XLOG_KEY_FINGERPRINT_LEN * 2 + 1];
+
+	if (TDEXLogKeyFingerprint(buf))
+		PG_RETURN_TEXT_P(cstring_to_text(buf));
+#endif
+
+	PG_RETURN_NULL();
+}
@@ -119,9 +119,7 @@ pg_tde_ddl_command_start_capture(PG_FUNCTION_ARGS)
 		{
 			tablespace_oid = stmt->tablespacename != NULL ? get_tablespace_oid(stmt->tablespacename, false) 
 							 : MyDatabaseTableSpace;  
-			LWLockAcquire(tde_lwlock_enc_keys(), LW_SHARED);
-			principal_key = GetPrincipalKey(MyDatabaseId, tablespace_oid, LW_SHARED);
-			LWLockRelease(tde_lwlock_enc_keys());
+			principal_key = GetPrincipalKeySnapshot(MyDatabaseId, tablespace_oid);
 			if (principal_key == NULL)
 			{
 				ereport(ERROR,
@@ -156,9 +154,7 @@ pg_tde_ddl_command_start_capture(PG_FUNCTION_ARGS)
 
 		if (tdeCurrentCreateEvent.encryptMode)
 		{
-			LWLockAcquire(tde_lwlock_enc_keys(), LW_SHARED);
-			principal_key = GetPrincipalKey(MyDatabaseId, tablespace_oid, LW_SHARED);
-			LWLockRelease(tde_lwlock_enc_keys());
+			principal_key = GetPrincipalKeySnapshot(MyDatabaseId, tablespace_oid);
 			if (principal_key == NULL)
 			{
 				ereport(ERROR,
@@ -4,14 +4,118 @@
 #include "storage/smgr.h"
 #include "storage/md.h"
 #include "catalog/catalog.h"
+#include "utils/guc.h"
 #include "encryption/enc_aes.h"
+#include "access/pg_tde_keycache.h"
 #include "access/pg_tde_tdemap.h"
 #include "pg_tde_event_capture.h"
 
 #ifdef PERCONA_EXT
 
+typedef enum TDESMgrKeyState
+{
+	TDE_SMGR_KEY_UNKNOWN,		/* not resolved since the relation was opened */
+	TDE_SMGR_KEY_NONE,			/* the relation is not encrypted */
+	TDE_SMGR_KEY_VALID			/* relKey is the key of the relation */
+} TDESMgrKeyState;
+
+typedef struct TDESMgrRelationData
+{
+	/* parent data, must be first */
+	SMgrRelationData reln;
+
+	TDESMgrKeyState key_state;
+	uint64		key_generation; /* pg_tde_key_generation() at resolution */
+	RelKeyData *relKey;			/* record of the backend relation key cache */
+} TDESMgrRelationData;
+
+typedef TDESMgrRelationData *TDESMgrRelation;
+
+/* GUC */
+static int tde_page_cipher = TDE_PAGE_CIPHER_XTS;
+
+static const struct config_enum_entry tde_page_cipher_options[] = {
+	{"cbc", TDE_PAGE_CIPHER_CBC, false},
+	{"xts", TDE_PAGE_CIPHER_XTS, false},
+	{NULL, 0, false}
+};
+
+void
+TDESmgrInitGUC(void)
+{
+	DefineCustomEnumVariable("pg_tde.page_cipher",	/* name */
+							 "Cipher mode used to encrypt pages of newly created relations.",	/* short_desc */
+							 NULL,	/* long_desc */
+							 &tde_page_cipher, /* value address */
+							 TDE_PAGE_CIPHER_XTS,	/* boot value */
+							 tde_page_cipher_options,	/* options */
+							 PGC_SUSET,	/* context */
+							 0, /* flags */
+							 NULL,	/* check_hook */
+							 NULL,	/* assign_hook */
+							 NULL	/* show_hook */
+		);
+}
+
+/*
+ * Page encryption/decryption.
+ *
+ * The page cipher of a relation is chosen at creation time and recorded in
+ * its key map entry:
+ *  - TDE_PAGE_CIPHER_CBC: AES-128-CBC, the IV is the block number. CBC
+ *    encryption is serial, every 16 byte block depends on the previous one.
+ *  - TDE_PAGE_CIPHER_XTS: AES-128-XTS, the tweak is (block number, fork).
+ *    All the blocks of a page are independent and are processed in parallel
+ *    by the AES units.
+ */
+static void
+tde_encrypt_page(RelKeyData *rkd, ForkNumber forknum, BlockNumber blocknum, const char *in, char *out)
+{
+	int out_len = BLCKSZ;
+	unsigned char iv[16] = {0,};
+
+	if (rkd->internal_key.page_cipher == TDE_PAGE_CIPHER_XTS)
+	{
+		memcpy(iv, &blocknum, sizeof(BlockNumber));
+		memcpy(iv + sizeof(BlockNumber), &forknum, sizeof(ForkNumber));
+
+		AesXtsEncryptWithCtx(&rkd->internal_key.ctx, rkd->internal_key.key, iv, (const unsigned char *) in, BLCKSZ, (unsigned char *) out, &out_len);
+	}
+	else
+	{
+		memcpy(iv+4, &blocknum, sizeof(BlockNumber));
+
+		AesEncryptWithCtx(&rkd->internal_key.ctx, rkd->internal_key.key, iv, (const unsigned char *) in, BLCKSZ, (unsigned char *) out, &out_len);
+	}
+}
+
+static void
+tde_decrypt_page(RelKeyData *rkd, ForkNumber forknum, BlockNumber blocknum, char *buffer)
+{
+	int out_len = BLCKSZ;
+	unsigned char iv[16] = {0,};
+
+	if (rkd->internal_key.page_cipher == TDE_PAGE_CIPHER_XTS)
+	{
+		memcpy(iv, &blocknum, sizeof(BlockNumber));
+		memcpy(iv + sizeof(BlockNumber), &forknum, sizeof(ForkNumber));
+
+		AesXtsDecryptWithCtx(&rkd->internal_key.ctx, rkd->internal_key.key, iv, (unsigned char *) buffer, BLCKSZ, (unsigned char *) buffer, &out_len);
+	}
+	else
+	{
+		memcpy(iv+4, &blocknum, sizeof(BlockNumber));
+
+		AesDecryptWithCtx(&rkd->internal_key.ctx, rkd->internal_key.key, iv, (unsigned char *) buffer, BLCKSZ, (unsigned char *) buffer, &out_len);
+	}
+}
+
+/*
+ * Looks up the key of the relation, creating it if the relation is being
+ * created encrypted. Returns NULL if the relation is not encrypted.
+ */
 static RelKeyData*
-tde_smgr_get_key(SMgrRelation reln)
+tde_smgr_find_key(SMgrRelation reln)
 {
 	TdeCreateEvent *event;
 	RelKeyData *rkd;
@@ -23,16 +127,18 @@ tde_smgr_get_key(SMgrRelation reln)
 		return NULL;
 	}
 
-	LWLockAcquire(tde_lwlock_enc_keys(), LW_SHARED);
-	pk = GetPrincipalKey(reln->smgr_rlocator.locator.dbOid, reln->smgr_rlocator.locator.spcOid, LW_SHARED);
-	LWLockRelease(tde_lwlock_enc_keys());
+	event = GetCurrentTdeCreateEvent();
+
+	/* Unencrypted relations: no principal key lookup, no key file access */
+	if (!event->encryptMode && !pg_tde_rel_may_have_key(&reln->smgr_rlocator.locator))
+		return NULL;
+
+	pk = GetPrincipalKeySnapshot(reln->smgr_rlocator.locator.dbOid, reln->smgr_rlocator.locator.spcOid);
 	if(pk == NULL)
 	{
 		return NULL;
 	}
 
-	event = GetCurrentTdeCreateEvent();
-
 	// see if we have a key for the relation, and return if yes
 	rkd = GetRelationKey(reln->smgr_rlocator.locator);
 
@@ -44,7 +150,7 @@ tde_smgr_get_key(SMgrRelation reln)
 	// if this is a CREATE TABLE, we have to generate the key
 	if(event->encryptMode == true && event->eventType == TDE_TABLE_CREATE_EVENT)
 	{
-		return pg_tde_create_key_map_entry(&reln->smgr_rlocator.locator);
+		return pg_tde_create_key_map_entry(&reln->smgr_rlocator.locator, tde_page_cipher);
 	}
 	
 	// if this is a CREATE INDEX, we have to load the key based on the table
@@ -52,18 +158,60 @@ tde_smgr_get_key(SMgrRelation reln)
 	{
 		// For now keep it simple and create separate key for indexes
 		// Later we might modify the map infrastructure to support the same keys
-		return pg_tde_create_key_map_entry(&reln->smgr_rlocator.locator);
+		return pg_tde_create_key_map_entry(&reln->smgr_rlocator.locator, tde_page_cipher);
 	}
 
 	return NULL;
 }
 
+static void
+tde_smgr_forget_key(TDESMgrRelation tdereln)
+{
+	tdereln->key_state = TDE_SMGR_KEY_UNKNOWN;
+	tdereln->relKey = NULL;
+}
+
+/*
+ * Returns the key of the relation, NULL if it is not encrypted.
+ *
+ * The answer is resolved on the first I/O after the relation is opened and
+ * kept in the SMgrRelation, along with the key generation of the cluster at
+ * that time. It stays valid until a relation key is created or removed
+ * anywhere in the cluster, so the usual cost is a single read of shared
+ * memory, without any lock.
+ *
+ * The key itself is not copied: the SMgrRelation points to the record of
+ * the backend relation key cache, which is locked in memory. A record is
+ * only evicted along with a change of the key generation, so the pointer is
+ * never used after that.
+ */
+static RelKeyData*
+tde_smgr_get_key(SMgrRelation reln)
+{
+	TDESMgrRelation tdereln = (TDESMgrRelation) reln;
+	uint64		generation = pg_tde_key_generation();
+	RelKeyData *rkd;
+
+	if (tdereln->key_state != TDE_SMGR_KEY_UNKNOWN && tdereln->key_generation == generation)
+		return tdereln->relKey;
+
+	tde_smgr_forget_key(tdereln);
+
+	rkd = tde_smgr_find_key(reln);
+	if (rkd != NULL)
+		AesInit();
+
+	tdereln->relKey = rkd;
+	tdereln->key_generation = generation;
+	tdereln->key_state = rkd != NULL ? TDE_SMGR_KEY_VALID : TDE_SMGR_KEY_NONE;
+
+	return rkd;
+}
+
 static void
 tde_mdwritev(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 		 const void **buffers, BlockNumber nblocks, bool skipFsync)
 {
-	AesInit();
-
 	RelKeyData* rkd = tde_smgr_get_key(reln);
 
 	if(rkd == NULL)
@@ -80,14 +228,9 @@ tde_mdwritev(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 
 		for(int i = 0; i  < nblocks; ++i )
 		{
-			int out_len = BLCKSZ;
 			local_buffers[i] = &local_blocks_aligned[i * BLCKSZ];
 
-			BlockNumber bn = blocknum + i;
-			unsigned char iv[16] = {0,};
-			memcpy(iv+4, &bn, sizeof(BlockNumber));
-
-			AesEncrypt(rkd->internal_key.key, iv, ((char**)buffers)[i], BLCKSZ, local_buffers[i], &out_len);
+			tde_encrypt_page(rkd, forknum, blocknum + i, ((char**)buffers)[i], (char *) local_buffers[i]);
 		}
 
 		mdwritev(reln, forknum, blocknum,
@@ -104,8 +247,6 @@ tde_mdextend(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 {
 	RelKeyData *rkd;
 
-	AesInit();
-
 	rkd = tde_smgr_get_key(reln);
 
 	if(rkd == NULL)
@@ -119,12 +260,8 @@ tde_mdextend(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 
 		char *local_blocks = palloc(BLCKSZ * (1 + 1));
 		char *local_blocks_aligned = (char *)TYPEALIGN(PG_IO_ALIGN_SIZE, local_blocks);
-		int out_len = BLCKSZ;
-
-		unsigned char iv[16] = {0,};
-		memcpy(iv+4, &blocknum, sizeof(BlockNumber));
 
-		AesEncrypt(rkd->internal_key.key, iv, ((char*)buffer), BLCKSZ, local_blocks_aligned, &out_len);
+		tde_encrypt_page(rkd, forknum, blocknum, (const char *) buffer, local_blocks_aligned);
 
 		mdextend(reln, forknum, blocknum, local_blocks_aligned, skipFsync);
 
@@ -137,9 +274,6 @@ tde_mdreadv(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 		void **buffers, BlockNumber nblocks)
 {
 	RelKeyData *rkd;
-	int out_len = BLCKSZ;
-
-	AesInit();
 
 	mdreadv(reln, forknum, blocknum, buffers, nblocks);
 
@@ -167,11 +301,7 @@ tde_mdreadv(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 		if(allZero)
 			continue;
 
-		BlockNumber bn = blocknum + i;
-		unsigned char iv[16] = {0,};
-		memcpy(iv+4, &bn, sizeof(BlockNumber));
-
-		AesDecrypt(rkd->internal_key.key, iv, ((char **)buffers)[i], BLCKSZ, ((char **)buffers)[i], &out_len);
+		tde_decrypt_page(rkd, forknum, blocknum + i, ((char **)buffers)[i]);
 	}
 }
 
@@ -181,18 +311,39 @@ tde_mdcreate(SMgrRelation reln, ForkNumber forknum, bool isRedo)
 	// This is the only function that gets called during actual CREATE TABLE/INDEX (EVENT TRIGGER)
 	// so we create the key here by loading it
 	// Later calls then decide to encrypt or not based on the existence of the key
+	tde_smgr_forget_key((TDESMgrRelation) reln);
 	tde_smgr_get_key(reln);
 	return mdcreate(reln, forknum, isRedo);
 }
 
+static void
+tde_mdopen(SMgrRelation reln)
+{
+	TDESMgrRelation tdereln = (TDESMgrRelation) reln;
+
+	tde_smgr_forget_key(tdereln);
+
+	mdopen(reln);
+}
+
+static void
+tde_mdclose(SMgrRelation reln, ForkNumber forknum)
+{
+	mdclose(reln, forknum);
+
+	/* All the forks are closed together, forget the key with the first one */
+	if (forknum == MAIN_FORKNUM)
+		tde_smgr_forget_key((TDESMgrRelation) reln);
+}
+
 
 static SMgrId tde_smgr_id;
 static const struct f_smgr tde_smgr = {
 	.name = "tde",
 	.smgr_init = mdinit,
 	.smgr_shutdown = NULL,
-	.smgr_open = mdopen,
-	.smgr_close = mdclose,
+	.smgr_open = tde_mdopen,
+	.smgr_close = tde_mdclose,
 	.smgr_create = tde_mdcreate,
 	.smgr_exists = mdexists,
 	.smgr_unlink = mdunlink,
@@ -210,7 +361,7 @@ static const struct f_smgr tde_smgr = {
 
 void RegisterStorageMgr(void)
 {
-    tde_smgr_id = smgr_register(&tde_smgr, 0);
+    tde_smgr_id = smgr_register(&tde_smgr, sizeof(TDESMgrRelationData));
 
 	// TODO: figure out how this part should work in a real extension
 	storage_manager_id = tde_smgr_id; 
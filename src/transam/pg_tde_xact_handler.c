@@ -20,7 +20,6 @@
 
 typedef struct PendingMapEntryDelete
 {
-    off_t   map_entry_offset;               /* map entry offset */
     RelFileLocator rlocator;                /* main for use as relation OID */
     bool    atCommit;                       /* T=delete at commit; F=delete at abort */
     int     nestLevel;                      /* xact nesting level of request */
@@ -74,11 +73,10 @@ pg_tde_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 }
 
 void
-RegisterEntryForDeletion(const RelFileLocator *rlocator, off_t map_entry_offset, bool atCommit)
+RegisterEntryForDeletion(const RelFileLocator *rlocator, bool atCommit)
 {
     PendingMapEntryDelete *pending;
     pending = (PendingMapEntryDelete *) MemoryContextAlloc(TopMemoryContext, sizeof(PendingMapEntryDelete));
-    pending->map_entry_offset = map_entry_offset;
     memcpy(&pending->rlocator, rlocator, sizeof(RelFileLocator));
     pending->atCommit = atCommit;  /* delete if abort */
     pending->nestLevel = GetCurrentTransactionNestLevel();
@@ -121,9 +119,9 @@ do_pending_deletes(bool isCommit)
         if (pending->atCommit == isCommit)
         {
             ereport(LOG,
-                    (errmsg("pg_tde_xact_callback: deleting entry at offset %d",
-                            (int)(pending->map_entry_offset))));
-            pg_tde_free_key_map_entry(&pending->rlocator, pending->map_entry_offset);
+                    (errmsg("pg_tde_xact_callback: deleting entry of relation %u",
+                            pending->rlocator.relNumber)));
+            pg_tde_free_key_map_entry(&pending->rlocator);
         }
         pfree(pending);
         /* prev does not change */
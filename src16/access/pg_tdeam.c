@@ -490,6 +490,35 @@ tdeheapgetpage(TableScanDesc sscan, BlockNumber block)
 	scan->rs_ntuples = ntup;
 }
 
+/*
+ * tdeheap_decrypt_pagescan - decrypt the visible tuples of the current page
+ *
+ * Decrypts all the tuples found visible by tdeheapgetpage() into the
+ * decrypted page of the scan at once, instead of decrypting every tuple when
+ * it is stored in the slot. The key of the relation is looked up only once
+ * per scan. Has to be called once rs_vistuples[] is filled for the page.
+ */
+void
+tdeheap_decrypt_pagescan(TableScanDesc sscan)
+{
+	HeapScanDesc scan = (HeapScanDesc) sscan;
+	Relation	rel = scan->rs_base.rs_rd;
+
+	/* TOAST data is encrypted separately, the tuples are stored as is */
+	if (rel->rd_rel->relkind == RELKIND_TOASTVALUE)
+		return;
+
+	if (scan->rs_decrypted_page == NULL)
+	{
+		scan->rs_decrypted_page = MemoryContextAlloc(GetMemoryChunkContext(scan), BLCKSZ);
+		scan->rs_relation_key = GetRelationKey(rel->rd_locator);
+	}
+
+	pg_tde_decrypt_page_tuples(BufferGetPage(scan->rs_cbuf), scan->rs_cblock,
+							   scan->rs_vistuples, scan->rs_ntuples,
+							   scan->rs_decrypted_page, scan->rs_relation_key);
+}
+
 /*
  * tdeheapgettup_initial_block - return the first BlockNumber to scan
  *
@@ -890,6 +919,7 @@ tdeheapgettup_pagemode(HeapScanDesc scan,
 	while (block != InvalidBlockNumber)
 	{
 		tdeheapgetpage((TableScanDesc) scan, block);
+		tdeheap_decrypt_pagescan((TableScanDesc) scan);
 		page = BufferGetPage(scan->rs_cbuf);
 		TestForOldSnapshot(scan->rs_base.rs_snapshot, scan->rs_base.rs_rd, page);
 		linesleft = scan->rs_ntuples;
@@ -907,7 +937,10 @@ continue_page:
 			lpp = PageGetItemId(page, lineoff);
 			Assert(ItemIdIsNormal(lpp));
 
-			tuple->t_data = (HeapTupleHeader) PageGetItem(page, lpp);
+			if (scan->rs_decrypted_page != NULL)
+				tuple->t_data = (HeapTupleHeader) (scan->rs_decrypted_page + ItemIdGetOffset(lpp));
+			else
+				tuple->t_data = (HeapTupleHeader) PageGetItem(page, lpp);
 			tuple->t_len = ItemIdGetLength(lpp);
 			ItemPointerSet(&(tuple->t_self), block, lineoff);
 
@@ -969,6 +1002,8 @@ tdeheap_beginscan(Relation relation, Snapshot snapshot,
 	scan->rs_base.rs_flags = flags;
 	scan->rs_base.rs_parallel = parallel_scan;
 	scan->rs_strategy = NULL;	/* set in initscan */
+	scan->rs_decrypted_page = NULL;
+	scan->rs_relation_key = NULL;
 
 	/*
 	 * Disable page-at-a-time mode if it's not a MVCC-safe snapshot.
@@ -1090,6 +1125,9 @@ tdeheap_endscan(TableScanDesc sscan)
 	if (scan->rs_parallelworkerdata != NULL)
 		pfree(scan->rs_parallelworkerdata);
 
+	if (scan->rs_decrypted_page != NULL)
+		pfree(scan->rs_decrypted_page);
+
 	if (scan->rs_base.rs_flags & SO_TEMP_SNAPSHOT)
 		UnregisterSnapshot(scan->rs_base.rs_snapshot);
 
@@ -1170,8 +1208,11 @@ tdeheap_getnextslot(TableScanDesc sscan, ScanDirection direction, TupleTableSlot
 
 	pgstat_count_tdeheap_getnext(scan->rs_base.rs_rd);
 
-	PGTdeExecStoreBufferHeapTuple(sscan->rs_rd, &scan->rs_ctup, slot,
-							 scan->rs_cbuf);
+	if (sscan->rs_flags & SO_ALLOW_PAGEMODE)
+		PGTdeExecStoreDecryptedBufferHeapTuple(&scan->rs_ctup, slot, scan->rs_cbuf);
+	else
+		PGTdeExecStoreBufferHeapTuple(sscan->rs_rd, &scan->rs_ctup, slot,
+								 scan->rs_cbuf);
 	return true;
 }
 
@@ -1318,7 +1359,10 @@ tdeheap_getnextslot_tidrange(TableScanDesc sscan, ScanDirection direction,
 	 */
 	pgstat_count_tdeheap_getnext(scan->rs_base.rs_rd);
 
-	PGTdeExecStoreBufferHeapTuple(sscan->rs_rd, &scan->rs_ctup, slot, scan->rs_cbuf);
+	if (sscan->rs_flags & SO_ALLOW_PAGEMODE)
+		PGTdeExecStoreDecryptedBufferHeapTuple(&scan->rs_ctup, slot, scan->rs_cbuf);
+	else
+		PGTdeExecStoreBufferHeapTuple(sscan->rs_rd, &scan->rs_ctup, slot, scan->rs_cbuf);
 	return true;
 }
 
@@ -648,7 +648,7 @@ pg_tdeam_relation_set_new_filelocator(Relation rel,
 		ereport(DEBUG1,
 			(errmsg("creating key file for relation %s", RelationGetRelationName(rel))));
 
-		pg_tde_create_key_map_entry(newrlocator);
+		pg_tde_create_key_map_entry(newrlocator, TDE_PAGE_CIPHER_CBC);
 	}
 }
 
@@ -2252,6 +2252,9 @@ pg_tdeam_scan_bitmap_next_block(TableScanDesc scan,
 	Assert(ntup <= MaxHeapTuplesPerPage);
 	hscan->rs_ntuples = ntup;
 
+	/* decrypt all the tuples we are going to return at once */
+	tdeheap_decrypt_pagescan(scan);
+
 	return ntup > 0;
 }
 
@@ -2276,7 +2279,10 @@ pg_tdeam_scan_bitmap_next_tuple(TableScanDesc scan,
 	lp = PageGetItemId(page, targoffset);
 	Assert(ItemIdIsNormal(lp));
 
-	hscan->rs_ctup.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+	if (hscan->rs_decrypted_page != NULL)
+		hscan->rs_ctup.t_data = (HeapTupleHeader) (hscan->rs_decrypted_page + ItemIdGetOffset(lp));
+	else
+		hscan->rs_ctup.t_data = (HeapTupleHeader) PageGetItem(page, lp);
 	hscan->rs_ctup.t_len = ItemIdGetLength(lp);
 	hscan->rs_ctup.t_tableOid = scan->rs_rd->rd_id;
 	ItemPointerSet(&hscan->rs_ctup.t_self, hscan->rs_cblock, targoffset);
@@ -2287,7 +2293,7 @@ pg_tdeam_scan_bitmap_next_tuple(TableScanDesc scan,
 	 * Set up the result slot to point to this tuple.  Note that the slot
 	 * acquires a pin on the buffer.
 	 */
-	PGTdeExecStoreBufferHeapTuple(scan->rs_rd, &hscan->rs_ctup,
+	PGTdeExecStoreDecryptedBufferHeapTuple(&hscan->rs_ctup,
 							 slot,
 							 hscan->rs_cbuf);
 
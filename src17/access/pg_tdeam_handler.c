@@ -645,7 +645,7 @@ pg_tdeam_relation_set_new_filelocator(Relation rel,
 		ereport(DEBUG1,
 			(errmsg("creating key file for relation %s", RelationGetRelationName(rel))));
 
-		pg_tde_create_key_map_entry(newrlocator);
+		pg_tde_create_key_map_entry(newrlocator, TDE_PAGE_CIPHER_CBC);
 	}
 }
 
@@ -2273,6 +2273,9 @@ pg_tdeam_scan_bitmap_next_block(TableScanDesc scan,
 	Assert(ntup <= MaxHeapTuplesPerPage);
 	hscan->rs_ntuples = ntup;
 
+	/* decrypt all the tuples we are going to return at once */
+	tdeheap_decrypt_pagescan(scan);
+
 	return ntup > 0;
 }
 
@@ -2307,7 +2310,10 @@ pg_tdeam_scan_bitmap_next_tuple(TableScanDesc scan,
 	lp = PageGetItemId(page, targoffset);
 	Assert(ItemIdIsNormal(lp));
 
-	hscan->rs_ctup.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+	if (hscan->rs_decrypted_page != NULL)
+		hscan->rs_ctup.t_data = (HeapTupleHeader) (hscan->rs_decrypted_page + ItemIdGetOffset(lp));
+	else
+		hscan->rs_ctup.t_data = (HeapTupleHeader) PageGetItem(page, lp);
 	hscan->rs_ctup.t_len = ItemIdGetLength(lp);
 	hscan->rs_ctup.t_tableOid = scan->rs_rd->rd_id;
 	ItemPointerSet(&hscan->rs_ctup.t_self, hscan->rs_cblock, targoffset);
@@ -2318,7 +2324,7 @@ pg_tdeam_scan_bitmap_next_tuple(TableScanDesc scan,
 	 * Set up the result slot to point to this tuple.  Note that the slot
 	 * acquires a pin on the buffer.
 	 */
-	PGTdeExecStoreBufferHeapTuple(scan->rs_rd, &hscan->rs_ctup,
+	PGTdeExecStoreDecryptedBufferHeapTuple(&hscan->rs_ctup,
 							 slot,
 							 hscan->rs_cbuf);
 
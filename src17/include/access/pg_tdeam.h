@@ -106,6 +106,14 @@ typedef struct HeapScanDescData
 	int			rs_cindex;		/* current tuple's index in vistuples */
 	int			rs_ntuples;		/* number of visible tuples on page */
 	OffsetNumber rs_vistuples[MaxHeapTuplesPerPage];	/* their offsets */
+
+	/*
+	 * pg_tde: the visible tuples of the current page decrypted at their page
+	 * offsets, filled by tdeheap_decrypt_pagescan(). NULL until the first
+	 * page is decrypted, and for relations without encrypted tuples.
+	 */
+	char	   *rs_decrypted_page;
+	struct RelKeyData *rs_relation_key;
 }			HeapScanDescData;
 typedef struct HeapScanDescData *HeapScanDesc;
 
@@ -294,6 +302,7 @@ extern TableScanDesc tdeheap_beginscan(Relation relation, Snapshot snapshot,
 extern void tdeheap_setscanlimits(TableScanDesc sscan, BlockNumber startBlk,
 							   BlockNumber numBlks);
 extern void tdeheap_prepare_pagescan(TableScanDesc sscan);
+extern void tdeheap_decrypt_pagescan(TableScanDesc sscan);
 extern void tdeheap_rescan(TableScanDesc sscan, ScanKey key, bool set_params,
 						bool allow_strat, bool allow_sync, bool allow_pagemode);
 extern void tdeheap_endscan(TableScanDesc sscan);
@@ -0,0 +1,165 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Test::More;
+use lib 't';
+use pgtde;
+use Env;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# Minimal Vault KV v2 mock: stores the keys it receives and hands them back
+# to requests carrying the right token. While the flag file exists, it takes
+# a few seconds to answer reads.
+my $slow_flag = "/tmp/pg_tde_mock_vault_slow";
+unlink($slow_flag);
+
+{
+package MockVault;
+
+use HTTP::Server::Simple::CGI;
+use base qw(HTTP::Server::Simple::CGI);
+
+my %keys;
+
+sub handle_request {
+    my $self = shift;
+    my $cgi  = shift;
+
+    my $path = $cgi->path_info();
+    my $token = $cgi->http('X-Vault-Token') // '';
+
+    if ($token ne 'mock-token') {
+        print "HTTP/1.0 403 Forbidden\r\n";
+        print $cgi->header('application/json'), "{\"errors\":[\"permission denied\"]}";
+        return;
+    }
+
+    if ($path =~ m{^/v1/secret/data/(.+)$}) {
+        my $name = $1;
+
+        if ($cgi->request_method() eq 'POST') {
+            my ($key) = ($cgi->param('POSTDATA') // '') =~ /"key":"([^"]+)"/;
+            $keys{$name} = $key;
+            print "HTTP/1.0 200 OK\r\n";
+            print $cgi->header('application/json'), "{}";
+            return;
+        }
+
+        sleep(3) if -e $slow_flag;
+
+        if (defined $keys{$name}) {
+            print "HTTP/1.0 200 OK\r\n";
+            print $cgi->header('application/json'), "{\"data\":{\"data\":{\"key\":\"$keys{$name}\"}}}";
+            return;
+        }
+    }
+
+    print "HTTP/1.0 404 Not found\r\n";
+    print $cgi->header('application/json'), "{\"errors\":[]}";
+}
+
+}
+my $pid = MockVault->new(8889)->background();
+
+
+# UPDATE postgresql.conf to include/load pg_tde library and start the broker
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+print $conf "pg_tde.keyring_broker = on\n";
+close $conf;
+
+my $rt_value = $node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "SELECT count(*) FROM pg_stat_activity WHERE backend_type = 'pg_tde keyring broker';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_vault_v2('vault-provider', 'mock-token', 'http://127.0.0.1:8889', 'secret', NULL);", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','vault-provider');", extra_params => ['-a']);
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_enc(id SERIAL,k INTEGER,PRIMARY KEY (id)) USING tde_heap_basic;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'INSERT INTO test_enc (k) VALUES (5),(6);', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT * FROM test_enc ORDER BY id ASC;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Restart the server, the principal key now has to come from the broker
+PGTDE::append_to_file("-- server restart");
+$rt_value = $node->stop();
+$rt_value = $node->start();
+
+$stdout = $node->safe_psql('postgres', 'SELECT * FROM test_enc ORDER BY id ASC;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT requests_served > 0, timeouts FROM pg_tde_keyring_broker_stats();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# A provider slower than the broker timeout: the backend stops waiting for
+# the broker and fetches the key itself
+PGTDE::append_to_file("-- server restart with a slow provider");
+$node->append_conf('postgresql.conf', "pg_tde.keyring_broker_timeout = 1000\n");
+$rt_value = $node->stop();
+open my $flag, '>', $slow_flag;
+close $flag;
+$rt_value = $node->start();
+
+my $log_offset = -s $node->logfile;
+
+$stdout = $node->safe_psql('postgres', 'SELECT * FROM test_enc ORDER BY id ASC;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$node->wait_for_log(qr/pg_tde keyring broker did not answer within 1000 ms/, $log_offset);
+ok(1, "Backend stopped waiting for the broker");
+
+$stdout = $node->safe_psql('postgres', 'SELECT timeouts > 0 FROM pg_tde_keyring_broker_stats();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+unlink($slow_flag);
+
+# Without the broker the backends fetch the keys themselves
+PGTDE::append_to_file("-- server restart without the broker");
+$node->append_conf('postgresql.conf', "pg_tde.keyring_broker = off\n");
+$rt_value = $node->stop();
+$rt_value = $node->start();
+
+$stdout = $node->safe_psql('postgres', 'SELECT * FROM test_enc ORDER BY id ASC;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+system("kill $pid");
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
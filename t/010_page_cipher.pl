@@ -0,0 +1,142 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $PG_VERSION_STRING = `pg_config --version`;
+
+if (index(lc($PG_VERSION_STRING), lc("Percona Server")) == -1)
+{
+    plan skip_all => "pg_tde test case only for Percona Server for PostgreSQL";
+}
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library, the relations
+# created first use the CBC page cipher
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+print $conf "pg_tde.page_cipher = 'cbc'\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-vault','/tmp/pg_tde_test_keyring.per');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-2','/tmp/pg_tde_test_keyring_2.per');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','file-vault');", extra_params => ['-a']);
+
+# Several pages per relation, so that every page is read back
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_cbc(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_cbc (k) SELECT 'foobar' || g FROM generate_series(1, 2000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "SET pg_tde.page_cipher = 'xts'; CREATE TABLE test_xts(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_xts (k) SELECT 'foobar' || g FROM generate_series(1, 2000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+sub check_tables
+{
+    foreach my $table ('test_cbc', 'test_xts')
+    {
+        $stdout = $node->safe_psql('postgres', "SELECT count(*), sum(length(k)) FROM $table;", extra_params => ['-a']);
+        PGTDE::append_to_file($stdout);
+
+        $stdout = $node->safe_psql('postgres', "SELECT * FROM $table WHERE id IN (1, 1000, 2000) ORDER BY id ASC;", extra_params => ['-a']);
+        PGTDE::append_to_file($stdout);
+    }
+}
+
+check_tables();
+
+# Restart the server, the relations are read from disk with the cipher
+# recorded in their key map entries
+PGTDE::append_to_file("-- server restart");
+$node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+check_tables();
+
+# Rotating the principal key rewrites the map entries, the cipher must stay
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key('rotated-principal-key','file-2');");
+$rt_value = $node->psql('postgres', "SELECT pg_tde_rotate_principal_key('rotated-principal-key','file-2');", extra_params => ['-a']);
+
+PGTDE::append_to_file("-- server restart");
+$node->stop();
+$rt_value = $node->start();
+
+check_tables();
+
+# XTS becomes the default, the existing CBC relation is still read as CBC
+PGTDE::append_to_file("-- server restart with pg_tde.page_cipher = 'xts'");
+$node->stop();
+open $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "pg_tde.page_cipher = 'xts'\n";
+close $conf;
+$rt_value = $node->start();
+
+check_tables();
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_cbc (k) VALUES ('barfoo');", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "SELECT * FROM test_cbc WHERE k = 'barfoo';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Verify that we can't see the data in the files
+foreach my $table ('test_cbc', 'test_xts')
+{
+    $stdout = $node->safe_psql('postgres', 'CHECKPOINT;');
+
+    my $tablefile = $node->safe_psql('postgres', 'SHOW data_directory;');
+    $tablefile .= '/';
+    $tablefile .= $node->safe_psql('postgres', "SELECT pg_relation_filepath('$table');");
+
+    my $strings = 'CONTAINS FOO (should be empty): ';
+    $strings .= `strings $tablefile | grep foo`;
+    PGTDE::append_to_file($strings);
+}
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_cbc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_xts;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
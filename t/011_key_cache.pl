@@ -0,0 +1,166 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library and prewarm the keys
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+print $conf "pg_tde.prewarm_keys = on\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'CREATE DATABASE keycache2;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+foreach my $db ('postgres', 'keycache2')
+{
+    $rt_value = $node->psql($db, 'CREATE EXTENSION IF NOT EXISTS pg_tde;', extra_params => ['-a']);
+    $rt_value = $node->psql($db, "SELECT pg_tde_add_key_provider_file('file-vault','/tmp/pg_tde_test_keyring.per');", extra_params => ['-a']);
+    $rt_value = $node->psql($db, "SELECT pg_tde_add_key_provider_file('file-2','/tmp/pg_tde_test_keyring_2.per');", extra_params => ['-a']);
+    $rt_value = $node->psql($db, "SELECT pg_tde_set_principal_key('test-db-principal-key','file-vault');", extra_params => ['-a']);
+}
+
+foreach my $table ('test_a', 'test_b')
+{
+    $stdout = $node->safe_psql('postgres', "CREATE TABLE $table(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap_basic;", extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+
+    $stdout = $node->safe_psql('postgres', "INSERT INTO $table (k) SELECT 'foobar' || g FROM generate_series(1, 1000) g;", extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+$stdout = $node->safe_psql('keycache2', 'CREATE TABLE test_c(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap_basic;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('keycache2', "INSERT INTO test_c (k) SELECT 'foobar' || g FROM generate_series(1, 1000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Every psql call below is a new backend, which starts with an empty key
+# cache of its own
+sub check_tables
+{
+    foreach my $table ('test_a', 'test_b')
+    {
+        $stdout = $node->safe_psql('postgres', "SELECT count(*), sum(length(k)) FROM $table;", extra_params => ['-a']);
+        PGTDE::append_to_file($stdout);
+    }
+
+    $stdout = $node->safe_psql('keycache2', 'SELECT count(*), sum(length(k)) FROM test_c;', extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+check_tables();
+
+# The prewarm worker loads the keys of both databases at start
+PGTDE::append_to_file("-- server restart with pg_tde.prewarm_keys = on");
+my $log_offset = -s $node->logfile;
+$node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+$node->wait_for_log(qr/pg_tde key prewarm loaded [1-9][0-9]* relation keys of [0-9]+ databases/, $log_offset);
+ok(1, "Prewarm worker loaded the relation keys");
+
+# Loads the relations of the database into the filter of the negative cache
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_a;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Without the map file, the key of test_b can only come from the shared cache,
+# nobody has read it since the restart but the prewarm worker
+my $dboid = $node->safe_psql('postgres', "SELECT oid FROM pg_database WHERE datname = 'postgres';");
+my $mapfile = "$pgdata/base/$dboid/pg_tde.map";
+
+PGTDE::append_to_file("-- map file moved away");
+move($mapfile, "$mapfile.moved") or die "could not move $mapfile: $!";
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_b;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "SELECT * FROM test_b WHERE k = 'foobar500';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+move("$mapfile.moved", $mapfile) or die "could not move $mapfile.moved back: $!";
+PGTDE::append_to_file("-- map file moved back");
+
+check_tables();
+
+# A new relation file gets a new key, the key of the old one is evicted
+$stdout = $node->safe_psql('postgres', 'TRUNCATE test_a;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_a (k) SELECT 'barfoo' || g FROM generate_series(1, 10) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'VACUUM FULL test_b;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+check_tables();
+
+# Rotating the principal key rewrites the key files, the keys of the database
+# are evicted
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key('rotated-principal-key','file-2');");
+$rt_value = $node->psql('postgres', "SELECT pg_tde_rotate_principal_key('rotated-principal-key','file-2');", extra_params => ['-a']);
+
+check_tables();
+
+$stdout = $node->safe_psql('postgres', "SELECT * FROM test_a WHERE k = 'barfoo10';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# The prewarmed keys come from the rewritten files
+PGTDE::append_to_file("-- server restart with pg_tde.prewarm_keys = on");
+$log_offset = -s $node->logfile;
+$node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+$node->wait_for_log(qr/pg_tde key prewarm loaded [1-9][0-9]* relation keys of [0-9]+ databases/, $log_offset);
+ok(1, "Prewarm worker loaded the rotated relation keys");
+
+check_tables();
+
+foreach my $table ('test_a', 'test_b')
+{
+    $stdout = $node->safe_psql('postgres', "DROP TABLE $table;", extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+$stdout = $node->safe_psql('postgres', 'DROP DATABASE keycache2;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,226 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-vault','/tmp/pg_tde_test_keyring.per');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-2','/tmp/pg_tde_test_keyring_2.per');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','file-vault');", extra_params => ['-a']);
+
+my $dboid = $node->safe_psql('postgres', "SELECT oid FROM pg_database WHERE datname = 'postgres';");
+my $mapfile = "$pgdata/base/$dboid/pg_tde.map";
+
+# Entries are {relNumber, flags, key_index, next}, v1 files have no next
+my $entry_size = 16;
+my $entry_size_v1 = 12;
+
+sub read_map
+{
+    open my $fh, '<', $mapfile or die "could not open $mapfile: $!";
+    binmode $fh;
+    local $/;
+    my $data = <$fh>;
+    close $fh;
+    return $data;
+}
+
+sub write_map
+{
+    my ($data) = @_;
+
+    open my $fh, '>', $mapfile or die "could not open $mapfile: $!";
+    binmode $fh;
+    print $fh $data;
+    close $fh;
+}
+
+# Returns the offset of the index header {nbuckets, nentries, free_head} of
+# a v2 map file, which follows the file header
+sub find_index_header
+{
+    my ($data) = @_;
+
+    for (my $offset = 4; $offset + 16 <= length($data); $offset += 4)
+    {
+        my ($nbuckets, $nentries) = unpack('l l', substr($data, $offset, 8));
+
+        next if $nbuckets <= 0 || ($nbuckets & ($nbuckets - 1)) != 0 || $nentries < 0;
+        return $offset
+            if $offset + 16 + $nbuckets * 4 + $nentries * $entry_size == length($data);
+    }
+    die "no index header found in $mapfile";
+}
+
+sub create_table
+{
+    my ($table) = @_;
+
+    $stdout = $node->safe_psql('postgres', "CREATE TABLE $table(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap_basic;", extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+
+    $stdout = $node->safe_psql('postgres', "INSERT INTO $table (k) SELECT 'foobar' || g FROM generate_series(1, 100) g;", extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+sub check_tables
+{
+    foreach my $table (@_)
+    {
+        $stdout = $node->safe_psql('postgres', "SELECT count(*), sum(length(k)) FROM $table;", extra_params => ['-a']);
+        PGTDE::append_to_file($stdout);
+    }
+}
+
+create_table('test_a');
+create_table('test_b');
+create_table('test_c');
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_b;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+check_tables('test_a', 'test_c');
+
+# Turn the map file into a v1 file: same file header with the old magic, then
+# the entries without next, no index
+PGTDE::append_to_file("-- map file downgraded to v1");
+$node->stop();
+
+my $data = read_map();
+my $ihdr = find_index_header($data);
+my ($nbuckets, $nentries) = unpack('l l', substr($data, $ihdr, 8));
+my $entries = $ihdr + 16 + $nbuckets * 4;
+my $v1 = pack('l', 0x01454454) . substr($data, 4, $ihdr - 4);
+
+for (my $i = 0; $i < $nentries; $i++)
+{
+    $v1 .= substr($data, $entries + $i * $entry_size, $entry_size_v1);
+}
+write_map($v1);
+
+$rt_value = $node->start();
+ok($rt_value == 1, "Start Server with a v1 map file");
+
+# Lookups read the v1 file as is
+check_tables('test_a', 'test_c');
+
+# The first change upgrades the file, then the new entry takes the free one
+my $log_offset = -s $node->logfile;
+create_table('test_d');
+$node->wait_for_log(qr/upgrading tde map file ".*pg_tde\.map" to a new format/, $log_offset);
+ok(1, "Map file upgraded to v2");
+
+$data = read_map();
+PGTDE::append_to_file("-- map file version: " . sprintf('%08x', unpack('l', $data)));
+
+check_tables('test_a', 'test_c', 'test_d');
+
+# Entries are freed and reused
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_a;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+create_table('test_e');
+create_table('test_f');
+
+# An aborted creation frees its entry
+$stdout = $node->safe_psql('postgres', "BEGIN; CREATE TABLE test_g(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap_basic; ROLLBACK;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+check_tables('test_c', 'test_d', 'test_e', 'test_f');
+
+# Enough relations to make the index grow
+$stdout = $node->safe_psql('postgres', "DO \$\$ BEGIN FOR i IN 1..40 LOOP EXECUTE format('CREATE TABLE test_many_%s(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap_basic', i); EXECUTE format('INSERT INTO test_many_%s (k) VALUES (''foobar%s'')', i, i); END LOOP; END \$\$;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "DO \$\$ BEGIN FOR i IN 1..40 BY 2 LOOP EXECUTE format('DROP TABLE test_many_%s', i); END LOOP; END \$\$;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "SELECT k FROM test_many_2 UNION ALL SELECT k FROM test_many_20 UNION ALL SELECT k FROM test_many_40;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Crash right after creating and dropping relations
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_c;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+create_table('test_h');
+
+PGTDE::append_to_file("-- server crash");
+$node->stop('immediate');
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server after crash");
+
+check_tables('test_d', 'test_e', 'test_f', 'test_h');
+
+# Leave an entry out of its chain, as a crash between writing an entry and
+# linking it does. It has the relation number of test_d and a key index with
+# no key behind it, it must not be used for anything.
+PGTDE::append_to_file("-- unlinked map entry added");
+my $relnumber = $node->safe_psql('postgres', "SELECT pg_relation_filenode('test_d');");
+$node->stop();
+
+$data = read_map();
+$ihdr = find_index_header($data);
+($nbuckets, $nentries) = unpack('l l', substr($data, $ihdr, 8));
+substr($data, $ihdr + 4, 4) = pack('l', $nentries + 1);
+$data .= pack('L l l l', $relnumber, 1, $nentries, -1);
+write_map($data);
+
+$rt_value = $node->start();
+ok($rt_value == 1, "Start Server with an unlinked map entry");
+
+check_tables('test_d', 'test_e', 'test_f', 'test_h');
+
+# Key rotation reads the whole map and rewrites it without the entry
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key('rotated-principal-key','file-2');");
+$rt_value = $node->psql('postgres', "SELECT pg_tde_rotate_principal_key('rotated-principal-key','file-2');", extra_params => ['-a']);
+
+check_tables('test_d', 'test_e', 'test_f', 'test_h');
+
+PGTDE::append_to_file("-- server restart");
+$node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+check_tables('test_d', 'test_e', 'test_f', 'test_h');
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde CASCADE;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,150 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $PG_VERSION_STRING = `pg_config --version`;
+
+if (index(lc($PG_VERSION_STRING), lc("Percona Server")) == -1)
+{
+    plan skip_all => "pg_tde test case only for Percona Server for PostgreSQL";
+}
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-vault','/tmp/pg_tde_test_keyring.per');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','file-vault');", extra_params => ['-a']);
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_plain(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING heap;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_plain (k) SELECT 'foobar' || g FROM generate_series(1, 1000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_enc(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_enc (k) SELECT 'foobar' || g FROM generate_series(1, 1000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Two sessions which stay connected: both of them look up the relations
+# without a key, and remember it, before another session encrypts them
+my @sessions = ($node->background_psql('postgres'), $node->background_psql('postgres'));
+
+sub session_query
+{
+    my ($session, $query) = @_;
+
+    PGTDE::append_to_file("-- session $session: $query");
+    PGTDE::append_to_file($sessions[$session]->query_safe($query));
+}
+
+foreach my $session (0, 1)
+{
+    session_query($session, 'SELECT count(*), sum(length(k)) FROM test_plain;');
+    session_query($session, 'SELECT count(*), sum(length(k)) FROM test_enc;');
+    session_query($session, "SELECT * FROM test_plain WHERE id = 500;");
+}
+
+# The pages written by the first session go through the storage manager
+# relation it opened while the table had no key
+session_query(0, "UPDATE test_plain SET k = 'barfoo' || id WHERE id <= 10;");
+
+$stdout = $node->safe_psql('postgres', 'ALTER TABLE test_plain SET ACCESS METHOD tde_heap;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "SELECT pg_tde_is_encrypted('test_plain');", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# A new relation gets a key while both sessions are connected too
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_new(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+foreach my $session (0, 1)
+{
+    session_query($session, 'SELECT count(*), sum(length(k)) FROM test_plain;');
+    session_query($session, "SELECT * FROM test_plain WHERE id IN (5, 500) ORDER BY id;");
+}
+
+# Both sessions write to the encrypted relations and flush the pages
+session_query(0, "INSERT INTO test_plain (k) SELECT 'foobar' || g FROM generate_series(1001, 2000) g;");
+session_query(1, "INSERT INTO test_new (k) SELECT 'foobar' || g FROM generate_series(1, 1000) g;");
+session_query(1, 'CHECKPOINT;');
+
+foreach my $session (0, 1)
+{
+    session_query($session, 'SELECT count(*), sum(length(k)) FROM test_plain;');
+    session_query($session, 'SELECT count(*), sum(length(k)) FROM test_new;');
+}
+
+$_->quit foreach @sessions;
+
+# Nothing was written in clear to the files of the encrypted relations
+foreach my $table ('test_plain', 'test_new')
+{
+    my $tablefile = $node->safe_psql('postgres', 'SHOW data_directory;');
+    $tablefile .= '/';
+    $tablefile .= $node->safe_psql('postgres', "SELECT pg_relation_filepath('$table');");
+
+    my $strings = "CONTAINS FOO IN $table (should be empty): ";
+    $strings .= `strings $tablefile | grep foo`;
+    PGTDE::append_to_file($strings);
+}
+
+PGTDE::append_to_file("-- server restart");
+$node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+foreach my $table ('test_plain', 'test_enc', 'test_new')
+{
+    $stdout = $node->safe_psql('postgres', "SELECT count(*), sum(length(k)) FROM $table;", extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+foreach my $table ('test_plain', 'test_enc', 'test_new')
+{
+    $stdout = $node->safe_psql('postgres', "DROP TABLE $table;", extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,155 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $keyring_file = '/tmp/pg_tde_test_keyring_014.per';
+my $external_file = '/tmp/pg_tde_test_keyring_014_ext.per';
+unlink($keyring_file, $external_file);
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-vault','$keyring_file');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','file-vault');", extra_params => ['-a']);
+
+my $record_size = -s $keyring_file;
+ok($record_size > 0, "Keyring file holds the principal key");
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_enc(id SERIAL,k VARCHAR(64),PRIMARY KEY (id)) USING tde_heap_basic;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_enc (k) SELECT 'foobar' || g FROM generate_series(1, 100) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Enough rotations for the in-memory index of the file to grow a few times
+# and to need more than one batch of reads to be built
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key() 200 times");
+for (my $i = 0; $i < 200; $i++)
+{
+    $node->safe_psql('postgres', 'SELECT pg_tde_rotate_principal_key();');
+}
+ok(-s $keyring_file == 201 * $record_size, "Every rotation appended one key");
+
+$stdout = $node->safe_psql('postgres', 'SELECT principal_key_internal_name, principal_key_version FROM pg_tde_principal_key_info();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Rotating to a name that was used before picks the next free version
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key('test-db-principal-key','file-vault');");
+$node->safe_psql('postgres', "SELECT pg_tde_rotate_principal_key('test-db-principal-key','file-vault');");
+ok(-s $keyring_file == 202 * $record_size, "Rotation appended one key");
+
+$stdout = $node->safe_psql('postgres', 'SELECT principal_key_internal_name, principal_key_version FROM pg_tde_principal_key_info();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# A session that has indexed the keyring file before it is appended to from
+# outside the server
+my $session = $node->background_psql('postgres');
+$session->query_safe('SELECT pg_tde_rotate_principal_key();');
+ok(-s $keyring_file == 203 * $record_size, "Rotation in the session appended one key");
+
+# A key created in another keyring file
+$stdout = $node->safe_psql('postgres', 'CREATE DATABASE ext;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+$rt_value = $node->psql('ext', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+$rt_value = $node->psql('ext', "SELECT pg_tde_add_key_provider_file('file-ext','$external_file');", extra_params => ['-a']);
+$rt_value = $node->psql('ext', "SELECT pg_tde_set_principal_key('external-key','file-ext');", extra_params => ['-a']);
+ok(-s $external_file == $record_size, "External keyring file holds one key");
+
+PGTDE::append_to_file("-- external-key_1 appended to the keyring file");
+open my $in, '<:raw', $external_file or die "could not open $external_file: $!";
+my $external_key = do { local $/; <$in> };
+close $in;
+open my $out, '>>:raw', $keyring_file or die "could not open $keyring_file: $!";
+print $out $external_key;
+close $out;
+
+# The session finds the appended key, so the rotation reuses it instead of
+# storing a new one
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key_internal('external-key','file-vault',false,false);");
+$session->query_safe("SELECT pg_tde_rotate_principal_key_internal('external-key','file-vault',false,false);");
+ok(-s $keyring_file == 204 * $record_size, "Rotation used the appended key");
+
+$stdout = $session->query_safe('SELECT principal_key_internal_name, principal_key_version FROM pg_tde_principal_key_info();');
+PGTDE::append_to_file('SELECT principal_key_internal_name, principal_key_version FROM pg_tde_principal_key_info();');
+PGTDE::append_to_file($stdout);
+
+$stdout = $session->query_safe('SELECT count(*), sum(length(k)) FROM test_enc;');
+PGTDE::append_to_file('SELECT count(*), sum(length(k)) FROM test_enc;');
+PGTDE::append_to_file($stdout);
+$session->quit;
+
+# A new session indexes the whole file at once
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Restart the server
+PGTDE::append_to_file("-- server restart");
+$rt_value = $node->stop();
+$rt_value = $node->start();
+
+$stdout = $node->safe_psql('postgres', 'SELECT principal_key_internal_name, principal_key_version FROM pg_tde_principal_key_info();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key();");
+$node->safe_psql('postgres', 'SELECT pg_tde_rotate_principal_key();');
+ok(-s $keyring_file == 205 * $record_size, "Rotation after the appended key appended one key");
+
+$stdout = $node->safe_psql('postgres', 'SELECT principal_key_internal_name, principal_key_version FROM pg_tde_principal_key_info();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP DATABASE ext;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+unlink($keyring_file, $external_file);
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,190 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use File::Copy;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $path_location = '/tmp/pg_tde_test_015_path';
+my $remote_location = '/tmp/pg_tde_test_015_remote';
+my @keyrings = map { "/tmp/pg_tde_test_015_keyring_$_.per" } ('a', 'b', 'c', 'd');
+unlink($path_location, $remote_location, @keyrings);
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+{
+package MyWebServer;
+
+use HTTP::Server::Simple::CGI;
+use base qw(HTTP::Server::Simple::CGI);
+
+# Answers with the keyring file path currently written in $remote_location
+sub handle_request {
+    my $self = shift;
+    my $cgi  = shift;
+
+    if ($cgi->path_info() eq '/path' && open(my $fh, '<', $remote_location)) {
+        my $path = <$fh>;
+        close $fh;
+        chomp $path;
+        print "HTTP/1.0 200 OK\r\n";
+        print $cgi->header, "$path\r\n";
+    } else {
+        print "HTTP/1.0 404 Not found\r\n";
+        print $cgi->header,
+              $cgi->start_html('Not found'),
+              $cgi->h1('Not found'),
+              $cgi->end_html;
+    }
+}
+
+}
+my $pid = MyWebServer->new(8890)->background();
+
+sub set_location
+{
+    my ($location, $keyring) = @_;
+
+    open my $fh, '>', $location or die "could not open $location: $!";
+    print $fh "$keyring\n";
+    close $fh;
+}
+
+# UPDATE postgresql.conf to include/load pg_tde library
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+my $dboid = $node->safe_psql('postgres', "SELECT oid FROM pg_database WHERE datname = 'postgres';");
+my $keyrings_file = "$pgdata/base/$dboid/pg_tde_keyrings";
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-vault','/tmp/pg_tde_test_keyring.per');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-2','/tmp/pg_tde_test_keyring_2.per');", extra_params => ['-a']);
+
+# Every psql call below is a new backend, so whatever it doesn't read from
+# the file comes from the shared cache
+$stdout = $node->safe_psql('postgres', 'SELECT id, provider_name FROM pg_tde_list_all_key_providers();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- pg_tde_keyrings moved away");
+move($keyrings_file, "$keyrings_file.away") or die "could not move $keyrings_file: $!";
+
+$stdout = $node->safe_psql('postgres', 'SELECT id, provider_name FROM pg_tde_list_all_key_providers();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','file-vault');", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- pg_tde_keyrings moved back");
+move("$keyrings_file.away", $keyrings_file) or die "could not move $keyrings_file.away: $!";
+
+# Adding a provider drops the cached providers of the database
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-3','/tmp/pg_tde_test_keyring_3.per');", extra_params => ['-a']);
+
+$stdout = $node->safe_psql('postgres', 'SELECT id, provider_name FROM pg_tde_list_all_key_providers();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- pg_tde_keyrings moved away");
+move($keyrings_file, "$keyrings_file.away") or die "could not move $keyrings_file: $!";
+
+$stdout = $node->safe_psql('postgres', 'SELECT id, provider_name FROM pg_tde_list_all_key_providers();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- pg_tde_keyrings moved back");
+move("$keyrings_file.away", $keyrings_file) or die "could not move $keyrings_file.away: $!";
+
+# Providers reading their keyring path from a file or a URL are never cached
+set_location($path_location, $keyrings[0]);
+set_location($remote_location, $keyrings[2]);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-path', json_object( 'type' VALUE 'file', 'path' VALUE '$path_location' ));", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-remote', json_object( 'type' VALUE 'remote', 'url' VALUE 'http://localhost:8890/path' ));", extra_params => ['-a']);
+
+$stdout = $node->safe_psql('postgres', 'SELECT id, provider_name FROM pg_tde_list_all_key_providers();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# The list is not complete in the cache anymore, so it comes from the file
+PGTDE::append_to_file("-- pg_tde_keyrings moved away");
+move($keyrings_file, "$keyrings_file.away") or die "could not move $keyrings_file: $!";
+
+$stdout = $node->safe_psql('postgres', 'SELECT id, provider_name FROM pg_tde_list_all_key_providers();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- pg_tde_keyrings moved back");
+move("$keyrings_file.away", $keyrings_file) or die "could not move $keyrings_file.away: $!";
+
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key('path-key','file-path');");
+$node->safe_psql('postgres', "SELECT pg_tde_rotate_principal_key('path-key','file-path');");
+ok(-s $keyrings[0], "Key stored in the first keyring of file-path");
+
+PGTDE::append_to_file("-- file-path points to another keyring");
+set_location($path_location, $keyrings[1]);
+
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key();");
+$node->safe_psql('postgres', "SELECT pg_tde_rotate_principal_key();");
+ok(-s $keyrings[1], "Key stored in the second keyring of file-path");
+
+$stdout = $node->safe_psql('postgres', 'SELECT principal_key_internal_name, key_provider_name FROM pg_tde_principal_key_info();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key('remote-key','file-remote');");
+$node->safe_psql('postgres', "SELECT pg_tde_rotate_principal_key('remote-key','file-remote');");
+ok(-s $keyrings[2], "Key stored in the first keyring of file-remote");
+
+PGTDE::append_to_file("-- file-remote points to another keyring");
+set_location($remote_location, $keyrings[3]);
+
+PGTDE::append_to_file("-- ROTATE KEY pg_tde_rotate_principal_key();");
+$node->safe_psql('postgres', "SELECT pg_tde_rotate_principal_key();");
+ok(-s $keyrings[3], "Key stored in the second keyring of file-remote");
+
+$stdout = $node->safe_psql('postgres', 'SELECT principal_key_internal_name, key_provider_name FROM pg_tde_principal_key_info();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+# Installing the extension again removes the file and drops the cache
+$stdout = $node->safe_psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT id, provider_name FROM pg_tde_list_all_key_providers();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Stop the server
+$node->stop();
+
+system("kill $pid");
+unlink($path_location, $remote_location, @keyrings);
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
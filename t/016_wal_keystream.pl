@@ -0,0 +1,189 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $PG_VERSION_STRING = `pg_config --version`;
+
+if (index(lc($PG_VERSION_STRING), lc("Percona Server")) == -1)
+{
+    plan skip_all => "pg_tde test case only for Percona Server for PostgreSQL";
+}
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library, encrypt the WAL and
+# precompute its keystream
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+print $conf "wal_level = logical\n";
+print $conf "pg_tde.wal_encrypt = on\n";
+print $conf "pg_tde.wal_keystream_pages = 128\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+# Writes the same changes on every call and returns them decoded from the WAL
+sub run_workload
+{
+    my $out;
+    my $decoded;
+
+    $node->safe_psql('postgres', "SELECT pg_create_logical_replication_slot('wal_slot', 'test_decoding');");
+
+    foreach my $sql ('CREATE TABLE test_wal(id INTEGER PRIMARY KEY, k VARCHAR(64));',
+                     "INSERT INTO test_wal SELECT g, 'walmarker' || g FROM generate_series(1, 1000) g;",
+                     "UPDATE test_wal SET k = k || 'u' WHERE id % 10 = 0;",
+                     'DELETE FROM test_wal WHERE id % 100 = 0;')
+    {
+        $out = $node->safe_psql('postgres', $sql, extra_params => ['-a']);
+        PGTDE::append_to_file($out);
+    }
+
+    $decoded = $node->safe_psql('postgres', "SELECT data FROM pg_logical_slot_get_changes('wal_slot', NULL, NULL, 'include-xids', '0', 'skip-empty-xacts', '1');");
+    $node->safe_psql('postgres', "SELECT pg_drop_replication_slot('wal_slot');");
+
+    return $decoded;
+}
+
+# The rows are only stored in plain text in the heap, not in the WAL
+sub wal_has_plaintext
+{
+    opendir(my $dh, "$pgdata/pg_wal") or die "could not open pg_wal: $!";
+    my @segments = grep { /^[0-9A-F]{24}$/ } readdir($dh);
+    closedir($dh);
+
+    foreach my $segment (@segments)
+    {
+        open my $fh, '<:raw', "$pgdata/pg_wal/$segment" or die "could not open $segment: $!";
+        my $data = do { local $/; <$fh> };
+        close $fh;
+        return 1 if index($data, 'walmarker') != -1;
+    }
+    return 0;
+}
+
+# The keystream worker starts once the server accepts connections
+$node->poll_query_until('postgres', "SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_tde wal keystream';");
+$stdout = $node->safe_psql('postgres', "SELECT count(*) FROM pg_stat_activity WHERE backend_type = 'pg_tde wal keystream';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+my $decoded_xor = run_workload();
+$node->safe_psql('postgres', 'CHECKPOINT;');
+ok(!wal_has_plaintext(), "WAL written with the precomputed keystream is encrypted");
+
+my @changes = split(/\n/, $decoded_xor);
+PGTDE::append_to_file("-- decoded changes: " . scalar(@changes));
+
+# Crash recovery replays the WAL written with the precomputed keystream
+PGTDE::append_to_file("-- server crash");
+$node->stop('immediate');
+$rt_value = $node->start();
+ok($rt_value == 1, "Start Server after crash");
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# The same changes, encrypted page by page
+PGTDE::append_to_file("-- server restart with pg_tde.wal_keystream_pages = 0");
+$node->stop();
+$node->append_conf('postgresql.conf', "pg_tde.wal_keystream_pages = 0\n");
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+$stdout = $node->safe_psql('postgres', "SELECT count(*) FROM pg_stat_activity WHERE backend_type = 'pg_tde wal keystream';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+my $decoded_plain = run_workload();
+@changes = split(/\n/, $decoded_plain);
+PGTDE::append_to_file("-- decoded changes: " . scalar(@changes));
+is($decoded_xor, $decoded_plain, "WAL written with the precomputed keystream decodes like WAL encrypted page by page");
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# Large writes split between the crypto workers and the writing process
+PGTDE::append_to_file("-- server restart with pg_tde.wal_encrypt_workers = 4");
+$node->stop();
+$node->append_conf('postgresql.conf', "pg_tde.wal_encrypt_workers = 4\nwal_buffers = 16MB\n");
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+$node->poll_query_until('postgres', "SELECT count(*) = 4 FROM pg_stat_activity WHERE backend_type = 'pg_tde wal crypt';");
+
+# Writes don't wait for the workers that are gone, they are restarted only
+# after a few seconds
+PGTDE::append_to_file("-- crypto workers terminated");
+$node->safe_psql('postgres', "SELECT pg_terminate_backend(pid) FROM pg_stat_activity WHERE backend_type = 'pg_tde wal crypt';");
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_bulk(id INTEGER, k TEXT);', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_bulk SELECT g, repeat('walmarker', 50) FROM generate_series(1, 20000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$node->poll_query_until('postgres', "SELECT count(*) = 4 FROM pg_stat_activity WHERE backend_type = 'pg_tde wal crypt';");
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_bulk SELECT g, repeat('walmarker', 50) FROM generate_series(20001, 40000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+my $decoded_parallel = run_workload();
+@changes = split(/\n/, $decoded_parallel);
+PGTDE::append_to_file("-- decoded changes: " . scalar(@changes));
+is($decoded_parallel, $decoded_plain, "WAL encrypted by the crypto workers decodes like WAL encrypted by the writer");
+
+$node->safe_psql('postgres', 'CHECKPOINT;');
+ok(!wal_has_plaintext(), "WAL encrypted by the crypto workers is encrypted");
+
+PGTDE::append_to_file("-- server crash");
+$node->stop('immediate');
+$rt_value = $node->start();
+ok($rt_value == 1, "Start Server after crash");
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_bulk;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_bulk, test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,191 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $PG_VERSION_STRING = `pg_config --version`;
+
+if (index(lc($PG_VERSION_STRING), lc("Percona Server")) == -1)
+{
+    plan skip_all => "pg_tde test case only for Percona Server for PostgreSQL";
+}
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library, encrypt the WAL and
+# ship it to the standbys as it is stored
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+print $conf "wal_level = replica\n";
+print $conf "pg_tde.wal_encrypt = on\n";
+print $conf "pg_tde.wal_passthrough = on\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+# The option can't change while walsenders run
+$stdout = $node->safe_psql('postgres', "SELECT context FROM pg_settings WHERE name = 'pg_tde.wal_passthrough';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_wal(id INTEGER PRIMARY KEY, k VARCHAR(64));', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_wal SELECT g, 'walmarker' || g FROM generate_series(1, 1000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+my $fingerprint = $node->safe_psql('postgres', 'SELECT pg_tde_wal_key_fingerprint();');
+ok($fingerprint =~ /^[0-9a-f]{16}$/, "WAL key fingerprint of the primary");
+
+# A standby built from a base backup has the WAL key of the primary, it gives
+# its fingerprint when it connects
+PGTDE::append_to_file("-- standby created from a base backup");
+$node->backup('passthrough_backup');
+my $standby = PostgreSQL::Test::Cluster->new('passthrough_standby');
+$standby->init_from_backup($node, 'passthrough_backup', has_streaming => 1);
+$standby->append_conf('postgresql.conf',
+    "primary_conninfo = '" . $node->connstr . " application_name=passthrough_standby options=''-c pg_tde.wal_peer_fingerprint=$fingerprint'''\n");
+my $standby_log_offset = -s $standby->logfile;
+$rt_value = $standby->start();
+ok($rt_value == 1, "Start Standby");
+
+$stdout = $node->safe_psql('postgres', "UPDATE test_wal SET k = k || 'u' WHERE id % 10 = 0;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DELETE FROM test_wal WHERE id % 100 = 0;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_wal SELECT g, 'walmarker' || g FROM generate_series(1001, 2000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$node->wait_for_catchup($standby, 'replay');
+
+# Both ends use the same WAL key, and say so in their logs
+$stdout = $standby->safe_psql('postgres', "SELECT pg_tde_wal_key_fingerprint() = '$fingerprint';");
+PGTDE::append_to_file("-- on the standby");
+PGTDE::append_to_file("SELECT pg_tde_wal_key_fingerprint() = <fingerprint on the primary>;");
+PGTDE::append_to_file($stdout);
+
+ok($node->wait_for_log(qr/shipping encrypted WAL, WAL key fingerprint $fingerprint/, 0), "Primary ships encrypted WAL");
+ok($standby->wait_for_log(qr/receiving encrypted WAL, WAL key fingerprint $fingerprint/, $standby_log_offset), "Standby receives encrypted WAL");
+
+$stdout = $standby->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file("-- on the standby");
+PGTDE::append_to_file($stdout);
+
+# The standby stored the pages as they were shipped
+opendir(my $dh, $standby->data_dir . "/pg_wal") or die "could not open pg_wal: $!";
+my @segments = grep { /^[0-9A-F]{24}$/ } readdir($dh);
+closedir($dh);
+my $plaintext = 0;
+foreach my $segment (@segments)
+{
+    open my $fh, '<:raw', $standby->data_dir . "/pg_wal/$segment" or die "could not open $segment: $!";
+    my $data = do { local $/; <$fh> };
+    close $fh;
+    $plaintext = 1 if index($data, 'walmarker') != -1;
+}
+ok(!$plaintext, "WAL received by the standby is encrypted");
+
+# The standby replays the stored WAL again from its last restartpoint
+PGTDE::append_to_file("-- standby restart");
+$standby->stop('immediate');
+$rt_value = $standby->start();
+ok($rt_value == 1, "Restart Standby");
+
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_wal SELECT g, 'walmarker' || g FROM generate_series(2001, 3000) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$node->wait_for_catchup($standby, 'replay');
+
+$stdout = $standby->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file("-- on the standby");
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$standby->stop();
+
+# Streams the WAL of the current segment up to the current position with
+# pg_receivewal, giving the WAL key fingerprint $peer if any. Returns whether
+# the WAL received has any plain text.
+sub receive_wal
+{
+    my ($name, $peer) = @_;
+    my $dir = $node->basedir . "/$name";
+    my $connstr = $node->connstr;
+    my $endpos = $node->safe_psql('postgres', 'SELECT pg_current_wal_insert_lsn();');
+    my $plaintext = 0;
+
+    mkdir($dir) or die "could not create $dir: $!";
+    $connstr .= " options='-c pg_tde.wal_peer_fingerprint=$peer'" if defined($peer);
+    $node->command_ok([ 'pg_receivewal', '-D', $dir, '-d', $connstr, '--endpos', $endpos, '--no-loop' ],
+                      "pg_receivewal into $name");
+
+    opendir(my $dh, $dir) or die "could not open $dir: $!";
+    foreach my $segment (grep { /^[0-9A-F]{24}/ } readdir($dh))
+    {
+        open my $fh, '<:raw', "$dir/$segment" or die "could not open $segment: $!";
+        my $data = do { local $/; <$fh> };
+        close $fh;
+        $plaintext = 1 if index($data, 'walmarker') != -1;
+    }
+    closedir($dh);
+
+    return $plaintext;
+}
+
+# The WAL is shipped encrypted only to the receivers with the WAL key
+$node->safe_psql('postgres', 'SELECT pg_switch_wal();');
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_wal SELECT g, 'walmarker' || g FROM generate_series(3001, 3100) g;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+PGTDE::append_to_file("-- pg_receivewal without a WAL key fingerprint");
+ok(receive_wal('receivewal_plain'), "WAL shipped to a receiver giving no fingerprint is decrypted");
+
+PGTDE::append_to_file("-- pg_receivewal with the WAL key fingerprint of the primary");
+ok(!receive_wal('receivewal_encrypted', $fingerprint), "WAL shipped to a receiver with the WAL key is encrypted");
+
+PGTDE::append_to_file("-- pg_receivewal with another WAL key fingerprint");
+mkdir($node->basedir . "/receivewal_refused");
+$node->command_fails_like(
+    [ 'pg_receivewal', '-D', $node->basedir . "/receivewal_refused", '--no-loop',
+      '-d', $node->connstr . " options='-c pg_tde.wal_peer_fingerprint=0123456789abcdef'" ],
+    qr/WAL key fingerprint 0123456789abcdef of the WAL receiver does not match the WAL key of the server/,
+    "WAL receiver with another WAL key is refused");
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
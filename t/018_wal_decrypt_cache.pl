@@ -0,0 +1,158 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use IPC::Run;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $PG_VERSION_STRING = `pg_config --version`;
+
+if (index(lc($PG_VERSION_STRING), lc("Percona Server")) == -1)
+{
+    plan skip_all => "pg_tde test case only for Percona Server for PostgreSQL";
+}
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library and encrypt the WAL,
+# the walsenders share the decrypted WAL cache
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+print $conf "wal_level = logical\n";
+print $conf "pg_tde.wal_encrypt = on\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+# Writes the same changes on every call, then has two standbys and two logical
+# decoding clients read them all at the same time. Returns the changes decoded
+# by the clients, which must agree.
+sub run_readers
+{
+    my ($name) = @_;
+    my @standbys;
+    my @readers;
+    my @decoded;
+    my $out;
+    my $endpos;
+
+    $node->backup("${name}_backup");
+    foreach my $i (1 .. 2)
+    {
+        my $standby = PostgreSQL::Test::Cluster->new("${name}_standby_$i");
+        $standby->init_from_backup($node, "${name}_backup", has_streaming => 1);
+        push @standbys, $standby;
+
+        $node->safe_psql('postgres', "SELECT pg_create_logical_replication_slot('${name}_slot_$i', 'test_decoding');");
+    }
+
+    foreach my $sql ('CREATE TABLE test_wal(id INTEGER PRIMARY KEY, k VARCHAR(64));',
+                     "INSERT INTO test_wal SELECT g, 'walmarker' || g FROM generate_series(1, 1000) g;",
+                     "UPDATE test_wal SET k = k || 'u' WHERE id % 10 = 0;",
+                     'DELETE FROM test_wal WHERE id % 100 = 0;')
+    {
+        $out = $node->safe_psql('postgres', $sql, extra_params => ['-a']);
+        PGTDE::append_to_file($out);
+    }
+
+    $endpos = $node->safe_psql('postgres', 'SELECT pg_current_wal_insert_lsn();');
+
+    # The standbys start streaming from the backup while the clients decode
+    # from the slots, so all of them read the same pages
+    PGTDE::append_to_file("-- two standbys and two logical decoding clients started");
+    foreach my $i (1 .. 2)
+    {
+        $decoded[$i - 1] = '';
+        push @readers, IPC::Run::start(
+            [ 'pg_recvlogical', '-d', $node->connstr('postgres'), '-S', "${name}_slot_$i",
+              '--start', '--endpos', $endpos, '--no-loop', '-f', '-',
+              '-o', 'include-xids=0', '-o', 'skip-empty-xacts=1' ],
+            '>', \$decoded[$i - 1],
+            IPC::Run::timeout($PostgreSQL::Test::Utils::timeout_default));
+    }
+    $_->start() foreach @standbys;
+
+    foreach my $reader (@readers)
+    {
+        ok($reader->finish(), "pg_recvlogical decoded up to $endpos");
+    }
+    is($decoded[1], $decoded[0], "Concurrent logical decoding clients decode the same changes");
+
+    foreach my $standby (@standbys)
+    {
+        $node->wait_for_catchup($standby, 'replay');
+
+        $out = $standby->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+        PGTDE::append_to_file("-- on the standby");
+        PGTDE::append_to_file($out);
+
+        $standby->stop();
+    }
+
+    foreach my $i (1 .. 2)
+    {
+        $node->safe_psql('postgres', "SELECT pg_drop_replication_slot('${name}_slot_$i');");
+    }
+
+    return $decoded[0];
+}
+
+$stdout = $node->safe_psql('postgres', 'SHOW pg_tde.wal_decrypt_cache_pages;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+my $decoded_cached = run_readers('cached');
+my @changes = split(/\n/, $decoded_cached);
+PGTDE::append_to_file("-- decoded changes: " . scalar(@changes));
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# The same changes, each reader decrypting the pages itself
+PGTDE::append_to_file("-- server restart with pg_tde.wal_decrypt_cache_pages = 0");
+$node->stop();
+$node->append_conf('postgresql.conf', "pg_tde.wal_decrypt_cache_pages = 0\n");
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+$stdout = $node->safe_psql('postgres', 'SHOW pg_tde.wal_decrypt_cache_pages;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+my $decoded_uncached = run_readers('uncached');
+@changes = split(/\n/, $decoded_uncached);
+PGTDE::append_to_file("-- decoded changes: " . scalar(@changes));
+is($decoded_cached, $decoded_uncached, "WAL read through the decrypted WAL cache decodes like WAL read without it");
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_wal;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
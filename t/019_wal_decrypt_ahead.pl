@@ -0,0 +1,154 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $PG_VERSION_STRING = `pg_config --version`;
+
+if (index(lc($PG_VERSION_STRING), lc("Percona Server")) == -1)
+{
+    plan skip_all => "pg_tde test case only for Percona Server for PostgreSQL";
+}
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library and encrypt the WAL,
+# keep it around for the standbys started after the writes
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+print $conf "wal_level = replica\n";
+print $conf "wal_keep_size = 128MB\n";
+print $conf "pg_tde.wal_encrypt = on\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+# The decrypt-ahead worker goes as far ahead of the startup process as
+# recovery_prefetch reads, and stays idle when it is off
+foreach my $prefetch ('try', 'off')
+{
+    PGTDE::append_to_file("-- server restart with recovery_prefetch = $prefetch");
+    $node->stop();
+    $node->append_conf('postgresql.conf', "recovery_prefetch = $prefetch\n");
+    $rt_value = $node->start();
+    ok($rt_value == 1, "Restart Server");
+
+    $stdout = $node->safe_psql('postgres', 'SHOW recovery_prefetch;', extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+
+    # The standby gets the same settings and replays everything written below
+    $node->backup("prefetch_${prefetch}_backup");
+    my $standby = PostgreSQL::Test::Cluster->new("prefetch_${prefetch}_standby");
+    $standby->init_from_backup($node, "prefetch_${prefetch}_backup", has_streaming => 1);
+
+    foreach my $sql ('CREATE TABLE test_wal(id INTEGER PRIMARY KEY, k VARCHAR(64));',
+                     "INSERT INTO test_wal SELECT g, 'walmarker' || g FROM generate_series(1, 1000) g;",
+                     "UPDATE test_wal SET k = k || 'u' WHERE id % 10 = 0;",
+                     'DELETE FROM test_wal WHERE id % 100 = 0;',
+                     'CREATE TABLE test_bulk(id INTEGER, k TEXT);',
+                     "INSERT INTO test_bulk SELECT g, repeat('walmarker', 50) FROM generate_series(1, 20000) g;")
+    {
+        $stdout = $node->safe_psql('postgres', $sql, extra_params => ['-a']);
+        PGTDE::append_to_file($stdout);
+    }
+
+    # Crash recovery replays all of the writes since the backup
+    PGTDE::append_to_file("-- server crash");
+    $node->stop('immediate');
+    $rt_value = $node->start();
+    ok($rt_value == 1, "Start Server after crash");
+
+    $stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_wal;', extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+
+    $stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_bulk;', extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+
+    # So does the standby, from the WAL it streams
+    PGTDE::append_to_file("-- standby started");
+    $rt_value = $standby->start();
+    ok($rt_value == 1, "Start Standby");
+
+    $node->wait_for_catchup($standby, 'replay');
+
+    foreach my $sql ('SHOW recovery_prefetch;',
+                     'SELECT count(*), sum(length(k)) FROM test_wal;',
+                     'SELECT count(*), sum(length(k)) FROM test_bulk;')
+    {
+        $stdout = $standby->safe_psql('postgres', $sql, extra_params => ['-a']);
+        PGTDE::append_to_file("-- on the standby");
+        PGTDE::append_to_file($stdout);
+    }
+
+    $standby->stop();
+
+    $stdout = $node->safe_psql('postgres', 'DROP TABLE test_wal, test_bulk;', extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+# The worker outlives the recovery, so it is there again when the server
+# reinitializes after a backend crash and replays the WAL
+PGTDE::append_to_file("-- backend crash with recovery_prefetch = try");
+$node->append_conf('postgresql.conf', "recovery_prefetch = try\n");
+$node->reload();
+
+$node->poll_query_until('postgres', "SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_tde wal decrypt ahead';");
+$stdout = $node->safe_psql('postgres', "SELECT count(*) FROM pg_stat_activity WHERE backend_type = 'pg_tde wal decrypt ahead';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+foreach my $sql ('CREATE TABLE test_bulk(id INTEGER, k TEXT);',
+                 "INSERT INTO test_bulk SELECT g, repeat('walmarker', 50) FROM generate_series(1, 20000) g;")
+{
+    $stdout = $node->safe_psql('postgres', $sql, extra_params => ['-a']);
+    PGTDE::append_to_file($stdout);
+}
+
+my $log_offset = -s $node->logfile;
+my $session = $node->background_psql('postgres');
+my $pid = $session->query_safe('SELECT pg_backend_pid();');
+kill 'KILL', $pid;
+$session->quit;
+ok($node->wait_for_log(qr/all server processes terminated; reinitializing/, $log_offset), "Server reinitialized after a backend crash");
+$node->poll_query_until('postgres', "SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'pg_tde wal decrypt ahead';");
+
+$stdout = $node->safe_psql('postgres', "SELECT count(*) FROM pg_stat_activity WHERE backend_type = 'pg_tde wal decrypt ahead';", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(length(k)) FROM test_bulk;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_bulk;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
@@ -0,0 +1,140 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+my $PG_VERSION_STRING = `pg_config --version`;
+my $percona = index(lc($PG_VERSION_STRING), lc("Percona Server")) != -1;
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# UPDATE postgresql.conf to include/load pg_tde library
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_file('file-vault','/tmp/pg_tde_test_keyring.per');", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','file-vault');", extra_params => ['-a']);
+
+# OpenSSL is always there, the other kernels only with the CPU support for them
+my @kernels = ('openssl');
+foreach my $kernel ('aesni', 'vaes')
+{
+    my $ret = $node->psql('postgres', "SET pg_tde.crypto_kernel = '$kernel';");
+    push @kernels, $kernel if $ret == 0;
+}
+note("crypto kernels: @kernels");
+
+# Values of every length, not aligned on the AES block, and a few TOAST values
+# spanning several chunks
+my $rows = "SELECT g, repeat(md5(g::text), 1 + g % 50) || g FROM generate_series(1, 2000) g "
+         . "UNION ALL SELECT g, repeat(md5(g::text), 2000) FROM generate_series(2001, 2005) g";
+my $digest = "SELECT count(*), md5(string_agg(id || ':' || k, ',' ORDER BY id))";
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_plain(id INTEGER PRIMARY KEY, k TEXT);', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+$stdout = $node->safe_psql('postgres', "INSERT INTO test_plain $rows;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+$stdout = $node->safe_psql('postgres', "$digest FROM test_plain;", extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+my $expected = $stdout;
+
+my @tables;
+
+# Reads back every table written so far, whichever kernel wrote it
+sub check_tables
+{
+    my ($kernel) = @_;
+
+    foreach my $table (@tables)
+    {
+        my $out = $node->safe_psql('postgres', "SET pg_tde.crypto_kernel = '$kernel'; $digest FROM $table;");
+        is($out, $expected, "$table read with the $kernel kernel");
+    }
+}
+
+# Every kernel encrypts its own tables and decrypts the tables of the others.
+# The page ciphers run in the process flushing the pages, so the kernel is
+# set for the whole server.
+foreach my $kernel (@kernels)
+{
+    $node->stop();
+    $node->append_conf('postgresql.conf', "pg_tde.crypto_kernel = '$kernel'\n");
+    $rt_value = $node->start();
+    ok($rt_value == 1, "Restart Server with the $kernel kernel");
+
+    check_tables($kernel);
+
+    my @new = ("test_basic_$kernel");
+    $node->safe_psql('postgres', "CREATE TABLE test_basic_$kernel(id INTEGER PRIMARY KEY, k TEXT STORAGE EXTERNAL) USING tde_heap_basic;");
+    if ($percona)
+    {
+        foreach my $cipher ('cbc', 'xts')
+        {
+            $node->safe_psql('postgres', "SET pg_tde.page_cipher = '$cipher'; CREATE TABLE test_${cipher}_$kernel(id INTEGER PRIMARY KEY, k TEXT STORAGE EXTERNAL) USING tde_heap;");
+            push @new, "test_${cipher}_$kernel";
+        }
+    }
+
+    foreach my $table (@new)
+    {
+        $node->safe_psql('postgres', "INSERT INTO $table $rows;");
+        push @tables, $table;
+    }
+    $node->safe_psql('postgres', 'CHECKPOINT;');
+
+    check_tables($kernel);
+}
+
+PGTDE::append_to_file("-- server restart");
+$node->stop();
+$node->append_conf('postgresql.conf', "pg_tde.crypto_kernel = 'auto'\n");
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+# The tuples of tde_heap_basic are decrypted by the reading backend, with the
+# kernel of its session
+check_tables($_) foreach @kernels;
+
+foreach my $table (@tables)
+{
+    $node->safe_psql('postgres', "DROP TABLE $table;");
+}
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_plain;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();
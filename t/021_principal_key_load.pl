@@ -0,0 +1,209 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use File::Basename;
+use File::Compare;
+use IPC::Run;
+use Test::More;
+use lib 't';
+use pgtde;
+
+# Get file name and CREATE out file name and dirs WHERE requried
+PGTDE::setup_files_dir(basename($0));
+
+# CREATE new PostgreSQL node and do initdb
+my $node = PGTDE->pgtde_init_pg();
+my $pgdata = $node->data_dir;
+
+# Minimal Vault KV v2 mock like the one of 009_keyring_broker.pl, it also
+# logs the name of every key read. While the flag file exists, it takes a
+# few seconds to answer reads, so that the backends pile up behind the load.
+my $slow_flag = "/tmp/pg_tde_021_mock_vault_slow";
+my $read_log = "/tmp/pg_tde_021_mock_vault_reads";
+unlink($slow_flag, $read_log);
+
+{
+package MockVault;
+
+use HTTP::Server::Simple::CGI;
+use base qw(HTTP::Server::Simple::CGI);
+
+my %keys;
+
+sub handle_request {
+    my $self = shift;
+    my $cgi  = shift;
+
+    my $path = $cgi->path_info();
+    my $token = $cgi->http('X-Vault-Token') // '';
+
+    if ($token ne 'mock-token') {
+        print "HTTP/1.0 403 Forbidden\r\n";
+        print $cgi->header('application/json'), "{\"errors\":[\"permission denied\"]}";
+        return;
+    }
+
+    if ($path =~ m{^/v1/secret/data/(.+)$}) {
+        my $name = $1;
+
+        if ($cgi->request_method() eq 'POST') {
+            my ($key) = ($cgi->param('POSTDATA') // '') =~ /"key":"([^"]+)"/;
+            $keys{$name} = $key;
+            print "HTTP/1.0 200 OK\r\n";
+            print $cgi->header('application/json'), "{}";
+            return;
+        }
+
+        if (open(my $log, '>>', $read_log)) {
+            print $log "$name\n";
+            close $log;
+        }
+        sleep(3) if -e $slow_flag;
+
+        if (defined $keys{$name}) {
+            print "HTTP/1.0 200 OK\r\n";
+            print $cgi->header('application/json'), "{\"data\":{\"data\":{\"key\":\"$keys{$name}\"}}}";
+            return;
+        }
+    }
+
+    print "HTTP/1.0 404 Not found\r\n";
+    print $cgi->header('application/json'), "{\"errors\":[]}";
+}
+
+}
+my $pid = MockVault->new(8891)->background();
+
+# Number of reads of the principal key logged by the mock Vault
+sub principal_key_reads
+{
+    my $count = 0;
+
+    open(my $log, '<', $read_log) or return 0;
+    while (my $line = <$log>)
+    {
+        $count++ if $line =~ /principal-key/;
+    }
+    close $log;
+
+    return $count;
+}
+
+# Runs the same query from several sessions at once, returns their results
+sub run_concurrently
+{
+    my ($sessions, $sql, $extra_sql) = @_;
+    my @runs;
+    my @results;
+
+    foreach my $i (0 .. $sessions - 1)
+    {
+        $results[$i] = '';
+        push @runs, IPC::Run::start(
+            [ 'psql', '-XAtq', '-d', $node->connstr('postgres'), '-c', $sql ],
+            '>', \$results[$i],
+            IPC::Run::timeout($PostgreSQL::Test::Utils::timeout_default));
+    }
+
+    $node->safe_psql('postgres', $extra_sql) if defined($extra_sql);
+
+    foreach my $run (@runs)
+    {
+        ok($run->finish(), "Concurrent session finished");
+    }
+    chomp(@results);
+
+    return @results;
+}
+
+# UPDATE postgresql.conf to include/load pg_tde library
+open my $conf, '>>', "$pgdata/postgresql.conf";
+print $conf "shared_preload_libraries = 'pg_tde'\n";
+close $conf;
+
+# Start server
+my $rt_value = $node->start;
+ok($rt_value == 1, "Start Server");
+
+# CREATE EXTENSION and change out file permissions
+my ($cmdret, $stdout, $stderr) = $node->psql('postgres', 'CREATE EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "CREATE PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+
+$rt_value = $node->psql('postgres', "SELECT pg_tde_add_key_provider_vault_v2('vault-provider', 'mock-token', 'http://127.0.0.1:8891', 'secret', NULL);", extra_params => ['-a']);
+$rt_value = $node->psql('postgres', "SELECT pg_tde_set_principal_key('test-db-principal-key','vault-provider');", extra_params => ['-a']);
+
+$stdout = $node->safe_psql('postgres', 'CREATE TABLE test_enc(id SERIAL,k INTEGER,PRIMARY KEY (id)) USING tde_heap_basic;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'INSERT INTO test_enc (k) SELECT g FROM generate_series(1, 100) g;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(k) FROM test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+my $expected = $stdout;
+
+# After a restart the key is in no cache. Only one backend asks the slow
+# provider for it, the others wait for it and find it in the cache.
+PGTDE::append_to_file("-- server restart with a slow provider, 8 concurrent sessions");
+$node->stop();
+open my $flag, '>', $slow_flag;
+close $flag;
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+my $reads = principal_key_reads();
+my @results = run_concurrently(8, 'SELECT count(*), sum(k) FROM test_enc;');
+is($_, $expected, "Concurrent session read the table") foreach @results;
+is(principal_key_reads() - $reads, 1, "Principal key read once from the provider");
+
+# A rotation needs the key while the other backends load it. It keeps its
+# exclusive lock all along, the sessions waiting for the load get the new key.
+PGTDE::append_to_file("-- server restart with a slow provider, 4 concurrent sessions and a rotation");
+$node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+@results = run_concurrently(4, 'SELECT count(*), sum(k) FROM test_enc;',
+                            "SELECT pg_tde_rotate_principal_key('rotated-principal-key', 'vault-provider');");
+is($_, $expected, "Concurrent session read the table during the rotation") foreach @results;
+
+unlink($slow_flag);
+
+$stdout = $node->safe_psql('postgres', 'SELECT principal_key_name, principal_key_version FROM pg_tde_principal_key_info();', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+$stdout = $node->safe_psql('postgres', 'SELECT count(*), sum(k) FROM test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# The rotated key is the one the other backends load after a restart
+PGTDE::append_to_file("-- server restart");
+$node->stop();
+$rt_value = $node->start();
+ok($rt_value == 1, "Restart Server");
+
+@results = run_concurrently(4, 'SELECT count(*), sum(k) FROM test_enc;');
+is($_, $expected, "Concurrent session read the table with the rotated key") foreach @results;
+
+$stdout = $node->safe_psql('postgres', 'DROP TABLE test_enc;', extra_params => ['-a']);
+PGTDE::append_to_file($stdout);
+
+# DROP EXTENSION
+$stdout = $node->safe_psql('postgres', 'DROP EXTENSION pg_tde;', extra_params => ['-a']);
+ok($cmdret == 0, "DROP PGTDE EXTENSION");
+PGTDE::append_to_file($stdout);
+# Stop the server
+$node->stop();
+
+system("kill $pid");
+unlink($slow_flag, $read_log);
+
+# compare the expected and out file
+my $compare = PGTDE->compare_results();
+
+# Test/check if expected and result/out file match. If Yes, test passes.
+is($compare,0,"Compare Files: $PGTDE::expected_filename_with_path and $PGTDE::out_filename_with_path files.");
+
+# Done testing for this testcase file.
+done_testing();